@@ -0,0 +1,372 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * micro-benchmarks run on the current song: each one repeats an
+ * operation of the editing, storage, undo or playback code, and
+ * measures the time spent in it. Operations that change the song
+ * are done on copies of tracks, or undone, so the song is left
+ * unchanged and benchmarks may be chained
+ */
+
+#include <stdio.h>
+#include "utils.h"
+#include "defs.h"
+#include "pool.h"
+#include "track.h"
+#include "frame.h"
+#include "song.h"
+#include "undo.h"
+#include "saveload.h"
+#include "smf.h"
+#include "mux.h"
+#include "norm.h"
+#include "str.h"
+#include "mdep_desp.h"
+#include "bench.h"
+
+struct benchdesc {
+	char *name;
+	void (*init)(struct song *);	/* prepare files, may be NULL */
+	void (*run)(struct song *);	/* a single iteration */
+};
+
+unsigned long bench_usec, bench_t0;
+
+void
+bench_start(void)
+{
+	bench_t0 = mdep_desp_clock();
+}
+
+void
+bench_stop(void)
+{
+	bench_usec += mdep_desp_clock() - bench_t0;
+}
+
+/*
+ * make a copy of the given track
+ */
+void
+bench_copytrk(struct track *src, struct track *dst)
+{
+	struct evspec es;
+
+	evspec_reset(&es);
+	track_init(dst);
+	track_move(src, 0, ~0U, &es, dst, 1, 0);
+}
+
+/*
+ * quantization step used by benchmarks, a 16th note
+ */
+unsigned
+bench_quant(struct song *s)
+{
+	return s->tics_per_unit >= 16 ? s->tics_per_unit / 16 : 1;
+}
+
+void
+bench_copy(struct song *s)
+{
+	struct songtrk *t;
+	struct track copy;
+
+	SONG_FOREACH_TRK(s, t) {
+		bench_start();
+		bench_copytrk(&t->track, &copy);
+		bench_stop();
+		track_done(&copy);
+	}
+}
+
+void
+bench_merge(struct song *s)
+{
+	struct songtrk *t;
+	struct track dst, src;
+
+	SONG_FOREACH_TRK(s, t) {
+		bench_copytrk(&t->track, &dst);
+		bench_copytrk(&t->track, &src);
+		track_shift(&src, 1);
+		bench_start();
+		track_merge(&dst, &src);
+		bench_stop();
+		track_done(&src);
+		track_done(&dst);
+	}
+}
+
+void
+bench_flatten(struct song *s)
+{
+	struct songtrk *t;
+	struct track dst, **src;
+	unsigned n;
+
+	n = 0;
+	SONG_FOREACH_TRK(s, t)
+		n++;
+	src = xmalloc((n > 0 ? n : 1) * sizeof(struct track *), "benchsrc");
+	n = 0;
+	SONG_FOREACH_TRK(s, t)
+		src[n++] = &t->track;
+	track_init(&dst);
+	bench_start();
+	track_mergek(&dst, src, n);
+	bench_stop();
+	track_done(&dst);
+	xfree(src);
+}
+
+void
+bench_quantize(struct song *s)
+{
+	struct songtrk *t;
+	struct track copy;
+	struct evspec es;
+
+	evspec_reset(&es);
+	SONG_FOREACH_TRK(s, t) {
+		bench_copytrk(&t->track, &copy);
+		bench_start();
+		track_quantize(&copy, &es, 0, track_numtic(&copy),
+		    0, bench_quant(s), 75);
+		bench_stop();
+		track_done(&copy);
+	}
+}
+
+void
+bench_edit(struct song *s)
+{
+	struct songtrk *t;
+	struct track copy;
+	struct trackedit ops[2];
+	struct evspec es;
+
+	evspec_reset(&es);
+	ops[0].type = TRACKEDIT_TRANSP;
+	ops[0].halftones = 1;
+	ops[1].type = TRACKEDIT_VCURVE;
+	vcurve_mktab(ops[1].vtab, 64 - 10);
+	SONG_FOREACH_TRK(s, t) {
+		bench_copytrk(&t->track, &copy);
+		bench_start();
+		track_edit(&copy, 0, track_numtic(&copy), &es,
+		    0, bench_quant(s), 75, ops, 2);
+		bench_stop();
+		track_done(&copy);
+	}
+}
+
+void
+bench_undo(struct song *s)
+{
+	struct songtrk *t;
+	struct undo *u;
+	struct evspec es;
+	unsigned len;
+
+	evspec_reset(&es);
+	SONG_FOREACH_TRK(s, t) {
+		len = track_numtic(&t->track);
+		bench_start();
+		undo_track_save(s, &t->track, "bench", t->name.str);
+		u = s->undo;
+		track_transpose(&t->track, 0, len, &es, 1);
+		undo_track_diff(s);
+
+		/*
+		 * changes exceeding the undo memory limit are not
+		 * saved, in this case revert them by hand
+		 */
+		if (s->undo == u)
+			undo_pop(s);
+		else
+			track_transpose(&t->track, 0, len, &es, -1);
+		bench_stop();
+	}
+}
+
+void
+bench_save(struct song *s)
+{
+	bench_start();
+	song_save(s, BENCH_FILE);
+	bench_stop();
+}
+
+void
+bench_savebin(struct song *s)
+{
+	bench_start();
+	song_savebin(s, BENCH_FILE);
+	bench_stop();
+}
+
+void
+bench_load(struct song *s)
+{
+	struct song *n;
+
+	n = song_new();
+	bench_start();
+	(void)song_load(n, BENCH_FILE);
+	bench_stop();
+	song_delete(n);
+}
+
+void
+bench_export(struct song *s)
+{
+	bench_start();
+	(void)song_exportsmf(s, BENCH_FILE);
+	bench_stop();
+}
+
+void
+bench_import(struct song *s)
+{
+	struct song *n;
+
+	bench_start();
+	n = song_importsmf(BENCH_FILE);
+	bench_stop();
+	if (n != NULL)
+		song_delete(n);
+}
+
+/*
+ * play the song from the beginning to the end, without waiting for
+ * the clock; output goes to the attached devices
+ */
+void
+bench_play(struct song *s)
+{
+	struct songtrk *t;
+	unsigned n, len, ntics;
+
+	ntics = 0;
+	SONG_FOREACH_TRK(s, t) {
+		len = track_numtic(&t->track);
+		if (ntics < len)
+			ntics = len;
+	}
+	song_setmode(s, SONG_IDLE);
+	song_goto(s, 0);
+	bench_start();
+	for (n = 0; n < ntics; n++) {
+		song_ticplay(s);
+		mux_flush();
+		song_ticskip(s);
+	}
+	bench_stop();
+	song_stop(s);
+}
+
+/*
+ * pass input events through the song filter to the output, as if
+ * they were received on the first device: notes, with a controller
+ * sweep on each one
+ */
+void
+bench_thru(struct song *s)
+{
+	struct ev ev;
+	unsigned n, i;
+
+	song_setmode(s, SONG_IDLE);
+	ev.dev = 0;
+	ev.ch = 0;
+	bench_start();
+	for (n = 0; n < 128; n++) {
+		ev.cmd = EV_NON;
+		ev.note_num = n;
+		ev.note_vel = 100;
+		norm_evcb(&ev);
+		for (i = 0; i < 16; i++) {
+			ev.cmd = EV_XCTL;
+			ev.ctl_num = 1;
+			ev.ctl_val = (n * 16 + i) & EV_MAXFINE;
+			norm_evcb(&ev);
+		}
+		ev.cmd = EV_NOFF;
+		ev.note_num = n;
+		ev.note_vel = EV_NOFF_DEFAULTVEL;
+		norm_evcb(&ev);
+	}
+	bench_stop();
+	song_stop(s);
+}
+
+const struct benchdesc bench_tab[] = {
+	{"copy", NULL, bench_copy},
+	{"merge", NULL, bench_merge},
+	{"flatten", NULL, bench_flatten},
+	{"quantize", NULL, bench_quantize},
+	{"edit", NULL, bench_edit},
+	{"undo", NULL, bench_undo},
+	{"save", NULL, bench_save},
+	{"savebin", NULL, bench_savebin},
+	{"load", bench_save, bench_load},
+	{"loadbin", bench_savebin, bench_load},
+	{"export", NULL, bench_export},
+	{"import", bench_export, bench_import},
+	{"play", NULL, bench_play},
+	{"thru", NULL, bench_thru},
+	{NULL, NULL, NULL}
+};
+
+/*
+ * run 'count' iterations of the given benchmark and fill the
+ * result. Pool usage peaks are reset, so the reported peak is the
+ * one of the benchmark. Return 0 if there's no such benchmark.
+ */
+unsigned
+bench_run(struct song *s, char *name, unsigned count, struct benchres *res)
+{
+	const struct benchdesc *b;
+	struct songtrk *t;
+	struct pool *p;
+	unsigned n;
+
+	for (b = bench_tab; ; b++) {
+		if (b->name == NULL)
+			return 0;
+		if (str_eq(b->name, name))
+			break;
+	}
+	for (p = pool_list; p != NULL; p = p->next)
+		p->maxused = p->used;
+	if (b->init)
+		b->init(s);
+	bench_usec = 0;
+	for (n = 0; n < count; n++)
+		b->run(s);
+	remove(BENCH_FILE);
+
+	res->usec = bench_usec;
+	res->nevs = track_numev(&s->meta);
+	SONG_FOREACH_TRK(s, t)
+		res->nevs += track_numev(&t->track);
+	res->peak = 0;
+	for (p = pool_list; p != NULL; p = p->next)
+		res->peak += (unsigned long)p->maxused * p->itemsize;
+	return 1;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MIDISH_BENCH_H
+#define MIDISH_BENCH_H
+
+struct song;
+
+/*
+ * file used by benchmarks of storage routines
+ */
+#define BENCH_FILE	"bench.tmp"
+
+/*
+ * result of a benchmark
+ */
+struct benchres {
+	unsigned long usec;		/* time spent in measured code */
+	unsigned nevs;			/* number of events of the song */
+	unsigned long peak;		/* peak memory used by pools */
+};
+
+unsigned bench_run(struct song *, char *, unsigned, struct benchres *);
+
+#endif /* MIDISH_BENCH_H */
@@ -26,6 +26,7 @@
 #include "user.h"
 #include "smf.h"
 #include "saveload.h"
+#include "setlist.h"
 #include "textio.h"
 #include "mux.h"
 #include "mididev.h"
@@ -33,6 +34,12 @@
 #include "builtin.h"
 #include "version.h"
 #include "undo.h"
+#include "pool.h"
+#include "bench.h"
+#include "sim.h"
+#include "ticprof.h"
+#include "work.h"
+#include "mdep_desp.h"
 
 unsigned
 blt_info(struct exec *o, struct data **r)
@@ -136,7 +143,7 @@ blt_debug(struct exec *o, struct data **r)
 {
 	extern unsigned filt_debug, mididev_debug, mux_debug, mixout_debug,
 	    norm_debug, pool_debug, song_debug,
-	    timo_debug;
+	    timo_debug, vm_debug;
 	char *flag;
 	long value;
 
@@ -160,6 +167,8 @@ blt_debug(struct exec *o, struct data **r)
 		song_debug = value;
 	} else if (str_eq(flag, "timo")) {
 		timo_debug = value;
+	} else if (str_eq(flag, "vm")) {
+		vm_debug = value;
 	} else {
 		cons_errs(o->procname, "unknuwn debug-flag");
 		return 0;
@@ -167,6 +176,344 @@ blt_debug(struct exec *o, struct data **r)
 	return 1;
 }
 
+unsigned
+blt_bench(struct exec *o, struct data **r)
+{
+	struct benchres res;
+	char *name;
+	long count;
+	unsigned long usec;
+
+	if (!exec_lookupname(o, "name", &name) ||
+	    !exec_lookuplong(o, "count", &count)) {
+		return 0;
+	}
+	if (count <= 0) {
+		cons_errs(o->procname, "count must be positive");
+		return 0;
+	}
+	song_stop(usong);
+	if (!bench_run(usong, name, count, &res)) {
+		cons_errs(name, "no such benchmark");
+		return 0;
+	}
+	usec = res.usec > 0 ? res.usec : 1;
+	textout_putstr(tout, name);
+	textout_putstr(tout, "\t");
+	textout_putlong(tout, count);
+	textout_putstr(tout, "\t");
+	textout_putlong(tout, res.nevs);
+	textout_putstr(tout, "\t");
+	textout_putlong(tout, res.usec);
+	textout_putstr(tout, "\t");
+	textout_putlong(tout, (unsigned long long)count * 1000000 / usec);
+	textout_putstr(tout, "\t");
+	textout_putlong(tout, res.peak);
+	textout_putstr(tout, "\n");
+	return 1;
+}
+
+unsigned
+blt_jitter(struct exec *o, struct data **r)
+{
+	struct simres res;
+	struct sim_in *in, *p;
+	struct data *list, *d, *a;
+	long period, jitter, seed;
+	unsigned nin;
+	unsigned long last;
+
+	if (!exec_lookuplong(o, "period", &period) ||
+	    !exec_lookuplong(o, "jitter", &jitter) ||
+	    !exec_lookuplong(o, "seed", &seed) ||
+	    !exec_lookuplist(o, "input", &list)) {
+		return 0;
+	}
+#ifdef ESP_PLATFORM
+	/*
+	 * the clock is advanced by the realtime task, not by us
+	 */
+	cons_errs(o->procname, "not available on this platform");
+	return 0;
+#endif
+	if (period < 0 || jitter < 0 || period + jitter > SIM_MAXSTEP) {
+		cons_errs(o->procname, "period or jitter out of range");
+		return 0;
+	}
+	nin = 0;
+	for (d = list; d != NULL; d = d->next)
+		nin++;
+	in = nin > 0 ? xmalloc(nin * sizeof(struct sim_in), "simin") : NULL;
+	last = 0;
+	for (d = list, p = in; d != NULL; d = d->next, p++) {
+		a = d->type == DATA_LIST ? d->val.list : NULL;
+		if (a == NULL || a->type != DATA_LONG || a->val.num < 0 ||
+		    (unsigned long)a->val.num < last ||
+		    a->next == NULL || a->next->type != DATA_LONG ||
+		    a->next->val.num < 0 ||
+		    a->next->val.num >= DEFAULT_MAXNDEVS) {
+			cons_errs(o->procname,
+			    "{usec unit bytes ...} in time order expected");
+			goto bad;
+		}
+		p->usec = last = a->val.num;
+		p->unit = a->next->val.num;
+		p->len = 0;
+		for (a = a->next->next; a != NULL; a = a->next) {
+			if (a->type != DATA_LONG || a->val.num < 0 ||
+			    a->val.num > 255 || p->len == SIM_INMAX) {
+				cons_errs(o->procname, "bad input bytes");
+				goto bad;
+			}
+			p->data[p->len++] = a->val.num;
+		}
+	}
+	song_stop(usong);
+	sim_run(usong, period, jitter, seed, in, nin, &res);
+	if (in)
+		xfree(in);
+	textout_putlong(tout, period);
+	textout_putstr(tout, "\t");
+	textout_putlong(tout, jitter);
+	textout_putstr(tout, "\t");
+	textout_putlong(tout, res.ticks);
+	textout_putstr(tout, "\t");
+	textout_putlong(tout, res.nbytes);
+	textout_putstr(tout, "\t");
+	textout_putlong(tout, res.ndiff);
+	textout_putstr(tout, "\t");
+	textout_putlong(tout, res.minerr);
+	textout_putstr(tout, "\t");
+	textout_putlong(tout, res.maxerr);
+	textout_putstr(tout, "\t");
+	textout_putlong(tout, res.nbytes > 0 ? res.sumerr / res.nbytes : 0);
+	textout_putstr(tout, "\n");
+	return 1;
+bad:
+	if (in)
+		xfree(in);
+	return 0;
+}
+
+unsigned
+blt_poolinfo(struct exec *o, struct data **r)
+{
+	struct pool *p;
+
+	textout_putstr(tout, "{\n");
+	textout_shiftright(tout);
+	textout_putstr(tout, "# name\tsize\tslabs\titems\tused\tmaxused\tallocs\tover\n");
+	for (p = pool_list; p != NULL; p = p->next) {
+		textout_putstr(tout, p->name);
+		textout_putstr(tout, "\t");
+		textout_putlong(tout, p->itemsize);
+		textout_putstr(tout, "\t");
+		textout_putlong(tout, p->nslabs);
+		textout_putstr(tout, "\t");
+		textout_putlong(tout, p->itemnum);
+		textout_putstr(tout, "\t");
+		textout_putlong(tout, p->used);
+		textout_putstr(tout, "\t");
+		textout_putlong(tout, p->maxused);
+		textout_putstr(tout, "\t");
+		textout_putlong(tout, p->newcnt);
+		textout_putstr(tout, "\t");
+		textout_putlong(tout, p->nover);
+		textout_putstr(tout, "\n");
+	}
+	textout_shiftleft(tout);
+	textout_putstr(tout, "}\n");
+	if (pool_fixed)
+		textout_putstr(tout, "# fixed\n");
+	return 1;
+}
+
+/*
+ * print a name and the given numbers, tab separated
+ */
+void
+blt_memline(char *name, unsigned long *val, unsigned n)
+{
+	unsigned i;
+
+	textout_putstr(tout, name);
+	for (i = 0; i < n; i++) {
+		textout_putstr(tout, "\t");
+		textout_putlong(tout, val[i]);
+	}
+	textout_putstr(tout, "\n");
+}
+
+unsigned
+blt_meminfo(struct exec *o, struct data **r)
+{
+	static char tag[64];
+	struct songtrk *t;
+	struct songchan *c;
+	struct songfilt *f;
+	struct songsx *s;
+	struct pool *p;
+	unsigned long val[4];
+	unsigned i;
+
+	textout_putstr(tout, "{\n");
+	textout_shiftright(tout);
+	textout_putstr(tout, "# object\tbytes\n");
+	val[0] = track_memsize(&usong->meta);
+	SONG_FOREACH_TRK(usong, t)
+		val[0] += track_memsize(&t->track);
+	blt_memline("tracks", val, 1);
+	val[0] = 0;
+	SONG_FOREACH_CHAN(usong, c)
+		val[0] += track_memsize(&c->conf);
+	blt_memline("chans", val, 1);
+	val[0] = 0;
+	SONG_FOREACH_FILT(usong, f)
+		val[0] += filt_memsize(&f->filt);
+	blt_memline("filters", val, 1);
+	val[0] = 0;
+	SONG_FOREACH_SX(usong, s)
+		val[0] += sysexlist_memsize(&s->sx);
+	blt_memline("sysex", val, 1);
+	val[0] = usong->undo_size;
+	blt_memline("undo", val, 1);
+	val[0] = track_memsize(&usong->clip);
+	blt_memline("clip", val, 1);
+	textout_putstr(tout, "# pool\tbytes\tused\tmaxused\n");
+	for (p = pool_list; p != NULL; p = p->next) {
+		val[0] = (unsigned long)p->itemnum * p->itemsize +
+		    p->nslabs * sizeof(struct poolslab);
+		val[1] = (unsigned long)p->used * p->itemsize;
+		val[2] = (unsigned long)p->maxused * p->itemsize;
+		blt_memline(p->name, val, 3);
+	}
+	textout_putstr(tout, "# tag\tblocks\tbytes\tmaxbytes\n");
+	for (i = 0; i < mem_ntags; i++) {
+		val[0] = mem_tags[i].nblks;
+		val[1] = mem_tags[i].used;
+		val[2] = mem_tags[i].maxused;
+		blt_memline(mem_tags[i].name, val, 3);
+	}
+	textout_putstr(tout, "# heap\tused\tmaxused\tfree\tlargest\n");
+	val[0] = mem_used;
+	val[1] = mem_maxused;
+	mem_heapinfo(&val[2], &val[3]);
+	blt_memline("heap", val, 4);
+	textout_shiftleft(tout);
+	textout_putstr(tout, "}\n");
+	snprintf(tag, sizeof(tag), "mem %lu %lu %lu %lu",
+	    val[0], val[1], val[2], val[3]);
+	cons_puttag(tag);
+	return 1;
+}
+
+unsigned
+blt_poolsize(struct exec *o, struct data **r)
+{
+	struct pool *p;
+	char *name;
+	long size;
+
+	if (!exec_lookupname(o, "pool", &name) ||
+	    !exec_lookuplong(o, "size", &size)) {
+		return 0;
+	}
+	if (pool_fixed) {
+		cons_errs(o->procname, "pools are fixed");
+		return 0;
+	}
+	for (p = pool_list; p != NULL; p = p->next) {
+		if (str_eq(p->name, name))
+			break;
+	}
+	if (p == NULL) {
+		cons_errss(o->procname, name, "no such pool");
+		return 0;
+	}
+	if (size < 0 || size > POOL_MAXSIZE) {
+		cons_errs(o->procname, "size out of range");
+		return 0;
+	}
+	while (p->itemnum < size)
+		pool_grow(p);
+	return 1;
+}
+
+unsigned
+blt_poolfix(struct exec *o, struct data **r)
+{
+	pool_fixed = 1;
+	return 1;
+}
+
+unsigned
+blt_compact(struct exec *o, struct data **r)
+{
+	if (!song_try_mode(usong, 0)) {
+		return 0;
+	}
+	song_compact(usong);
+	return 1;
+}
+
+/*
+ * print a profiler counter as average and maximum per tick
+ */
+void
+blt_prof_cnt(char *name, struct ticprof_cnt *c)
+{
+	textout_putstr(tout, name);
+	textout_putstr(tout, "\t");
+	textout_putlong(tout, ticprof.ntics ? c->sum / ticprof.ntics : 0);
+	textout_putstr(tout, "\t");
+	textout_putlong(tout, c->max);
+	textout_putstr(tout, "\n");
+}
+
+unsigned
+blt_prof(struct exec *o, struct data **r)
+{
+	struct songtrk *t;
+	unsigned i;
+
+	textout_putstr(tout, "{\n");
+	textout_shiftright(tout);
+	textout_putstr(tout, "tics ");
+	textout_putlong(tout, ticprof.ntics);
+	textout_putstr(tout, "\n");
+	textout_putstr(tout, "late ");
+	textout_putlong(tout, ticprof.nlate);
+	textout_putstr(tout, "\t\t\t# longer than the tick period\n");
+	textout_putstr(tout, "usec ");
+	textout_putlong(tout, DESP_CYCLES_PER_USEC);
+	textout_putstr(tout, "\t\t\t# cycles per microsecond\n");
+	textout_putstr(tout, "# stage\tavg\tmax\n");
+	blt_prof_cnt("tic", &ticprof.tic);
+	for (i = 0; i < TICPROF_NSTAGES; i++)
+		blt_prof_cnt(ticprof_stagename[i], &ticprof.stage[i]);
+	textout_putstr(tout, "# output\tavg\tmax\n");
+	blt_prof_cnt("bytes", &ticprof.bytes);
+	textout_putstr(tout, "# track\tavg\tmax\n");
+	SONG_FOREACH_TRK(usong, t) {
+		blt_prof_cnt(t->name.str, &t->prof);
+	}
+	textout_shiftleft(tout);
+	textout_putstr(tout, "}\n");
+	return 1;
+}
+
+unsigned
+blt_profclr(struct exec *o, struct data **r)
+{
+	struct songtrk *t;
+
+	ticprof_reset();
+	SONG_FOREACH_TRK(usong, t) {
+		ticprof_cntreset(&t->prof);
+	}
+	return 1;
+}
+
 unsigned
 blt_exec(struct exec *o, struct data **r)
 {
@@ -214,7 +561,7 @@ blt_h(struct exec *o, struct data **r)
 {
 	char *name;
 	struct data *d;
-	struct help *h;
+	const struct help *h;
 	struct var *arg;
 
 	arg = exec_varlookup(o, "...");
@@ -374,6 +721,7 @@ blt_setunit(struct exec *o, struct data **r)
 {
 	long tpu;
 	struct songtrk *t;
+	unsigned n;
 
 	if (!exec_lookuplong(o, "tics_per_unit", &tpu)) {
 		return 0;
@@ -391,14 +739,13 @@ blt_setunit(struct exec *o, struct data **r)
 	}
 
 	undo_track_save(usong, &usong->meta, o->procname, NULL);
-	track_prescale(&usong->meta, usong->tics_per_unit, tpu);
-	undo_track_diff(usong);
-
+	n = 1;
 	SONG_FOREACH_TRK(usong, t) {
 		undo_track_save(usong, &t->track, NULL, NULL);
-		track_prescale(&t->track, usong->tics_per_unit, tpu);
-		undo_track_diff(usong);
+		n++;
 	}
+	song_prescale(usong, usong->tics_per_unit, tpu);
+	undo_track_diffn(usong, n);
 
 	undo_scale(usong, NULL, NULL, usong->tics_per_unit, tpu);
 
@@ -902,10 +1249,89 @@ blt_save(struct exec *o, struct data **r)
 	return 1;
 }
 
+unsigned
+blt_bgsave(struct exec *o, struct data **r)
+{
+	char *filename;
+
+	if (!exec_lookupstring(o, "filename", &filename)) {
+		return 0;
+	}
+	saveload_yield = 1;
+	song_save(usong, filename);
+	saveload_yield = 0;
+	return 1;
+}
+
+unsigned
+blt_savelz(struct exec *o, struct data **r)
+{
+	char *filename;
+
+	if (!exec_lookupstring(o, "filename", &filename)) {
+		return 0;
+	}
+	song_stop(usong);
+	song_savelz(usong, filename);
+	return 1;
+}
+
+unsigned
+blt_savebin(struct exec *o, struct data **r)
+{
+	char *filename;
+
+	if (!exec_lookupstring(o, "filename", &filename)) {
+		return 0;
+	}
+	song_stop(usong);
+	song_savebin(usong, filename);
+	return 1;
+}
+
+unsigned
+blt_snapshot(struct exec *o, struct data **r)
+{
+	char *filename;
+
+	if (!exec_lookupstring(o, "filename", &filename)) {
+		return 0;
+	}
+	song_stop(usong);
+	return exec_snapshot(o, usong, filename);
+}
+
+unsigned
+blt_restore(struct exec *o, struct data **r)
+{
+	struct song *newsong;
+	struct pool *p;
+	char *filename;
+	unsigned res;
+
+	if (!exec_lookupstring(o, "filename", &filename)) {
+		return 0;
+	}
+	song_stop(usong);
+	newsong = song_new();
+	res = exec_restore(o, newsong, filename);
+	if (res) {
+		song_delete(usong);
+		usong = newsong;
+		cons_putpos(usong->curpos, 0, 0);
+	} else
+		song_delete(newsong);
+	for (p = pool_list; p != NULL; p = p->next)
+		pool_shrink(p);
+	song_compact(usong);
+	return res;
+}
+
 unsigned
 blt_load(struct exec *o, struct data **r)
 {
 	struct song *newsong;
+	struct pool *p;
 	char *filename;
 	unsigned res;
 
@@ -921,15 +1347,64 @@ blt_load(struct exec *o, struct data **r)
 		cons_putpos(usong->curpos, 0, 0);
 	} else
 		song_delete(newsong);
+	for (p = pool_list; p != NULL; p = p->next)
+		pool_shrink(p);
+	song_compact(usong);
 	return res;
 }
 
+unsigned
+blt_mapload(struct exec *o, struct data **r)
+{
+	struct song *newsong;
+	struct pool *p;
+	char *name;
+	unsigned res;
+
+	if (!exec_lookupstring(o, "name", &name)) {
+		return 0;
+	}
+	song_stop(usong);
+	newsong = song_new();
+	res = song_mapbin(newsong, name);
+	if (res) {
+		song_delete(usong);
+		usong = newsong;
+		cons_putpos(usong->curpos, 0, 0);
+	} else
+		song_delete(newsong);
+	for (p = pool_list; p != NULL; p = p->next)
+		pool_shrink(p);
+	return res;
+}
+
+unsigned
+blt_slload(struct exec *o, struct data **r)
+{
+	char *filename;
+
+	if (!exec_lookupstring(o, "filename", &filename)) {
+		return 0;
+	}
+	return setlist_load(filename);
+}
+
+unsigned
+blt_slnext(struct exec *o, struct data **r)
+{
+	return setlist_arm();
+}
+
 unsigned
 blt_reset(struct exec *o, struct data **r)
 {
+	struct pool *p;
+
 	song_stop(usong);
 	song_done(usong);
 	evpat_reset();
+	for (p = pool_list; p != NULL; p = p->next)
+		pool_shrink(p);
 	song_init(usong);
 	cons_putpos(usong->curpos, 0, 0);
 	return 1;
@@ -967,6 +1442,40 @@ blt_import(struct exec *o, struct data **r)
 	return 1;
 }
 
+unsigned
+blt_smfplay(struct exec *o, struct data **r)
+{
+	struct smfstream *stream;
+	struct var *arg;
+	char *filename;
+
+	arg = exec_varlookup(o, "filename");
+	if (!arg) {
+		log_puts("blt_smfplay: filename: no such param\n");
+		return 0;
+	}
+	if (arg->data->type == DATA_NIL) {
+		song_stop(usong);
+		if (usong->stream) {
+			smfstream_del(usong->stream);
+			usong->stream = NULL;
+		}
+		return 1;
+	}
+	if (!exec_lookupstring(o, "filename", &filename)) {
+		return 0;
+	}
+	song_stop(usong);
+	stream = smfstream_new(filename);
+	if (stream == NULL) {
+		return 0;
+	}
+	if (usong->stream)
+		smfstream_del(usong->stream);
+	usong->stream = stream;
+	return 1;
+}
+
 unsigned
 blt_idle(struct exec *o, struct data **r)
 {
@@ -992,8 +1501,9 @@ blt_play(struct exec *o, struct data **r)
 	song_play(usong);
 	if (user_flag_batch) {
 		cons_err("press ^C to stop playback");
-		while (!usong->complete && mux_mdep_wait(0))
-			; /* nothing */
+		while ((!usong->complete || setlist_armed) &&
+		    mux_mdep_wait(0))
+			setlist_poll();
 		cons_err("playback stopped");
 		song_stop(usong);
 	}
@@ -1539,6 +2049,29 @@ blt_evinfo(struct exec *o, struct data **r)
 	return 1;
 }
 
+unsigned
+blt_normrate(struct exec *o, struct data **r)
+{
+	struct ev ev;
+	char *name;
+	long maxev;
+
+	if (!exec_lookupname(o, "evname", &name) ||
+	    !exec_lookuplong(o, "maxev", &maxev)) {
+		return 0;
+	}
+	if (!ev_str2cmd(&ev, name) || !EV_ISVOICE(&ev)) {
+		cons_errs(o->procname, "voice event type expected");
+		return 0;
+	}
+	if (maxev < 0 || maxev > NORM_MAXRATE) {
+		cons_errs(o->procname, "rate out of range");
+		return 0;
+	}
+	norm_maxev[ev.cmd] = maxev;
+	return 1;
+}
+
 unsigned
 blt_metro(struct exec *o, struct data **r)
 {
@@ -1625,8 +2158,18 @@ unsigned
 blt_undolist(struct exec *o, struct data **r)
 {
 	struct undo *u;
+	unsigned size, packed;
 
+	/*
+	 * entries without function belong to the next one with it,
+	 * so sum their sizes to get the cost of the operation
+	 */
+	size = 0;
+	packed = 0;
 	for (u = usong->undo; u != NULL; u = u->next) {
+		size += u->size;
+		if (u->type == UNDO_TRACK && u->u.track.spill != NULL)
+			packed = 1;
 		if (u->func == NULL)
 			continue;
 		textout_putstr(tout, u->func);
@@ -1637,11 +2180,50 @@ blt_undolist(struct exec *o, struct data **r)
 				u->next->name != NULL))
 				textout_putstr(tout, " (no-op)");
 		}
-		textout_putstr(tout, "\n");
+		textout_putstr(tout, "\t# ");
+		textout_putlong(tout, size);
+		textout_putstr(tout, packed ? " bytes, packed\n" : " bytes\n");
+		size = 0;
+		packed = 0;
 	}
 	return 1;
 }
 
+unsigned
+blt_undosize(struct exec *o, struct data **r)
+{
+	long hot, max;
+
+	if (!exec_lookuplong(o, "hot", &hot) ||
+	    !exec_lookuplong(o, "max", &max)) {
+		return 0;
+	}
+	if (hot < 0 || max < hot) {
+		cons_errs(o->procname, "sizes out of range");
+		return 0;
+	}
+	undo_hotsize = hot;
+	undo_maxsize = max;
+	undo_shrink(usong);
+	return 1;
+}
+
+unsigned
+blt_workers(struct exec *o, struct data **r)
+{
+	long count;
+
+	if (!exec_lookuplong(o, "count", &count)) {
+		return 0;
+	}
+	if (count < 0 || count > WORK_MAXTHREADS) {
+		cons_errs(o->procname, "count out of range");
+		return 0;
+	}
+	work_nthreads = count;
+	return 1;
+}
+
 
 unsigned
 blt_tlist(struct exec *o, struct data **r)
@@ -1715,7 +2297,7 @@ blt_tren(struct exec *o, struct data **r)
 		    "name already used by another track");
 		return 0;
 	}
-	undo_setstr(usong, o->procname, &t->name.str, name);
+	undo_setname(usong, o->procname, &t->name, name);
 	return 1;
 }
 
@@ -1826,7 +2408,28 @@ blt_tgetf(struct exec *o, struct data **r)
 }
 
 unsigned
-blt_tcheck(struct exec *o, struct data **r)
+blt_tcheck(struct exec *o, struct data **r)
+{
+	struct songtrk *t;
+
+	song_getcurtrk(usong, &t);
+	if (t == NULL) {
+		cons_errs(o->procname, "no current track");
+		return 0;
+	}
+	if (!song_try_trk(usong, t)) {
+		return 0;
+	}
+	undo_track_save(usong, &t->track, o->procname, t->name.str);
+	work_detach();
+	track_check(&t->track);
+	work_attach();
+	undo_track_diff(usong);
+	return 1;
+}
+
+unsigned
+blt_trewrite(struct exec *o, struct data **r)
 {
 	struct songtrk *t;
 
@@ -1839,13 +2442,15 @@ blt_tcheck(struct exec *o, struct data **r)
 		return 0;
 	}
 	undo_track_save(usong, &t->track, o->procname, t->name.str);
-	track_check(&t->track);
+	work_detach();
+	track_rewrite(&t->track);
+	work_attach();
 	undo_track_diff(usong);
 	return 1;
 }
 
 unsigned
-blt_trewrite(struct exec *o, struct data **r)
+blt_tpack(struct exec *o, struct data **r)
 {
 	struct songtrk *t;
 
@@ -1858,7 +2463,9 @@ blt_trewrite(struct exec *o, struct data **r)
 		return 0;
 	}
 	undo_track_save(usong, &t->track, o->procname, t->name.str);
-	track_rewrite(&t->track);
+	work_detach();
+	track_pack(&t->track);
+	work_attach();
 	undo_track_diff(usong);
 	return 1;
 }
@@ -2030,9 +2637,65 @@ blt_tmerge(struct exec *o, struct data **r)
 		return 0;
 	}
 	undo_track_save(usong, &dst->track, o->procname, dst->name.str);
+	work_detach();
 	track_merge(&src->track, &dst->track);
+	work_attach();
+	undo_track_diff(usong);
+	return 1;
+}
+
+unsigned
+blt_tflatten(struct exec *o, struct data **r)
+{
+	struct songtrk *t, *dst;
+	struct track **src;
+	struct data *list, *d;
+	unsigned n;
+
+	if (!exec_lookuplist(o, "tracklist", &list)) {
+		return 0;
+	}
+	song_getcurtrk(usong, &dst);
+	if (dst == NULL) {
+		cons_errs(o->procname, "no current track");
+		return 0;
+	}
+	if (!song_try_trk(usong, dst)) {
+		return 0;
+	}
+	n = 0;
+	for (d = list; d != NULL; d = d->next)
+		n++;
+	if (n == 0)
+		return 1;
+	src = xmalloc(n * sizeof(struct track *), "tflatten");
+	n = 0;
+	for (d = list; d != NULL; d = d->next) {
+		if (d->type != DATA_REF) {
+			cons_errs(o->procname, "list of tracks expected");
+			goto bad;
+		}
+		t = song_trklookup(usong, d->val.str);
+		if (t == NULL) {
+			cons_errs(d->val.str, "no such track");
+			goto bad;
+		}
+		if (t == dst) {
+			cons_errs(d->val.str, "can't merge the current track");
+			goto bad;
+		}
+		src[n++] = &t->track;
+	}
+	undo_track_save(usong, &dst->track, o->procname, dst->name.str);
+	work_detach();
+	track_mergek(&dst->track, src, n);
+	work_attach();
 	undo_track_diff(usong);
+	xfree(src);
 	return 1;
+bad:
+	xfree(src);
+	return 0;
 }
 
 unsigned
@@ -2069,6 +2732,7 @@ blt_tquant_common(struct exec *o, struct data **r, int all)
 			len -= qstep;
 	}
 	undo_track_save(usong, &t->track, o->procname, t->name.str);
+	work_detach();
 	if (all) {
 		track_quantize(&t->track, &usong->curev,
 		    tic, len, offset, 2 * qstep, rate);
@@ -2076,6 +2740,7 @@ blt_tquant_common(struct exec *o, struct data **r, int all)
 		track_quantize_frame(&t->track, &usong->curev,
 		    tic, len, offset, 2 * qstep, rate);
 	}
+	work_attach();
 	undo_track_diff(usong);
 	return 1;
 }
@@ -2130,7 +2795,9 @@ blt_ttransp(struct exec *o, struct data **r)
 		len -= qstep;
 	}
 	undo_track_save(usong, &t->track, o->procname, t->name.str);
+	work_detach();
 	track_transpose(&t->track, tic, len, &usong->curev, halftones);
+	work_attach();
 	undo_track_diff(usong);
 	return 1;
 }
@@ -2165,7 +2832,9 @@ blt_tvcurve(struct exec *o, struct data **r)
 		len -= qstep;
 	}
 	undo_track_save(usong, &t->track, o->procname, t->name.str);
+	work_detach();
 	track_vcurve(&t->track, tic, len, &usong->curev, weight);
+	work_attach();
 	undo_track_diff(usong);
 	return 1;
 }
@@ -2198,7 +2867,124 @@ blt_tevmap(struct exec *o, struct data **r)
 		len -= qstep;
 	}
 	undo_track_save(usong, &t->track, o->procname, t->name.str);
+	work_detach();
 	track_evmap(&t->track, tic, len, &usong->curev, &from, &to);
+	work_attach();
+	undo_track_diff(usong);
+	return 1;
+}
+
+/*
+ * get the number argument of a tedit transformation
+ */
+unsigned
+blt_tedit_getnum(struct exec *o, struct data *d, long min, long max,
+    long *res)
+{
+	if (d == NULL || d->type != DATA_LONG || d->next != NULL) {
+		cons_errs(o->procname, "single number expected");
+		return 0;
+	}
+	if (d->val.num < min || d->val.num > max) {
+		cons_errs(o->procname, "number out of range");
+		return 0;
+	}
+	*res = d->val.num;
+	return 1;
+}
+
+unsigned
+blt_tedit(struct exec *o, struct data **r)
+{
+	struct songtrk *t;
+	struct trackedit ops[TRACKEDIT_MAXOPS], *op;
+	struct data *list, *d, *a;
+	unsigned tic, len, qstep, offset, nops, quant;
+	long rate, num;
+	char *name;
+
+	song_getcurtrk(usong, &t);
+	if (t == NULL) {
+		cons_errs(o->procname, "no current track");
+		return 0;
+	}
+	if (!exec_lookuplist(o, "list", &list)) {
+		return 0;
+	}
+	nops = 0;
+	quant = 0;
+	rate = 0;
+	for (d = list; d != NULL; d = d->next) {
+		if (d->type != DATA_LIST || d->val.list == NULL ||
+		    d->val.list->type != DATA_REF) {
+			cons_errs(o->procname, "{name args ...} expected");
+			return 0;
+		}
+		name = d->val.list->val.ref;
+		a = d->val.list->next;
+		if (str_eq(name, "quanta")) {
+			if (quant) {
+				cons_errs(o->procname, "only one quanta allowed");
+				return 0;
+			}
+			if (!blt_tedit_getnum(o, a, 0, 100, &rate))
+				return 0;
+			quant = 1;
+			continue;
+		}
+		if (nops == TRACKEDIT_MAXOPS) {
+			cons_errs(o->procname, "too many transformations");
+			return 0;
+		}
+		op = &ops[nops];
+		if (str_eq(name, "transp")) {
+			if (!blt_tedit_getnum(o, a, -64, 62, &num))
+				return 0;
+			op->type = TRACKEDIT_TRANSP;
+			op->halftones = num;
+		} else if (str_eq(name, "vcurve")) {
+			if (!blt_tedit_getnum(o, a, -63, 63, &num))
+				return 0;
+			op->type = TRACKEDIT_VCURVE;
+			vcurve_mktab(op->vtab, (64 - num) & 0x7f);
+		} else if (str_eq(name, "evmap")) {
+			if (a == NULL || a->next == NULL ||
+			    a->next->next != NULL) {
+				cons_errs(o->procname, "source and dest expected");
+				return 0;
+			}
+			if (!data_getevspec(a, &op->from, 0) ||
+			    !data_getevspec(a->next, &op->to, 0) ||
+			    !evspec_isamap(&op->from, &op->to))
+				return 0;
+			op->type = TRACKEDIT_EVMAP;
+		} else {
+			cons_errs(name, "no such transformation");
+			return 0;
+		}
+		nops++;
+	}
+	if (!song_try_trk(usong, t)) {
+		return 0;
+	}
+	tic = track_findmeasure(&usong->meta, usong->curpos);
+	len = track_findmeasure(&usong->meta, usong->curpos + usong->curlen) - tic;
+	qstep = usong->curquant / 2;
+	if (tic > qstep) {
+		tic -= qstep;
+		offset = qstep;
+	} else {
+		offset = 0;
+		if (tic + len > qstep)
+			len -= qstep;
+	}
+	if (!quant)
+		rate = 0;
+	undo_track_save(usong, &t->track, o->procname, t->name.str);
+	work_detach();
+	track_edit(&t->track, tic, len, &usong->curev,
+	    offset, 2 * qstep, rate, ops, nops);
+	work_attach();
 	undo_track_diff(usong);
 	return 1;
 }
@@ -2253,7 +3039,7 @@ blt_tinfo(struct exec *o, struct data **r)
 
 	m = 0;
 	count_next = 0;
-	tp = seqptr_new(&t->track);
+	tp = seqptr_newro(&t->track);
 	mp = seqptr_new(&usong->meta);
 	for (;;) {
 		/*
@@ -2580,9 +3366,9 @@ blt_cren(struct exec *o, struct data **r, int input)
 		cons_errss(o->procname, name, "filt name already in use");
 		return 0;
 	}
-	undo_setstr(usong, o->procname, &c->name.str, name);
+	undo_setname(usong, o->procname, &c->name, name);
 	if (c->filt)
-		undo_setstr(usong, NULL, &c->filt->name.str, name);
+		undo_setname(usong, NULL, &c->filt->name, name);
 	return 1;
 }
 
@@ -2894,7 +3680,7 @@ blt_fren(struct exec *o, struct data **r)
 			return 0;
 		}
 	}
-	undo_setstr(usong, o->procname, &f->name.str, name);
+	undo_setname(usong, o->procname, &f->name, name);
 	return 1;
 }
 
@@ -3193,7 +3979,7 @@ blt_xren(struct exec *o, struct data **r)
 	if (!song_try_sx(usong, c)) {
 		return 0;
 	}
-	undo_setstr(usong, o->procname, &c->name.str, name);
+	undo_setname(usong, o->procname, &c->name, name);
 	return 1;
 }
 
@@ -3427,6 +4213,35 @@ blt_xexport(struct exec *o, struct data **r)
 	return 1;
 }
 
+unsigned
+blt_xasync(struct exec *o, struct data **r)
+{
+	if (!song_try_mode(usong, 0)) {
+		return 0;
+	}
+	usong->sx_async = 1;
+	return 1;
+}
+
+unsigned
+blt_noxasync(struct exec *o, struct data **r)
+{
+	if (!song_try_mode(usong, 0)) {
+		return 0;
+	}
+	usong->sx_async = 0;
+	return 1;
+}
+
+unsigned
+blt_xprogress(struct exec *o, struct data **r)
+{
+	*r = data_newlist(NULL);
+	data_listadd(*r, data_newlong(usong->sx_nsent));
+	data_listadd(*r, data_newlong(usong->sx_ntotal));
+	return 1;
+}
+
 unsigned
 blt_dlist(struct exec *o, struct data **r)
 {
@@ -3596,6 +4411,144 @@ blt_dclkrx(struct exec *o, struct data **r)
 	return 0;
 }
 
+unsigned
+blt_dclkpll(struct exec *o, struct data **r)
+{
+	long onoff;
+
+	if (!song_try_mode(usong, 0)) {
+		return 0;
+	}
+	if (!exec_lookupbool(o, "onoff", &onoff)) {
+		return 0;
+	}
+	mux_pllmode = onoff;
+	mux_pllreset();
+	return 1;
+}
+
+unsigned
+blt_dclkinfo(struct exec *o, struct data **r)
+{
+	unsigned ticrate;
+
+	textout_putstr(tout, "{\n");
+	textout_shiftright(tout);
+
+	textout_putstr(tout, "pll ");
+	textout_putstr(tout, mux_pllmode ? "on" : "off");
+	textout_putstr(tout, "\n");
+
+	if (mididev_clksrc == NULL) {
+		textout_putstr(tout, "clkrx nil\t\t# internal clock\n");
+	} else {
+		textout_putstr(tout, "clkrx ");
+		textout_putlong(tout, mididev_clksrc->unit);
+		textout_putstr(tout, "\n");
+		textout_putstr(tout, "lock ");
+		textout_putlong(tout, mux_pll.lock);
+		textout_putstr(tout, "\n");
+		if (mux_pll.lock) {
+			ticrate = mididev_clksrc->ticrate;
+			textout_putstr(tout, "tempo ");
+			textout_putlong(tout,
+			    1440000000UL / mux_pll.period * 4 / ticrate);
+			textout_putstr(tout, "\t\t# beats per minute\n");
+			textout_putstr(tout, "period ");
+			textout_putlong(tout, mux_pll.period / 24);
+			textout_putstr(tout, "\t\t# tic period, us\n");
+			textout_putstr(tout, "jitter ");
+			textout_putlong(tout, mux_pll.jitter / 24);
+			textout_putstr(tout, "\t\t# mean tic deviation, us\n");
+		}
+		textout_putstr(tout, "bridged ");
+		textout_putlong(tout, mux_pll.nbridged);
+		textout_putstr(tout, "\t\t# tics generated without input\n");
+	}
+
+	textout_shiftleft(tout);
+	textout_putstr(tout, "}\n");
+	return 1;
+}
+
+unsigned
+blt_dxthru(struct exec *o, struct data **r)
+{
+	struct var *arg;
+	long unit, thru;
+
+	if (!exec_lookuplong(o, "devnum", &unit)) {
+		return 0;
+	}
+	if (unit < 0 || unit >= DEFAULT_MAXNDEVS || !mididev_byunit[unit]) {
+		cons_errs(o->procname, "bad device number");
+		return 0;
+	}
+	arg = exec_varlookup(o, "thrudev");
+	if (!arg) {
+		log_puts("blt_dxthru: no such var\n");
+		panic();
+	}
+	if (arg->data->type == DATA_NIL) {
+		mididev_byunit[unit]->ixthru = -1;
+		return 1;
+	} else if (arg->data->type == DATA_LONG) {
+		thru = arg->data->val.num;
+		if (thru < 0 || thru >= DEFAULT_MAXNDEVS ||
+		    !mididev_byunit[thru]) {
+			cons_errs(o->procname, "bad device number");
+			return 0;
+		}
+		mididev_byunit[unit]->ixthru = thru;
+		return 1;
+	}
+	cons_errs(o->procname, "bad argument type for 'thrudev'");
+	return 0;
+}
+
+unsigned
+blt_dbaud(struct exec *o, struct data **r)
+{
+	long unit, baud;
+
+	if (!exec_lookuplong(o, "devnum", &unit) ||
+	    !exec_lookuplong(o, "baud", &baud)) {
+		return 0;
+	}
+	if (unit < 0 || unit >= DEFAULT_MAXNDEVS || !mididev_byunit[unit]) {
+		cons_errs(o->procname, "bad device number");
+		return 0;
+	}
+	if (baud < 0 || (baud > 0 && baud < 300) || baud > 100000000) {
+		cons_errs(o->procname, "baud rate out of range");
+		return 0;
+	}
+	mididev_putpend(mididev_byunit[unit], 0);
+	mididev_byunit[unit]->obaud = baud;
+	return 1;
+}
+
+unsigned
+blt_dlook(struct exec *o, struct data **r)
+{
+	long unit, msec;
+
+	if (!exec_lookuplong(o, "devnum", &unit) ||
+	    !exec_lookuplong(o, "msec", &msec)) {
+		return 0;
+	}
+	if (unit < 0 || unit >= DEFAULT_MAXNDEVS || !mididev_byunit[unit]) {
+		cons_errs(o->procname, "bad device number");
+		return 0;
+	}
+	if (msec < 0 || msec > MIDIDEV_MAXLOOK) {
+		cons_errs(o->procname, "lookahead out of range");
+		return 0;
+	}
+	mididev_byunit[unit]->olook = msec * 1000;
+	return 1;
+}
+
 unsigned
 blt_dclktx(struct exec *o, struct data **r)
 {
@@ -3732,11 +4685,120 @@ blt_dinfo(struct exec *o, struct data **r)
 	textout_putlong(tout, mididev_byunit[unit]->ticrate);
 	textout_putstr(tout, "\n");
 
+	if (dev->obaud > 0) {
+		textout_putstr(tout, "baud ");
+		textout_putlong(tout, dev->obaud);
+		textout_putstr(tout, "\t\t# ");
+		textout_putlong(tout, dev->ocoal);
+		textout_putstr(tout, " updates coalesced\n");
+	}
+
+	if (dev->olook > 0) {
+		textout_putstr(tout, "look ");
+		textout_putlong(tout, dev->olook / 1000);
+		textout_putstr(tout, "\t\t\t# output lookahead, ms\n");
+	}
+
+	if (dev->ixthru >= 0) {
+		textout_putstr(tout, "xthru ");
+		textout_putlong(tout, dev->ixthru);
+		textout_putstr(tout, "\t\t\t# forwards input sysex\n");
+	}
+
+	textout_shiftleft(tout);
+	textout_putstr(tout, "}\n");
+	return 1;
+}
+
+/*
+ * print the given latency histogram as a list of {usec count} pairs,
+ * usec being the lower bound of the bucket; skip empty buckets
+ */
+void
+blt_dlat_hist(char *name, unsigned long *hist)
+{
+	unsigned long lo;
+	unsigned i, more;
+
+	textout_putstr(tout, name);
+	textout_putstr(tout, " {");
+	lo = 0;
+	for (i = 0, more = 0; i < MIDIDEV_LATNBKT; i++) {
+		if (hist[i] > 0) {
+			if (more)
+				textout_putstr(tout, " ");
+			textout_putstr(tout, "{");
+			textout_putlong(tout, lo);
+			textout_putstr(tout, " ");
+			textout_putlong(tout, hist[i]);
+			textout_putstr(tout, "}");
+			more = 1;
+		}
+		lo = (i == 0) ? MIDIDEV_LATBKT0 : lo << 1;
+	}
+	textout_putstr(tout, "}\n");
+}
+
+unsigned
+blt_dlat(struct exec *o, struct data **r)
+{
+	struct mididev_lat *l;
+	long unit;
+
+	if (!exec_lookuplong(o, "devnum", &unit)) {
+		return 0;
+	}
+	if (unit < 0 || unit >= DEFAULT_MAXNDEVS || !mididev_byunit[unit]) {
+		cons_errs(o->procname, "bad device number");
+		return 0;
+	}
+	l = &mididev_byunit[unit]->lat;
+	textout_putstr(tout, "{\n");
+	textout_shiftright(tout);
+
+	textout_putstr(tout, "devnum ");
+	textout_putlong(tout, unit);
+	textout_putstr(tout, "\n");
+
+	textout_putstr(tout, "count ");
+	textout_putlong(tout, l->n);
+	textout_putstr(tout, "\n");
+
+	if (l->n > 0) {
+		textout_putstr(tout, "min ");
+		textout_putlong(tout, l->min);
+		textout_putstr(tout, "\t\t\t# usec\n");
+		textout_putstr(tout, "avg ");
+		textout_putlong(tout, l->sum / l->n);
+		textout_putstr(tout, "\t\t\t# usec\n");
+		textout_putstr(tout, "max ");
+		textout_putlong(tout, l->max);
+		textout_putstr(tout, "\t\t\t# usec\n");
+	}
+	blt_dlat_hist("lat", l->hist);
+	blt_dlat_hist("jitter", l->jhist);
+
 	textout_shiftleft(tout);
 	textout_putstr(tout, "}\n");
 	return 1;
 }
 
+unsigned
+blt_dlatclr(struct exec *o, struct data **r)
+{
+	long unit;
+
+	if (!exec_lookuplong(o, "devnum", &unit)) {
+		return 0;
+	}
+	if (unit < 0 || unit >= DEFAULT_MAXNDEVS || !mididev_byunit[unit]) {
+		cons_errs(o->procname, "bad device number");
+		return 0;
+	}
+	mididev_latreset(mididev_byunit[unit]);
+	return 1;
+}
+
 unsigned
 blt_dixctl(struct exec *o, struct data **r)
 {
@@ -27,6 +27,15 @@ unsigned blt_builtinlist(struct exec *, struct data **);
 
 unsigned blt_version(struct exec *, struct data **);
 unsigned blt_panic(struct exec *, struct data **);
+unsigned blt_bench(struct exec *, struct data **);
+unsigned blt_jitter(struct exec *, struct data **);
+unsigned blt_poolinfo(struct exec *, struct data **);
+unsigned blt_poolsize(struct exec *, struct data **);
+unsigned blt_meminfo(struct exec *, struct data **);
+unsigned blt_poolfix(struct exec *, struct data **);
+unsigned blt_compact(struct exec *, struct data **);
+unsigned blt_prof(struct exec *, struct data **);
+unsigned blt_profclr(struct exec *, struct data **);
 unsigned blt_debug(struct exec *, struct data **);
 unsigned blt_exec(struct exec *, struct data **);
 unsigned blt_print(struct exec *, struct data **);
@@ -61,10 +70,19 @@ unsigned blt_unmute(struct exec *, struct data **);
 unsigned blt_getmute(struct exec *, struct data **);
 unsigned blt_ls(struct exec *, struct data **);
 unsigned blt_save(struct exec *, struct data **);
+unsigned blt_savelz(struct exec *, struct data **);
+unsigned blt_savebin(struct exec *, struct data **);
+unsigned blt_bgsave(struct exec *, struct data **);
+unsigned blt_snapshot(struct exec *, struct data **);
+unsigned blt_restore(struct exec *, struct data **);
+unsigned blt_mapload(struct exec *, struct data **);
+unsigned blt_slload(struct exec *, struct data **);
+unsigned blt_slnext(struct exec *, struct data **);
 unsigned blt_load(struct exec *, struct data **);
 unsigned blt_reset(struct exec *, struct data **);
 unsigned blt_export(struct exec *, struct data **);
 unsigned blt_import(struct exec *, struct data **);
+unsigned blt_smfplay(struct exec *, struct data **);
 unsigned blt_idle(struct exec *, struct data **);
 unsigned blt_play(struct exec *, struct data **);
 unsigned blt_rec(struct exec *, struct data **);
@@ -83,12 +101,15 @@ unsigned blt_ctlunconf(struct exec *, struct data **);
 unsigned blt_ctlinfo(struct exec *, struct data **);
 unsigned blt_evpat(struct exec *, struct data **);
 unsigned blt_evinfo(struct exec *, struct data **);
+unsigned blt_normrate(struct exec *, struct data **);
 unsigned blt_metro(struct exec *, struct data **);
 unsigned blt_metrocf(struct exec *, struct data **);
 unsigned blt_tap(struct exec *, struct data **);
 unsigned blt_tapev(struct exec *, struct data **);
 unsigned blt_undo(struct exec *, struct data **);
 unsigned blt_undolist(struct exec *, struct data **);
+unsigned blt_undosize(struct exec *, struct data **);
+unsigned blt_workers(struct exec *, struct data **);
 
 unsigned blt_tlist(struct exec *, struct data **);
 unsigned blt_tnew(struct exec *, struct data **);
@@ -100,18 +121,21 @@ unsigned blt_tsetf(struct exec *, struct data **);
 unsigned blt_tgetf(struct exec *, struct data **);
 unsigned blt_tcheck(struct exec *, struct data **);
 unsigned blt_trewrite(struct exec *, struct data **);
+unsigned blt_tpack(struct exec *, struct data **);
 unsigned blt_tcut(struct exec *, struct data **);
 unsigned blt_tins(struct exec *, struct data **);
 unsigned blt_tclr(struct exec *, struct data **);
 unsigned blt_tpaste(struct exec *, struct data **);
 unsigned blt_tcopy(struct exec *, struct data **);
 unsigned blt_tmerge(struct exec *, struct data **);
+unsigned blt_tflatten(struct exec *, struct data **);
 unsigned blt_tquant(struct exec *, struct data **);
 unsigned blt_tquanta(struct exec *, struct data **);
 unsigned blt_tquantf(struct exec *, struct data **);
 unsigned blt_ttransp(struct exec *, struct data **);
 unsigned blt_tvcurve(struct exec *, struct data **);
 unsigned blt_tevmap(struct exec *, struct data **);
+unsigned blt_tedit(struct exec *, struct data **);
 unsigned blt_tclist(struct exec *, struct data **);
 unsigned blt_tinfo(struct exec *, struct data **);
 unsigned blt_tdump(struct exec *, struct data **);
@@ -167,6 +191,9 @@ unsigned blt_xsetd(struct exec *, struct data **);
 unsigned blt_xadd(struct exec *, struct data **);
 unsigned blt_ximport(struct exec *, struct data **);
 unsigned blt_xexport(struct exec *, struct data **);
+unsigned blt_xasync(struct exec *, struct data **);
+unsigned blt_noxasync(struct exec *, struct data **);
+unsigned blt_xprogress(struct exec *, struct data **);
 
 unsigned blt_dlist(struct exec *, struct data **);
 unsigned blt_dnew(struct exec *, struct data **);
@@ -174,9 +201,16 @@ unsigned blt_ddel(struct exec *, struct data **);
 unsigned blt_dmtcrx(struct exec *, struct data **);
 unsigned blt_dmmctx(struct exec *, struct data **);
 unsigned blt_dclkrx(struct exec *, struct data **);
+unsigned blt_dclkpll(struct exec *, struct data **);
+unsigned blt_dclkinfo(struct exec *, struct data **);
 unsigned blt_dclktx(struct exec *, struct data **);
 unsigned blt_dclkrate(struct exec *, struct data **);
 unsigned blt_dinfo(struct exec *, struct data **);
+unsigned blt_dxthru(struct exec *, struct data **);
+unsigned blt_dbaud(struct exec *, struct data **);
+unsigned blt_dlook(struct exec *, struct data **);
+unsigned blt_dlat(struct exec *, struct data **);
+unsigned blt_dlatclr(struct exec *, struct data **);
 unsigned blt_dixctl(struct exec *, struct data **);
 unsigned blt_doxctl(struct exec *, struct data **);
 unsigned blt_diev(struct exec *, struct data **);
@@ -23,6 +23,13 @@
 #include "tty.h"
 #include "user.h"
 
+/*
+ * position and tag reported from the realtime path, printed later
+ * by cons_flush(): only the last ones are kept
+ */
+unsigned cons_pospending = 0, cons_pos[3];
+char *cons_tagpending = NULL;
+
 /*
  * print song position
  */
@@ -31,6 +38,13 @@ cons_putpos(unsigned measure, unsigned beat, unsigned tic)
 {
 	char buf[32];
 
+	if (log_rt) {
+		cons_pos[0] = measure;
+		cons_pos[1] = beat;
+		cons_pos[2] = tic;
+		cons_pospending = 1;
+		return;
+	}
 	if (user_flag_verb) {
 		fprintf(stdout, "+pos %u %u %u\n", measure, beat, tic);
 		fflush(stdout);
@@ -47,12 +61,35 @@ cons_putpos(unsigned measure, unsigned beat, unsigned tic)
 void
 cons_puttag(char *tag)
 {
+	if (log_rt) {
+		cons_tagpending = tag;
+		return;
+	}
 	if (user_flag_verb) {
 		fprintf(stdout, "+%s\n", tag);
 		fflush(stdout);
 	}
 }
 
+/*
+ * print the position and the tag reported from the realtime path
+ */
+void
+cons_flush(void)
+{
+	char *tag;
+
+	if (cons_pospending) {
+		cons_pospending = 0;
+		cons_putpos(cons_pos[0], cons_pos[1], cons_pos[2]);
+	}
+	if (cons_tagpending) {
+		tag = cons_tagpending;
+		cons_tagpending = NULL;
+		cons_puttag(tag);
+	}
+}
+
 /*
  * print "+ready"
  */
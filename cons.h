@@ -23,6 +23,7 @@ void cons_init(struct el_ops *, void *);
 void cons_done(void);
 void cons_putpos(unsigned, unsigned, unsigned);
 void cons_puttag(char *);
+void cons_flush(void);
 void cons_ready(void);
 
 void cons_err(char *);
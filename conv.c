@@ -28,42 +28,114 @@
  * controller followed by a prog change will be converted to a
  * "extended" prog change (XPC) that contains also the bank number.
  * In order to generate XPCs whose context is the current bank number,
- * we keep the bank number into a statelist. Similarly the current
+ * we keep the bank number in a context. Similarly the current
  * NRPN and RPN numbers are kept.
  *
- * To keep the state, we use statelist_xxx() functions. However since
- * we store only controllers, we roll simplified lookup() and update()
- * functions.
+ * The context is kept per device/channel pair, in a small array
+ * indexed by controller number (see conv_ctlidx()), so looking up a
+ * controller doesn't depend on the number of controllers set. The
+ * array of the last channel used is moved at the head of the list,
+ * so a stream of events on the same channel finds it immediately.
  */
 
 #include "utils.h"
-#include "state.h"
+#include "defs.h"
+#include "ev.h"
 #include "conv.h"
 
-#define CHAN_MATCH(e1, e2) \
-	((e1)->ch == (e2)->ch && (e1)->dev == (e2)->dev)
+/*
+ * return the index in the context array of the given controller, or
+ * CONV_NCTL if it's never stored
+ */
+unsigned
+conv_ctlidx(unsigned num)
+{
+	if (num < 32)
+		return num;
+	switch (num) {
+	case BANK_LO:
+		return 32;
+	case NRPN_LO:
+		return 33;
+	case NRPN_HI:
+		return 34;
+	case RPN_LO:
+		return 35;
+	case RPN_HI:
+		return 36;
+	}
+	return CONV_NCTL;
+}
 
-#define CTL_MATCH(e1, e2) \
-	((e1)->ctl_num == (e2)->ctl_num && CHAN_MATCH((e1), (e2)))
+/*
+ * initialize an empty context
+ */
+void
+conv_init(struct conv *o)
+{
+	o->chans = NULL;
+}
 
 /*
- * create a state for the given controller event. If there is already
- * one, then update it.
+ * free all channels of the context, which becomes empty
  */
 void
-conv_setctl(struct statelist *slist, struct ev *ev)
+conv_done(struct conv *o)
+{
+	struct convchan *c, *cnext;
+
+	for (c = o->chans; c != NULL; c = cnext) {
+		cnext = c->next;
+		xfree(c);
+	}
+	o->chans = NULL;
+}
+
+/*
+ * return the context of the device/channel of the given event and
+ * move it at the head of the list. If there's none, create it if
+ * 'create' is set, else return NULL
+ */
+struct convchan *
+conv_getchan(struct conv *o, struct ev *ev, unsigned create)
 {
-	struct state *i;
+	struct convchan **pc, *c;
+	unsigned i;
 
-	for (i = slist->first; i != NULL; i = i->next) {
-		if (CTL_MATCH(&i->ev, ev)) {
-			i->ev.ctl_val = ev->ctl_val;
-			return;
+	for (pc = &o->chans; (c = *pc) != NULL; pc = &c->next) {
+		if (c->dev == ev->dev && c->ch == ev->ch) {
+			if (pc != &o->chans) {
+				*pc = c->next;
+				c->next = o->chans;
+				o->chans = c;
+			}
+			return c;
 		}
 	}
-	i = state_new();
-	statelist_add(slist, i);
-	i->ev = *ev;
+	if (!create)
+		return NULL;
+	c = xmalloc(sizeof(struct convchan), "convchan");
+	c->dev = ev->dev;
+	c->ch = ev->ch;
+	for (i = 0; i < CONV_NCTL; i++)
+		c->ctl[i] = EV_UNDEF;
+	c->next = o->chans;
+	o->chans = c;
+	return c;
+}
+
+/*
+ * set the value of the given controller event
+ */
+void
+conv_setctl(struct conv *o, struct ev *ev)
+{
+	unsigned idx;
+
+	idx = conv_ctlidx(ev->ctl_num);
+	if (idx == CONV_NCTL)
+		return;
+	conv_getchan(o, ev, 1)->ctl[idx] = ev->ctl_val;
 }
 
 /*
@@ -72,16 +144,16 @@ conv_setctl(struct statelist *slist, struct ev *ev)
  * recorded, then return EV_UNDEF
  */
 unsigned
-conv_getctl(struct statelist *slist, struct ev *ev, unsigned num)
+conv_getctl(struct conv *o, struct ev *ev, unsigned num)
 {
-	struct state *i;
+	struct convchan *c;
+	unsigned idx;
 
-	for (i = slist->first; i != NULL; i = i->next) {
-		if (i->ev.ctl_num == num && CHAN_MATCH(&i->ev, ev)) {
-			return i->ev.ctl_val;
-		}
-	}
-	return EV_UNDEF;
+	idx = conv_ctlidx(num);
+	if (idx == CONV_NCTL)
+		return EV_UNDEF;
+	c = conv_getchan(o, ev, 0);
+	return c ? c->ctl[idx] : EV_UNDEF;
 }
 
 /*
@@ -89,17 +161,17 @@ conv_getctl(struct statelist *slist, struct ev *ev, unsigned num)
  * same channel/device as the given event.
  */
 void
-conv_rmctl(struct statelist *slist, struct ev *ev, unsigned num)
+conv_rmctl(struct conv *o, struct ev *ev, unsigned num)
 {
-	struct state *i;
+	struct convchan *c;
+	unsigned idx;
 
-	for (i = slist->first; i != NULL; i = i->next) {
-		if (i->ev.ctl_num == num && CHAN_MATCH(&i->ev, ev)) {
-			statelist_rm(slist, i);
-			state_del(i);
-			break;
-		}
-	}
+	idx = conv_ctlidx(num);
+	if (idx == CONV_NCTL)
+		return;
+	c = conv_getchan(o, ev, 0);
+	if (c != NULL)
+		c->ctl[idx] = EV_UNDEF;
 }
 
 /*
@@ -109,15 +181,15 @@ conv_rmctl(struct statelist *slist, struct ev *ev, unsigned num)
  * returned.
  */
 unsigned
-conv_getctx(struct statelist *slist, struct ev *ev, unsigned hi, unsigned lo)
+conv_getctx(struct conv *ctx, struct ev *ev, unsigned hi, unsigned lo)
 {
 	unsigned vhi, vlo;
 
-	vlo = conv_getctl(slist, ev, lo);
+	vlo = conv_getctl(ctx, ev, lo);
 	if (vlo == EV_UNDEF) {
 		return EV_UNDEF;
 	}
-	vhi = conv_getctl(slist, ev, hi);
+	vhi = conv_getctl(ctx, ev, hi);
 	if (vhi == EV_UNDEF) {
 		return EV_UNDEF;
 	}
@@ -130,7 +202,7 @@ conv_getctx(struct statelist *slist, struct ev *ev, unsigned hi, unsigned lo)
  * filled and 1 is returned.
  */
 unsigned
-conv_packev(struct statelist *l, unsigned xctlset, unsigned flags,
+conv_packev(struct conv *ctx, unsigned xctlset, unsigned flags,
 	    struct ev *ev, struct ev *rev)
 {
 	unsigned num, val;
@@ -141,67 +213,67 @@ conv_packev(struct statelist *l, unsigned xctlset, unsigned flags,
 		rev->ch = ev->ch;
 		rev->pc_prog = ev->v0;
 		rev->pc_bank = (flags & CONV_XPC) ?
-		    conv_getctx(l, ev, BANK_HI, BANK_LO) : 0;
+		    conv_getctx(ctx, ev, BANK_HI, BANK_LO) : 0;
 		return 1;
 	} else if (ev->cmd == EV_CTL) {
 		switch (ev->ctl_num) {
 		case BANK_HI:
 			if (!(flags & CONV_XPC))
 				break;
-			conv_rmctl(l, ev, BANK_LO);
-			conv_setctl(l, ev);
+			conv_rmctl(ctx, ev, BANK_LO);
+			conv_setctl(ctx, ev);
 			return 0;
 		case RPN_HI:
 			if (!(flags & CONV_XPC))
 				break;
-			conv_rmctl(l, ev, NRPN_LO);
-			conv_rmctl(l, ev, RPN_LO);
-			conv_setctl(l, ev);
+			conv_rmctl(ctx, ev, NRPN_LO);
+			conv_rmctl(ctx, ev, RPN_LO);
+			conv_setctl(ctx, ev);
 			return 0;
 		case NRPN_HI:
 			if (!(flags & CONV_NRPN))
 				break;
-			conv_rmctl(l, ev, RPN_LO);
-			conv_rmctl(l, ev, NRPN_LO);
-			conv_setctl(l, ev);
+			conv_rmctl(ctx, ev, RPN_LO);
+			conv_rmctl(ctx, ev, NRPN_LO);
+			conv_setctl(ctx, ev);
 			return 0;
 		case DATAENT_HI:
 			if (!(flags & (CONV_RPN | CONV_NRPN)))
 				break;
-			conv_rmctl(l, ev, DATAENT_LO);
-			conv_setctl(l, ev);
+			conv_rmctl(ctx, ev, DATAENT_LO);
+			conv_setctl(ctx, ev);
 			return 0;
 		case BANK_LO:
 			if (!(flags & CONV_XPC))
 				break;
-			conv_setctl(l, ev);
+			conv_setctl(ctx, ev);
 			return 0;
 		case NRPN_LO:
 			if (!(flags & CONV_NRPN))
 				break;
-			conv_rmctl(l, ev, RPN_LO);
-			conv_setctl(l, ev);
+			conv_rmctl(ctx, ev, RPN_LO);
+			conv_setctl(ctx, ev);
 			return 0;
 		case RPN_LO:
 			if (!(flags & CONV_RPN))
 				break;
-			conv_rmctl(l, ev, NRPN_LO);
-			conv_setctl(l, ev);
+			conv_rmctl(ctx, ev, NRPN_LO);
+			conv_setctl(ctx, ev);
 			return 0;
 		case DATAENT_LO:
 			if (!(flags & (CONV_RPN | CONV_NRPN)))
 				break;
-			num = conv_getctx(l, ev, NRPN_HI, NRPN_LO);
+			num = conv_getctx(ctx, ev, NRPN_HI, NRPN_LO);
 			if (num != EV_UNDEF) {
 				rev->cmd = EV_NRPN;
 			} else {
-				num = conv_getctx(l, ev,
+				num = conv_getctx(ctx, ev,
 				    RPN_HI, NRPN_LO);
 				if (num == EV_UNDEF)
 					return 0;
 				rev->cmd = EV_RPN;
 			}
-			val = conv_getctl(l, ev, DATAENT_HI);
+			val = conv_getctl(ctx, ev, DATAENT_HI);
 			if (val == EV_UNDEF)
 				return 0;
 			rev->dev = ev->dev;
@@ -212,13 +284,13 @@ conv_packev(struct statelist *l, unsigned xctlset, unsigned flags,
 		}
 		if (ev->ctl_num < 32) {
 			if (EVCTL_ISFINE(xctlset, ev->ctl_num)) {
-				conv_setctl(l, ev);
+				conv_setctl(ctx, ev);
 				return 0;
 			}
 		} else if (ev->ctl_num < 64) {
 			num = ev->ctl_num - 32;
 			if (EVCTL_ISFINE(xctlset, num)) {
-				val = conv_getctl(l, ev, num);
+				val = conv_getctl(ctx, ev, num);
 				if (val == EV_UNDEF)
 					return 0;
 				rev->ctl_num = num;
@@ -245,7 +317,7 @@ conv_packev(struct statelist *l, unsigned xctlset, unsigned flags,
  * the array.
  */
 unsigned
-conv_unpackev(struct statelist *slist, unsigned xctlset, unsigned flags,
+conv_unpackev(struct conv *ctx, unsigned xctlset, unsigned flags,
 	      struct ev *ev, struct ev *rev)
 {
 	unsigned val, hi;
@@ -276,14 +348,14 @@ conv_unpackev(struct statelist *slist, unsigned xctlset, unsigned flags,
 		}
 		if (ev->ctl_num < 32 && EVCTL_ISFINE(xctlset, ev->ctl_num)) {
 			hi = ev->ctl_val >> 7;
-			val = conv_getctl(slist, ev, ev->ctl_num);
+			val = conv_getctl(ctx, ev, ev->ctl_num);
 			if (val != hi || val == EV_UNDEF) {
 				rev->cmd = EV_CTL;
 				rev->dev = ev->dev;
 				rev->ch = ev->ch;
 				rev->ctl_num = ev->ctl_num;
 				rev->ctl_val = hi;
-				conv_setctl(slist, rev);
+				conv_setctl(ctx, rev);
 				rev++;
 				nev++;
 			}
@@ -305,14 +377,14 @@ conv_unpackev(struct statelist *slist, unsigned xctlset, unsigned flags,
 		}
 	} else if (ev->cmd == EV_XPC) {
 		if (flags & CONV_XPC) {
-			val = conv_getctx(slist, ev, BANK_HI, BANK_LO);
+			val = conv_getctx(ctx, ev, BANK_HI, BANK_LO);
 			if (val != ev->pc_bank && ev->pc_bank != EV_UNDEF) {
 				rev->cmd = EV_CTL;
 				rev->dev = ev->dev;
 				rev->ch = ev->ch;
 				rev->ctl_num = BANK_HI;
 				rev->ctl_val = ev->pc_bank >> 7;
-				conv_setctl(slist, rev);
+				conv_setctl(ctx, rev);
 				rev++;
 				nev++;
 				rev->cmd = EV_CTL;
@@ -320,7 +392,7 @@ conv_unpackev(struct statelist *slist, unsigned xctlset, unsigned flags,
 				rev->ch = ev->ch;
 				rev->ctl_num = BANK_LO;
 				rev->ctl_val = ev->pc_bank & 0x7f;
-				conv_setctl(slist, rev);
+				conv_setctl(ctx, rev);
 				rev++;
 				nev++;
 			}
@@ -335,16 +407,16 @@ conv_unpackev(struct statelist *slist, unsigned xctlset, unsigned flags,
 	} else if (ev->cmd == EV_NRPN) {
 		if (!(flags & CONV_NRPN))
 			return 0;
-		val = conv_getctx(slist, ev, NRPN_HI, NRPN_LO);
+		val = conv_getctx(ctx, ev, NRPN_HI, NRPN_LO);
 		if (val != ev->rpn_num) {
-			conv_rmctl(slist, ev, RPN_HI);
-			conv_rmctl(slist, ev, RPN_LO);
+			conv_rmctl(ctx, ev, RPN_HI);
+			conv_rmctl(ctx, ev, RPN_LO);
 			rev->cmd = EV_CTL;
 			rev->dev = ev->dev;
 			rev->ch = ev->ch;
 			rev->ctl_num = NRPN_HI;
 			rev->ctl_val = ev->rpn_num >> 7;
-			conv_setctl(slist, rev);
+			conv_setctl(ctx, rev);
 			rev++;
 			nev++;
 			rev->cmd = EV_CTL;
@@ -352,7 +424,7 @@ conv_unpackev(struct statelist *slist, unsigned xctlset, unsigned flags,
 			rev->ch = ev->ch;
 			rev->ctl_num = NRPN_LO;
 			rev->ctl_val = ev->rpn_num & 0x7f;
-			conv_setctl(slist, rev);
+			conv_setctl(ctx, rev);
 			rev++;
 			nev++;
 		}
@@ -375,16 +447,16 @@ conv_unpackev(struct statelist *slist, unsigned xctlset, unsigned flags,
 	} else if (ev->cmd == EV_RPN) {
 		if (!(flags & CONV_RPN))
 			return 0;
-		val = conv_getctx(slist, ev, RPN_HI, RPN_LO);
+		val = conv_getctx(ctx, ev, RPN_HI, RPN_LO);
 		if (val != ev->rpn_num) {
-			conv_rmctl(slist, ev, NRPN_HI);
-			conv_rmctl(slist, ev, NRPN_LO);
+			conv_rmctl(ctx, ev, NRPN_HI);
+			conv_rmctl(ctx, ev, NRPN_LO);
 			rev->cmd = EV_CTL;
 			rev->dev = ev->dev;
 			rev->ch = ev->ch;
 			rev->ctl_num = RPN_HI;
 			rev->ctl_val = ev->rpn_num >> 7;
-			conv_setctl(slist, rev);
+			conv_setctl(ctx, rev);
 			rev++;
 			nev++;
 			rev->cmd = EV_CTL;
@@ -392,7 +464,7 @@ conv_unpackev(struct statelist *slist, unsigned xctlset, unsigned flags,
 			rev->ch = ev->ch;
 			rev->ctl_num = RPN_LO;
 			rev->ctl_val = ev->rpn_num & 0x7f;
-			conv_setctl(slist, rev);
+			conv_setctl(ctx, rev);
 			rev++;
 			nev++;
 		}
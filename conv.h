@@ -21,6 +21,12 @@
 
 #define CONV_NUMREV 4
 
+/*
+ * number of controllers stored per channel: the 32 high bytes of
+ * 14-bit controllers, the low byte of the bank and the (N)RPN numbers
+ */
+#define CONV_NCTL 37
+
 /*
  * constants to define a set of packed events
  */
@@ -28,12 +34,29 @@
 #define CONV_NRPN	(1 << EV_NRPN)
 #define CONV_RPN	(1 << EV_RPN)
 
+/*
+ * controllers of a device/channel pair, EV_UNDEF if unknown
+ */
+struct convchan {
+	struct convchan *next;		/* next used channel */
+	unsigned dev, ch;
+	unsigned short ctl[CONV_NCTL];	/* see conv_ctlidx() */
+};
+
+/*
+ * state needed to convert events of all channels
+ */
+struct conv {
+	struct convchan *chans;		/* last used first */
+};
+
 struct ev;
-struct statelist;
 
-unsigned conv_packev(struct statelist *, unsigned, unsigned,
+void conv_init(struct conv *);
+void conv_done(struct conv *);
+unsigned conv_packev(struct conv *, unsigned, unsigned,
     struct ev *, struct ev *);
-unsigned conv_unpackev(struct statelist *, unsigned, unsigned,
+unsigned conv_unpackev(struct conv *, unsigned, unsigned,
     struct ev *, struct ev *);
 
 #endif /* MIDISH_CONV_H */
@@ -33,6 +33,21 @@
 #include "str.h"
 #include "cons.h"
 #include "data.h"
+#include "pool.h"
+
+struct pool data_pool;
+
+void
+data_pool_init(unsigned size)
+{
+	pool_init(&data_pool, "data", sizeof(struct data), size);
+}
+
+void
+data_pool_done(void)
+{
+	pool_done(&data_pool);
+}
 
 /*
  * allocate a new data structure and initialize it as 'nil'
@@ -41,7 +56,7 @@ struct data *
 data_newnil(void)
 {
 	struct data *o;
-	o = (struct data *)xmalloc(sizeof(struct data), "data");
+	o = (struct data *)pool_new(&data_pool);
 	o->type = DATA_NIL;
 	o->next = NULL;
 	return o;
@@ -224,7 +239,7 @@ void
 data_delete(struct data *o)
 {
 	data_clear(o);
-	xfree(o);
+	pool_del(&data_pool, o);
 }
 
 void
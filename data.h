@@ -49,6 +49,8 @@ struct data {
 	struct data *next;
 };
 
+void	     data_pool_init(unsigned);
+void	     data_pool_done(void);
 struct data *data_newnil(void);
 struct data *data_newlong(long);
 struct data *data_newstring(char *);
@@ -61,6 +61,13 @@
  */
 #define DEFAULT_MAXNDEVS	16
 
+/*
+ * maximum number of scheduled timeouts: sensing and MTC of each
+ * device, the normalizer, the mixer, the metronome and the sysex
+ * sender of the playing song, with some room to spare
+ */
+#define DEFAULT_MAXNTIMOS	(DEFAULT_MAXNDEVS * 3 + 8)
+
 /*
  * maximum number of instruments
  */
@@ -71,6 +78,11 @@
  */
 #define DEFAULT_MAXNSEQEVS	1000//400000
 
+/*
+ * initial number of events of the scratch arena, see track_inittmp()
+ */
+#define DEFAULT_MAXNSCRATCHEVS	256
+
 /*
  * maximum number of tracks
  */
@@ -88,10 +100,26 @@
 #define DEFAULT_MAXNSYSEXS 100//	2000
 
 /*
- * maximum number of chunks (each sysex is a set of chunks)
+ * maximum number of chunks (each sysex is a set of chunks), used
+ * only by messages being received or built, stored ones are packed
  */
 #define DEFAULT_MAXNCHUNKS	(DEFAULT_MAXNSYSEXS * 2)
 
+/*
+ * initial number of interpreter values, code nodes and variables,
+ * pools grow as needed
+ */
+#define DEFAULT_MAXNDATAS	256
+#define DEFAULT_MAXNNODES	256
+#define DEFAULT_MAXNVARS	64
+
+/*
+ * initial number of channels whose parameters are cached for output,
+ * and of state lists using a hash table
+ */
+#define DEFAULT_MAXNMIXCHANS	4
+#define DEFAULT_MAXNSTATEHASHES	8
+
 /*
  * default number of tics per beat
  */
@@ -135,6 +163,12 @@
  */
 #define DEFAULT_SXWAIT		20
 
+/*
+ * time to transmit a byte on a MIDI wire (10 bits at 31250 bit/s) in
+ * 24-th of microsecond, used to pace sysex messages sent in background
+ */
+#define DEFAULT_SXBYTETIME	(320 * 24)
+
 /*
  * metronome click length in 24-th of microsecond (30ms)
  */
@@ -155,9 +189,11 @@
 #define DEFAULT_METRO_LO_VEL	90
 
 /*
- * max memory usage allowed for undo
+ * max memory usage allowed for undo, and for the most recent entries,
+ * older ones are packed in bulk memory
  */
 #define UNDO_MAXSIZE		(4 * 1024 * 1024)
+#define UNDO_HOTSIZE		(64 * 1024)
 
 /*
  * output source prioriries
@@ -29,114 +29,129 @@ struct evinfo evinfo[EV_NUMCMD] =
 	  0,
 	  0, 0,
 	  0, 0, 0, 0,
-	  NULL
+	  NULL, 0, {0}
 	},
 	{ NULL,	"any",
 	  EV_HAS_DEV | EV_HAS_CH,
 	  0, 0,
 	  0, 0, 0, 0,
-	  NULL
+	  NULL, 0, {0}
 	},
 	{ "tempo", NULL,
 	  0,
 	  1, 0xdeadbeef,
 	  TEMPO_MIN, TEMPO_MAX, 0, 0,
-	  NULL
+	  NULL, 0, {0}
 	},
 	{ "timesig", NULL,
 	  0,
 	  2, 0xdeadbeef,
 	  1, 16, 1, 32,
-	  NULL
+	  NULL, 0, {0}
 	},
 	{ "nrpn", "nrpn",
 	  EV_HAS_DEV | EV_HAS_CH,
 	  2, 2,
 	  0, EV_MAXFINE, 0, EV_MAXFINE,
-	  NULL
+	  NULL, 0, {0}
 	},
 	{ "rpn", "rpn",
 	  EV_HAS_DEV | EV_HAS_CH,
 	  2, 2,
 	  0, EV_MAXFINE, 0, EV_MAXFINE,
-	  NULL
+	  NULL, 0, {0}
 	},
 	{ "xctl", "xctl",
 	  EV_HAS_DEV | EV_HAS_CH,
 	  2, 1,
 	  0, EV_MAXCOARSE, 0, EV_MAXFINE,
-	  NULL
+	  NULL, 0, {0}
 	},
 	{ "xpc", "xpc",
 	  EV_HAS_DEV | EV_HAS_CH,
 	  2, 2,
 	  0, EV_MAXFINE, 0, EV_MAXCOARSE,
-	  NULL
+	  NULL, 0, {0}
 	},
 	{ "noff", NULL,
 	  EV_HAS_DEV | EV_HAS_CH,
 	  2, 0xdeadbeef,
 	  0, EV_MAXCOARSE, 0, EV_MAXCOARSE,
-	  NULL
+	  NULL, 0, {0}
 	},
 	{ "non", "note",
 	  EV_HAS_DEV | EV_HAS_CH,
 	  2, 1,
 	  0, EV_MAXCOARSE, 0, EV_MAXCOARSE,
-	  NULL
+	  NULL, 0, {0}
 	},
 	{ "kat", NULL,
 	  EV_HAS_DEV | EV_HAS_CH,
 	  2, 0xdeadbeef,
 	  0, EV_MAXCOARSE, 0, EV_MAXCOARSE,
-	  NULL
+	  NULL, 0, {0}
 	},
 	{ "ctl", "ctl",
 	  EV_HAS_DEV | EV_HAS_CH,
 	  2, 1,
 	  0, EV_MAXCOARSE, 0, EV_MAXCOARSE,
-	  NULL
+	  NULL, 0, {0}
 	},
 	{ "pc", "pc",
 	  EV_HAS_DEV | EV_HAS_CH,
 	  1, 1,
 	  0, EV_MAXCOARSE, 0, 0,
-	  NULL
+	  NULL, 0, {0}
 	},
 	{ "cat", "cat",
 	  EV_HAS_DEV | EV_HAS_CH,
 	  1, 0,
 	  0, EV_MAXCOARSE, 0, 0,
-	  NULL
+	  NULL, 0, {0}
 	},
 	{ "bend", "bend",
 	  EV_HAS_DEV | EV_HAS_CH,
 	  1, 0,
 	  0, EV_MAXFINE, 0, 0,
-	  NULL
+	  NULL, 0, {0}
 	},
-	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL }, /* unused slot */
-	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL }, /* sysex pattern 0 */
-	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL }, /* sysex pattern 1 */
-	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL }, /* sysex pattern 2 */
-	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL }, /* sysex pattern 3 */
-	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL }, /* sysex pattern 4 */
-	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL }, /* sysex pattern 5 */
-	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL }, /* sysex pattern 6 */
-	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL }, /* sysex pattern 7 */
-	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL }, /* sysex pattern 8 */
-	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL }, /* sysex pattern 9 */
-	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL }, /* sysex pattern 0xa */
-	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL }, /* sysex pattern 0xb */
-	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL }, /* sysex pattern 0xc */
-	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL }, /* sysex pattern 0xd */
-	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL }, /* sysex pattern 0xe */
-	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL }  /* sysex pattern 0xf */
+	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL, 0, {0} }, /* unused slot */
+	/* sysex patterns */
+	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL, 0, {0} }, /* pattern 0 */
+	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL, 0, {0} }, /* pattern 1 */
+	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL, 0, {0} }, /* pattern 2 */
+	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL, 0, {0} }, /* pattern 3 */
+	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL, 0, {0} }, /* pattern 4 */
+	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL, 0, {0} }, /* pattern 5 */
+	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL, 0, {0} }, /* pattern 6 */
+	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL, 0, {0} }, /* pattern 7 */
+	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL, 0, {0} }, /* pattern 8 */
+	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL, 0, {0} }, /* pattern 9 */
+	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL, 0, {0} }, /* pattern 0xa */
+	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL, 0, {0} }, /* pattern 0xb */
+	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL, 0, {0} }, /* pattern 0xc */
+	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL, 0, {0} }, /* pattern 0xd */
+	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL, 0, {0} }, /* pattern 0xe */
+	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL, 0, {0} }  /* pattern 0xf */
 
 };
 
 struct evctl evctl_tab[EV_MAXCOARSE + 1];
 
+/*
+ * controllers configured by evctl_init(), some defaults for testing
+ */
+const struct evctl_def {
+	unsigned num;
+	char *name;
+	unsigned defval;
+} evctl_defs[] = {
+	{1,	"mod",		0},
+	{7,	"vol",		EV_UNDEF},
+	{11,	"expr",		EV_MAXCOARSE << 7},
+	{64,	"sustain",	0}
+};
+
 /*
  * return the 'name' of the given event
  */
@@ -598,6 +613,86 @@ evspec_matchev(struct evspec *es, struct ev *ev)
 	return 1;
 }
 
+/*
+ * compile the given spec, NULL meaning any event. The result
+ * matches the same events as evspec_matchev() and state_inspec()
+ */
+void
+evsel_init(struct evsel *o, struct evspec *es)
+{
+	struct evinfo *ei;
+	unsigned i, bit, devmask, chmask;
+
+	o->cmd = o->devcmd = o->chcmd = o->v0cmd = o->v1cmd = 0;
+	o->dev = o->ch = 0;
+	o->v0_min = o->v0_len = o->v1_min = o->v1_len = 0;
+	if (es == NULL) {
+		o->cmd = ~0U;
+		return;
+	}
+	if (es->cmd == EVSPEC_EMPTY)
+		return;
+	for (i = es->dev_min; i <= es->dev_max && i <= EV_MAXDEV; i++)
+		o->dev |= 1U << i;
+	for (i = es->ch_min; i <= es->ch_max && i <= EV_MAXCH; i++)
+		o->ch |= 1U << i;
+	devmask = (evinfo[es->cmd].flags & EV_HAS_DEV) ? ~0U : 0;
+	chmask = (evinfo[es->cmd].flags & EV_HAS_CH) ? ~0U : 0;
+	for (i = 0; i < EV_NUMCMD; i++) {
+		if (es->cmd == EVSPEC_NOTE) {
+			if (i != EV_NON && i != EV_NOFF && i != EV_KAT)
+				continue;
+		} else if (es->cmd != EVSPEC_ANY && es->cmd != i)
+			continue;
+		bit = 1U << i;
+		ei = &evinfo[i];
+		o->cmd |= bit;
+		if (ei->flags & EV_HAS_DEV)
+			o->devcmd |= bit & devmask;
+		if (ei->flags & EV_HAS_CH)
+			o->chcmd |= bit & chmask;
+		if (es->cmd == EVSPEC_ANY)
+			continue;
+		if (ei->nparams > 0 && evinfo[es->cmd].nparams > 0)
+			o->v0cmd |= bit;
+		if (ei->nparams > 1 && evinfo[es->cmd].nparams > 1)
+			o->v1cmd |= bit;
+	}
+	if (o->v0cmd) {
+		if (es->v0_min > es->v0_max)
+			o->v0cmd = o->cmd = 0;
+		o->v0_min = es->v0_min;
+		o->v0_len = es->v0_max - es->v0_min;
+	}
+	if (o->v1cmd) {
+		if (es->v1_min > es->v1_max)
+			o->v1cmd = o->cmd = 0;
+		o->v1_min = es->v1_min;
+		o->v1_len = es->v1_max - es->v1_min;
+	}
+}
+
+/*
+ * check if the event matches the compiled spec
+ */
+unsigned
+evsel_match(struct evsel *o, struct ev *ev)
+{
+	unsigned bit = 1U << ev->cmd;
+
+	if (!(o->cmd & bit))
+		return 0;
+	if ((o->devcmd & bit) && !(o->dev & (1U << ev->dev)))
+		return 0;
+	if ((o->chcmd & bit) && !(o->ch & (1U << ev->ch)))
+		return 0;
+	if ((o->v0cmd & bit) && ev->v0 - o->v0_min > o->v0_len)
+		return 0;
+	if ((o->v1cmd & bit) && ev->v1 - o->v1_min > o->v1_len)
+		return 0;
+	return 1;
+}
+
 /*
  * check if both sets are the same
  */
@@ -1005,20 +1100,17 @@ evctl_lookup(char *name, unsigned *ret)
 void
 evctl_init(void)
 {
+	const struct evctl_def *d;
 	unsigned i;
 
 	for (i = 0; i < EV_MAXCOARSE + 1; i++) {
 		evctl_tab[i].name = NULL;
 		evctl_tab[i].defval = EV_UNDEF;
 	}
-
-	/*
-	 * some defaults, for testing ...
-	 */
-	evctl_conf(1,   "mod", 0);
-	evctl_conf(7,   "vol", EV_UNDEF);
-	evctl_conf(11,  "expr", EV_MAXCOARSE << 7);
-	evctl_conf(64,  "sustain", 0);
+	for (i = 0; i < sizeof(evctl_defs) / sizeof(evctl_defs[0]); i++) {
+		d = &evctl_defs[i];
+		evctl_conf(d->num, d->name, d->defval);
+	}
 }
 
 /*
@@ -1036,6 +1128,12 @@ evctl_done(void)
 	}
 }
 
+/*
+ * trie of the defined sysex patterns, see evpat_build()
+ */
+struct evpat_node evpat_trie[EV_NPAT * EV_PATSIZE + 1];
+unsigned evpat_nnodes = 1;
+
 /*
  * find the sysex pattern corresponding to the given name
  */
@@ -1065,6 +1163,7 @@ evpat_unconf(unsigned cmd)
 	evinfo[cmd].ev = NULL;
 	evinfo[cmd].spec = NULL;
 	evinfo[cmd].pattern = NULL;
+	evpat_build();
 }
 
 void
@@ -1126,6 +1225,13 @@ evpat_set(unsigned cmd, char *name, unsigned char *pattern, unsigned size)
 		return 0;
 	}
 	evinfo[cmd].pattern = pattern;
+	evinfo[cmd].patlen = size;
+	for (i = 0; i < 4; i++)
+		evinfo[cmd].patoffs[i] = 0;
+	for (i = 1; i < size - 1; i++) {
+		if (pattern[i] >= EV_PATV0_HI)
+			evinfo[cmd].patoffs[pattern[i] - EV_PATV0_HI] = i;
+	}
 	evinfo[cmd].ev = evinfo[cmd].spec = name;
 	evinfo[cmd].flags = EV_HAS_DEV;
 	evinfo[cmd].nparams = has_v0_hi + has_v1_hi;
@@ -1139,5 +1245,116 @@ evpat_set(unsigned cmd, char *name, unsigned char *pattern, unsigned size)
 	log_putu(evinfo[cmd].nparams);
 	log_puts("\n");
 #endif
+	evpat_build();
 	return 1;
 }
+
+/*
+ * rebuild the trie from the defined patterns. Patterns are added in
+ * 'cmd' order, so new nodes are appended to the children lists
+ */
+void
+evpat_build(void)
+{
+	struct evpat_node *n;
+	unsigned cmd, i, node, c, prev;
+	unsigned char *p;
+
+	evpat_nnodes = 1;
+	evpat_trie[0].child = 0;
+	for (cmd = EV_PAT0; cmd < EV_PAT0 + EV_NPAT; cmd++) {
+		if (evinfo[cmd].ev == NULL)
+			continue;
+		p = evinfo[cmd].pattern;
+		node = 0;
+		for (i = 0; i < evinfo[cmd].patlen; i++) {
+			prev = 0;
+			for (c = evpat_trie[node].child; c != 0;
+			     c = evpat_trie[c].next) {
+				if (evpat_trie[c].byte == p[i])
+					break;
+				prev = c;
+			}
+			if (c == 0) {
+				c = evpat_nnodes++;
+				n = &evpat_trie[c];
+				n->byte = p[i];
+				n->cmd = cmd;
+				n->child = n->next = 0;
+				if (prev == 0)
+					evpat_trie[node].child = c;
+				else
+					evpat_trie[prev].next = c;
+			}
+			node = c;
+		}
+	}
+}
+
+/*
+ * match the given bytes against the children of the given node,
+ * and store in 'ev' the first matching pattern if it's before
+ * ev->cmd. Patterns that can't be before ev->cmd are skipped
+ */
+void
+evpat_walk(unsigned node, unsigned char *p, unsigned len,
+    unsigned v0, unsigned v1, struct ev *ev)
+{
+	struct evpat_node *n;
+	unsigned c, nv0, nv1;
+
+	if (len == 0)
+		return;
+	for (c = evpat_trie[node].child; c != 0; c = n->next) {
+		n = &evpat_trie[c];
+		if (n->cmd >= ev->cmd)
+			break;
+		nv0 = v0;
+		nv1 = v1;
+		switch (n->byte) {
+		case EV_PATV0_HI:
+			if (*p > 0x7f)
+				continue;
+			nv0 |= *p << 7;
+			break;
+		case EV_PATV0_LO:
+			if (*p > 0x7f)
+				continue;
+			nv0 |= *p;
+			break;
+		case EV_PATV1_HI:
+			if (*p > 0x7f)
+				continue;
+			nv1 |= *p << 7;
+			break;
+		case EV_PATV1_LO:
+			if (*p > 0x7f)
+				continue;
+			nv1 |= *p;
+			break;
+		case 0xf7:
+			if (*p != 0xf7)
+				continue;
+			ev->cmd = n->cmd;
+			ev->v0 = nv0;
+			ev->v1 = nv1;
+			return;
+		default:
+			if (*p != n->byte)
+				continue;
+		}
+		evpat_walk(c, p + 1, len - 1, nv0, nv1, ev);
+	}
+}
+
+/*
+ * find the first sysex pattern matching the given message, and
+ * store the event in 'ev'. Return 0 if there's none
+ */
+unsigned
+evpat_match(unsigned char *data, unsigned len, struct ev *ev)
+{
+	ev->cmd = EV_NUMCMD;
+	evpat_walk(0, data, len, 0, 0, ev);
+	return ev->cmd != EV_NUMCMD;
+}
@@ -64,10 +64,12 @@
  * an event: structure used to store MIDI events and some
  * midish-sepcific events (tempo changes, etc...). This structure have
  * to be kept as small as possible, because its used to store events
- * on tracks, that may contain a lot of events
+ * on tracks, that may contain a lot of events. Small fields are
+ * packed with v1 in a single word; v0 is kept full-size because it
+ * holds tempo values that don't fit in 16 bits
  */
 struct ev {
-	unsigned char cmd, dev, ch;
+	unsigned cmd:8, dev:4, ch:4;
 #define note_num	v0
 #define note_vel	v1
 #define note_kat	v1
@@ -82,7 +84,8 @@ struct ev {
 #define tempo_usec24	v0
 #define timesig_beats	v0
 #define timesig_tics	v1
-	unsigned v0, v1;
+	unsigned v1:16;
+	unsigned v0;
 #define EV_UNDEF	0xffff
 #define EV_MAXDEV	(DEFAULT_MAXNDEVS - 1)
 #define EV_MAXCH	15
@@ -90,6 +93,10 @@ struct ev {
 #define EV_MAXFINE	0x3fff
 };
 
+#if DEFAULT_MAXNDEVS > 16
+#error "DEFAULT_MAXNDEVS doesn't fit in the dev field of struct ev"
+#endif
+
 /*
  * event phase bitmasks
  */
@@ -123,6 +130,26 @@ struct evspec {
 	unsigned v1_min, v1_max;	/* except for EMPTY, ANY, CAT, PC */
 };
 
+/*
+ * an evspec compiled by evsel_init() into bitmaps, so that loops
+ * over events can check them with a few mask tests. The ???cmd
+ * fields are bitmaps indexed by the event type: the event matches
+ * if its bit is set in 'cmd' and it passes the checks of the other
+ * bitmaps its bit is set in. Ranges are checked with a single
+ * unsigned comparison of the offset from the range start
+ */
+struct evsel {
+	unsigned cmd;			/* types matching the spec */
+	unsigned devcmd, dev;		/* types to check dev in, devices */
+	unsigned chcmd, ch;		/* types to check ch in, channels */
+	unsigned v0cmd, v0_min, v0_len;	/* types to check v0 in, range */
+	unsigned v1cmd, v1_min, v1_len;	/* types to check v1 in, range */
+};
+
+#if EV_NUMCMD > 32 || EV_MAXCH > 31 || EV_MAXDEV > 31
+#error "struct evsel bitmaps too small"
+#endif
+
 
 /*
  * we use a static array (indexed by 'cmd') of the following
@@ -150,6 +177,22 @@ struct evinfo {
 #define EV_PATNEGSUM	0x85
 #define EV_PATSIZE	32
 	unsigned char *pattern;
+	unsigned patlen;	/* bytes in pattern, 0xf7 included */
+	unsigned char patoffs[4]; /* offset of each atom, 0 if none */
+};
+
+/*
+ * node of the trie of sysex patterns: children of a node are the
+ * possible next bytes or atoms of the patterns with the same
+ * beginning. Children are in increasing 'cmd' order, where 'cmd' is
+ * the first pattern using the node. Nodes are indexes in evpat_trie[],
+ * 0 is the root (the empty beginning) and means none.
+ */
+struct evpat_node {
+	unsigned char byte;	/* byte or atom, 0xf7 for the ends */
+	unsigned char cmd;	/* first pattern using the node */
+	unsigned short child;	/* first child */
+	unsigned short next;	/* next sibling */
 };
 
 extern struct evinfo evinfo[EV_NUMCMD];
@@ -165,6 +208,8 @@ unsigned evspec_str2cmd(struct evspec *, char *);
 void	 evspec_log(struct evspec *);
 void	 evspec_reset(struct evspec *);
 unsigned evspec_matchev(struct evspec *, struct ev *);
+void	 evsel_init(struct evsel *, struct evspec *);
+unsigned evsel_match(struct evsel *, struct ev *);
 unsigned evspec_eq(struct evspec *, struct evspec *);
 unsigned evspec_isec(struct evspec *, struct evspec *);
 unsigned evspec_in(struct evspec *, struct evspec *);
@@ -210,5 +255,9 @@ void	 evpat_unconf(unsigned);
 unsigned evpat_lookup(char *, unsigned *);
 unsigned evpat_set(unsigned, char *, unsigned char *, unsigned);
 void	 evpat_reset(void);
+void	 evpat_build(void);
+void	 evpat_walk(unsigned, unsigned char *, unsigned,
+    unsigned, unsigned, struct ev *);
+unsigned evpat_match(unsigned char *, unsigned, struct ev *);
 
 #endif /* MIDISH_EV_H */
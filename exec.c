@@ -33,11 +33,27 @@
 #include "exec.h"
 #include "data.h"
 #include "node.h"
+#include "vm.h"
+#include "pool.h"
 
 #include "cons.h"	/* for cons_errxxx */
 
 /* ----------------------------------------------- variable lists --- */
 
+struct pool var_pool;
+
+void
+var_pool_init(unsigned size)
+{
+	pool_init(&var_pool, "var", sizeof(struct var), size);
+}
+
+void
+var_pool_done(void)
+{
+	pool_done(&var_pool);
+}
+
 /*
  * create a new variable with the given name and value
  * and insert it on the given variable list
@@ -46,7 +62,7 @@ struct var *
 var_new(struct name **list, char *name, struct data *data)
 {
 	struct var *o;
-	o = (struct var *)xmalloc(sizeof(struct var), "var");
+	o = (struct var *)pool_new(&var_pool);
 	o->data = data;
 	name_init(&o->name, name);
 	name_insert(list, (struct name *)o);
@@ -64,7 +80,7 @@ var_delete(struct name **list, struct var *o)
 		data_delete(o->data);
 	}
 	name_done(&o->name);
-	xfree(o);
+	pool_del(&var_pool, o);
 }
 
 /*
@@ -103,6 +119,7 @@ proc_new(char *name)
 	name_init(&o->name, name);
 	o->args = NULL;
 	o->code = NULL;
+	o->vm = NULL;
 	return o;
 }
 
@@ -113,6 +130,7 @@ void
 proc_delete(struct proc *o)
 {
 	node_delete(o->code);
+	vm_free(o->vm);
 	name_empty(&o->args);
 	name_done(&o->name);
 	xfree(o);
@@ -169,6 +187,8 @@ exec_new(void)
 	o = (struct exec *)xmalloc(sizeof(struct exec), "exec");
 	o->procs = NULL;
 	o->globals = NULL;
+	name_index(&o->procs);
+	name_index(&o->globals);
 	o->locals = &o->globals;
 	o->procname = "top-level";
 	o->depth = 0;
@@ -189,6 +209,8 @@ exec_delete(struct exec *o)
 	}
 	var_empty(&o->globals);
 	proc_empty(&o->procs);
+	name_unindex(&o->procs);
+	name_unindex(&o->globals);
 	xfree(o);
 }
 
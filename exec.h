@@ -30,6 +30,7 @@ struct proc;
 struct node;
 struct tree;
 struct exec;
+struct vm_code;
 
 /*
  * a variable is a (identifier, value) pair
@@ -53,6 +54,7 @@ struct proc {
 	struct name name;
 	struct name *args;
 	struct node *code;
+	struct vm_code *vm;	/* compiled code, NULL if none */
 };
 
 #define PROC_FOREACH(i,list)			\
@@ -74,6 +76,8 @@ struct exec {
 	unsigned result;	/* result of last operation */
 };
 
+void	    var_pool_init(unsigned);
+void	    var_pool_done(void);
 struct var *var_new(struct name **, char *, struct data *);
 void        var_delete(struct name **, struct var *);
 void	    var_log(struct var *);
@@ -20,6 +20,12 @@
  * a simple midi filter. Rewrites input events according a set
  * of user-configurable rules.
  *
+ * to avoid matching each event against all rules, rules are
+ * compiled into bitmaps indexed by the event type, device, channel
+ * and first parameter: for each value the bitmap gives the rules
+ * that may match it. The intersection of the bitmaps gives the few
+ * rules to check with evspec_matchev(). Rules are recompiled by
+ * filt_do() after any change.
  */
 
 #include "utils.h"
@@ -29,8 +35,38 @@
 #include "mux.h"
 #include "cons.h"
 
+/*
+ * bitmaps of rules of a single list, bit 'i' corresponds to
+ * the i-th rule of the list. Lists longer than the number of bits
+ * of the bitmaps are not indexed.
+ */
+#define FILTIDX_MAXRULES	32
+
+struct filtidx {
+	unsigned cmd[EV_NUMCMD];		/* rules by event type */
+	unsigned dev[EV_MAXDEV + 1];		/* rules by device */
+	unsigned ch[EV_MAXCH + 1];		/* rules by channel */
+	struct filtnode *rule[FILTIDX_MAXRULES]; /* rules in list order */
+	struct filtnode *list;			/* list, if not indexed */
+};
+
+/*
+ * compiled filter, the first parameter index is used only for the
+ * map list, where split-keyboard style rules differ only by it
+ */
+struct filttab {
+	struct filtidx map, vcurve, transp;
+	unsigned v0[EV_MAXCOARSE + 1];		/* map rules by 1st param */
+};
+
 unsigned filt_debug = 0;
 
+/*
+ * incremented each time rules of any filter change, so results
+ * derived from filters can be cached
+ */
+unsigned filt_serial = 0;
+
 void
 rule_log(struct evspec *from, struct  evspec *to)
 {
@@ -69,6 +105,20 @@ filtnode_del(struct filtnode **loc)
 	xfree(s);
 }
 
+/*
+ * return the memory used by the given list of nodes and their
+ * destinations
+ */
+unsigned long
+filtnode_memsize(struct filtnode *s)
+{
+	unsigned long size = 0;
+
+	for (; s != NULL; s = s->next)
+		size += sizeof(struct filtnode) + filtnode_memsize(s->dstlist);
+	return size;
+}
+
 /*
  * find a node (or create one) such that the given evspec includes the previous
  * nodes and is included in the next nodes. Remove nodes that cause conflicts.
@@ -155,6 +205,126 @@ filtnode_mkdst(struct filtnode *s, struct evspec *to)
 }
 
 
+/*
+ * build the bitmaps of the given list of rules. If there are too
+ * many rules, leave the list non-indexed
+ */
+void
+filtidx_build(struct filtidx *x, struct filtnode *list, unsigned *v0)
+{
+	struct filtnode *s;
+	struct evinfo *ei;
+	unsigned i, n, bit;
+
+	for (n = 0; n < EV_NUMCMD; n++)
+		x->cmd[n] = 0;
+	for (n = 0; n <= EV_MAXDEV; n++)
+		x->dev[n] = 0;
+	for (n = 0; n <= EV_MAXCH; n++)
+		x->ch[n] = 0;
+	if (v0) {
+		for (n = 0; n <= EV_MAXCOARSE; n++)
+			v0[n] = 0;
+	}
+	x->list = NULL;
+	for (i = 0, s = list; s != NULL; i++, s = s->next) {
+		if (i == FILTIDX_MAXRULES) {
+			x->list = list;
+			return;
+		}
+		x->rule[i] = s;
+		bit = 1U << i;
+		ei = &evinfo[s->es.cmd];
+		for (n = 0; n < EV_NUMCMD; n++) {
+			if (s->es.cmd == EVSPEC_EMPTY)
+				break;
+			if (s->es.cmd == EVSPEC_ANY ||
+			    s->es.cmd == n ||
+			    (s->es.cmd == EVSPEC_NOTE &&
+				(n == EV_NON || n == EV_NOFF || n == EV_KAT)))
+				x->cmd[n] |= bit;
+		}
+		for (n = 0; n <= EV_MAXDEV; n++) {
+			if (!(ei->flags & EV_HAS_DEV) ||
+			    (n >= s->es.dev_min && n <= s->es.dev_max))
+				x->dev[n] |= bit;
+		}
+		for (n = 0; n <= EV_MAXCH; n++) {
+			if (!(ei->flags & EV_HAS_CH) ||
+			    (n >= s->es.ch_min && n <= s->es.ch_max))
+				x->ch[n] |= bit;
+		}
+		if (v0) {
+			for (n = 0; n <= EV_MAXCOARSE; n++) {
+				if (ei->nparams == 0 ||
+				    (n >= s->es.v0_min && n <= s->es.v0_max))
+					v0[n] |= bit;
+			}
+		}
+	}
+}
+
+/*
+ * return the first rule of the list matching the given event, or
+ * NULL if none. The event is checked only against rules whose
+ * bitmaps contain it
+ */
+struct filtnode *
+filtidx_lookup(struct filtidx *x, unsigned *v0, struct ev *ev)
+{
+	struct evinfo *ei = &evinfo[ev->cmd];
+	struct filtnode *s;
+	unsigned mask, i;
+
+	if (x->list) {
+		for (s = x->list; s != NULL; s = s->next) {
+			if (evspec_matchev(&s->es, ev))
+				return s;
+		}
+		return NULL;
+	}
+	mask = x->cmd[ev->cmd];
+	if ((ei->flags & EV_HAS_DEV) && ev->dev <= EV_MAXDEV)
+		mask &= x->dev[ev->dev];
+	if ((ei->flags & EV_HAS_CH) && ev->ch <= EV_MAXCH)
+		mask &= x->ch[ev->ch];
+	if (v0 && ei->nparams > 0 && ev->v0 <= EV_MAXCOARSE)
+		mask &= v0[ev->v0];
+	while (mask) {
+		i = __builtin_ctz(mask);
+		if (evspec_matchev(&x->rule[i]->es, ev))
+			return x->rule[i];
+		mask &= mask - 1;
+	}
+	return NULL;
+}
+
+/*
+ * compile the rules of the given filter
+ */
+void
+filt_compile(struct filt *o)
+{
+	if (o->tab == NULL)
+		o->tab = xmalloc(sizeof(struct filttab), "filttab");
+	filtidx_build(&o->tab->map, o->map, o->tab->v0);
+	filtidx_build(&o->tab->vcurve, o->vcurve, NULL);
+	filtidx_build(&o->tab->transp, o->transp, NULL);
+}
+
+/*
+ * discard compiled rules, must be called each time rules change
+ */
+void
+filt_outdate(struct filt *o)
+{
+	filt_serial++;
+	if (o->tab) {
+		xfree(o->tab);
+		o->tab = NULL;
+	}
+}
+
 /*
  * initialize a filter
  */
@@ -164,6 +334,8 @@ filt_init(struct filt *o)
 	o->map = NULL;
 	o->vcurve = NULL;
 	o->transp = NULL;
+	o->tab = NULL;
+	filt_serial++;
 }
 
 /*
@@ -178,6 +350,7 @@ filt_reset(struct filt *o)
 		filtnode_del(&o->transp);
 	while (o->vcurve)
 		filtnode_del(&o->vcurve);
+	filt_outdate(o);
 }
 
 /*
@@ -190,6 +363,21 @@ filt_done(struct filt *o)
 	o->map = o->transp = o->vcurve = (void *)0xdeadbeef;
 }
 
+/*
+ * return the memory used by the rules of the filter
+ */
+unsigned long
+filt_memsize(struct filt *o)
+{
+	unsigned long size;
+
+	size = filtnode_memsize(o->map) + filtnode_memsize(o->vcurve) +
+	    filtnode_memsize(o->transp);
+	if (o->tab)
+		size += sizeof(struct filttab);
+	return size;
+}
+
 /*
  * return velocity adjusted by curve with the given weight.
  * the weight must be in the 1..127 range, 64 means neutral
@@ -213,6 +401,20 @@ vcurve(unsigned nweight, unsigned x)
 	}
 }
 
+/*
+ * fill the given table with the velocities adjusted by the curve
+ * with the given weight, so that the table can be used instead of
+ * calling vcurve() for each event
+ */
+void
+vcurve_mktab(unsigned char *tab, unsigned nweight)
+{
+	unsigned x;
+
+	for (x = 0; x <= EV_MAXCOARSE; x++)
+		tab[x] = vcurve(nweight, x);
+}
+
 /*
  * match event against all sources and for each source
  * generate output events
@@ -225,54 +427,84 @@ filt_do(struct filt *o, struct ev *in, struct ev *out)
 	struct filtnode *d;
 	unsigned nev, i;
 
+	if (o->tab == NULL)
+		filt_compile(o);
+	if (filt_debug) {
+		log_puts("filt_do: in = ");
+		ev_log(in);
+		log_puts("\n");
+	}
 	nev = 0;
-	for (s = o->map;; s = s->next) {
-		if (s == NULL)
-			break;
-		if (filt_debug) {
-			log_puts("filt_do: in = ");
-			ev_log(in);
-			log_puts("\n");
-		}
-		if (evspec_matchev(&s->es, in)) {
-			for (d = s->dstlist; d != NULL; d = d->next) {
-				if (d->es.cmd == EVSPEC_EMPTY)
-					continue;
-				ev_map(in, &s->es, &d->es, &out[nev]);
-				if (filt_debug) {
-					log_puts("filt_do: (");
-					rule_log(&s->es, &d->es);
-					log_puts("): ");
-					ev_log(in);
-					log_puts(" -> ");
-					ev_log(&out[nev]);
-					log_puts("\n");
-				}
-				nev++;
+	s = filtidx_lookup(&o->tab->map, o->tab->v0, in);
+	if (s != NULL) {
+		for (d = s->dstlist; d != NULL; d = d->next) {
+			if (d->es.cmd == EVSPEC_EMPTY)
+				continue;
+			ev_map(in, &s->es, &d->es, &out[nev]);
+			if (filt_debug) {
+				log_puts("filt_do: (");
+				rule_log(&s->es, &d->es);
+				log_puts("): ");
+				ev_log(in);
+				log_puts(" -> ");
+				ev_log(&out[nev]);
+				log_puts("\n");
 			}
-			break;
+			nev++;
 		}
 	}
 	if (!EV_ISNOTE(in))
 		return nev;
 	for (i = 0, ev = out; i < nev; i++, ev++) {
-		for (d = o->vcurve; d != NULL; d = d->next) {
-			if (!evspec_matchev(&d->es, ev))
-				continue;
-			ev->note_vel = vcurve(d->u.vel.nweight, ev->note_vel);
-			break;
-		}
-		for (d = o->transp; d != NULL; d = d->next) {
-			if (!evspec_matchev(&d->es, ev))
-				continue;
+		d = filtidx_lookup(&o->tab->vcurve, NULL, ev);
+		if (d != NULL)
+			ev->note_vel = d->u.vel.tab[ev->note_vel & 0x7f];
+		d = filtidx_lookup(&o->tab->transp, NULL, ev);
+		if (d != NULL) {
 			ev->note_num += d->u.transp.plus;
 			ev->note_num &= 0x7f;
-			break;
 		}
 	}
 	return nev;
 }
 
+/*
+ * return the bitmap of the channels on which events of the given
+ * type and device may match a rule with a destination. Events on
+ * other channels are always discarded by the filter
+ */
+unsigned
+filt_chmask(struct filt *o, unsigned cmd, unsigned dev)
+{
+	struct filtnode *s, *d;
+	struct evinfo *ei;
+	unsigned ch, mask = 0;
+
+	for (s = o->map; s != NULL; s = s->next) {
+		for (d = s->dstlist; d != NULL; d = d->next) {
+			if (d->es.cmd != EVSPEC_EMPTY)
+				break;
+		}
+		if (d == NULL)
+			continue;
+		if (s->es.cmd != EVSPEC_ANY && s->es.cmd != cmd &&
+		    !(s->es.cmd == EVSPEC_NOTE &&
+			(cmd == EV_NOFF || cmd == EV_KAT)))
+			continue;
+		ei = &evinfo[s->es.cmd];
+		if ((ei->flags & EV_HAS_DEV) &&
+		    (dev < s->es.dev_min || dev > s->es.dev_max))
+			continue;
+		if (!(ei->flags & EV_HAS_CH))
+			return (1U << (EV_MAXCH + 1)) - 1;
+		for (ch = s->es.ch_min; ch <= s->es.ch_max; ch++) {
+			if (ch <= EV_MAXCH)
+				mask |= 1U << ch;
+		}
+	}
+	return mask;
+}
+
 /*
  * remove all rules that are included in the from->to argument.
  */
@@ -282,6 +514,7 @@ filt_mapdel(struct filt *f, struct evspec *from, struct evspec *to)
 	struct filtnode *s, **ps;
 	struct filtnode *d, **pd;
 
+	filt_outdate(f);
 	for (ps = &f->map; (s = *ps) != NULL;) {
 		if (evspec_in(&s->es, from)) {
 			for (pd = &s->dstlist; (d = *pd) != NULL;) {
@@ -330,6 +563,7 @@ filt_mapnew(struct filt *f, struct evspec *from, struct evspec *to)
 	if (to->cmd != EVSPEC_EMPTY && !evspec_isamap(from, to))
 		return;
 
+	filt_outdate(f);
 	s = filtnode_mksrc(&f->map, from);
 	filtnode_mkdst(s, to);
 }
@@ -339,6 +573,7 @@ filt_detach(struct filt *o)
 {
 	struct filtnode *list, *s;
 
+	filt_outdate(o);
 	for (list = NULL; (s = o->map) != NULL;) {
 		o->map = s->next;
 		s->next = list;
@@ -424,6 +659,7 @@ filt_transp(struct filt *f, struct evspec *from, int plus)
 		return;
 	}
 
+	filt_outdate(f);
 	s = filtnode_mksrc(&f->transp, from);
 	s->u.transp.plus = plus & 0x7f;
 }
@@ -437,8 +673,10 @@ filt_vcurve(struct filt *f, struct evspec *from, int weight)
 		log_puts("filt_vcurve: set must contain notes\n");
 		return;
 	}
+	filt_outdate(f);
 	s = filtnode_mksrc(&f->vcurve, from);
 	s->u.vel.nweight = (64 - weight) & 0x7f;
+	vcurve_mktab(s->u.vel.tab, s->u.vel.nweight);
 }
 
 unsigned
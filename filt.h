@@ -29,6 +29,7 @@ struct filtnode {
 	union {
 		struct {
 			unsigned nweight;
+			unsigned char tab[EV_MAXCOARSE + 1];
 		} vel;
 		struct {
 			int plus;
@@ -42,12 +43,15 @@ struct filt {
 	struct filtnode *map;		/* root of map rules */
 	struct filtnode *vcurve;	/* root of vcurve rules */
 	struct filtnode *transp;	/* root of transp rules */
+	struct filttab *tab;		/* compiled rules, NULL if outdated */
 };
 
 unsigned vcurve(unsigned, unsigned);
+void vcurve_mktab(unsigned char *, unsigned);
 
 void filt_init(struct filt *);
 void filt_done(struct filt *);
+unsigned long filt_memsize(struct filt *);
 void filt_reset(struct filt *);
 unsigned filt_do(struct filt *, struct ev *, struct ev *);
 void filt_mapnew(struct filt *, struct evspec *, struct  evspec *);
@@ -57,10 +61,12 @@ void filt_chgout(struct filt *, struct evspec *, struct evspec *, int);
 void filt_transp(struct filt *, struct evspec *, int);
 void filt_vcurve(struct filt *, struct evspec *, int);
 unsigned filt_evcnt(struct filt *, unsigned);
+unsigned filt_chmask(struct filt *, unsigned, unsigned);
 
 struct filtnode *filtnode_new(struct evspec *, struct filtnode **);
 void filtnode_del(struct filtnode **);
 
 extern unsigned filt_debug;
+extern unsigned filt_serial;
 
 #endif /* MIDISH_FILT_H */
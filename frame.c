@@ -148,12 +148,15 @@
  *	  the same as the event we write
  */
 
+#include <string.h>
 #include "utils.h"
 #include "track.h"
 #include "defs.h"
 #include "filt.h"
 #include "frame.h"
 #include "pool.h"
+#include "heap.h"
+#include "work.h"
 
 struct pool seqptr_pool;
 
@@ -170,20 +173,68 @@ seqptr_pool_done(void)
 }
 
 /*
- * initialize a seqptr structure at the beginning of
- * the given track.
+ * move to the given record of a mapped track. At the end of the
+ * pattern, if it must be played again, move to its first record: the
+ * delta of the end-of-track is added to it
+ */
+void
+seqptr_romget(struct seqptr *sp, unsigned char *p)
+{
+	unsigned delta = 0;
+
+	for (;;) {
+		sp->rom = p;
+		sp->romlen = seqev_unpack(p, &sp->romev.delta, &sp->romev.ev);
+		sp->romev.delta += delta;
+		if (sp->romev.ev.cmd != EV_NULL || sp->romrep == 0)
+			break;
+		sp->romrep--;
+		delta = sp->romev.delta;
+		p = sp->pat->data;
+	}
+	sp->pos = &sp->romev;
+}
+
+/*
+ * initialize a seqptr structure at the beginning of the given track,
+ * if the track is mapped, its events are copied first so it can be
+ * modified
  */
 struct seqptr *
 seqptr_new(struct track *t)
+{
+	track_unmap(t);
+	return seqptr_newro(t);
+}
+
+/*
+ * initialize a seqptr structure that will only read the given track,
+ * mapped tracks are read in place. Only seqptr_evget(), seqptr_ticskip()
+ * and functions using them may be called
+ */
+struct seqptr *
+seqptr_newro(struct track *t)
 {
 	struct seqptr *sp;
 
 	sp = (struct seqptr *)pool_new(&seqptr_pool);
 	statelist_init(&sp->statelist);
 	sp->link = NULL;
-	sp->pos = t->first;
+	sp->track = t;
 	sp->delta = 0;
 	sp->tic = 0;
+	sp->romev.next = NULL;
+	sp->romev.prev = NULL;
+	sp->pat = t->pat;
+	if (t->rom) {
+		trackpat_ref(sp->pat);
+		sp->romrep = sp->pat->nrep - 1;
+		seqptr_romget(sp, t->rom);
+		sp->romev.delta += sp->pat->offs;
+	} else {
+		sp->rom = NULL;
+		sp->pos = t->first;
+	}
 	return sp;
 }
 
@@ -195,6 +246,8 @@ seqptr_del(struct seqptr *sp)
 {
 	if (sp->link != NULL)
 		sp->link->link = NULL;
+	if (sp->pat != NULL)
+		trackpat_unref(sp->pat);
 
 	statelist_done(&sp->statelist);
 	pool_del(&seqptr_pool, sp);
@@ -242,7 +295,10 @@ seqptr_evget(struct seqptr *sp)
 		st->pos = sp->pos;
 		st->tic = sp->tic;
 	}
-	sp->pos = sp->pos->next;
+	if (sp->rom)
+		seqptr_romget(sp, sp->rom + sp->romlen);
+	else
+		sp->pos = sp->pos->next;
 	sp->delta = 0;
 	return st;
 }
@@ -261,16 +317,19 @@ seqptr_evdel(struct seqptr *sp, struct statelist *slist)
 	if (sp->delta != sp->pos->delta || sp->pos->ev.cmd == EV_NULL) {
 		return NULL;
 	}
+	track_outdate(sp->track);
 	if (slist)
 		st = statelist_update(slist, &sp->pos->ev);
 	else
 		st = NULL;
 	next = sp->pos->next;
+	track_undodelta(sp->track, next);
 	next->delta += sp->pos->delta;
 	/* unlink and delete sp->pos */
 	*(sp->pos->prev) = next;
 	next->prev = sp->pos->prev;
-	seqev_del(sp->pos);
+	if (!track_undorm(sp->track, sp->pos))
+		seqev_del(sp->pos);
 	/* fix current position */
 	sp->pos = next;
 	return st;
@@ -284,11 +343,18 @@ struct state *
 seqptr_evput(struct seqptr *sp, struct ev *ev)
 {
 	struct seqptr *link;
-	struct seqev *se;
+	struct seqev *se, *reused;
 
-	se = seqev_new();
-	se->ev = *ev;
+	track_outdate(sp->track);
+	reused = track_undoreuse(sp->track, sp->pos, ev);
+	if (reused) {
+		se = reused;
+	} else {
+		se = track_evnew(sp->track);
+		se->ev = *ev;
+	}
 	se->delta = sp->delta;
+	track_undodelta(sp->track, sp->pos);
 	sp->pos->delta -= sp->delta;
 
 	/* link to the list */
@@ -296,6 +362,10 @@ seqptr_evput(struct seqptr *sp, struct ev *ev)
 	se->prev = sp->pos->prev;
 	*se->prev = se;
 	sp->pos->prev = &se->next;
+	if (reused)
+		track_undotrim(sp->track);
+	else
+		track_undoins(sp->track, se);
 
 	/* if there's a reader update its pointer */
 	link = sp->link;
@@ -343,6 +413,10 @@ seqptr_ticdel(struct seqptr *sp, unsigned max, struct statelist *slist)
 	if (ntics > max) {
 		ntics = max;
 	}
+	if (ntics > 0) {
+		track_outdate(sp->track);
+		track_undodelta(sp->track, sp->pos);
+	}
 	sp->pos->delta -= ntics;
 	if (slist != NULL && max > 0) {
 		statelist_outdate(slist);
@@ -369,6 +443,8 @@ seqptr_ticput(struct seqptr *sp, unsigned ntics)
 	if (ntics == 0)
 		return;
 
+	track_outdate(sp->track);
+	track_undodelta(sp->track, sp->pos);
 	sp->pos->delta += ntics;
 	sp->delta += ntics;
 	sp->tic += ntics;
@@ -389,8 +465,40 @@ seqptr_ticput(struct seqptr *sp, unsigned ntics)
 unsigned
 seqptr_skip(struct seqptr *sp, unsigned ntics)
 {
-	unsigned delta;
+	struct track *t = sp->track;
+	struct trackmark *m;
+	unsigned delta, lo, hi, mid;
 
+	/*
+	 * if we're at the beginning of a track with a seek index,
+	 * jump to the last mark before the requested position
+	 */
+	if (ntics > 0 && t->marks != NULL && sp->tic == 0 &&
+	    sp->delta == 0 && sp->statelist.first == NULL &&
+	    (sp->rom ? sp->rom == t->rom : sp->pos == t->first)) {
+		lo = 0;
+		hi = t->nmarks;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (t->marks[mid].tic <= ntics)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo > 0) {
+			m = &t->marks[lo - 1];
+			statelist_copy(&sp->statelist, &m->statelist);
+			if (sp->rom) {
+				sp->romrep = m->romrep;
+				seqptr_romget(sp, m->rom);
+				sp->romev.delta = m->romdelta;
+			} else
+				sp->pos = m->pos;
+			sp->delta = m->delta;
+			sp->tic = m->tic;
+			ntics -= m->tic;
+		}
+	}
 	while (ntics > 0) {
 		while (seqptr_evget(sp))
 			; /* nothing */
@@ -405,6 +513,64 @@ seqptr_skip(struct seqptr *sp, unsigned ntics)
 	return ntics;
 }
 
+/*
+ * build the seek index of the given track up to the given tic: save
+ * the position and the state list every TRACK_MARKEVS events.
+ * Restoring a mark is equivalent to calling seqptr_skip() from the
+ * beginning of the track up to the tic of the mark, so the loop below
+ * must follow exactly the same steps as seqptr_skip().
+ *
+ * The index is built only as far as it's needed, and is extended
+ * from its last mark when a later position is requested, so the first
+ * relocation in a long track doesn't scan it to the end
+ */
+void
+track_mkidx(struct track *t, unsigned tic)
+{
+	struct seqptr *sp;
+	struct trackmark *m;
+	unsigned nev;
+
+	if (t->marks == NULL) {
+		t->maxmarks = track_numev(t) / TRACK_MARKEVS + 1;
+		t->marks = xmalloc_class(t->maxmarks *
+		    sizeof(struct trackmark), "trackmark", MEM_BULK);
+		t->nmarks = 0;
+		t->idxtic = 0;
+	} else if (t->idxtic > tic)
+		return;
+	sp = seqptr_newro(t);
+	if (t->nmarks > 0)
+		seqptr_skip(sp, t->marks[t->nmarks - 1].tic);
+	nev = 0;
+	for (;;) {
+		while (seqptr_evget(sp))
+			nev++;
+		if (seqptr_ticskip(sp, ~0U) == 0) {
+			t->idxtic = ~0U;
+			break;
+		}
+		if (nev >= TRACK_MARKEVS) {
+			m = &t->marks[t->nmarks++];
+			m->pos = sp->pos;
+			m->rom = sp->rom;
+			m->romrep = sp->romrep;
+			m->romdelta = sp->romev.delta;
+			m->delta = sp->delta;
+			m->tic = sp->tic;
+			statelist_init(&m->statelist);
+			statelist_copy(&m->statelist, &sp->statelist);
+			nev = 0;
+		}
+		if (sp->tic > tic) {
+			t->idxtic = sp->tic;
+			break;
+		}
+	}
+	statelist_empty(&sp->statelist);
+	seqptr_del(sp);
+}
+
 /*
  * move forward 'ntics', if the end-of-track is reached then fill with
  * blank space. Used for writing on a track
@@ -437,6 +603,7 @@ seqptr_framerm(struct seqptr *sp, struct track *f)
 		panic();
 	}
 
+	track_outdate(sp->track);
 	track_clear(f);
 	fpos = f->first;
 
@@ -458,7 +625,7 @@ seqptr_framerm(struct seqptr *sp, struct track *f)
 	/* move event to frame track */
 	se = spos;
 	spos = se->next;
-	seqev_rm(se);
+	se = track_undomove(sp->track, se, f);
 	seqev_ins(fpos, se);
 
 	for (;;) {
@@ -484,7 +651,7 @@ seqptr_framerm(struct seqptr *sp, struct track *f)
 			/* move event to frame track */
 			se = spos;
 			spos = se->next;
-			seqev_rm(se);
+			se = track_undomove(sp->track, se, f);
 			seqev_ins(fpos, se);
 		} else {
 			/* skip event */
@@ -512,6 +679,9 @@ seqptr_frameadd(struct seqptr *sp, struct track *f)
 	struct seqev *se, *spos, **save_pos;
 	unsigned ntics, offs, sdelta, save_delta;
 
+	track_outdate(sp->track);
+	track_outdate(f);
+
 	/*
 	 * Save current postition.
 	 */
@@ -543,6 +713,7 @@ seqptr_frameadd(struct seqptr *sp, struct track *f)
 
 			/* if reached the end, append space */
 			if (spos->ev.cmd == EV_NULL) {
+				track_undodelta(sp->track, spos);
 				spos->delta += offs;
 				sdelta += offs;
 				offs = 0;
@@ -560,6 +731,7 @@ seqptr_frameadd(struct seqptr *sp, struct track *f)
 		}
 
 		se->delta = sdelta;
+		track_undodelta(sp->track, spos);
 		spos->delta -= sdelta;
 		sdelta = 0;
 		/* link to the list */
@@ -567,6 +739,7 @@ seqptr_frameadd(struct seqptr *sp, struct track *f)
 		se->prev = spos->prev;
 		*se->prev = se;
 		spos->prev = &se->next;
+		track_undoins(sp->track, se);
 	}
 
 	/*
@@ -637,6 +810,7 @@ seqptr_rmlast(struct seqptr *sp, struct state **pst)
 	 * 'prev' the event before 'cur' that belongs to the same
 	 * frame
 	 */
+	track_outdate(sp->track);
 	i = cur = st->pos;
 	prev = NULL;
 	for (;;) {
@@ -654,13 +828,15 @@ seqptr_rmlast(struct seqptr *sp, struct state **pst)
 	 * (but not the blank space)
 	 */
 	next = cur->next;
+	track_undodelta(sp->track, next);
 	next->delta += cur->delta;
 	if (next == sp->pos) {
 		sp->delta += cur->delta;
 	}
 	next->prev = cur->prev;
 	*(cur->prev) = next;
-	seqev_del(cur);
+	if (!track_undorm(sp->track, cur))
+		seqev_del(cur);
 
 	/*
 	 * update the state; if we deleted the first event of the
@@ -696,6 +872,7 @@ seqptr_rmprev(struct seqptr *sp, struct state **pst)
 	 * start a the first event of the frame and iterate until the
 	 * current postion removing all events of the frame.
 	 */
+	track_outdate(sp->track);
 	i = st->pos;
 	for (;;) {
 		if (state_match(st, &i->ev)) {
@@ -704,13 +881,15 @@ seqptr_rmprev(struct seqptr *sp, struct state **pst)
 			 * (but not the blank space)
 			 */
 			next = i->next;
+			track_undodelta(sp->track, next);
 			next->delta += i->delta;
 			if (next == sp->pos) {
 				sp->delta += i->delta;
 			}
 			next->prev = i->prev;
 			*(i->prev) = next;
-			seqev_del(i);
+			if (!track_undorm(sp->track, i))
+				seqev_del(i);
 			i = next;
 		} else {
 			i = i->next;
@@ -821,9 +1000,38 @@ seqptr_evmerge2(struct seqptr *pd, struct statelist *slist1, struct ev *ev2,
 	return rc;
 }
 
+/*
+ * return true if the merged state of 'pd' is the same as the state
+ * of the original track 'orglist', in which case merging the rest of
+ * the original track would leave it unchanged
+ */
+unsigned
+track_mergedone(struct seqptr *pd, struct statelist *orglist)
+{
+	struct state *sd, *s1;
+
+	if (pd->statelist.nstates != orglist->nstates)
+		return 0;
+	for (sd = pd->statelist.first; sd != NULL; sd = sd->next) {
+		if (sd->tag == 0)
+			return 0;
+		s1 = statelist_lookup(orglist, &sd->ev);
+		if (s1 == NULL || s1->phase != sd->phase ||
+		    (s1->flags & (STATE_BOGUS | STATE_NESTED)) ||
+		    !state_eq(s1, &sd->ev))
+			return 0;
+	}
+	return 1;
+}
+
 /*
  * Merge track "src" (high priority) in track "dst" (low prority)
  * resolving all conflicts, so that "dst" is consistent.
+ *
+ * Only the part of "dst" overlapping "src" is processed: we start at
+ * the first event of "src" and stop as soon as "src" is exhausted and
+ * the merged state matches the original one, so merging a short
+ * take in a long track doesn't rewrite the whole track.
  */
 void
 track_merge(struct track *dst, struct track *src)
@@ -838,7 +1046,25 @@ track_merge(struct track *dst, struct track *src)
 	p2 = seqptr_new(src);
 	statelist_init(&orglist);
 
+	/*
+	 * skip the part before the first event of 'src', states of
+	 * frames in progress are those of the original track
+	 */
+	deltad = src->first->delta;
+	if (src->first->ev.cmd != EV_NULL && deltad > 0) {
+		(void)seqptr_ticskip(p2, deltad);
+		deltad = seqptr_skip(pd, deltad);
+		if (deltad > 0)
+			seqptr_ticput(pd, deltad);
+		for (s = pd->statelist.first; s != NULL; s = s->next)
+			s->tag = 1;
+		statelist_copy(&orglist, &pd->statelist);
+	}
+
 	for (;;) {
+		if (seqptr_eot(p2) && track_mergedone(pd, &orglist))
+			break;
+
 		/*
 		 * remove all events from 'dst' and put them back on
 		 * on 'dst' by merging them with the state table of
@@ -885,12 +1111,225 @@ track_merge(struct track *dst, struct track *src)
 		seqptr_ticput(pd, deltad);
 	}
 
+	/*
+	 * if we stopped before the end, frames are not terminated
+	 */
+	if (!seqptr_eot(pd)) {
+		statelist_empty(&orglist);
+		statelist_empty(&pd->statelist);
+	}
 	statelist_done(&orglist);
 	seqptr_del(p2);
 	seqptr_del(pd);
 	track_chomp(dst);
 }
 
+/*
+ * next event of a track merged by track_mergek()
+ */
+struct mergek {
+	unsigned tic;			/* absolute tic of the event */
+	unsigned prio;			/* track index, plus one */
+};
+
+/*
+ * event of a controller, bend, or other non-note frame, kept until
+ * all tracks are read for the current tick
+ */
+struct mergeev {
+	struct ev ev;
+	unsigned prio;			/* priority of the track */
+	unsigned phase;			/* phase of the event */
+};
+
+/*
+ * return true if the entry 'a' must be processed before 'b': events
+ * of lower priority tracks come first within the tick
+ */
+unsigned
+mergek_before(void *arg_a, void *arg_b)
+{
+	struct mergek *a = arg_a, *b = arg_b;
+
+	return a->tic < b->tic || (a->tic == b->tic && a->prio < b->prio);
+}
+
+/*
+ * merge an event of the track with the given priority, as
+ * seqptr_evmerge1() and seqptr_evmerge2() do for two tracks: the tag
+ * of each state of 'pd' is the priority of the track owning the
+ * frame. A frame of a lower priority track is replaced by a new
+ * frame, while the events of a higher priority frame are kept. When
+ * a frame ends, the value of a lower priority track in the middle of
+ * a frame is restored
+ */
+void
+mergek_ev(struct seqptr *pd, struct seqptr **ptrs, unsigned prio,
+    struct ev *ev, unsigned phase)
+{
+	struct state *sd, *s1;
+	unsigned i;
+
+	sd = statelist_lookup(&pd->statelist, ev);
+	if (sd == NULL) {
+		if (!(phase & EV_PHASE_FIRST))
+			return;
+	} else if (sd->tag > prio) {
+		if (!(sd->phase & EV_PHASE_LAST) ||
+		    !(phase & EV_PHASE_FIRST))
+			return;
+	} else if (sd->tag < prio) {
+		if (!(phase & EV_PHASE_FIRST))
+			return;
+		if (EV_ISNOTE(&sd->ev)) {
+			if (sd->phase != EV_PHASE_LAST)
+				seqptr_rmprev(pd, &sd);
+		} else if (sd->flags & STATE_CHANGED)
+			seqptr_rmlast(pd, &sd);
+	} else if (phase == EV_PHASE_LAST && !EV_ISNOTE(&sd->ev)) {
+		for (i = prio - 1; i > 0; i--) {
+			s1 = statelist_lookup(&ptrs[i - 1]->statelist, ev);
+			if (s1 != NULL && s1->phase != EV_PHASE_LAST &&
+			    !(s1->flags & (STATE_BOGUS | STATE_NESTED))) {
+				if (!state_eq(s1, ev))
+					sd = seqptr_evput(pd, &s1->ev);
+				sd->tag = i;
+				return;
+			}
+		}
+	}
+	if (sd == NULL || !state_eq(sd, ev))
+		sd = seqptr_evput(pd, ev);
+	sd->tag = prio;
+}
+
+/*
+ * merge non-note events of the current tick, kept in 'buf', highest
+ * priority tracks first: events of lower priority tracks replaced
+ * within the tick are dropped instead of being stored and then
+ * removed with seqptr_rmlast(), which would scan the whole frame.
+ * Events of a given track are merged in their original order
+ */
+void
+mergek_flush(struct seqptr *pd, struct seqptr **ptrs,
+    struct mergeev *buf, unsigned n)
+{
+	struct mergeev *b;
+	unsigned i, j;
+
+	while (n > 0) {
+		j = n - 1;
+		while (j > 0 && buf[j - 1].prio == buf[n - 1].prio)
+			j--;
+		for (i = j; i < n; i++) {
+			b = &buf[i];
+			mergek_ev(pd, ptrs, b->prio, &b->ev, b->phase);
+		}
+		n = j;
+	}
+}
+
+/*
+ * merge the given tracks into "dst" in a single pass. Tracks listed
+ * later have higher priority, and all have higher priority than
+ * "dst", so conflicts are resolved as merging them one by one with
+ * track_merge() would. The source tracks are combined first, taking
+ * at each step the tracks with the nearest event from a heap, then
+ * the result is merged into "dst"
+ */
+void
+track_mergek(struct track *dst, struct track **src, unsigned n)
+{
+	struct track tmp;
+	struct seqptr *pd, *p, **ptrs;
+	struct mergek *ents, *e;
+	struct mergeev *buf, *nbuf;
+	struct state *s;
+	struct heap heap;
+	unsigned i, nev, bufsz, len, end, tic;
+
+	if (n == 0)
+		return;
+	if (n == 1) {
+		track_merge(dst, src[0]);
+		return;
+	}
+	track_init(&tmp);
+	pd = seqptr_new(&tmp);
+	ptrs = xmalloc(n * sizeof(struct seqptr *), "mergekptr");
+	ents = xmalloc(n * sizeof(struct mergek), "mergekent");
+	heap_init(&heap, xmalloc(n * sizeof(void *), "mergekheap"),
+	    mergek_before, NULL);
+	bufsz = 64;
+	buf = xmalloc(bufsz * sizeof(struct mergeev), "mergekbuf");
+	end = 0;
+	for (i = 0; i < n; i++) {
+		ptrs[i] = seqptr_new(src[i]);
+		len = track_numtic(src[i]);
+		if (end < len)
+			end = len;
+		if (src[i]->first->ev.cmd != EV_NULL) {
+			ents[i].tic = src[i]->first->delta;
+			ents[i].prio = i + 1;
+			heap_put(&heap, &ents[i]);
+		}
+	}
+	while (heap.n > 0) {
+		e = heap.ent[0];
+		tic = e->tic;
+		if (tic > pd->tic)
+			seqptr_ticput(pd, tic - pd->tic);
+		nev = 0;
+		while (heap.n > 0) {
+			e = heap.ent[0];
+			if (e->tic != tic)
+				break;
+			p = ptrs[e->prio - 1];
+			(void)seqptr_ticskip(p, e->tic - p->tic);
+			while ((s = seqptr_evget(p)) != NULL) {
+				if (s->flags & (STATE_BOGUS | STATE_NESTED))
+					continue;
+				if (EV_ISNOTE(&s->ev)) {
+					mergek_ev(pd, ptrs, e->prio,
+					    &s->ev, s->phase);
+					continue;
+				}
+				if (nev == bufsz) {
+					nbuf = xmalloc(2 * bufsz *
+					    sizeof(struct mergeev),
+					    "mergekbuf");
+					memcpy(nbuf, buf,
+					    bufsz * sizeof(struct mergeev));
+					xfree(buf);
+					buf = nbuf;
+					bufsz *= 2;
+				}
+				buf[nev].ev = s->ev;
+				buf[nev].prio = e->prio;
+				buf[nev].phase = s->phase;
+				nev++;
+			}
+			if (p->pos->ev.cmd != EV_NULL) {
+				e->tic = p->tic + p->pos->delta - p->delta;
+				heap_fix(&heap, 0);
+			} else
+				heap_rm(&heap, 0);
+		}
+		mergek_flush(pd, ptrs, buf, nev);
+	}
+	if (end > pd->tic)
+		seqptr_ticput(pd, end - pd->tic);
+	for (i = 0; i < n; i++)
+		seqptr_del(ptrs[i]);
+	seqptr_del(pd);
+	xfree(buf);
+	xfree(heap.ent);
+	xfree(ents);
+	xfree(ptrs);
+	track_merge(dst, &tmp);
+	track_done(&tmp);
+}
+
 /*
  * move/copy/blank a portion of the given track. All operations are
  * consistent: notes are always completely copied/moved/erased and
@@ -907,6 +1346,9 @@ track_move(struct track *src, unsigned start, unsigned len,
 	struct seqptr *sp, *dp;		/* current src & dst track states */
 	struct statelist slist;		/* original src track state */
 	struct state *st;
+	struct evsel sel;
+
+	evsel_init(&sel, es);
 
 #define TAG_KEEP	1		/* frame is not erased */
 #define TAG_COPY	2		/* frame is copied */
@@ -937,7 +1379,7 @@ track_move(struct track *src, unsigned start, unsigned len,
 	 */
 	if (blank) {
 		for (st = slist.first; st != NULL; st = st->next) {
-			if (!EV_ISNOTE(&st->ev) && state_inspec(st, es) &&
+			if (!EV_ISNOTE(&st->ev) && evsel_match(&sel, &st->ev) &&
 			    seqptr_cancel(sp, st))
 				st->tag &= ~TAG_KEEP;
 		}
@@ -956,7 +1398,7 @@ track_move(struct track *src, unsigned start, unsigned len,
 		if ((st->phase & EV_PHASE_FIRST) ||
 		    (st->phase & EV_PHASE_NEXT && !EV_ISNOTE(&st->ev))) {
 			st->tag &= ~TAG_COPY;
-			if (state_inspec(st, es))
+			if (evsel_match(&sel, &st->ev))
 				st->tag |= TAG_COPY;
 		}
 		if (st->phase & EV_PHASE_FIRST) {
@@ -975,7 +1417,7 @@ track_move(struct track *src, unsigned start, unsigned len,
 	 */
 	if (copy) {
 		for (st = slist.first; st != NULL; st = st->next) {
-			if (EV_ISNOTE(&st->ev) || !state_inspec(st, es))
+			if (EV_ISNOTE(&st->ev) || !evsel_match(&sel, &st->ev))
 				continue;
 			if (!(st->tag & TAG_COPY) && seqptr_restore(dp, st)) {
 				st->tag |= TAG_COPY;
@@ -998,7 +1440,8 @@ track_move(struct track *src, unsigned start, unsigned len,
 		if (st == NULL)
 			break;
 		if (st->phase & EV_PHASE_FIRST) {
-			st->tag = state_inspec(st, es) ? TAG_COPY : TAG_KEEP;
+			st->tag = evsel_match(&sel, &st->ev) ?
+			    TAG_COPY : TAG_KEEP;
 		}
 		if (copy && (st->tag & TAG_COPY)) {
 			seqptr_evput(dp, &st->ev);
@@ -1090,6 +1533,22 @@ track_move(struct track *src, unsigned start, unsigned len,
 #undef TAG_COPY
 }
 
+/*
+ * log the statistics of a quantization, it may run without the
+ * realtime lock, see work_detach()
+ */
+void
+track_quantlog(unsigned notes, unsigned fluct)
+{
+	work_lock();
+	log_puts("quantize: ");
+	log_putu(notes);
+	log_puts(" notes, fluctuation = ");
+	log_putu(100 * fluct / notes);
+	log_puts("% of a tick\n");
+	work_unlock();
+}
+
 /*
  * quantize the given track
  */
@@ -1105,8 +1564,11 @@ track_quantize(struct track *src, struct evspec *es,
 	unsigned remaind;
 	unsigned fluct, notes;
 	int ofs, delta;
+	struct evsel sel;
+
+	evsel_init(&sel, es);
 
-	track_init(&qt);
+	track_inittmp(&qt, track_numev(src));
 	sp = seqptr_new(src);
 	qp = seqptr_new(&qt);
 
@@ -1157,7 +1619,7 @@ track_quantize(struct track *src, struct evspec *es,
 		qtic += delta;
 
 		if (st->phase & EV_PHASE_FIRST) {
-			if (evspec_matchev(es, &st->ev)) {
+			if (evsel_match(&sel, &st->ev)) {
 				st->tag = 1;
 				if (EV_ISNOTE(&st->ev)) {
 					fluct += (ofs < 0) ? -ofs : ofs;
@@ -1196,13 +1658,8 @@ track_quantize(struct track *src, struct evspec *es,
 	seqptr_del(sp);
 	seqptr_del(qp);
 	track_done(&qt);
-	if (notes > 0) {
-		log_puts("quantize: ");
-		log_putu(notes);
-		log_puts(" notes, fluctuation = ");
-		log_putu(100 * fluct / notes);
-		log_puts("% of a tick\n");
-	}
+	if (notes > 0)
+		track_quantlog(notes, fluct);
 }
 
 /*
@@ -1219,6 +1676,9 @@ track_quantize_frame(struct track *src, struct evspec *es,
 	unsigned remaind;
 	unsigned fluct, notes;
 	int ofs, delta;
+	struct evsel sel;
+
+	evsel_init(&sel, es);
 
 	sp = seqptr_new(src);
 
@@ -1230,11 +1690,11 @@ track_quantize_frame(struct track *src, struct evspec *es,
 		return;
 	}
 
-	track_init(&qt);
+	track_inittmp(&qt, track_numev(src));
 	qp = seqptr_new(&qt);
 	seqptr_seek(qp, start);
 
-	track_init(&frame);
+	track_inittmp(&frame, track_numev(src));
 	tic = qtic = start;
 	ofs = 0;
 
@@ -1303,7 +1763,7 @@ track_quantize_frame(struct track *src, struct evspec *es,
 			continue;
 		}
 
-		if (!evspec_matchev(es, &sp->pos->ev)) {
+		if (!evsel_match(&sel, &sp->pos->ev)) {
 			/*
 			 * Doesn't match selection, Skip this event.
 			 */
@@ -1330,13 +1790,8 @@ track_quantize_frame(struct track *src, struct evspec *es,
 	track_merge(src, &qt);
 	track_done(&qt);
 
-	if (notes > 0) {
-		log_puts("quantize: ");
-		log_putu(notes);
-		log_puts(" notes, fluctuation = ");
-		log_putu(100 * fluct / notes);
-		log_puts("% of a tick\n");
-	}
+	if (notes > 0)
+		track_quantlog(notes, fluct);
 }
 
 /*
@@ -1428,8 +1883,11 @@ track_transpose(struct track *src, unsigned start, unsigned len,
 	struct state *st;
 	struct statelist slist;
 	struct ev ev;
+	struct evsel sel;
+
+	evsel_init(&sel, es);
 
-	track_init(&qt);
+	track_inittmp(&qt, track_numev(src));
 	sp = seqptr_new(src);
 	qp = seqptr_new(&qt);
 
@@ -1459,7 +1917,7 @@ track_transpose(struct track *src, unsigned start, unsigned len,
 		if (st == NULL)
 			break;
 		if (st->phase & EV_PHASE_FIRST) {
-			if (EV_ISNOTE(&st->ev) && state_inspec(st, es))
+			if (EV_ISNOTE(&st->ev) && evsel_match(&sel, &st->ev))
 				st->tag = 1;
 			else
 				st->tag = 0;
@@ -1514,9 +1972,14 @@ track_vcurve(struct track *src, unsigned start, unsigned len,
 	struct state *st;
 	struct statelist slist;
 	struct ev ev;
+	unsigned char tab[EV_MAXCOARSE + 1];
+	struct evsel sel;
+
+	evsel_init(&sel, es);
 
 	/* put weight from -63:63 to 1:127 range */
 	weight = (64 - weight) & 0x7f;
+	vcurve_mktab(tab, weight);
 
 	sp = seqptr_new(src);
 	statelist_dup(&slist, &sp->statelist);
@@ -1534,9 +1997,9 @@ track_vcurve(struct track *src, unsigned start, unsigned len,
 		tic += delta;
 		if ((st->phase & EV_PHASE_FIRST) &&
 		    tic >= start && tic < start + len &&
-		    EV_ISNOTE(&st->ev) && state_inspec(st, es)) {
+		    EV_ISNOTE(&st->ev) && evsel_match(&sel, &st->ev)) {
 			ev = st->ev;
-			ev.note_vel = vcurve(weight, ev.note_vel);
+			ev.note_vel = tab[ev.note_vel & 0x7f];
 			seqptr_evput(sp, &ev);
 		} else {
 			seqptr_evput(sp, &st->ev);
@@ -1591,6 +2054,20 @@ track_rewrite(struct track *src)
 	track_done(&dst);
 }
 
+/*
+ * log a problem found by track_check(), tracks may be checked on
+ * several threads
+ */
+void
+track_checklog(struct ev *ev, char *msg)
+{
+	work_lock();
+	log_puts("track_check: ");
+	ev_log(ev);
+	log_puts(msg);
+	work_unlock();
+}
+
 /*
  * check (and fix) the given track for inconsistencies
  */
@@ -1619,14 +2096,10 @@ track_check(struct track *src)
 		}
 		if (st->phase & EV_PHASE_FIRST) {
 			if (st->flags & STATE_BOGUS) {
-				log_puts("track_check: ");
-				ev_log(&st->ev);
-				log_puts(": bogus\n");
+				track_checklog(&st->ev, ": bogus\n");
 				st->tag = 0;
 			} else if (st->flags & STATE_NESTED) {
-				log_puts("track_check: ");
-				ev_log(&st->ev);
-				log_puts(": nested\n");
+				track_checklog(&st->ev, ": nested\n");
 				st->tag = 0;
 			} else {
 				st->tag = 1;
@@ -1640,9 +2113,7 @@ track_check(struct track *src)
 			if (dst == NULL || !state_eq(dst, &st->ev)) {
 				seqptr_evput(sp, &st->ev);
 			} else {
-				log_puts("track_check: ");
-				ev_log(&st->ev);
-				log_puts(": duplicated\n");
+				track_checklog(&st->ev, ": duplicated\n");
 			}
 		}
 	}
@@ -1653,9 +2124,7 @@ track_check(struct track *src)
 	for (st = sp->statelist.first; st != NULL; st = stnext) {
 		stnext = st->next;
 		if (!(st->phase & EV_PHASE_LAST)) {
-			log_puts("track_check: ");
-			ev_log(&st->ev);
-			log_puts(": unterminated\n");
+			track_checklog(&st->ev, ": unterminated\n");
 			seqptr_rmprev(sp, &st);
 		}
 	}
@@ -1728,6 +2197,75 @@ seqptr_skipmeasure(struct seqptr *sp, unsigned meas)
 	return 0;
 }
 
+/*
+ * build the tempo map of the given meta track, by walking through it
+ * measure by measure the same way as seqptr_skipmeasure(). A new range
+ * is started each time the time signature or the tempo at the
+ * beginning of a measure change. The (extra) last entry in the array
+ * holds the last measure starting before the end-of-track and the
+ * time signature and the tempo at the end-of-track.
+ */
+void
+track_mktmap(struct track *t)
+{
+	struct seqptr *sp;
+	struct trackseg *s;
+	unsigned bpm, tpb, m;
+	unsigned long usec24;
+
+	t->segs = xmalloc_class((track_numev(t) + 2) * sizeof(struct trackseg),
+	    "trackseg", MEM_BULK);
+	t->nsegs = 0;
+	sp = seqptr_new(t);
+	for (m = 0; ; m++) {
+		while (seqptr_evget(sp)) {
+			/* nothing */
+		}
+		seqptr_getsign(sp, &bpm, &tpb);
+		seqptr_gettempo(sp, &usec24);
+		s = (t->nsegs > 0) ? &t->segs[t->nsegs - 1] : NULL;
+		if (s == NULL ||
+		    s->bpm != bpm || s->tpb != tpb || s->usec24 != usec24) {
+			s = &t->segs[t->nsegs++];
+			s->meas = m;
+			s->tic = sp->tic;
+			s->bpm = bpm;
+			s->tpb = tpb;
+			s->usec24 = usec24;
+		}
+		if (seqptr_skip(sp, bpm * tpb) > 0)
+			break;
+	}
+	s = &t->segs[t->nsegs];
+	s->meas = m;
+	s->tic = sp->tic;
+	seqptr_getsign(sp, &s->bpm, &s->tpb);
+	seqptr_gettempo(sp, &s->usec24);
+	seqptr_del(sp);
+}
+
+/*
+ * return the range of the tempo map containing the given measure
+ */
+struct trackseg *
+track_findseg(struct track *t, unsigned meas)
+{
+	unsigned lo, hi, mid;
+
+	if (t->segs == NULL)
+		track_mktmap(t);
+	lo = 1;
+	hi = t->nsegs;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (t->segs[mid].meas <= meas)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return &t->segs[lo - 1];
+}
+
 /*
  * convert a measure number to a tic number using
  * meta-events from the given track
@@ -1735,13 +2273,11 @@ seqptr_skipmeasure(struct seqptr *sp, unsigned meas)
 unsigned
 track_findmeasure(struct track *t, unsigned m)
 {
-	struct seqptr *sp;
+	struct trackseg *s;
 	unsigned tic;
 
-	sp = seqptr_new(t);
-	tic  = seqptr_skipmeasure(sp, m);
-	tic += sp->tic;
-	seqptr_del(sp);
+	s = track_findseg(t, m);
+	tic = s->tic + (m - s->meas) * s->bpm * s->tpb;
 
 #ifdef FRAME_DEBUG
 	log_puts("track_findmeasure: ");
@@ -1754,6 +2290,39 @@ track_findmeasure(struct track *t, unsigned m)
 	return tic;
 }
 
+/*
+ * return the number of measures needed to hold the given number of
+ * tics, ie the first measure starting at or after 'tic'
+ */
+unsigned
+track_nmeasures(struct track *t, unsigned tic)
+{
+	struct trackseg *s;
+	unsigned lo, hi, mid, tpm;
+
+	if (tic == 0)
+		return 0;
+	if (t->segs == NULL)
+		track_mktmap(t);
+
+	/*
+	 * find the last range starting before 'tic', past the
+	 * end-of-track the last range goes on forever
+	 */
+	lo = 1;
+	hi = t->nsegs;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (t->segs[mid].tic < tic)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	s = &t->segs[lo - 1];
+	tpm = s->bpm * s->tpb;
+	return s->meas + (tic - s->tic + tpm - 1) / tpm;
+}
+
 /*
  * return the absolute tic, the tempo and the time signature
  * corresponding to the given measure number
@@ -1762,26 +2331,24 @@ void
 track_timeinfo(struct track *t, unsigned meas, unsigned *abs,
     unsigned long *usec24, unsigned *bpm, unsigned *tpb)
 {
-	struct seqptr *sp;
-	unsigned tic;
+	struct trackseg *s, *e;
 
-	sp = seqptr_new(t);
-	tic  = seqptr_skipmeasure(sp, meas);
-	tic += sp->tic;
+	s = track_findseg(t, meas);
+	if (abs)
+		*abs = s->tic + (meas - s->meas) * s->bpm * s->tpb;
 
 	/*
-	 * move to the last event, so all meta events enter the
-	 * state list
+	 * past the end-of-track, all meta events are in the state
 	 */
-	while (seqptr_evget(sp)) {
-		/* nothing */
-	}
-	if (abs) {
-		*abs = tic;
-	}
-	seqptr_getsign(sp, bpm, tpb);
-	seqptr_gettempo(sp, usec24);
-	seqptr_del(sp);
+	e = &t->segs[t->nsegs];
+	if (meas > e->meas)
+		s = e;
+	if (bpm)
+		*bpm = s->bpm;
+	if (tpb)
+		*tpb = s->tpb;
+	if (usec24)
+		*usec24 = s->usec24;
 }
 
 /*
@@ -1902,6 +2469,9 @@ track_unconfev(struct track *src, struct evspec *es)
 	struct statelist slist;
 	struct seqptr *sp;
 	struct state *st;
+	struct evsel sel;
+
+	evsel_init(&sel, es);
 
 	sp = seqptr_new(src);
 	statelist_init(&slist);
@@ -1915,7 +2485,7 @@ track_unconfev(struct track *src, struct evspec *es)
 		if (st == NULL)
 			break;
 		if (st->phase & EV_PHASE_FIRST) {
-			st->tag = state_inspec(st, es) ? 0 : 1;
+			st->tag = evsel_match(&sel, &st->ev) ? 0 : 1;
 		}
 		if (st->tag) {
 			seqptr_evput(sp, &st->ev);
@@ -1934,8 +2504,8 @@ track_ins(struct track *t, unsigned stic, unsigned len)
 {
 	struct track t1, t2;
 
-	track_init(&t1);
-	track_init(&t2);
+	track_inittmp(&t1, track_numev(t));
+	track_inittmp(&t2, track_numev(t));
 	track_move(t, 0 ,  stic, NULL, &t1, 1, 1);
 	track_move(t, stic, ~0U, NULL, &t2, 1, 1);
 	track_shift(&t2, stic + len);
@@ -1956,8 +2526,8 @@ track_cut(struct track *t, unsigned stic, unsigned len)
 {
 	struct track t1, t2;
 
-	track_init(&t1);
-	track_init(&t2);
+	track_inittmp(&t1, track_numev(t));
+	track_inittmp(&t2, track_numev(t));
 	track_move(t, 0,	 stic, NULL, &t1, 1, 1);
 	track_move(t, stic + len, ~0U, NULL, &t2, 1, 1);
 	track_shift(&t2, stic);
@@ -1983,11 +2553,15 @@ track_evmap(struct track *src, unsigned start, unsigned len,
 	struct state *st;
 	struct statelist slist;
 	struct ev ev;
+	struct evsel sel, fromsel;
+
+	evsel_init(&sel, es);
+	evsel_init(&fromsel, from);
 
 	if (!evspec_isamap(from, to))
 		return;
 
-	track_init(&qt);
+	track_inittmp(&qt, track_numev(src));
 	sp = seqptr_new(src);
 	qp = seqptr_new(&qt);
 
@@ -2017,7 +2591,8 @@ track_evmap(struct track *src, unsigned start, unsigned len,
 		if (st == NULL)
 			break;
 		if (st->phase & EV_PHASE_FIRST) {
-			if (state_inspec(st, es) && state_inspec(st, from))
+			if (evsel_match(&sel, &st->ev) &&
+			    evsel_match(&fromsel, &st->ev))
 				st->tag = 1;
 			else
 				st->tag = 0;
@@ -2055,3 +2630,201 @@ track_evmap(struct track *src, unsigned start, unsigned len,
 	seqptr_del(qp);
 	track_done(&qt);
 }
+
+/*
+ * return a bitmap of the transformations to apply to the frame
+ * starting with the given event: bit n + 1 is set if the n-th
+ * transformation applies, and bit 0 if any does. Transformations
+ * are matched against the event as modified by the previous ones
+ */
+unsigned
+trackedit_tag(struct trackedit *ops, unsigned nops, struct ev *first)
+{
+	struct trackedit *op;
+	struct ev ev;
+	unsigned n, tag, match;
+
+	tag = 0;
+	ev = *first;
+	for (n = 0, op = ops; n < nops; n++, op++) {
+		if (op->type == TRACKEDIT_EVMAP)
+			match = evsel_match(&op->fromsel, &ev);
+		else
+			match = EV_ISNOTE(&ev);
+		if (match) {
+			tag |= 1 | (2 << n);
+			trackedit_apply(op, 1, 2, EV_PHASE_FIRST, &ev, &ev);
+		}
+	}
+	return tag;
+}
+
+/*
+ * apply the transformations selected by the given tag to the given
+ * event of a frame
+ */
+void
+trackedit_apply(struct trackedit *ops, unsigned nops, unsigned tag,
+    unsigned phase, struct ev *in, struct ev *out)
+{
+	struct trackedit *op;
+	struct ev ev;
+	unsigned n;
+
+	*out = *in;
+	for (n = 0, op = ops; n < nops; n++, op++) {
+		if (!(tag & (2 << n)))
+			continue;
+		switch (op->type) {
+		case TRACKEDIT_TRANSP:
+			out->note_num += (128 + op->halftones);
+			out->note_num &= 0x7f;
+			break;
+		case TRACKEDIT_VCURVE:
+			if (phase & EV_PHASE_FIRST)
+				out->note_vel = op->vtab[out->note_vel & 0x7f];
+			break;
+		case TRACKEDIT_EVMAP:
+			ev = *out;
+			ev_map(&ev, &op->from, &op->to, out);
+			break;
+		}
+	}
+}
+
+/*
+ * apply the given transformations to the selected frames and
+ * quantize them, in a single pass. Frames are moved to a temporary
+ * track as track_quantize() does and merged back once; if 'quant'
+ * or 'rate' is zero, frames are not moved in time
+ */
+void
+track_edit(struct track *src, unsigned start, unsigned len,
+    struct evspec *es, unsigned offset, unsigned quant, unsigned rate,
+    struct trackedit *ops, unsigned nops)
+{
+	unsigned tic, qtic;
+	struct track qt;
+	struct seqptr *sp, *qp;
+	struct state *st;
+	struct statelist slist;
+	struct ev ev;
+	unsigned remaind;
+	unsigned fluct, notes;
+	int ofs, delta;
+	struct evsel sel;
+	unsigned n;
+
+	if (quant == 0)
+		rate = 0;
+	if (nops == 0 && rate == 0)
+		return;
+
+	evsel_init(&sel, es);
+	for (n = 0; n < nops; n++) {
+		if (ops[n].type == TRACKEDIT_EVMAP)
+			evsel_init(&ops[n].fromsel, &ops[n].from);
+	}
+
+	track_inittmp(&qt, track_numev(src));
+	sp = seqptr_new(src);
+	qp = seqptr_new(&qt);
+
+	/*
+	 * go to start position and untag all frames
+	 * (tagged = will be moved to qt)
+	 */
+	(void)seqptr_skip(sp, start);
+	statelist_dup(&slist, &sp->statelist);
+	for (st = slist.first; st != NULL; st = st->next) {
+		st->tag = 0;
+	}
+	seqptr_seek(qp, start);
+	tic = qtic = start;
+	ofs = 0;
+
+	/*
+	 * go ahead and move all events to edit during 'len' tics,
+	 * while stretching the time scale in the destination track
+	 */
+	fluct = 0;
+	notes = 0;
+	for (;;) {
+		delta = seqptr_ticdel(sp, start + len - tic, &slist);
+		seqptr_ticput(sp, delta);
+		tic += delta;
+		if (tic >= start + len)
+			break;
+		st = seqptr_evdel(sp, &slist);
+		if (st == NULL)
+			break;
+
+		if (rate > 0) {
+			remaind = (tic - start + offset) % quant;
+			if (remaind < quant / 2) {
+				ofs = - ((remaind * rate + 99) / 100);
+			} else {
+				ofs = ((quant - remaind) * rate + 99) / 100;
+			}
+		}
+
+		delta = tic + ofs - qtic;
+#ifdef FRAME_DEBUG
+		if (delta < 0) {
+			log_puts("track_edit: delta < 0\n");
+			panic();
+		}
+#endif
+		seqptr_ticput(qp, delta);
+		qtic += delta;
+
+		if (st->phase & EV_PHASE_FIRST) {
+			if (evsel_match(&sel, &st->ev)) {
+				st->tag = trackedit_tag(ops, nops, &st->ev);
+				if (rate > 0) {
+					st->tag |= 1;
+					if (EV_ISNOTE(&st->ev)) {
+						fluct += (ofs < 0) ? -ofs : ofs;
+						notes++;
+					}
+				}
+			} else
+				st->tag = 0;
+		}
+		if (st->tag) {
+			trackedit_apply(ops, nops, st->tag, st->phase,
+			    &st->ev, &ev);
+			seqptr_evput(qp, &ev);
+		} else {
+			seqptr_evput(sp, &st->ev);
+		}
+	}
+
+	/*
+	 * finish edited (tagged) frames
+	 */
+	for (;;) {
+		delta = seqptr_ticdel(sp, ~0U, &slist);
+		seqptr_ticput(sp, delta);
+		st = seqptr_evdel(sp, &slist);
+		if (st == NULL)
+			break;
+		if (st->phase & EV_PHASE_FIRST)
+			st->tag = 0;
+		seqptr_ticput(qp, delta);
+		if (st->tag) {
+			trackedit_apply(ops, nops, st->tag, st->phase,
+			    &st->ev, &ev);
+			seqptr_evput(qp, &ev);
+		} else {
+			seqptr_evput(sp, &st->ev);
+		}
+	}
+	track_merge(src, &qt);
+	statelist_done(&slist);
+	seqptr_del(sp);
+	seqptr_del(qp);
+	track_done(&qt);
+	if (notes > 0)
+		track_quantlog(notes, fluct);
+}
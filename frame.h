@@ -18,21 +18,49 @@
 #define MIDISH_FRAME_H
 
 #include "state.h"
+#include "track.h"
 
 struct seqptr {
 	struct statelist statelist;
 	struct seqptr *link;		/* opposite direction seqptr */
+	struct track *track;		/* track we're moving on */
 	struct seqev *pos;		/* next event (current position) */
 	unsigned delta;			/* tics until the next event */
 	unsigned tic;			/* absolute tic of the current pos */
+	unsigned char *rom;		/* record of 'pos', if reading in place */
+	unsigned romlen;		/* size of the record */
+	struct seqev romev;		/* unpacked record, 'pos' points here */
+	struct trackpat *pat;		/* pattern being read, if any */
+	unsigned romrep;		/* repetitions of 'pat' left */
 };
 
+/*
+ * transformation applied to frames by track_edit()
+ */
+struct trackedit {
+#define TRACKEDIT_TRANSP	0	/* transpose notes by 'halftones' */
+#define TRACKEDIT_VCURVE	1	/* apply 'vtab' to note velocities */
+#define TRACKEDIT_EVMAP		2	/* map 'from' events to 'to' */
+	unsigned type;
+	int halftones;
+	unsigned char vtab[EV_MAXCOARSE + 1];
+	struct evspec from, to;
+	struct evsel fromsel;		/* 'from' compiled by track_edit() */
+};
+
+/*
+ * max number of transformations in a single pass, one bit of
+ * state->tag per transformation
+ */
+#define TRACKEDIT_MAXOPS	16
+
 struct track;
-struct evspec;
 
 void	      seqptr_pool_init(unsigned);
 void	      seqptr_pool_done(void);
 struct seqptr *seqptr_new(struct track *);
+struct seqptr *seqptr_newro(struct track *);
+void	      seqptr_romget(struct seqptr *, unsigned char *);
 void	      seqptr_del(struct seqptr *);
 void	      seqptr_link(struct seqptr *, struct seqptr *);
 int	      seqptr_eot(struct seqptr *);
@@ -52,8 +80,12 @@ struct state *seqptr_evmerge1(struct seqptr *, struct state *);
 unsigned      seqptr_evmerge2(struct seqptr *,
     struct statelist *, struct ev *, struct ev *);
 
+void	 track_mkidx(struct track *, unsigned);
+void	 track_mktmap(struct track *);
 void	 track_merge(struct track *, struct track *);
+void	 track_mergek(struct track *, struct track **, unsigned);
 unsigned track_findmeasure(struct track *, unsigned);
+unsigned track_nmeasures(struct track *, unsigned);
 void	 track_timeinfo(struct track *, unsigned, unsigned *,
 			unsigned long *, unsigned *, unsigned *);
 void     track_settempo(struct track *, unsigned, unsigned);
@@ -74,6 +106,11 @@ void	 track_evmap(struct track *, unsigned, unsigned,
 	 struct evspec *, struct evspec *, struct evspec *);
 void	 track_vcurve(struct track *, unsigned, unsigned,
 	 struct evspec *, int);
+unsigned trackedit_tag(struct trackedit *, unsigned, struct ev *);
+void	 trackedit_apply(struct trackedit *, unsigned, unsigned, unsigned,
+	 struct ev *, struct ev *);
+void	 track_edit(struct track *, unsigned, unsigned, struct evspec *,
+	 unsigned, unsigned, unsigned, struct trackedit *, unsigned);
 void	 track_check(struct track *);
 void	 track_rewrite(struct track *);
 void     track_confev(struct track *, struct ev *);
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * binary heap shared by the song player, the smf streamer, the
+ * timeouts and the k-way track merge: adding, removing and fixing an
+ * entry take O(log n). The caller allocates the array of entries,
+ * so nothing is allocated on the realtime path. If the 'moved'
+ * routine is set, it's called each time an entry gets a new index,
+ * so the caller can remove it later without searching
+ */
+
+#include "heap.h"
+
+/*
+ * store the given entry at the given index
+ */
+void
+heap_set(struct heap *h, unsigned i, void *e)
+{
+	h->ent[i] = e;
+	if (h->moved)
+		h->moved(e, i);
+}
+
+/*
+ * move up the entry at the given index until its parent is before it
+ */
+void
+heap_up(struct heap *h, unsigned i)
+{
+	void *e = h->ent[i];
+	unsigned p;
+
+	while (i > 0) {
+		p = (i - 1) / 2;
+		if (!h->before(e, h->ent[p]))
+			break;
+		heap_set(h, i, h->ent[p]);
+		i = p;
+	}
+	heap_set(h, i, e);
+}
+
+/*
+ * move down the entry at the given index until it's before both
+ * children
+ */
+void
+heap_down(struct heap *h, unsigned i)
+{
+	void *e = h->ent[i];
+	unsigned c;
+
+	for (;;) {
+		c = 2 * i + 1;
+		if (c >= h->n)
+			break;
+		if (c + 1 < h->n && h->before(h->ent[c + 1], h->ent[c]))
+			c++;
+		if (!h->before(h->ent[c], e))
+			break;
+		heap_set(h, i, h->ent[c]);
+		i = c;
+	}
+	heap_set(h, i, e);
+}
+
+/*
+ * initialize an empty heap using the given array of entries, which
+ * must be large enough to hold all entries
+ */
+void
+heap_init(struct heap *h, void **ent,
+    unsigned (*before)(void *, void *), void (*moved)(void *, unsigned))
+{
+	h->ent = ent;
+	h->n = 0;
+	h->before = before;
+	h->moved = moved;
+}
+
+/*
+ * add an entry to the heap
+ */
+void
+heap_put(struct heap *h, void *e)
+{
+	h->ent[h->n] = e;
+	heap_up(h, h->n++);
+}
+
+/*
+ * restore the order after the entry at the given index changed
+ */
+void
+heap_fix(struct heap *h, unsigned i)
+{
+	if (i > 0 && h->before(h->ent[i], h->ent[(i - 1) / 2]))
+		heap_up(h, i);
+	else
+		heap_down(h, i);
+}
+
+/*
+ * remove the entry at the given index
+ */
+void
+heap_rm(struct heap *h, unsigned i)
+{
+	if (i == --h->n)
+		return;
+	h->ent[i] = h->ent[h->n];
+	heap_fix(h, i);
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MIDISH_HEAP_H
+#define MIDISH_HEAP_H
+
+/*
+ * binary heap of pointers, the first entry is the one before all
+ * others, as defined by the 'before' routine
+ */
+struct heap {
+	void **ent;			/* entries, first is ent[0] */
+	unsigned n;			/* number of entries */
+	unsigned (*before)(void *, void *);
+	void (*moved)(void *, unsigned); /* entry got new index, or NULL */
+};
+
+void heap_init(struct heap *, void **,
+    unsigned (*)(void *, void *), void (*)(void *, unsigned));
+void heap_put(struct heap *, void *);
+void heap_rm(struct heap *, unsigned);
+void heap_fix(struct heap *, unsigned);
+
+#endif /* MIDISH_HEAP_H */
@@ -17,7 +17,7 @@
 #include "textio.h"
 #include "help.h"
 
-struct help help_list[] = {
+const struct help help_list[] = {
 	{"tlist",
 	"tlist\n"
 	"\n"
@@ -71,6 +71,13 @@ struct help help_list[] = {
 	"\n"
 	"Rewrite the current track note-by-note."},
 
+	{"tpack",
+	"tpack\n"
+	"\n"
+	"If the current track is a pattern repeated several times, store "
+	"the pattern only once and play it repeatedly. Tracks with the "
+	"same pattern share it. The track is unpacked when it's edited."},
+
 	{"tcut",
 	"tcut\n"
 	"\n"
@@ -108,6 +115,13 @@ struct help help_list[] = {
 	"\n"
 	"Merge the given track into the current track."},
 
+	{"tflatten",
+	"tflatten tracklist\n"
+	"\n"
+	"Merge all tracks of the given list into the current track in a "
+	"single pass. In case of conflicting events, tracks listed last "
+	"take priority. Source tracks are left unchanged."},
+
 	{"tquanta",
 	"tquanta rate\n"
 	"\n"
@@ -148,6 +162,16 @@ struct help help_list[] = {
 	"Both event sets must have the same number of devices, "
 	"channels, notes, controllers etc.."},
 
+	{"tedit",
+	"tedit list\n"
+	"\n"
+	"Apply the given list of transformations to the current selection "
+	"of the current track in a single pass, saving a single undo entry. "
+	"Each transformation is a list of the name and the arguments of "
+	"the equivalent command among {quanta rate}, {transp halftones}, "
+	"{vcurve weight} and {evmap source dest}. Transformations are "
+	"applied in order, on events matching the current event selection."},
+
 	{"mute",
 	"mute trackname\n"
 	"\n"
@@ -454,6 +478,26 @@ struct help help_list[] = {
 	"\n"
 	"Store contents of the current sysex bank in the given .syx file."},
 
+	{"xasync",
+	"xasync\n"
+	"\n"
+	"Send sysex messages of all banks in background once the song "
+	"starts, so playback doesn't have to wait for them. Messages are "
+	"sent one by one, waiting the time each takes on the wire, and "
+	"other events are sent between them."},
+
+	{"noxasync",
+	"noxasync\n"
+	"\n"
+	"Send all sysex messages before the song starts, this is the "
+	"default."},
+
+	{"xprogress",
+	"xprogress\n"
+	"\n"
+	"Return the number of sysex messages sent in background and "
+	"the total number of messages to send, as a list."},
+
 	{"xlist",
 	"xlist\n"
 	"\n"
@@ -694,11 +738,74 @@ struct help help_list[] = {
 	"Save the song into the given file. The file name is a "
 	"quoted string."},
 
+	{"bgsave",
+	"bgsave filename\n"
+	"\n"
+	"Save the song into the given file without stopping it, so it "
+	"can be used during playback. Events being recorded are not "
+	"saved."},
+
+	{"savelz",
+	"savelz filename\n"
+	"\n"
+	"Save the song into the given file, in the text format, "
+	"compressed. The load command reads it like a text file. The "
+	"file name is a quoted string."},
+
+	{"savebin",
+	"savebin filename\n"
+	"\n"
+	"Save the song into the given file, in the compact binary "
+	"format. The file name is a quoted string."},
+
+	{"snapshot",
+	"snapshot filename\n"
+	"\n"
+	"Save the controller table, device settings, the song, user procs "
+	"and global variables into the given binary image. If a snapshot "
+	"named like the startup script followed by the .img suffix exists "
+	"and is not older than the script, it is restored at startup "
+	"instead of running the script. Devices are not created, only the "
+	"settings of existing ones are restored."},
+
+	{"restore",
+	"restore filename\n"
+	"\n"
+	"Restore the state saved in the given image by snapshot. The "
+	"current song is kept if the image can't be read."},
+
 	{"load",
 	"load filename\n"
 	"\n"
-	"Load the song from the given file. The file name is a "
-	"quoted string. The current song will be overwritten."},
+	"Load the song from the given file, in either the text or the "
+	"binary format. The file name is a quoted string. The current "
+	"song will be overwritten."},
+
+	{"mapload",
+	"mapload name\n"
+	"\n"
+	"Load the song from the given binary image, saved with savebin, "
+	"without copying track events into memory: they are read in place "
+	"from the image during playback. On the ESP32 the name is the "
+	"label of a data partition, elsewhere it's a file name. A track is "
+	"copied into memory the first time it's modified. The current song "
+	"will be overwritten."},
+
+	{"slload",
+	"slload filename\n"
+	"\n"
+	"Load the next song of the setlist from the given file, while the "
+	"current song keeps playing. The loaded song replaces the current "
+	"one once armed with slnext."},
+
+	{"slnext",
+	"slnext\n"
+	"\n"
+	"Switch to the song loaded with slload. If the current song is "
+	"playing, the switch occurs at the beginning of the next measure "
+	"without stopping the clock, and only channel config events that "
+	"differ from the current song are sent. Stopping playback before "
+	"the switch cancels it."},
 
 	{"reset",
 	"reset\n"
@@ -719,6 +826,15 @@ struct help help_list[] = {
 	"is a quoted string. The current song will be overwritten. "
 	"Only MIDI file formats 0 and 1 are supported."},
 
+	{"smfplay",
+	"smfplay filename\n"
+	"\n"
+	"Play the given standard MIDI file along with the song, reading "
+	"it from storage during playback instead of loading it in "
+	"memory, so files of any size can be played. Tempo changes of the "
+	"file are used, but time signatures and sysex messages are "
+	"ignored. If nil is given, the file is no longer played."},
+
 	{"u",
 	"u\n"
 	"\n"
@@ -727,7 +843,23 @@ struct help help_list[] = {
 	{"ul",
 	"ul\n"
 	"\n"
-	"List operations saved for undo."},
+	"List operations saved for undo, with the memory each one uses."},
+
+	{"undosize",
+	"undosize hot max\n"
+	"\n"
+	"Set the memory budget of undo data, in bytes. Once recent "
+	"operations take more than 'hot' bytes, older ones are packed "
+	"in bulk memory and unpacked when undone. Once all take more "
+	"than 'max' bytes, the oldest ones are dropped."},
+
+	{"workers",
+	"workers count\n"
+	"\n"
+	"Set the number of threads used by operations applying to all "
+	"tracks, as setunit or import. If 0, one thread per processor "
+	"is used, this is the default. Ignored on builds without "
+	"threads support."},
 
 	{"dlist",
 	"dlist\n"
@@ -749,7 +881,13 @@ struct help help_list[] = {
 	"If nil is given instead of the path, then the port is not "
 	"connected to any existing port}, this allows other ALSA sequencer "
 	"clients to subscribe to it and to provide events to midish or to "
-	"consume events midish sends to the port."},
+	"consume events midish sends to the port. "
+	"On ESP32 chips with a native USB port, the \"usb\" path "
+	"designates the USB-MIDI port. The \"ble\" path designates "
+	"the Bluetooth LE MIDI port. Paths like \"rtp:host:port\" "
+	"and \"rtp:port\" create RTP-MIDI network sessions, either "
+	"by inviting the given host or by waiting for an invitation "
+	"on the given port."},
 
 	{"ddel",
 	"ddel devnum\n"
@@ -790,6 +928,48 @@ struct help help_list[] = {
 	"If the device number is nil, then the internal clock will be "
 	"used and midish will act as master clock."},
 
+	{"dclkpll",
+	"dclkpll onoff\n"
+	"\n"
+	"If onoff is true, don't follow each MIDI tick of the master clock "
+	"source, but estimate its tempo and generate ticks at a steady "
+	"rate, slowly corrected to stay in phase. Jitter is smoothed out "
+	"and short dropouts are bridged. Default is false."},
+
+	{"dclkinfo",
+	"dclkinfo\n"
+	"\n"
+	"Print the state of the master clock follower: the estimated "
+	"tempo, tick period and jitter of the clock source, and the "
+	"number of ticks generated while it was silent."},
+
+	{"dxthru",
+	"dxthru devnum thrudev\n"
+	"\n"
+	"Forward system exclusive messages received from the given device "
+	"to the thrudev device. Messages longer than 256 bytes are sent as "
+	"they arrive, without being stored, unless they are recorded. If "
+	"thrudev is nil, forwarding is disabled."},
+
+	{"dbaud",
+	"dbaud devnum baud\n"
+	"\n"
+	"Set the line rate of the given device. Controller, bend and "
+	"aftertouch updates are held until the end of the tick, so "
+	"superseded ones are dropped, and they are sent after notes only "
+	"as fast as the line rate allows. Default is 31250 for serial "
+	"ports. If baud is 0, events are sent as they come."},
+
+	{"dlook",
+	"dlook devnum msec\n"
+	"\n"
+	"Delay all output of the given device by msec milliseconds, at "
+	"most 100. Played events are queued with the time their tick "
+	"was due at, plus this delay, and are sent by the timer at that "
+	"time, so their timing is kept even if the interpreter is busy. "
+	"Events passed thru from the input are not delayed. "
+	"Only serial ports support lookahead. Default is 0."},
+
 	{"dclkrate",
 	"dclkrate devnum tics_per_unit\n"
 	"\n"
@@ -802,6 +982,22 @@ struct help help_list[] = {
 	"\n"
 	"Print some information about the MIDI device."},
 
+	{"dlat",
+	"dlat devnum\n"
+	"\n"
+	"Print the latency of input events sent to the given MIDI device, "
+	"measured from their arrival to the moment the device is flushed, "
+	"in microseconds: the number of events, the minimum, average and "
+	"maximum latency, and the histograms of latency and jitter. "
+	"Histograms are lists of {usec count} pairs, where usec is "
+	"the lower bound of the bucket. Each bucket is twice as wide "
+	"as the previous one."},
+
+	{"dlatclr",
+	"dlatclr devnum\n"
+	"\n"
+	"Clear latency statistics of the given MIDI device."},
+
 	{"dixctl",
 	"dixctl devnum ctlset\n"
 	"\n"
@@ -884,6 +1080,14 @@ struct help help_list[] = {
 	"\n"
 	"Print the list of event patterns."},
 
+	{"normrate",
+	"normrate evname maxev\n"
+	"\n"
+	"Set the maximum number of input events of the given type passed "
+	"to the output per 1/48 second, for each note or controller. "
+	"Events in excess are dropped, except the last one, sent at the "
+	"beginning of the next period. Default is 2, 0 means no limit."},
+
 	{"m",
 	"m onoff\n"
 	"\n"
@@ -956,6 +1160,7 @@ struct help help_list[] = {
 	"    pool - show pool usage on exit\n"
 	"    song - show start/stop events\n"
 	"    timo - show timer internal errors\n"
+	"    vm - show the bytecode of procs when they are defined\n"
 	"    mem - show memory usage"},
 
 	{"version",
@@ -968,6 +1173,88 @@ struct help help_list[] = {
 	"\n"
 	"Abort (and core-dump)."},
 
+	{"bench",
+	"bench name count\n"
+	"\n"
+	"Run count iterations of the given benchmark on the current song "
+	"and print its name, the number of iterations and of events, the "
+	"time spent in microseconds, the iterations per second and the "
+	"peak memory used by pools in bytes. Benchmarks are copy, merge, "
+	"flatten, quantize, edit, undo, save, savebin, load, loadbin, export, "
+	"import, play and thru. The song is left unchanged."},
+
+	{"jitter",
+	"jitter period jitter seed input\n"
+	"\n"
+	"Play the current song on a simulated clock, first updated exactly "
+	"at each tic, then every period microseconds plus a pseudo-random "
+	"delay up to jitter microseconds, generated from the given seed. "
+	"Input is a list of {usec unit byte ...} items, in time order, "
+	"received during both runs. Print the period, the jitter, the "
+	"number of clock updates, the number of output bytes compared, "
+	"the number of bytes missing in either run, and the min, max "
+	"and mean timing error in microseconds."},
+
+	{"poolinfo",
+	"poolinfo\n"
+	"\n"
+	"Print memory pools usage: for each pool the entry size, the "
+	"number of slabs and entries, the number of entries in use, "
+	"the maximum number of entries ever used, the number of "
+	"allocations and the number of slabs added beyond the budget "
+	"once pools are fixed."},
+
+	{"meminfo",
+	"meminfo\n"
+	"\n"
+	"Print where memory goes: the bytes used by tracks, channels, "
+	"filters, sysex banks, undo data and the clipboard, then for "
+	"each pool its size, the bytes in use and the maximum ever used, "
+	"then for each allocation tag the number of blocks, the bytes "
+	"in use and the maximum ever used. Finally the heap usage, its "
+	"free size and largest free block are printed, and reported as "
+	"a +mem tag in verbose mode."},
+
+	{"poolsize",
+	"poolsize pool size\n"
+	"\n"
+	"Grow the given pool so it has at least the given number of "
+	"entries, eg. to reserve the memory budget of the pool before "
+	"calling poolfix."},
+
+	{"poolfix",
+	"poolfix\n"
+	"\n"
+	"Fix the size of all pools: they don't use the heap anymore, so "
+	"it can't get fragmented. The last 1/16th of each pool is kept "
+	"for playback and recording: commands that need it fail with a "
+	"``memory budget exhausted'' error. It can't be undone."},
+
+	{"compact",
+	"compact\n"
+	"\n"
+	"Move the events of all tracks to consecutive memory, in time "
+	"order, so playback and editing access memory sequentially. "
+	"This is done when a song is loaded; it may be worth running "
+	"after long editing sessions. Undo data is kept."},
+
+	{"prof",
+	"prof\n"
+	"\n"
+	"Print the time spent by the sequencer on each tick: the number "
+	"of ticks, the number of ticks that took longer than the tick "
+	"period, the number of cycles per microsecond, then the average "
+	"and maximum number of cycles per tick of the whole tick, of each "
+	"stage (meta track, metronome, streamed file, recording, skip to "
+	"the next tick and device flush), the average and maximum number "
+	"of bytes sent to devices per tick, and the number of cycles of "
+	"each track."},
+
+	{"profclr",
+	"profclr\n"
+	"\n"
+	"Clear the counters displayed by prof."},
+
 	{"shut",
 	"shut\n"
 	"\n"
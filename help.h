@@ -22,7 +22,7 @@ struct help {
 	char *text;
 };
 
-extern struct help help_list[];
+extern const struct help help_list[];
 
 void help_fmt(char *);
 
@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * LZSS compression of song files. The stream is a sequence of groups
+ * of up to 8 items, each group starts with a byte of flags, one bit
+ * per item, least significant bit first. An item whose bit is clear
+ * is a literal byte, otherwise it's a match: two bytes containing
+ * the distance minus 1 (12 bits) and the length minus LZ_MINLEN
+ * (4 bits) of a string to copy from the bytes already decompressed.
+ *
+ * Tabs, keywords and whole lines repeat a lot in song files, so
+ * even this simple scheme reduces them several times. Decoding
+ * needs only the window, so files are read as a stream
+ */
+
+#include <string.h>
+#include "utils.h"
+#include "lz.h"
+
+#define LZ_DEPTH	16	/* max candidates tried per match */
+#define LZ_WINMASK	(LZ_WINSZ - 1)
+#define LZ_RINGMASK	(LZ_RINGSZ - 1)
+
+void
+lzenc_init(struct lzenc *o)
+{
+	o->pos = o->cur = o->ins = 0;
+	memset(o->head, 0, sizeof(o->head));
+	o->glen = o->gbits = 0;
+}
+
+/*
+ * return the hash of the string at the given position
+ */
+unsigned
+lzenc_hash(struct lzenc *o, unsigned long p)
+{
+	unsigned h;
+
+	h = o->ring[p & LZ_RINGMASK];
+	h = (h << 5) ^ o->ring[(p + 1) & LZ_RINGMASK];
+	h = (h << 5) ^ o->ring[(p + 2) & LZ_RINGMASK];
+	return (h ^ (h >> 10)) & (LZ_HASHSZ - 1);
+}
+
+/*
+ * add the string at the given position to the hash table
+ */
+void
+lzenc_insert(struct lzenc *o, unsigned long p)
+{
+	unsigned h;
+	unsigned long last;
+
+	h = lzenc_hash(o, p);
+	last = o->head[h];
+	o->prev[p & LZ_WINMASK] =
+	    (last > 0 && p - (last - 1) < LZ_WINSZ) ? p - (last - 1) : 0;
+	o->head[h] = p + 1;
+}
+
+/*
+ * add an item to the current group, and move the group to the
+ * output once complete. Return the number of bytes written
+ */
+unsigned
+lzenc_item(struct lzenc *o, unsigned ismatch, unsigned char *data,
+    unsigned len, unsigned char *out)
+{
+	if (o->gbits == 0) {
+		o->grp[0] = 0;
+		o->glen = 1;
+	}
+	if (ismatch)
+		o->grp[0] |= 1 << o->gbits;
+	memcpy(o->grp + o->glen, data, len);
+	o->glen += len;
+	if (++o->gbits < 8)
+		return 0;
+	memcpy(out, o->grp, o->glen);
+	o->gbits = 0;
+	return o->glen;
+}
+
+/*
+ * compress the given bytes, and store the result in the given
+ * buffer of at least LZ_OUTSZ(len) bytes. Return the number of bytes
+ * stored
+ */
+unsigned
+lzenc_put(struct lzenc *o, unsigned char *in, unsigned len,
+    unsigned char *out)
+{
+	unsigned char code[2];
+	unsigned long end, cand;
+	unsigned n, i, max, bestlen, bestoff, depth, d, used;
+
+	used = 0;
+	while (len > 0) {
+		/*
+		 * append as many bytes as fit in the ring without
+		 * overwriting the window
+		 */
+		n = LZ_RINGSZ - LZ_WINSZ;
+		if (n > len)
+			n = len;
+		for (i = 0; i < n; i++)
+			o->ring[(o->pos + i) & LZ_RINGMASK] = in[i];
+		o->pos += n;
+		in += n;
+		len -= n;
+		end = o->pos;
+		while (o->cur < end) {
+			while (o->ins < o->cur && o->ins + LZ_MINLEN <= end)
+				lzenc_insert(o, o->ins++);
+			max = end - o->cur;
+			if (max > LZ_MAXLEN)
+				max = LZ_MAXLEN;
+			bestlen = bestoff = 0;
+			if (max >= LZ_MINLEN && o->ins == o->cur) {
+				cand = o->head[lzenc_hash(o, o->cur)];
+				depth = LZ_DEPTH;
+				while (cand > 0 && o->cur - (cand - 1) <= LZ_WINSZ &&
+				    depth-- > 0) {
+					cand--;
+					for (i = 0; i < max; i++) {
+						if (o->ring[(cand + i) & LZ_RINGMASK] !=
+						    o->ring[(o->cur + i) & LZ_RINGMASK])
+							break;
+					}
+					if (i > bestlen) {
+						bestlen = i;
+						bestoff = o->cur - cand;
+						if (i == max)
+							break;
+					}
+					d = o->prev[cand & LZ_WINMASK];
+					if (d == 0)
+						break;
+					cand = cand - d + 1;
+				}
+			}
+			if (bestlen >= LZ_MINLEN) {
+				code[0] = (bestoff - 1) >> 4;
+				code[1] = ((bestoff - 1) & 0xf) << 4 |
+				    (bestlen - LZ_MINLEN);
+				used += lzenc_item(o, 1, code, 2, out + used);
+				o->cur += bestlen;
+			} else {
+				code[0] = o->ring[o->cur & LZ_RINGMASK];
+				used += lzenc_item(o, 0, code, 1, out + used);
+				o->cur++;
+			}
+		}
+	}
+	return used;
+}
+
+/*
+ * store the incomplete group, if any, in the given buffer of at
+ * least LZ_OUTSZ(0) bytes, and return the number of bytes stored
+ */
+unsigned
+lzenc_end(struct lzenc *o, unsigned char *out)
+{
+	unsigned used;
+
+	if (o->gbits == 0)
+		return 0;
+	memcpy(out, o->grp, o->glen);
+	used = o->glen;
+	o->gbits = 0;
+	return used;
+}
+
+void
+lzdec_init(struct lzdec *o)
+{
+	o->pos = 0;
+	o->nflags = 0;
+	o->len = 0;
+}
+
+/*
+ * return the next decompressed byte, EOF at the end of the file, or
+ * -2 if the data is corrupted
+ */
+int
+lzdec_getc(struct lzdec *o, FILE *f)
+{
+	int c, c1;
+
+	if (o->len == 0) {
+		if (o->nflags == 0) {
+			c = fgetc(f);
+			if (c == EOF)
+				return EOF;
+			o->flags = c;
+			o->nflags = 8;
+		}
+		c = fgetc(f);
+		if (c == EOF)
+			return EOF;
+		o->nflags--;
+		if (!(o->flags & 1)) {
+			o->flags >>= 1;
+			o->ring[o->pos++ & LZ_WINMASK] = c;
+			return c;
+		}
+		o->flags >>= 1;
+		c1 = fgetc(f);
+		if (c1 == EOF)
+			return -2;
+		o->off = ((c << 4) | (c1 >> 4)) + 1;
+		o->len = (c1 & 0xf) + LZ_MINLEN;
+		if (o->off > o->pos)
+			return -2;
+	}
+	c = o->ring[(o->pos - o->off) & LZ_WINMASK];
+	o->ring[o->pos++ & LZ_WINMASK] = c;
+	o->len--;
+	return c;
+}
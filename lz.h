@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MIDISH_LZ_H
+#define MIDISH_LZ_H
+
+#include <stdio.h>
+
+/*
+ * the window size is the max distance of a match, the ring holds the
+ * window and the input being compressed
+ */
+#define LZ_WINSZ	4096
+#define LZ_RINGSZ	(2 * LZ_WINSZ)
+#define LZ_HASHSZ	1024
+#define LZ_MINLEN	3
+#define LZ_MAXLEN	(LZ_MINLEN + 15)
+
+/*
+ * max number of bytes generated by compressing the given number of
+ * bytes: each byte may become a literal, with one flag byte every 8
+ * literals, plus the partial group of the previous call
+ */
+#define LZ_OUTSZ(n)	((n) + (n) / 8 + 2 * (1 + 2 * 8))
+
+struct lzenc {
+	unsigned long pos;		/* bytes stored in the ring */
+	unsigned long cur;		/* bytes compressed so far */
+	unsigned long ins;		/* bytes in the hash table */
+	unsigned long head[LZ_HASHSZ];	/* last position + 1, per hash */
+	unsigned short prev[LZ_WINSZ];	/* distance to previous position */
+	unsigned char ring[LZ_RINGSZ];
+	unsigned char grp[1 + 2 * 8];	/* group being built */
+	unsigned glen, gbits;		/* bytes and items in the group */
+};
+
+struct lzdec {
+	unsigned long pos;		/* bytes decompressed so far */
+	unsigned flags, nflags;		/* items left in the group */
+	unsigned off, len;		/* match being copied */
+	unsigned char ring[LZ_WINSZ];
+};
+
+void lzenc_init(struct lzenc *);
+unsigned lzenc_put(struct lzenc *, unsigned char *, unsigned, unsigned char *);
+unsigned lzenc_end(struct lzenc *, unsigned char *);
+void lzdec_init(struct lzdec *);
+int lzdec_getc(struct lzdec *, FILE *);
+
+#endif /* MIDISH_LZ_H */
@@ -45,6 +45,20 @@
 #include "exec.h"
 #include "tty.h"
 #include "utils.h"
+#include "mdep_desp.h"
+#include "song.h"
+#include "saveload.h"
+#include "sim.h"
+#include "work.h"
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#else
+#include <sys/mman.h>
+#endif
 
 #define TIMER_USEC	1000
 
@@ -56,11 +70,128 @@
 #define RC_DIR		"/etc"
 #endif
 
+/*
+ * suffix of the snapshot of the startup script
+ */
+#ifndef RC_IMGSUFFIX
+#define RC_IMGSUFFIX	".img"
+#endif
+
 #define MIDI_BUFSIZE	1024
 #define MAXFDS		(DEFAULT_MAXNDEVS + 1)
 
 volatile sig_atomic_t cons_quit = 0, resize_flag = 0, cont_flag = 0;
 struct timespec ts, ts_last;
+unsigned long clk_last;
+
+/*
+ * period of the hardware timer driving the clock, in microseconds.
+ * May be changed before the mux is opened
+ */
+#ifndef MDEP_TICKUSEC
+#define MDEP_TICKUSEC	250
+#endif
+unsigned mdep_tickusec = MDEP_TICKUSEC;
+
+#ifdef ESP_PLATFORM
+/*
+ * on dual-core chips the clock and MIDI input are handled by a
+ * separate high priority task pinned to MDEP_RTCORE, while the
+ * interpreter runs in the task that called user_mainloop()
+ */
+#if !defined(CONFIG_FREERTOS_UNICORE) && !defined(MDEP_RTCORE)
+#define MDEP_RTCORE	0
+#endif
+#ifndef MDEP_RTPRIO
+#define MDEP_RTPRIO	(configMAX_PRIORITIES - 2)
+#endif
+#define MDEP_RTSTACK	4096
+
+/*
+ * max time the interpreter sleeps before rechecking its loop
+ * condition, in milliseconds
+ */
+#define MDEP_WAITMS	10
+
+/*
+ * max time the clock is not updated while idle, in microseconds;
+ * must be below the 1s gap mdep_clkadv() ignores
+ */
+#define MDEP_IDLEUSEC	500000
+
+esp_timer_handle_t mdep_timer = NULL;
+unsigned mdep_tickless = 0;		/* timer is single shot */
+TaskHandle_t mdep_task = NULL, mdep_rttask = NULL;
+
+/*
+ * big lock protecting all midish structures shared by the two
+ * tasks. The interpreter holds it all the time, except while
+ * sleeping in mux_mdep_wait() and while running long operations,
+ * see work_detach(). It's recursive because the realtime task
+ * takes it again through work_lock() when it uses pools meanwhile
+ */
+SemaphoreHandle_t mdep_rtlock = NULL;
+#endif
+
+void mdep_rtpoll(void);
+
+/*
+ * console input ring: filled by the console receive callback, drained
+ * by mux_mdep_wait(), so a half-typed command never stalls the clock.
+ * Same single-producer, single-consumer scheme as the desp ring.
+ */
+#define CONS_RXBUFSZ	256
+
+struct cons_rx {
+	unsigned head, tail;
+	unsigned char data[CONS_RXBUFSZ];
+} cons_rx;
+
+/*
+ * queue console input, called by the producer. Never blocks, bytes
+ * that don't fit are dropped. Return the number of bytes stored.
+ */
+size_t
+mdep_cons_rxput(const char *buf, size_t count)
+{
+	unsigned head, tail;
+	size_t n;
+
+	head = cons_rx.head;
+	tail = __atomic_load_n(&cons_rx.tail, __ATOMIC_ACQUIRE);
+	for (n = 0; n < count && head - tail < CONS_RXBUFSZ; n++)
+		cons_rx.data[head++ & (CONS_RXBUFSZ - 1)] = buf[n];
+	__atomic_store_n(&cons_rx.head, head, __ATOMIC_RELEASE);
+	if (n > 0)
+		mdep_conswakeup();
+	return n;
+}
+
+/*
+ * return 1 if there's queued console input
+ */
+unsigned
+mdep_cons_rxpending(void)
+{
+	return __atomic_load_n(&cons_rx.head, __ATOMIC_ACQUIRE) != cons_rx.tail;
+}
+
+/*
+ * move queued console input to the given buffer, never blocks.
+ * Return the number of bytes moved
+ */
+unsigned
+mdep_cons_rxget(unsigned char *buf, unsigned count)
+{
+	unsigned head, tail, n;
+
+	head = __atomic_load_n(&cons_rx.head, __ATOMIC_ACQUIRE);
+	tail = cons_rx.tail;
+	for (n = 0; n < count && tail != head; n++)
+		buf[n] = cons_rx.data[tail++ & (CONS_RXBUFSZ - 1)];
+	__atomic_store_n(&cons_rx.tail, tail, __ATOMIC_RELEASE);
+	return n;
+}
 
 int cons_eof, cons_isatty;
 
@@ -106,12 +237,170 @@ mdep_sigcont(int s)
 	cont_flag = 1;
 }
 
+#ifdef ESP_PLATFORM
+/*
+ * wake up the given task, may be called from interrupt context
+ */
+void
+mdep_notify(TaskHandle_t task)
+{
+	BaseType_t woken = pdFALSE;
+
+	if (task == NULL)
+		return;
+	if (xPortInIsrContext()) {
+		vTaskNotifyGiveFromISR(task, &woken);
+		if (woken)
+			portYIELD_FROM_ISR();
+	} else
+		xTaskNotifyGive(task);
+}
+#endif
+
+/*
+ * wake up the task handling the clock and MIDI input, may be called
+ * from interrupt context
+ */
+void
+mdep_wakeup(void)
+{
+#ifdef ESP_PLATFORM
+	mdep_notify(mdep_rttask != NULL ? mdep_rttask : mdep_task);
+#endif
+}
+
+/*
+ * wake up the interpreter, because new console input is available
+ */
+void
+mdep_conswakeup(void)
+{
+#ifdef ESP_PLATFORM
+	mdep_notify(mdep_task);
+#endif
+}
+
+#ifdef ESP_PLATFORM
+/*
+ * periodic timer callback, runs in the esp_timer task: the clock
+ * itself is updated by mdep_rtpoll(), here we only wake it up. Send
+ * transmit queue bytes that became due, so output with lookahead
+ * keeps its timing even if the realtime task is held up
+ */
+void
+mdep_tickcb(void *arg)
+{
+	mdep_desp_txkick();
+	mdep_wakeup();
+}
+
+/*
+ * if the clock doesn't need to be updated periodically, replace the
+ * periodic timer by a single shot one, expiring when the next
+ * timeout is due, so the chip can sleep meanwhile. Called each time
+ * the clock is updated or something may have been started. The
+ * interpreter is woken up when the mode changes, since it sleeps
+ * longer while the timer is single shot
+ */
+void
+mdep_settimer(void)
+{
+	unsigned delta;
+	unsigned long usec;
+
+	if (mdep_timer == NULL)
+		return;
+	if (!mux_idle(&delta) || mdep_desp_txbusy() ||
+	    blemidi_busy() || rtpmidi_busy()) {
+		if (mdep_tickless) {
+			esp_timer_stop(mdep_timer);
+			esp_timer_start_periodic(mdep_timer, mdep_tickusec);
+			mdep_tickless = 0;
+			mdep_notify(mdep_task);
+		}
+		return;
+	}
+	usec = delta / 24 + 1;
+	if (usec > MDEP_IDLEUSEC)
+		usec = MDEP_IDLEUSEC;
+	if (usec < mdep_tickusec)
+		usec = mdep_tickusec;
+	esp_timer_stop(mdep_timer);
+	esp_timer_start_once(mdep_timer, usec);
+	if (!mdep_tickless) {
+		mdep_tickless = 1;
+		mdep_notify(mdep_task);
+	}
+}
+#endif
+
+#ifdef MDEP_RTCORE
+/*
+ * realtime task: each time it's woken up, by the timer or by the
+ * receive ring, update the clock and process MIDI input
+ */
+void
+mdep_rtloop(void *arg)
+{
+	for (;;) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		xSemaphoreTakeRecursive(mdep_rtlock, portMAX_DELAY);
+		mdep_rtpoll();
+		xSemaphoreGiveRecursive(mdep_rtlock);
+	}
+}
+
+/*
+ * start the realtime task, called by the interpreter the first
+ * time the mux is opened. The task is never stopped, when the mux
+ * is closed it has nothing to do.
+ */
+void
+mdep_rtstart(void)
+{
+	mdep_rtlock = xSemaphoreCreateRecursiveMutex();
+	if (mdep_rtlock == NULL) {
+		log_puts("mdep_rtstart: couldn't create lock\n");
+		panic();
+	}
+	xSemaphoreTakeRecursive(mdep_rtlock, portMAX_DELAY);
+	if (xTaskCreatePinnedToCore(mdep_rtloop, "midish_rt", MDEP_RTSTACK,
+		NULL, MDEP_RTPRIO, &mdep_rttask, MDEP_RTCORE) != pdPASS) {
+		log_puts("mdep_rtstart: couldn't create task\n");
+		panic();
+	}
+}
+#endif
+
 /*
  * start the mux, must be called just after devices are opened
  */
 void
 mux_mdep_open(void)
 {
+#ifdef ESP_PLATFORM
+	esp_timer_create_args_t args = {
+		.callback = mdep_tickcb,
+		.arg = NULL,
+		.dispatch_method = ESP_TIMER_TASK,
+		.name = "midish"
+	};
+
+	mdep_task = xTaskGetCurrentTaskHandle();
+#ifdef MDEP_RTCORE
+	if (mdep_rttask == NULL)
+		mdep_rtstart();
+#endif
+	if (esp_timer_create(&args, &mdep_timer) != ESP_OK) {
+		log_puts("mux_mdep_open: esp_timer_create failed\n");
+		panic();
+	}
+	if (esp_timer_start_periodic(mdep_timer, mdep_tickusec) != ESP_OK) {
+		log_puts("mux_mdep_open: esp_timer_start_periodic failed\n");
+		panic();
+	}
+#endif
+	clk_last = mdep_desp_clock();
   /*
 	static struct sigaction sa;
 	struct itimerval it;
@@ -151,6 +440,14 @@ mux_mdep_open(void)
 void
 mux_mdep_close(void)
 {
+#ifdef ESP_PLATFORM
+	if (mdep_timer != NULL) {
+		esp_timer_stop(mdep_timer);
+		esp_timer_delete(mdep_timer);
+		mdep_timer = NULL;
+		mdep_tickless = 0;
+	}
+#endif
   /*
 	struct itimerval it;
 
@@ -165,6 +462,92 @@ mux_mdep_close(void)
   */
 }
 
+/*
+ * move the clock forward to the given time (in microseconds, as
+ * returned by mdep_desp_clock()), and run the timer callbacks
+ */
+void
+mdep_clkadv(unsigned long now)
+{
+	long delta_usec;
+
+	if (!mux_isopen)
+		return;
+
+	/*
+	 * number of micro-seconds between now and the last update.
+	 * Input bytes may be stamped before the last update, in
+	 * which case this value is negative
+	 */
+	delta_usec = now - clk_last;
+	if (delta_usec > 0) {
+		clk_last = now;
+		mididev_ostamp = now;
+		if (delta_usec < 1000000L) {
+			/*
+			 * update the current position,
+			 * (time unit = 24th of microsecond)
+			 */
+			mux_timercb(24 * delta_usec);
+		} else {
+			/*
+			 * delta is too large (eg. the program was
+			 * suspended and then resumed), just ignore it
+			 */
+		}
+	}
+}
+
+/*
+ * update the clock and process pending input of MIDI devices,
+ * stopping at each arrival time to update the clock
+ */
+void
+mdep_rtpoll(void)
+{
+	struct mididev *dev;
+	unsigned char midibuf[MIDI_BUFSIZE];
+	unsigned long stamp;
+	unsigned res, nread, rt;
+
+	/*
+	 * nothing here may block on the console: traces are kept in
+	 * the log buffer and the position is printed later
+	 */
+	rt = log_rt;
+	log_rt = 1;
+	while (mdep_desp_rxstamp(&stamp)) {
+		mdep_clkadv(stamp);
+		mididev_istamp = stamp;
+		nread = 0;
+		for (dev = mididev_list; dev != NULL; dev = dev->next) {
+			if (!(dev->mode & MIDIDEV_MODE_IN) || dev->eof)
+				continue;
+			res = dev->ops->read(dev, midibuf, MIDI_BUFSIZE);
+			if (dev->eof) {
+				mux_errorcb(dev->unit);
+				continue;
+			}
+			if (res == 0)
+				continue;
+			dev->ilast = timo_abstime;
+			mididev_inputcb(dev, midibuf, res);
+			nread += res;
+		}
+		if (nread == 0)
+			break;
+	}
+	blemidi_poll();
+	mdep_clkadv(mdep_desp_clock());
+	usbmidi_poll();
+	rtpmidi_poll();
+	mdep_desp_txkick();
+#ifdef ESP_PLATFORM
+	mdep_settimer();
+#endif
+	log_rt = rt;
+}
+
 /*
  * wait until an input device becomes readable or
  * until the next clock tick. Then process all events.
@@ -179,8 +562,50 @@ mux_mdep_wait(int docons)
 	struct pollfd *pfd, *tty_pfds, pfds[MAXFDS];
 	struct mididev *dev;
 	unsigned char midibuf[MIDI_BUFSIZE];
-	long long delta_nsec;
+#ifdef ESP_PLATFORM
+#ifdef MDEP_RTCORE
+	char *logbuf;
+	size_t loglen;
+#else
+	unsigned long stamp;
+#endif
+#endif
 
+	if (sim_active)
+		return sim_wait();
+#ifdef ESP_PLATFORM
+	if (mdep_task == NULL)
+		mdep_task = xTaskGetCurrentTaskHandle();
+	mdep_settimer();
+#ifdef MDEP_RTCORE
+	/*
+	 * release the lock and sleep until console input is
+	 * available, or for a short time, so callers waiting for
+	 * realtime state changes can recheck it. While the clock is
+	 * idle, nothing changes until we're woken up. Traces are written
+	 * without the lock, so a slow console doesn't stall the
+	 * realtime task, which meanwhile logs in the other buffer
+	 */
+	if (mdep_rttask != NULL && !(docons && mdep_cons_rxpending())) {
+		cons_flush();
+		loglen = log_take(&logbuf);
+		xSemaphoreGiveRecursive(mdep_rtlock);
+		if (loglen > 0)
+			tty_write(logbuf, loglen);
+		ulTaskNotifyTake(pdTRUE, mdep_tickless ?
+		    portMAX_DELAY : pdMS_TO_TICKS(MDEP_WAITMS));
+		xSemaphoreTakeRecursive(mdep_rtlock, portMAX_DELAY);
+	} else if (mdep_rttask == NULL && !(docons && mdep_cons_rxpending()))
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(MDEP_WAITMS));
+#else
+	/*
+	 * sleep until either the next timer tick or until one
+	 * of the receive rings gets new bytes
+	 */
+	if (!mdep_desp_rxstamp(&stamp) && !(docons && mdep_cons_rxpending()))
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#endif
+#endif
 /*
 	nfds = 0;
 	if (docons && !cons_eof) {
@@ -237,9 +662,7 @@ mux_mdep_wait(int docons)
 					mux_errorcb(dev->unit);
 					continue;
 				}
-				if (dev->isensto > 0) {
-					dev->isensto = MIDIDEV_ISENSTO;
-				}
+				dev->ilast = timo_abstime;
 				mididev_inputcb(dev, midibuf, res);
 			}
 			if (revents & POLLHUP) {
@@ -248,61 +671,107 @@ mux_mdep_wait(int docons)
 			}
 		}
 	}*/
-	if (mux_isopen) {
-		if (clock_gettime(CLOCK_REALTIME, &ts) < 0) {
-			log_perror("mux_mdep_wait: clock_gettime");
-			panic();
+#ifdef MDEP_RTCORE
+	/*
+	 * the realtime task handles the clock and MIDI input;
+	 * let it run while we sleep
+	 */
+#else
+	mdep_rtpoll();
+#endif
+	cons_flush();
+	log_flush();
+	if (docons && !cons_eof) {
+#ifdef ESP_PLATFORM
+		/*
+		 * never block here: just consume what the console
+		 * receive callback has queued so far
+		 */
+		res = mdep_cons_rxget(midibuf, MIDI_BUFSIZE);
+#else
+		res = read(STDIN_FILENO, midibuf, MIDI_BUFSIZE);
+		if (res < 0) {
+			cons_eof = 1;
+			log_perror("stdin");
+		} else if (res == 0) {
+			cons_eof = 1;
+			user_onchar(NULL, -1);
 		}
-
-		 // number of micro-seconds between now and the last
-		 // time we called poll(). Warning: because of system
-		 // clock changes this value can be negative.
-		delta_nsec = 1000000000LL * (ts.tv_sec - ts_last.tv_sec);
-		delta_nsec += ts.tv_nsec - ts_last.tv_nsec;
-		if (delta_nsec > 0) {
-			ts_last = ts;
-			if (delta_nsec < 1000000000LL) {
-				 // update the current position,
-				 // (time unit = 24th of microsecond)
-				mux_timercb(24 * delta_nsec / 1000);
-			} else {
-				// delta is too large (eg. the program was
-				// suspended and then resumed), just ignore it
-				//log_puts("ignored huge clock delta\n");
-			}
+#endif
+		if (res > 0) {
+			for (i = 0; i < res; i++)
+				user_onchar(NULL, midibuf[i]);
 		}
 	}
-	log_flush();
-  /*
-	if (tty_pfds) {
-    LOG_PUTC('.');
-		if (cons_isatty) {
-			revents = tty_revents(tty_pfds);
-			if (revents & POLLHUP)
-				cons_eof = 1;
-		} else {
-			if (tty_pfds->revents & POLLIN) {*/
-				//res = read(STDIN_FILENO, midibuf, MIDI_BUFSIZE);
-        res = read(STDIN_FILENO, midibuf, MIDI_BUFSIZE);
-        
-				/*if (res < 0) {
-					cons_eof = 1;
-					log_perror("stdin");
-				} else if (res == 0) {
-					cons_eof = 1;
-					user_onchar(NULL, -1);
-				} else*/ 
-        if(res>0){
-					for (i = 0; i < res; i++)
-						user_onchar(NULL, midibuf[i]);
-				}
-        /*
-			}
-		}
-	}*/
 	return 1;
 }
 
+/*
+ * let the clock and MIDI input be processed during a long operation
+ * (eg. loading a song while another one is playing). Must be called
+ * only where midish structures are consistent
+ */
+void
+mux_mdep_yield(void)
+{
+#ifdef MDEP_RTCORE
+	if (mdep_rttask != NULL && !work_active) {
+		xSemaphoreGiveRecursive(mdep_rtlock);
+		taskYIELD();
+		xSemaphoreTakeRecursive(mdep_rtlock, portMAX_DELAY);
+	}
+#else
+	mdep_rtpoll();
+#endif
+}
+
+/*
+ * let the realtime task run during a blocking call that doesn't
+ * use midish structures (eg. writing a block to a slow file
+ * system). Calls must be paired with mux_mdep_lock(). Nothing
+ * to do if the interpreter already runs without the lock, see
+ * work_detach()
+ */
+void
+mux_mdep_unlock(void)
+{
+#ifdef MDEP_RTCORE
+	if (mdep_rttask != NULL && !work_active)
+		xSemaphoreGiveRecursive(mdep_rtlock);
+#endif
+}
+
+void
+mux_mdep_lock(void)
+{
+#ifdef MDEP_RTCORE
+	if (mdep_rttask != NULL && !work_active)
+		xSemaphoreTakeRecursive(mdep_rtlock, portMAX_DELAY);
+#endif
+}
+
+/*
+ * take and release the lock unconditionally, used by work_lock() and
+ * work_detach(). Calls must be paired
+ */
+void
+mux_mdep_take(void)
+{
+#ifdef MDEP_RTCORE
+	if (mdep_rttask != NULL)
+		xSemaphoreTakeRecursive(mdep_rtlock, portMAX_DELAY);
+#endif
+}
+
+void
+mux_mdep_give(void)
+{
+#ifdef MDEP_RTCORE
+	if (mdep_rttask != NULL)
+		xSemaphoreGiveRecursive(mdep_rtlock);
+#endif
+}
+
 /*
  * sleep for 'millisecs' milliseconds useful when sending system
  * exclusive messages
@@ -315,6 +784,10 @@ mux_sleep(unsigned millisecs)
 	int res, delta_msec;
 	struct timespec ts;
 
+	if (sim_active) {
+		sim_sleep(millisecs);
+		return;
+	}
 	if (clock_gettime(CLOCK_REALTIME, &ts_last) < 0) {
 		log_perror("mux_sleep: clock_gettime");
 		exit(1);
@@ -418,6 +891,35 @@ cons_done(void)
   */
 }
 
+/*
+ * run the given startup script, or restore its snapshot if it's not
+ * older than the script. The snapshot is used even if the script
+ * doesn't exist. Return -1 if there's neither
+ */
+int
+exec_runrc(struct exec *o, char *name)
+{
+	char img[PATH_MAX];
+	struct stat st, imgst;
+	int haverc;
+
+	haverc = (stat(name, &st) == 0);
+	snprintf(img, PATH_MAX, "%s" RC_IMGSUFFIX, name);
+	if (stat(img, &imgst) == 0 &&
+	    (!haverc || imgst.st_mtime >= st.st_mtime)) {
+		if (exec_restore(o, usong, img))
+			return 1;
+		song_done(usong);
+		song_init(usong);
+		if (!haverc)
+			return 0;
+		cons_errs(img, "couldn't restore snapshot, running script");
+	}
+	if (!haverc)
+		return -1;
+	return exec_runfile(o, name);
+}
+
 /*
  * start $HOME/.midishrc script, if it doesn't exist then
  * try /etc/midishrc
@@ -427,21 +929,111 @@ exec_runrcfile(struct exec *o)
 {
 	char *home;
 	char name[PATH_MAX];
-	struct stat st;
+	int res;
 
 	home = getenv("HOME");
 	if (home != NULL) {
 		snprintf(name, PATH_MAX, "%s" "/" "." RC_NAME, home);
-		if (stat(name, &st) == 0) {
-			return exec_runfile(o, name);
-		}
-	}
-	if (stat(RC_DIR "/" RC_NAME, &st) == 0) {
-		return exec_runfile(o, RC_DIR "/" RC_NAME);
+		res = exec_runrc(o, name);
+		if (res >= 0)
+			return res;
 	}
+	res = exec_runrc(o, RC_DIR "/" RC_NAME);
+	if (res >= 0)
+		return res;
 	return 1;
 }
 
+#ifdef ESP_PLATFORM
+struct mdep_map {
+	esp_partition_mmap_handle_t handle;
+};
+
+/*
+ * map read-only the data partition with the given label, so its
+ * contents can be read in place, see song_mapbin()
+ */
+struct mdep_map *
+mdep_map(char *name, unsigned char **addr, unsigned *len)
+{
+	const esp_partition_t *part;
+	struct mdep_map *m;
+	const void *ptr;
+
+	part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+	    ESP_PARTITION_SUBTYPE_ANY, name);
+	if (part == NULL) {
+		cons_errs(name, "no such partition");
+		return NULL;
+	}
+	m = xmalloc(sizeof(struct mdep_map), "mdep_map");
+	if (esp_partition_mmap(part, 0, part->size, ESP_PARTITION_MMAP_DATA,
+		&ptr, &m->handle) != ESP_OK) {
+		cons_errs(name, "failed to map partition");
+		xfree(m);
+		return NULL;
+	}
+	*addr = (unsigned char *)ptr;
+	*len = part->size;
+	return m;
+}
+
+void
+mdep_unmap(struct mdep_map *m)
+{
+	esp_partition_munmap(m->handle);
+	xfree(m);
+}
+#else
+struct mdep_map {
+	void *addr;
+	size_t len;
+};
+
+/*
+ * map read-only the given file, so its contents can be read in
+ * place, see song_mapbin()
+ */
+struct mdep_map *
+mdep_map(char *name, unsigned char **addr, unsigned *len)
+{
+	struct mdep_map *m;
+	struct stat sb;
+	void *ptr;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		cons_errs(name, "failed to open input file");
+		return NULL;
+	}
+	if (fstat(fd, &sb) < 0 || sb.st_size == 0 || sb.st_size > UINT_MAX) {
+		cons_errs(name, "bad image size");
+		close(fd);
+		return NULL;
+	}
+	ptr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) {
+		cons_errs(name, "failed to map file");
+		return NULL;
+	}
+	m = xmalloc(sizeof(struct mdep_map), "mdep_map");
+	m->addr = ptr;
+	m->len = sb.st_size;
+	*addr = ptr;
+	*len = sb.st_size;
+	return m;
+}
+
+void
+mdep_unmap(struct mdep_map *m)
+{
+	munmap(m->addr, m->len);
+	xfree(m);
+}
+#endif
+
 void
 user_oncompl_path(char *text, int *rstart, int *rend)
 {
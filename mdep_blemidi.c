@@ -0,0 +1,736 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Bluetooth LE MIDI device, created with the "ble" path, eg:
+ *
+ *	dnew 2 "ble" rw
+ *
+ * The BLE stack itself is driven by the sketch, which registers the
+ * notification routine with mdep_ble_register(), reports connections
+ * with mdep_ble_connect() and gives received packets to
+ * mdep_ble_rxput().
+ *
+ * Output: bytes written by mididev_flush() are packed into BLE-MIDI
+ * packets, each message is preceded by the low 7 bits of the 13-bit
+ * millisecond timestamp, the high 6 bits being in the packet header.
+ * The packet being built is sent once per connection interval (or
+ * once it's full), so a single notification carries all events of
+ * the interval.
+ *
+ * Input: events are delivered with the timing they were sent with
+ * rather than the timing packets arrived with. The offset between
+ * the sender clock and ours is the smallest transit delay observed
+ * recently; the jitter is the largest transit delay in excess of
+ * it. Each event is delivered at its sender time, plus the offset,
+ * plus the jitter (at most BLEMIDI_RXMAXDELAY). So events that
+ * waited for the next connection interval are moved back to their
+ * original position.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "utils.h"
+#include "cons.h"
+#include "mididev.h"
+#include "str.h"
+#include "mdep_desp.h"
+
+/*
+ * max size of a packet, the default ATT MTU allows only 20 bytes
+ * per notification
+ */
+#define BLEMIDI_PKTMAX	244
+#define BLEMIDI_MTUMIN	23
+
+/*
+ * number of packets in the receive ring and in the transmit queue,
+ * must be powers of two
+ */
+#define BLEMIDI_RXNPKT	8
+#define BLEMIDI_TXNPKT	8
+
+/*
+ * max delay added to input events to absorb the jitter, in
+ * microseconds
+ */
+#define BLEMIDI_RXMAXDELAY	30000
+
+/*
+ * length of the window in which the smallest transit delay and the
+ * jitter are measured, in microseconds. The values of the current
+ * and of the previous window are used, so clock drift is followed
+ */
+#define BLEMIDI_RXWIN	2000000
+
+/*
+ * timestamps are 13-bit millisecond counters
+ */
+#define BLEMIDI_TSMASK	0x1fff
+#define BLEMIDI_TSHALF	0x1000
+
+struct blemidi_pkt {
+	unsigned len;
+	unsigned long stamp;			/* arrival time */
+	unsigned char data[BLEMIDI_PKTMAX];
+};
+
+/*
+ * single-producer, single-consumer ring of packets, see desp_rx
+ */
+struct blemidi_ring {
+	unsigned head, tail;
+	struct blemidi_pkt pkt[BLEMIDI_RXNPKT];
+};
+
+/*
+ * milliseconds counter derived from mdep_desp_clock(), so it
+ * doesn't jump when the latter wraps
+ */
+struct blemidi_clk {
+	unsigned long stamp;			/* last update */
+	unsigned long rem;			/* microseconds not counted */
+	unsigned ms;				/* 13-bit counter */
+};
+
+struct blemidi {
+	struct mididev mididev;			/* device stuff */
+	unsigned connseq;			/* connection in use */
+
+	/*
+	 * output: the packet being built and the queue of packets
+	 * waiting to be sent
+	 */
+	struct blemidi_clk oclk;
+	unsigned char msg[3];			/* message being built */
+	unsigned mlen, mneed;			/* bytes in msg, needed */
+	unsigned insx;				/* within a sysex */
+	unsigned char obuf[BLEMIDI_PKTMAX];	/* packet being built */
+	unsigned olen;				/* bytes in obuf */
+	unsigned oms;				/* time obuf was started */
+	unsigned long olast;			/* last notification */
+	unsigned ohead, otail;
+	struct blemidi_pkt oq[BLEMIDI_TXNPKT];
+
+	/*
+	 * input: packet being parsed and the next run of bytes
+	 */
+	struct blemidi_clk iclk;
+	struct blemidi_pkt *ipkt;		/* packet being parsed */
+	unsigned ims;				/* its arrival time */
+	unsigned ipos;				/* next byte to parse */
+	unsigned ihi;				/* high bits of timestamps */
+	int ilo;				/* low bits, or -1 */
+	unsigned iafterts;			/* last byte is a timestamp */
+	unsigned char irun[BLEMIDI_PKTMAX];	/* bytes to deliver */
+	unsigned irunlen;			/* bytes in irun */
+	unsigned long irundue;			/* when to deliver them */
+	unsigned isync;				/* dmin[] is valid */
+	unsigned dmin[2];			/* smallest transit delay */
+	unsigned jmax[2];			/* largest jitter */
+	unsigned long dwin;			/* start of current window */
+	unsigned long ilastdue;			/* last delivery time */
+};
+
+/*
+ * routine to send a notification, set by the sketch
+ */
+bleNotifyDef blemidi_notify = NULL;
+
+/*
+ * connection state, set by the BLE stack: 'blemidi_mtu' is zero if
+ * there's no connection, 'blemidi_connseq' is incremented on each
+ * new connection
+ */
+volatile unsigned blemidi_mtu = 0;
+volatile unsigned long blemidi_intvl = 0;
+volatile unsigned blemidi_connseq = 0;
+
+/*
+ * number of packets dropped because the rings were full
+ */
+unsigned long blemidi_rxovf = 0;
+unsigned long blemidi_txovf = 0;
+
+struct blemidi_ring blemidi_rx;
+
+/*
+ * there's a single BLE-MIDI service, so only one device can use it
+ */
+struct blemidi *blemidi_dev = NULL;
+
+void	 blemidi_open(struct mididev *);
+unsigned blemidi_read(struct mididev *, unsigned char *, unsigned);
+unsigned blemidi_write(struct mididev *, unsigned char *, unsigned);
+unsigned blemidi_nfds(struct mididev *);
+unsigned blemidi_pollfd(struct mididev *, struct pollfd *, int);
+int	 blemidi_revents(struct mididev *, struct pollfd *);
+void	 blemidi_close(struct mididev *);
+void	 blemidi_del(struct mididev *);
+
+struct devops blemidi_ops = {
+	blemidi_open,
+	blemidi_read,
+	blemidi_write,
+	blemidi_nfds,
+	blemidi_pollfd,
+	blemidi_revents,
+	blemidi_close,
+	blemidi_del
+};
+
+/*
+ * register the routine sending notifications; it's called with at
+ * most MTU - 3 bytes and returns 0 if the packet couldn't be queued
+ */
+void
+mdep_ble_register(bleNotifyDef n)
+{
+	blemidi_notify = n;
+}
+
+/*
+ * called by the BLE stack when a central connects or when the MTU
+ * is changed. The connection interval is in microseconds
+ */
+void
+mdep_ble_connect(unsigned mtu, unsigned long intvl)
+{
+	if (blemidi_mtu == 0)
+		blemidi_connseq++;
+	blemidi_intvl = intvl;
+	blemidi_mtu = mtu < BLEMIDI_MTUMIN ? BLEMIDI_MTUMIN : mtu;
+}
+
+void
+mdep_ble_disconnect(void)
+{
+	blemidi_mtu = 0;
+}
+
+/*
+ * store a received packet in the ring, called by the BLE stack.
+ * Never blocks: packets that don't fit are dropped and counted.
+ * Return the number of bytes stored
+ */
+size_t
+mdep_ble_rxput(const unsigned char *buf, size_t count)
+{
+	struct blemidi_pkt *p;
+	unsigned head, tail;
+
+	if (blemidi_dev == NULL || count == 0)
+		return 0;
+	head = blemidi_rx.head;
+	tail = __atomic_load_n(&blemidi_rx.tail, __ATOMIC_ACQUIRE);
+	if (head - tail == BLEMIDI_RXNPKT || count > BLEMIDI_PKTMAX) {
+		blemidi_rxovf++;
+		return 0;
+	}
+	p = &blemidi_rx.pkt[head & (BLEMIDI_RXNPKT - 1)];
+	memcpy(p->data, buf, count);
+	p->len = count;
+	p->stamp = mdep_desp_clock();
+	__atomic_store_n(&blemidi_rx.head, head + 1, __ATOMIC_RELEASE);
+	mdep_wakeup();
+	return count;
+}
+
+/*
+ * reset the given clock to the given time
+ */
+void
+blemidi_clkinit(struct blemidi_clk *c, unsigned long stamp)
+{
+	c->stamp = stamp;
+	c->rem = 0;
+	c->ms = (stamp / 1000) & BLEMIDI_TSMASK;
+}
+
+/*
+ * return the 13-bit millisecond counter at the given time
+ */
+unsigned
+blemidi_clkms(struct blemidi_clk *c, unsigned long stamp)
+{
+	c->rem += stamp - c->stamp;
+	c->stamp = stamp;
+	c->ms = (c->ms + c->rem / 1000) & BLEMIDI_TSMASK;
+	c->rem %= 1000;
+	return c->ms;
+}
+
+/*
+ * reset the state of both directions, called when a new
+ * connection is detected
+ */
+void
+blemidi_reset(struct blemidi *dev)
+{
+	unsigned long now = mdep_desp_clock();
+
+	dev->connseq = blemidi_connseq;
+	blemidi_clkinit(&dev->oclk, now);
+	dev->mlen = 0;
+	dev->insx = 0;
+	dev->olen = 0;
+	dev->olast = now - blemidi_intvl;
+	dev->ohead = dev->otail = 0;
+	blemidi_clkinit(&dev->iclk, now);
+	dev->irunlen = 0;
+	dev->isync = 0;
+}
+
+struct mididev *
+blemidi_new(char *path, unsigned mode)
+{
+	struct blemidi *dev;
+
+	if (blemidi_dev != NULL) {
+		cons_err("ble midi port already in use");
+		return NULL;
+	}
+	dev = xmalloc(sizeof(struct blemidi), "blemidi");
+	mididev_init(&dev->mididev, &blemidi_ops, mode);
+
+	/*
+	 * running status is supported, but messages are delimited by
+	 * timestamps anyway, so it saves nothing
+	 */
+	dev->mididev.runst = 0;
+	dev->ipkt = NULL;
+	blemidi_reset(dev);
+	blemidi_dev = dev;
+	return (struct mididev *)&dev->mididev;
+}
+
+void
+blemidi_del(struct mididev *addr)
+{
+	struct blemidi *dev = (struct blemidi *)addr;
+
+	mididev_done(&dev->mididev);
+	if (blemidi_dev == dev)
+		blemidi_dev = NULL;
+	xfree(dev);
+}
+
+void
+blemidi_open(struct mididev *addr)
+{
+	struct blemidi *dev = (struct blemidi *)addr;
+
+	/*
+	 * discard packets received while the device was closed
+	 */
+	dev->ipkt = NULL;
+	__atomic_store_n(&blemidi_rx.tail,
+	    __atomic_load_n(&blemidi_rx.head, __ATOMIC_ACQUIRE),
+	    __ATOMIC_RELEASE);
+	blemidi_reset(dev);
+}
+
+void
+blemidi_close(struct mididev *addr)
+{
+}
+
+/*
+ * input is pushed by blemidi_poll()
+ */
+unsigned
+blemidi_read(struct mididev *addr, unsigned char *buf, unsigned count)
+{
+	return 0;
+}
+
+/*
+ * return the max number of bytes of a packet
+ */
+unsigned
+blemidi_pktmax(void)
+{
+	unsigned n = blemidi_mtu - 3;
+
+	return n > BLEMIDI_PKTMAX ? BLEMIDI_PKTMAX : n;
+}
+
+/*
+ * move the packet being built to the transmit queue. If the queue
+ * is full, the oldest packet is dropped
+ */
+void
+blemidi_endpkt(struct blemidi *dev)
+{
+	struct blemidi_pkt *p;
+
+	if (dev->olen == 0)
+		return;
+	if (dev->ohead - dev->otail == BLEMIDI_TXNPKT) {
+		blemidi_txovf++;
+		dev->otail++;
+	}
+	p = &dev->oq[dev->ohead & (BLEMIDI_TXNPKT - 1)];
+	memcpy(p->data, dev->obuf, dev->olen);
+	p->len = dev->olen;
+	dev->ohead++;
+	dev->olen = 0;
+}
+
+/*
+ * append the given bytes to the packet being built, preceded by a
+ * timestamp if 'ts' is set. Only sysex may be split across packets
+ */
+void
+blemidi_putbuf(struct blemidi *dev, unsigned char *buf, unsigned n,
+    unsigned ts, unsigned ms)
+{
+	unsigned max;
+
+	max = blemidi_pktmax();
+	for (;;) {
+		/*
+		 * start a new packet if this one is full or if its
+		 * timestamps would be ambiguous
+		 */
+		if (dev->olen > 0 &&
+		    (dev->olen + ts + 1 > max ||
+		    (!dev->insx && dev->olen + ts + n > max) ||
+		    ((ms - dev->oms) & BLEMIDI_TSMASK) >= 64))
+			blemidi_endpkt(dev);
+		if (dev->olen == 0) {
+			dev->obuf[dev->olen++] = 0x80 | ((ms >> 7) & 0x3f);
+			dev->oms = ms;
+		}
+		if (ts)
+			dev->obuf[dev->olen++] = 0x80 | (ms & 0x7f);
+		while (n > 0 && dev->olen < max) {
+			dev->obuf[dev->olen++] = *buf++;
+			n--;
+		}
+		if (n == 0)
+			break;
+		ts = 0;
+	}
+}
+
+/*
+ * convert a byte to BLE-MIDI
+ */
+void
+blemidi_putbyte(struct blemidi *dev, unsigned char c, unsigned ms)
+{
+	if (c >= 0xf8) {
+		blemidi_putbuf(dev, &c, 1, 1, ms);
+	} else if (c == 0xf0) {
+		dev->mlen = 0;
+		blemidi_putbuf(dev, &c, 1, 1, ms);
+		dev->insx = 1;
+	} else if (c == 0xf7) {
+		if (dev->insx)
+			blemidi_putbuf(dev, &c, 1, 1, ms);
+		dev->insx = 0;
+	} else if (c >= 0x80) {
+		dev->insx = 0;
+		dev->msg[0] = c;
+		dev->mlen = 1;
+		if (c < 0xf0)
+			dev->mneed = (c >= 0xc0 && c < 0xe0) ? 2 : 3;
+		else if (c == 0xf1 || c == 0xf3)
+			dev->mneed = 2;
+		else if (c == 0xf2)
+			dev->mneed = 3;
+		else
+			dev->mneed = 1;
+	} else if (dev->insx) {
+		blemidi_putbuf(dev, &c, 1, 0, ms);
+	} else if (dev->mlen > 0) {
+		dev->msg[dev->mlen++] = c;
+	}
+	if (dev->mlen > 0 && dev->mlen == dev->mneed) {
+		blemidi_putbuf(dev, dev->msg, dev->mlen, 1, ms);
+		dev->mlen = 0;
+	}
+}
+
+/*
+ * send queued packets. The packet being built is queued only once
+ * per connection interval, so it gets all events of the interval
+ */
+void
+blemidi_kick(struct blemidi *dev, unsigned long now)
+{
+	struct blemidi_pkt *p;
+
+	if (dev->olen > 0 && now - dev->olast >= blemidi_intvl)
+		blemidi_endpkt(dev);
+	while (dev->ohead != dev->otail) {
+		p = &dev->oq[dev->otail & (BLEMIDI_TXNPKT - 1)];
+		if (blemidi_notify == NULL ||
+		    !blemidi_notify(p->data, p->len))
+			break;
+		dev->olast = now;
+		dev->otail++;
+	}
+}
+
+/*
+ * convert bytes to BLE-MIDI and send them if the connection
+ * interval allows it. If there's no connection, data is discarded
+ */
+unsigned
+blemidi_write(struct mididev *addr, unsigned char *buf, unsigned count)
+{
+	struct blemidi *dev = (struct blemidi *)addr;
+	unsigned long now;
+	unsigned ms, n;
+
+	if (blemidi_mtu == 0)
+		return count;
+	if (dev->connseq != blemidi_connseq)
+		blemidi_reset(dev);
+	now = mdep_desp_clock();
+	ms = blemidi_clkms(&dev->oclk, now);
+	for (n = 0; n < count; n++)
+		blemidi_putbyte(dev, buf[n], ms);
+	blemidi_kick(dev, now);
+	return count;
+}
+
+unsigned
+blemidi_nfds(struct mididev *addr)
+{
+	return 0;
+}
+
+unsigned
+blemidi_pollfd(struct mididev *addr, struct pollfd *pfd, int events)
+{
+	return 0;
+}
+
+int
+blemidi_revents(struct mididev *addr, struct pollfd *pfd)
+{
+	return 0;
+}
+
+/*
+ * return 1 if the timestamp 'a' is before 'b'
+ */
+unsigned
+blemidi_tsbefore(unsigned a, unsigned b)
+{
+	return ((a - b) & BLEMIDI_TSMASK) >= BLEMIDI_TSHALF;
+}
+
+/*
+ * store in irun[] the next bytes of the current packet having the
+ * same timestamp, return 0 if the end of the packet is reached. The
+ * timestamp is stored in 'ms', or -1 if the bytes have none (ie.
+ * the packet starts with the continuation of a sysex)
+ */
+unsigned
+blemidi_getrun(struct blemidi *dev, int *ms)
+{
+	struct blemidi_pkt *p = dev->ipkt;
+	unsigned c;
+
+	dev->irunlen = 0;
+	while (dev->ipos < p->len) {
+		c = p->data[dev->ipos];
+		if ((c & 0x80) && !dev->iafterts) {
+			if (dev->irunlen > 0)
+				break;
+			c &= 0x7f;
+			if (dev->ilo >= 0 && c < dev->ilo)
+				dev->ihi = (dev->ihi + 1) & 0x3f;
+			dev->ilo = c;
+			dev->iafterts = 1;
+		} else {
+			dev->irun[dev->irunlen++] = c;
+			dev->iafterts = 0;
+		}
+		dev->ipos++;
+	}
+	*ms = dev->ilo < 0 ? -1 : (int)((dev->ihi << 7) | dev->ilo);
+	return dev->irunlen > 0;
+}
+
+/*
+ * return the smallest transit delay of the current and previous
+ * windows
+ */
+unsigned
+blemidi_dbest(struct blemidi *dev)
+{
+	return blemidi_tsbefore(dev->dmin[0], dev->dmin[1]) ?
+	    dev->dmin[0] : dev->dmin[1];
+}
+
+/*
+ * start parsing the given packet: update the smallest transit delay
+ * and the jitter with the timestamps of its messages
+ */
+void
+blemidi_startpkt(struct blemidi *dev, struct blemidi_pkt *p)
+{
+	unsigned d, dlo, dhi, j, timed;
+	int ms;
+
+	dev->ipkt = p;
+	dev->ims = blemidi_clkms(&dev->iclk, p->stamp);
+	if (p->len < 2 || (p->data[0] & 0xc0) != 0x80) {
+		dev->ipos = p->len;
+		return;
+	}
+	dev->ihi = p->data[0] & 0x3f;
+	dev->ilo = -1;
+	dev->ipos = 1;
+	dev->iafterts = 0;
+	dlo = dhi = 0;
+	timed = 0;
+	while (blemidi_getrun(dev, &ms)) {
+		if (ms < 0)
+			continue;
+		d = (dev->ims - ms) & BLEMIDI_TSMASK;
+		if (!timed || blemidi_tsbefore(d, dlo))
+			dlo = d;
+		if (!timed || blemidi_tsbefore(dhi, d))
+			dhi = d;
+		timed = 1;
+	}
+	if (timed) {
+		if (!dev->isync) {
+			dev->dmin[0] = dev->dmin[1] = dlo;
+			dev->jmax[0] = dev->jmax[1] = 0;
+			dev->dwin = p->stamp;
+			dev->ilastdue = p->stamp;
+			dev->isync = 1;
+		} else if (p->stamp - dev->dwin >= BLEMIDI_RXWIN) {
+			dev->dmin[0] = dev->dmin[1];
+			dev->dmin[1] = dlo;
+			dev->jmax[0] = dev->jmax[1];
+			dev->jmax[1] = 0;
+			dev->dwin = p->stamp;
+		} else if (blemidi_tsbefore(dlo, dev->dmin[1]))
+			dev->dmin[1] = dlo;
+		j = (dhi - blemidi_dbest(dev)) & BLEMIDI_TSMASK;
+		if (j < BLEMIDI_TSHALF && j > dev->jmax[1])
+			dev->jmax[1] = j;
+	}
+	dev->ihi = p->data[0] & 0x3f;
+	dev->ilo = -1;
+	dev->ipos = 1;
+	dev->iafterts = 0;
+	dev->irunlen = 0;
+}
+
+/*
+ * return the time the given message must be delivered at: messages
+ * are delayed by the largest jitter observed, and messages that
+ * took longer than others to arrive are delayed less
+ */
+unsigned long
+blemidi_due(struct blemidi *dev, int ms)
+{
+	unsigned long due, delay;
+	unsigned excess;
+
+	if (ms < 0 || !dev->isync)
+		return dev->ipkt->stamp;
+	excess = (((dev->ims - ms) & BLEMIDI_TSMASK) - blemidi_dbest(dev)) &
+	    BLEMIDI_TSMASK;
+	if (excess >= BLEMIDI_TSHALF)
+		excess = 0;
+	delay = (dev->jmax[0] > dev->jmax[1] ? dev->jmax[0] : dev->jmax[1]);
+	delay *= 1000;
+	if (delay > BLEMIDI_RXMAXDELAY)
+		delay = BLEMIDI_RXMAXDELAY;
+	due = dev->ipkt->stamp - excess * 1000 + delay;
+	if ((long)(due - dev->ilastdue) < 0)
+		due = dev->ilastdue;
+	dev->ilastdue = due;
+	return due;
+}
+
+/*
+ * return 1 if blemidi_poll() has received events to deliver later
+ * or output packets to send, so it must be called periodically
+ */
+unsigned
+blemidi_busy(void)
+{
+	struct blemidi *dev = blemidi_dev;
+
+	if (dev == NULL || dev->mididev.eof)
+		return 0;
+	return dev->ipkt != NULL || dev->irunlen > 0 ||
+	    dev->olen > 0 || dev->ohead != dev->otail;
+}
+
+/*
+ * deliver received events whose time is reached and send pending
+ * output packets, called by the realtime loop
+ */
+void
+blemidi_poll(void)
+{
+	struct blemidi *dev = blemidi_dev;
+	unsigned long now;
+	unsigned head;
+	int ms;
+
+	if (dev == NULL || dev->mididev.eof)
+		return;
+	now = mdep_desp_clock();
+	if (!(dev->mididev.mode & MIDIDEV_MODE_IN)) {
+		__atomic_store_n(&blemidi_rx.tail,
+		    __atomic_load_n(&blemidi_rx.head, __ATOMIC_ACQUIRE),
+		    __ATOMIC_RELEASE);
+		dev->ipkt = NULL;
+	}
+	for (;;) {
+		if (dev->irunlen == 0) {
+			if (dev->ipkt == NULL) {
+				head = __atomic_load_n(&blemidi_rx.head,
+				    __ATOMIC_ACQUIRE);
+				if (head == blemidi_rx.tail)
+					break;
+				if (dev->connseq != blemidi_connseq)
+					blemidi_reset(dev);
+				blemidi_startpkt(dev, &blemidi_rx.pkt[
+				    blemidi_rx.tail & (BLEMIDI_RXNPKT - 1)]);
+			}
+			if (!blemidi_getrun(dev, &ms)) {
+				dev->ipkt = NULL;
+				__atomic_store_n(&blemidi_rx.tail,
+				    blemidi_rx.tail + 1, __ATOMIC_RELEASE);
+				continue;
+			}
+			dev->irundue = blemidi_due(dev, ms);
+		}
+		if ((long)(dev->irundue - now) > 0)
+			break;
+		mdep_clkadv(dev->irundue);
+		dev->mididev.ilast = timo_abstime;
+		mididev_istamp = dev->ipkt->stamp;
+		mididev_inputcb(&dev->mididev, dev->irun, dev->irunlen);
+		dev->irunlen = 0;
+	}
+	if (blemidi_mtu > 0 && dev->connseq == blemidi_connseq)
+		blemidi_kick(dev, now);
+}
@@ -18,24 +18,354 @@
 #include <fcntl.h>
 #include "poll.h"
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifdef ESP_PLATFORM
+#include "esp_timer.h"
+#include "esp_cpu.h"
+#endif
 #include "utils.h"
 #include "cons.h"
 #include "mididev.h"
 #include "str.h"
 #include "mdep_desp.h"
+#include "sim.h"
 
 struct desp {
 	struct mididev mididev;		/* device stuff */
 	char *path;			/* eg. "/dev/rmidi3" */
 	int fd;				/* file desc. */
+	struct desp_port *port;		/* serial port of the device */
 };
 
-writeDef serial2write;
-readBytesDef serial2readBytes;
+/*
+ * single-producer, single-consumer ring of received bytes. The
+ * producer is the UART receive interrupt (or the UART event task), the
+ * consumer is mux_mdep_wait(). Each byte is stored together with the
+ * time it was received, so the consumer can move the clock to the
+ * exact arrival time before handing the byte to the parser.
+ *
+ * 'head' is only written by the producer and 'tail' only by the
+ * consumer; both are free running, their difference is the number of
+ * bytes in the ring.
+ */
+struct desp_rx {
+	unsigned head, tail;
+	unsigned char data[DESP_RXBUFSZ];
+	unsigned long stamp[DESP_RXBUFSZ];
+};
+
+/*
+ * number of bytes dropped because a ring was full
+ */
+unsigned long desp_rxovf = 0;
+
+/*
+ * transmit queue: desp_write() appends to it and returns at once;
+ * it's drained by mdep_desp_txkick(), as fast as the UART driver
+ * accepts data, each time the clock is updated. Each byte is stored
+ * with the time it's due at, so devices with lookahead can queue
+ * output ahead of time.
+ *
+ * Realtime messages (single bytes >= 0xf8) may be inserted anywhere
+ * in the MIDI stream, so they are stored in a separate ring and sent
+ * ahead of the queue, by a dedicated timer expiring when they are
+ * due. Thus the clock sent to slaves doesn't depend on the amount
+ * of data queued nor on when the sequencer processes the tick. To
+ * let them overtake the queue, at most DESP_TXLEAD queued bytes are
+ * handed to the UART driver at a time; 'fifosz' is the largest free
+ * space it ever reported, i.e. its size.
+ *
+ * desp_write() runs in the realtime context, while
+ * mdep_desp_txkick() is also called by the timers, so the consumer
+ * side is guarded by the 'busy' flag: if it's already set, the other
+ * caller is draining the queue.
+ */
+struct desp_tx {
+	unsigned head, tail;
+	unsigned busy;
+	unsigned long lastdue;
+	unsigned char data[DESP_TXBUFSZ];
+	unsigned long due[DESP_TXBUFSZ];
+	unsigned rthead, rttail;
+	unsigned long rtlastdue;
+	unsigned char rtdata[DESP_RTBUFSZ];
+	unsigned long rtdue[DESP_RTBUFSZ];
+	unsigned fifosz;
+};
+
+/*
+ * a serial port registered with mdep_desp_register(), with its own
+ * rings and realtime timer, so ports don't delay each other. Only
+ * one device can use the receive ring of a port
+ */
+struct desp_port {
+	const char *name;		/* path of devices using it */
+	writeDef write;			/* UART routines */
+	availDef avail;
+	struct desp *rxdev;		/* device using the receive ring */
+	struct desp_rx rx;
+	struct desp_tx tx;
+#ifdef ESP_PLATFORM
+	esp_timer_handle_t rttimer;
+#endif
+};
+
+struct desp_port *desp_ports[DESP_NPORTS];
+unsigned desp_nports = 0;
+
+/*
+ * register the routines of a UART, and return the port number,
+ * used by mdep_desp_rxput(). 'w' writes bytes, it's called only
+ * with at most the number of bytes 'a' says the UART can accept
+ * without blocking. Devices whose path is 'name' use the port.
+ * Called before midish is started
+ */
+unsigned
+mdep_desp_register(const char *name, writeDef w, availDef a)
+{
+	struct desp_port *p;
+
+	if (desp_nports == DESP_NPORTS) {
+		log_puts("mdep_desp_register: too many ports\n");
+		panic();
+	}
+	p = xmalloc(sizeof(struct desp_port), "desp_port");
+	memset(p, 0, sizeof(struct desp_port));
+	p->name = name;
+	p->write = w;
+	p->avail = a;
+	desp_ports[desp_nports] = p;
+	return desp_nports++;
+}
+
+/*
+ * return the name of the given port, or NULL if it's not registered
+ */
+char *
+mdep_desp_name(unsigned i)
+{
+	return i < desp_nports ? (char *)desp_ports[i]->name : NULL;
+}
+
+/*
+ * schedule the realtime timer to expire when the first realtime
+ * message is due; if it's already due (the UART is full), retry
+ * once a byte is sent
+ */
+void
+desp_rtarm(struct desp_port *p, unsigned long now, unsigned long due)
+{
+#ifdef ESP_PLATFORM
+	long delta;
+
+	if (p->rttimer == NULL)
+		return;
+	delta = due - now;
+	if (delta <= 0)
+		delta = DESP_BYTEUSEC;
+	esp_timer_stop(p->rttimer);
+	esp_timer_start_once(p->rttimer, delta);
+#endif
+}
+
+/*
+ * move as many due bytes as the UART accepts from the transmit queue
+ * to the UART, without blocking. Realtime messages go first
+ */
+void
+desp_txkick(struct desp_port *p, unsigned long now)
+{
+	struct desp_tx *tx = &p->tx;
+	unsigned head, tail, start, n, avail, used;
+	size_t res;
+
+	if (__atomic_exchange_n(&tx->busy, 1, __ATOMIC_ACQUIRE))
+		return;
+	head = __atomic_load_n(&tx->rthead, __ATOMIC_ACQUIRE);
+	tail = tx->rttail;
+	while (tail != head) {
+		start = tail & (DESP_RTBUFSZ - 1);
+		if ((long)(now - tx->rtdue[start]) < 0)
+			break;
+		if ((*p->avail)() == 0)
+			break;
+		if ((*p->write)((char *)tx->rtdata + start, 1) == 0)
+			break;
+		tail++;
+	}
+	__atomic_store_n(&tx->rttail, tail, __ATOMIC_RELEASE);
+	if (tail != head)
+		desp_rtarm(p, now, tx->rtdue[tail & (DESP_RTBUFSZ - 1)]);
+
+	head = __atomic_load_n(&tx->head, __ATOMIC_ACQUIRE);
+	tail = tx->tail;
+	while (tail != head) {
+		avail = (*p->avail)();
+		if (tx->fifosz < avail)
+			tx->fifosz = avail;
+		used = tx->fifosz - avail;
+		if (used >= DESP_TXLEAD)
+			break;
+		if (avail > DESP_TXLEAD - used)
+			avail = DESP_TXLEAD - used;
+		start = tail & (DESP_TXBUFSZ - 1);
+		n = head - tail;
+		if (n > DESP_TXBUFSZ - start)
+			n = DESP_TXBUFSZ - start;
+		if (n > avail)
+			n = avail;
+		for (avail = 0; avail < n; avail++) {
+			if ((long)(now - tx->due[start + avail]) < 0)
+				break;
+		}
+		if (avail == 0)
+			break;
+		res = (*p->write)((char *)tx->data + start, avail);
+		if (res == 0)
+			break;
+		tail += res;
+		__atomic_store_n(&tx->tail, tail, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&tx->busy, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * return 1 if the transmit queue or the realtime ring of the port
+ * is not empty
+ */
+unsigned
+desp_txbusy(struct desp_port *p)
+{
+	return __atomic_load_n(&p->tx.tail, __ATOMIC_ACQUIRE) !=
+	    __atomic_load_n(&p->tx.head, __ATOMIC_ACQUIRE) ||
+	    __atomic_load_n(&p->tx.rttail, __ATOMIC_ACQUIRE) !=
+	    __atomic_load_n(&p->tx.rthead, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * realtime timer callback
+ */
+void
+desp_rttimo(void *arg)
+{
+	desp_txkick(arg, mdep_desp_clock());
+}
+
+/*
+ * send due bytes of all ports; ports with nothing queued are skipped
+ * without touching the UART
+ */
+void
+mdep_desp_txkick(void)
+{
+	unsigned long now;
+	unsigned i;
+
+	now = mdep_desp_clock();
+	for (i = 0; i < desp_nports; i++) {
+		if (desp_txbusy(desp_ports[i]))
+			desp_txkick(desp_ports[i], now);
+	}
+}
+
+/*
+ * return the current time in microseconds; must be safe to call
+ * from interrupt context. The result wraps, so only differences
+ * should be used.
+ */
+unsigned long
+mdep_desp_clock(void)
+{
+#ifdef ESP_PLATFORM
+	return (unsigned long)esp_timer_get_time();
+#else
+	struct timespec ts;
 
-void mdep_desp_register(writeDef w, readBytesDef r){
-  serial2write = w;
-  serial2readBytes = r;
+	if (sim_active)
+		return sim_clock();
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+#endif
+}
+
+/*
+ * return a free running counter of CPU cycles, for profiling. On
+ * other platforms nanoseconds are used instead. The result wraps,
+ * so only differences should be used.
+ */
+unsigned long
+mdep_desp_cycles(void)
+{
+#ifdef ESP_PLATFORM
+	return (unsigned long)esp_cpu_get_cycle_count();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * store bytes received on the given port in its ring, called by
+ * the producer. Never blocks: bytes that don't fit are dropped and
+ * counted. Return the number of bytes stored.
+ */
+size_t
+mdep_desp_rxput(unsigned port, const char *buf, size_t count)
+{
+	struct desp_rx *rx = &desp_ports[port]->rx;
+	unsigned head, tail, i;
+	unsigned long now;
+	size_t n;
+
+	now = mdep_desp_clock();
+	head = rx->head;
+	tail = __atomic_load_n(&rx->tail, __ATOMIC_ACQUIRE);
+	for (n = 0; n < count; n++) {
+		if (head - tail == DESP_RXBUFSZ) {
+			desp_rxovf += count - n;
+			break;
+		}
+		i = head & (DESP_RXBUFSZ - 1);
+		rx->data[i] = buf[n];
+		rx->stamp[i] = now;
+		head++;
+	}
+	__atomic_store_n(&rx->head, head, __ATOMIC_RELEASE);
+	if (n > 0)
+		mdep_wakeup();
+	return n;
+}
+
+/*
+ * if there are pending bytes in the rings, store the arrival time of
+ * the oldest one in 'stamp' and return 1. Return 0 if the rings are
+ * empty. Called by the consumer only.
+ */
+unsigned
+mdep_desp_rxstamp(unsigned long *stamp)
+{
+	struct desp_port *p;
+	unsigned head, tail, i, found;
+	unsigned long s;
+
+	found = 0;
+	for (i = 0; i < desp_nports; i++) {
+		p = desp_ports[i];
+		if (p->rxdev == NULL)
+			continue;
+		head = __atomic_load_n(&p->rx.head, __ATOMIC_ACQUIRE);
+		tail = p->rx.tail;
+		if (head == tail)
+			continue;
+		s = p->rx.stamp[tail & (DESP_RXBUFSZ - 1)];
+		if (!found || (long)(s - *stamp) < 0)
+			*stamp = s;
+		found = 1;
+	}
+	return found;
 }
 
 void	 desp_open(struct mididev *);
@@ -62,14 +392,26 @@ struct mididev *
 desp_new(char *path, unsigned mode)
 {
 	struct desp *dev;
+	unsigned i;
 
 	if (path == NULL) {
 		cons_err("path must be set for desp devices");
 		return NULL;
 	}
+	for (i = 0; ; i++) {
+		if (i == desp_nports) {
+			cons_errs(path, "no such serial port");
+			return NULL;
+		}
+		if (str_eq(mdep_desp_name(i), path))
+			break;
+	}
 	dev = xmalloc(sizeof(struct desp), "desp");
 	mididev_init(&dev->mididev, &desp_ops, mode);
 	dev->path = str_new(path);
+	dev->fd = -1;
+	dev->port = desp_ports[i];
+	dev->mididev.obaud = MIDIDEV_BAUD;
 	return (struct mididev *)&dev->mididev;
 }
 
@@ -78,6 +420,8 @@ desp_del(struct mididev *addr)
 {
 	struct desp *dev = (struct desp *)addr;
 
+	if (dev->port->rxdev == dev)
+		dev->port->rxdev = NULL;
 	mididev_done(&dev->mididev);
 	str_delete(dev->path);
 	xfree(dev);
@@ -87,6 +431,7 @@ void
 desp_open(struct mididev *addr)
 {
 	struct desp *dev = (struct desp *)addr;
+	struct desp_port *p = dev->port;
 	int mode;
 
 	if (dev->mididev.mode == MIDIDEV_MODE_IN) {
@@ -100,6 +445,29 @@ desp_open(struct mididev *addr)
 		panic();
 		mode = 0;
 	}
+	if ((dev->mididev.mode & MIDIDEV_MODE_IN) && p->rxdev == NULL) {
+		p->rxdev = dev;
+		p->rx.tail = __atomic_load_n(&p->rx.head, __ATOMIC_ACQUIRE);
+	}
+#ifdef ESP_PLATFORM
+	/*
+	 * the realtime timer is created once and never deleted, it
+	 * runs in the esp_timer task, like the tick timer, since the
+	 * UART driver can't be called from interrupt context
+	 */
+	if (p->rttimer == NULL) {
+		esp_timer_create_args_t args = {
+			.callback = desp_rttimo,
+			.arg = p,
+			.dispatch_method = ESP_TIMER_TASK,
+			.name = "midish_rt"
+		};
+		if (esp_timer_create(&args, &p->rttimer) != ESP_OK) {
+			log_puts("desp_open: esp_timer_create failed\n");
+			panic();
+		}
+	}
+#endif
   /*
 	dev->fd = open(dev->path, mode, 0666);
 	if (dev->fd < 0) {
@@ -115,40 +483,127 @@ desp_close(struct mididev *addr)
 {
 	struct desp *dev = (struct desp *)addr;
 
+	if (dev->port->rxdev == dev)
+		dev->port->rxdev = NULL;
 	if (dev->fd < 0)
 		return;
 	(void)close(dev->fd);
 	dev->fd = -1;
 }
 
+/*
+ * move bytes from the receive ring to the given buffer, never blocks.
+ * Only bytes received at the same time as the first one are
+ * returned, so the caller can update the clock between calls. Bytes
+ * received after mididev_istamp are left for later calls: they
+ * can't be processed before bytes of other ports received earlier
+ */
 unsigned
 desp_read(struct mididev *addr, unsigned char *buf, unsigned count)
 {
 	struct desp *dev = (struct desp *)addr;
-	ssize_t res;
+	struct desp_rx *rx = &dev->port->rx;
+	unsigned head, tail, i, n;
+	unsigned long stamp;
 
-	res = (*serial2readBytes)(buf, count);
-	if (res < 0) {
-		log_perror(dev->path);
-		dev->mididev.eof = 1;
+	if (dev != dev->port->rxdev)
 		return 0;
+	head = __atomic_load_n(&rx->head, __ATOMIC_ACQUIRE);
+	tail = rx->tail;
+	if (head == tail)
+		return 0;
+	stamp = rx->stamp[tail & (DESP_RXBUFSZ - 1)];
+	if ((long)(stamp - mididev_istamp) > 0)
+		return 0;
+	for (n = 0; n < count && tail != head; n++) {
+		i = tail & (DESP_RXBUFSZ - 1);
+		if (rx->stamp[i] != stamp)
+			break;
+		buf[n] = rx->data[i];
+		tail++;
+	}
+	__atomic_store_n(&rx->tail, tail, __ATOMIC_RELEASE);
+	return n;
+}
+
+/*
+ * return 1 if the transmit queue or the realtime ring of any port
+ * is not empty
+ */
+unsigned
+mdep_desp_txbusy(void)
+{
+	unsigned i;
+
+	for (i = 0; i < desp_nports; i++) {
+		if (desp_txbusy(desp_ports[i]))
+			return 1;
 	}
-	return res;
+	return 0;
 }
 
+/*
+ * queue bytes for transmission, and start sending them. Bytes are
+ * due at mididev_ostamp plus the device lookahead, but never before
+ * bytes already queued. Realtime messages are moved to their own
+ * ring. Return the number of bytes queued, which is less than
+ * 'count' only if the queue is full
+ */
 unsigned
 desp_write(struct mididev *addr, unsigned char *buf, unsigned count)
 {
-	struct desp *dev = (struct desp *)addr;
-	ssize_t res;
+	struct desp_port *p = ((struct desp *)addr)->port;
+	struct desp_tx *tx = &p->tx;
+	unsigned head, tail, rthead, rttail, start, n;
+	unsigned long now, due, rtdue;
 
-	res = (*serial2write)(buf,count);
-	if (res < 0) {
-		log_perror(dev->path);
-		dev->mididev.eof = 1;
-		return 0;
+	head = tx->head;
+	tail = __atomic_load_n(&tx->tail, __ATOMIC_ACQUIRE);
+	rthead = tx->rthead;
+	rttail = __atomic_load_n(&tx->rttail, __ATOMIC_ACQUIRE);
+
+	/*
+	 * if the output is already later than the lookahead (or the
+	 * clock isn't running), send it at once. Input passed thru
+	 * (produced while an input event is processed) doesn't use the
+	 * lookahead either, it only waits for bytes already queued
+	 */
+	now = mdep_desp_clock();
+	if (!mididev_ilatpend && now - mididev_ostamp < addr->olook)
+		due = mididev_ostamp + addr->olook;
+	else
+		due = now;
+	rtdue = due;
+	if (rthead != rttail && (long)(rtdue - tx->rtlastdue) < 0)
+		rtdue = tx->rtlastdue;
+	if (head != tail && (long)(due - tx->lastdue) < 0)
+		due = tx->lastdue;
+	for (n = 0; n < count; n++) {
+		if (buf[n] >= 0xf8) {
+			if (rthead - rttail == DESP_RTBUFSZ)
+				break;
+			start = rthead & (DESP_RTBUFSZ - 1);
+			tx->rtdata[start] = buf[n];
+			tx->rtdue[start] = rtdue;
+			rthead++;
+		} else {
+			if (head - tail == DESP_TXBUFSZ)
+				break;
+			start = head & (DESP_TXBUFSZ - 1);
+			tx->data[start] = buf[n];
+			tx->due[start] = due;
+			head++;
+		}
+	}
+	tx->lastdue = due;
+	tx->rtlastdue = rtdue;
+	__atomic_store_n(&tx->head, head, __ATOMIC_RELEASE);
+	if (rthead != tx->rthead) {
+		__atomic_store_n(&tx->rthead, rthead, __ATOMIC_RELEASE);
+		desp_rtarm(p, now, tx->rtdue[rttail & (DESP_RTBUFSZ - 1)]);
 	}
-	return res;
+	desp_txkick(p, now);
+	return n;
 }
 
 unsigned
@@ -1,11 +1,94 @@
+#ifndef MIDISH_MDEP_DESP_H
+#define MIDISH_MDEP_DESP_H
+
+#include <stddef.h>
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+
+/*
+ * max number of serial ports, each one has its own rings, and is
+ * used by the devices whose path is the name it's registered with
+ */
+#define DESP_NPORTS	4
+
+/*
+ * size of the receive ring, must be a power of two. At 31250 bit/s
+ * this is about 320ms of input
+ */
+#define DESP_RXBUFSZ	1024
+
+/*
+ * size of the transmit queue, must be a power of two. It must be
+ * large enough to hold the output of a burst (eg. song_playconf())
+ * so that mididev_flush() never has to wait for the UART
+ */
+#define DESP_TXBUFSZ	2048
+
+/*
+ * size of the ring of realtime messages (clock, start, stop, active
+ * sensing), sent ahead of the transmit queue; must be a power of two
+ */
+#define DESP_RTBUFSZ	64
+
+/*
+ * max bytes of the transmit queue handed to the UART driver at a
+ * time: a realtime message can't overtake bytes already given to
+ * it, so this bounds the delay of realtime messages (320us per byte)
+ */
+#define DESP_TXLEAD	4
+
+/*
+ * time it takes to send a byte at 31250 bit/s, in microseconds
+ */
+#define DESP_BYTEUSEC	320
+
+/*
+ * number of mdep_desp_cycles() units per microsecond
+ */
+#if defined(CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ)
+#define DESP_CYCLES_PER_USEC	CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ
+#elif defined(ESP_PLATFORM)
+#define DESP_CYCLES_PER_USEC	240
+#else
+#define DESP_CYCLES_PER_USEC	1000
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef size_t (*writeDef)(const char *buffer, size_t size);
-typedef size_t (*readBytesDef)( char *buffer, size_t length);
-void mdep_desp_register(writeDef w, readBytesDef r);
+typedef size_t (*availDef)(void);
+unsigned mdep_desp_register(const char *name, writeDef w, availDef a);
+char *mdep_desp_name(unsigned i);
+
+size_t mdep_desp_rxput(unsigned port, const char *buffer, size_t size);
+unsigned long mdep_desp_clock(void);
+unsigned long mdep_desp_cycles(void);
+unsigned mdep_desp_rxstamp(unsigned long *stamp);
+void mdep_desp_txkick(void);
+unsigned mdep_desp_txbusy(void);
+void mdep_wakeup(void);
+void mdep_conswakeup(void);
+
+typedef size_t (*bleNotifyDef)(const unsigned char *buffer, size_t size);
+void mdep_ble_register(bleNotifyDef n);
+void mdep_ble_connect(unsigned mtu, unsigned long intvl);
+void mdep_ble_disconnect(void);
+size_t mdep_ble_rxput(const unsigned char *buffer, size_t size);
+
+void mdep_clkadv(unsigned long now);
+
+size_t mdep_cons_rxput(const char *buffer, size_t size);
+unsigned mdep_cons_rxpending(void);
+unsigned mdep_cons_rxget(unsigned char *buffer, unsigned count);
+
+extern unsigned long desp_rxovf;
+extern unsigned long blemidi_rxovf, blemidi_txovf;
 
 #ifdef __cplusplus
 }
-#endif
\ No newline at end of file
+#endif
+
+#endif /* MIDISH_MDEP_DESP_H */
@@ -0,0 +1,1158 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * RTP-MIDI (RFC 6295) device using the AppleMIDI session protocol,
+ * each device is a session with a single peer:
+ *
+ *	dnew 3 "rtp:192.168.1.20:5004" rw	# invite the given peer
+ *	dnew 4 "rtp:5006" rw			# wait for an invitation
+ *
+ * A session uses two UDP sockets: the control port and the data
+ * port, which is the next port. Sockets are non-blocking and are
+ * polled by the realtime loop with rtpmidi_poll(), which also runs
+ * the session state machine (invitations, clock synchronization,
+ * receiver feedback).
+ *
+ * Each write() call is sent as one RTP packet. Packets carry a
+ * recovery journal with chapter N (note on/off) for all channels
+ * whose notes changed since the checkpoint. The checkpoint is moved
+ * forward when the peer acknowledges packets with receiver feedback
+ * (RS) messages, so the journal stays small. On input, if packets
+ * are lost, notes the journal reports as released but that are on
+ * here are turned off, so lost packets don't leave stuck notes.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+#include "cons.h"
+#include "mididev.h"
+#include "str.h"
+#include "mdep_desp.h"
+
+#define RTPMIDI_DEFPORT		5004
+
+/*
+ * max size of a packet (fits in an ethernet frame), and max size of
+ * the MIDI command section, the rest is for the journal
+ */
+#define RTPMIDI_PKTMAX		1400
+#define RTPMIDI_CMDMAX		512
+
+/*
+ * session protocol timings, in microseconds
+ */
+#define RTPMIDI_INVRETRY	1000000		/* invitation retry */
+#define RTPMIDI_INVIDLE		10000000	/* retry after many failures */
+#define RTPMIDI_INVMAX		12		/* before using INVIDLE */
+#define RTPMIDI_CKFAST		1500000		/* first clock syncs */
+#define RTPMIDI_CKSLOW		10000000	/* then, clock syncs */
+#define RTPMIDI_CKNFAST		6
+#define RTPMIDI_RSPERIOD	1000000		/* receiver feedback */
+#define RTPMIDI_TIMEOUT		60000000	/* peer is gone */
+
+/*
+ * session states
+ */
+#define RTPMIDI_LISTEN		0	/* waiting for an invitation */
+#define RTPMIDI_INVCTL		1	/* invitation on the control port */
+#define RTPMIDI_INVDATA		2	/* invitation on the data port */
+#define RTPMIDI_CONN		3	/* session established */
+
+/*
+ * AppleMIDI commands, in network byte order
+ */
+#define RTPMIDI_CMD(a, b)	(((a) << 8) | (b))
+#define RTPMIDI_IN		RTPMIDI_CMD('I', 'N')
+#define RTPMIDI_OK		RTPMIDI_CMD('O', 'K')
+#define RTPMIDI_NO		RTPMIDI_CMD('N', 'O')
+#define RTPMIDI_BY		RTPMIDI_CMD('B', 'Y')
+#define RTPMIDI_CK		RTPMIDI_CMD('C', 'K')
+#define RTPMIDI_RS		RTPMIDI_CMD('R', 'S')
+
+#define RTPMIDI_PT		0x61	/* RTP payload type */
+
+struct rtpmidi {
+	struct mididev mididev;		/* device stuff */
+	struct rtpmidi *next;		/* list of sessions */
+	char *path;			/* eg. "rtp:192.168.1.20:5004" */
+	unsigned initiator;		/* we send the invitation */
+	int cfd, dfd;			/* control and data sockets */
+	struct sockaddr_in caddr;	/* peer control port */
+	struct sockaddr_in daddr;	/* peer data port */
+	unsigned state;			/* one of RTPMIDI_xxx */
+	unsigned ntries;		/* invitations sent */
+	unsigned ckcount;		/* clock syncs done */
+	unsigned long tsend;		/* last invitation or sync */
+	unsigned long talive;		/* last message from the peer */
+	unsigned long token, ssrc, peerssrc;
+
+	/*
+	 * output: sequence number, notes state and bitmaps of notes
+	 * changed since the checkpoint (ochg[0]) and since the next
+	 * checkpoint (ochg[1])
+	 */
+	unsigned oseq;
+	unsigned ockseq, onewseq;
+	unsigned osx;			/* within a sysex */
+	unsigned char omsg[3];		/* message being built */
+	unsigned omlen, omneed;		/* bytes in omsg, needed */
+	unsigned char ovel[16][128];
+	unsigned char ochg[2][16][16];
+
+	/*
+	 * input: last sequence number, notes state
+	 */
+	unsigned iseq, isync;
+	unsigned irs;			/* new packets since last RS */
+	unsigned long trs;		/* last RS sent */
+	unsigned istatus;		/* running status */
+	unsigned isx;			/* within a sysex */
+	unsigned char ion[16][16];
+};
+
+/*
+ * list of sessions, for rtpmidi_poll()
+ */
+struct rtpmidi *rtpmidi_list = NULL;
+
+/*
+ * session clock in 100us units, derived from mdep_desp_clock()
+ */
+unsigned long long rtpmidi_clk = 0;
+unsigned long rtpmidi_clkstamp, rtpmidi_clkrem;
+unsigned rtpmidi_clkinit = 0;
+
+void	 rtpmidi_open(struct mididev *);
+unsigned rtpmidi_read(struct mididev *, unsigned char *, unsigned);
+unsigned rtpmidi_write(struct mididev *, unsigned char *, unsigned);
+unsigned rtpmidi_nfds(struct mididev *);
+unsigned rtpmidi_pollfd(struct mididev *, struct pollfd *, int);
+int	 rtpmidi_revents(struct mididev *, struct pollfd *);
+void	 rtpmidi_close(struct mididev *);
+void	 rtpmidi_del(struct mididev *);
+
+struct devops rtpmidi_ops = {
+	rtpmidi_open,
+	rtpmidi_read,
+	rtpmidi_write,
+	rtpmidi_nfds,
+	rtpmidi_pollfd,
+	rtpmidi_revents,
+	rtpmidi_close,
+	rtpmidi_del
+};
+
+/*
+ * return the session clock
+ */
+unsigned long long
+rtpmidi_time(void)
+{
+	unsigned long now = mdep_desp_clock();
+
+	if (!rtpmidi_clkinit) {
+		rtpmidi_clkstamp = now;
+		rtpmidi_clkrem = 0;
+		rtpmidi_clkinit = 1;
+	}
+	rtpmidi_clkrem += now - rtpmidi_clkstamp;
+	rtpmidi_clkstamp = now;
+	rtpmidi_clk += rtpmidi_clkrem / 100;
+	rtpmidi_clkrem %= 100;
+	return rtpmidi_clk;
+}
+
+unsigned
+rtpmidi_get16(unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+unsigned long
+rtpmidi_get32(unsigned char *p)
+{
+	return ((unsigned long)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+unsigned long long
+rtpmidi_get64(unsigned char *p)
+{
+	return ((unsigned long long)rtpmidi_get32(p) << 32) |
+	    rtpmidi_get32(p + 4);
+}
+
+void
+rtpmidi_put16(unsigned char *p, unsigned v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+void
+rtpmidi_put32(unsigned char *p, unsigned long v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+void
+rtpmidi_put64(unsigned char *p, unsigned long long v)
+{
+	rtpmidi_put32(p, v >> 32);
+	rtpmidi_put32(p + 4, v);
+}
+
+/*
+ * create a non-blocking UDP socket bound to the given port, return
+ * -1 on error
+ */
+int
+rtpmidi_socket(unsigned port)
+{
+	struct sockaddr_in addr;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * parse "rtp:port" or "rtp:host:port", set the peer address if the
+ * host is given, return 0 on error
+ */
+unsigned
+rtpmidi_parsepath(struct rtpmidi *dev, char *path, unsigned *port)
+{
+	struct addrinfo hints, *res;
+	char host[64], *p, *colon;
+	unsigned len;
+
+	p = path + 4;
+	colon = strrchr(p, ':');
+	if (colon == NULL) {
+		dev->initiator = 0;
+		*port = *p != '\0' ? atoi(p) : RTPMIDI_DEFPORT;
+		return *port > 0 && *port < 0xffff;
+	}
+	len = colon - p;
+	if (len == 0 || len >= sizeof(host))
+		return 0;
+	memcpy(host, p, len);
+	host[len] = '\0';
+	*port = atoi(colon + 1);
+	if (*port == 0 || *port >= 0xffff)
+		return 0;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	if (getaddrinfo(host, NULL, &hints, &res) != 0 || res == NULL)
+		return 0;
+	memcpy(&dev->caddr, res->ai_addr, sizeof(struct sockaddr_in));
+	freeaddrinfo(res);
+	dev->caddr.sin_port = htons(*port);
+	dev->daddr = dev->caddr;
+	dev->daddr.sin_port = htons(*port + 1);
+	dev->initiator = 1;
+	return 1;
+}
+
+struct mididev *
+rtpmidi_new(char *path, unsigned mode)
+{
+	struct rtpmidi *dev;
+	unsigned port;
+
+	dev = xmalloc(sizeof(struct rtpmidi), "rtpmidi");
+	memset(&dev->caddr, 0, sizeof(struct sockaddr_in));
+	memset(&dev->daddr, 0, sizeof(struct sockaddr_in));
+	if (!rtpmidi_parsepath(dev, path, &port)) {
+		cons_errs(path, "bad rtp address, expected rtp:[host:]port");
+		xfree(dev);
+		return NULL;
+	}
+
+	/*
+	 * the initiator uses any local ports
+	 */
+	if (dev->initiator)
+		port = 0;
+	dev->cfd = rtpmidi_socket(port);
+	dev->dfd = rtpmidi_socket(port ? port + 1 : 0);
+	if (dev->cfd < 0 || dev->dfd < 0) {
+		cons_errs(path, "failed to create sockets");
+		if (dev->cfd >= 0)
+			close(dev->cfd);
+		if (dev->dfd >= 0)
+			close(dev->dfd);
+		xfree(dev);
+		return NULL;
+	}
+	mididev_init(&dev->mididev, &rtpmidi_ops, mode);
+
+	/*
+	 * running status would make the journal harder to use, and
+	 * is not worth it
+	 */
+	dev->mididev.runst = 0;
+	dev->path = str_new(path);
+	dev->ssrc = (mdep_desp_cycles() ^ (unsigned long)dev) & 0xffffffff;
+	dev->state = dev->initiator ? RTPMIDI_INVCTL : RTPMIDI_LISTEN;
+	dev->ntries = 0;
+	dev->tsend = mdep_desp_clock() - RTPMIDI_INVIDLE;
+	dev->next = rtpmidi_list;
+	rtpmidi_list = dev;
+	return (struct mididev *)&dev->mididev;
+}
+
+/*
+ * send an AppleMIDI session message (IN, OK, NO or BY)
+ */
+void
+rtpmidi_sendsess(struct rtpmidi *dev, int fd, struct sockaddr_in *to,
+    unsigned cmd)
+{
+	static char name[] = "midish";
+	unsigned char buf[16 + sizeof(name)];
+	unsigned len = 16;
+
+	rtpmidi_put16(buf, 0xffff);
+	rtpmidi_put16(buf + 2, cmd);
+	rtpmidi_put32(buf + 4, 2);
+	rtpmidi_put32(buf + 8, dev->token);
+	rtpmidi_put32(buf + 12, dev->ssrc);
+	if (cmd != RTPMIDI_BY) {
+		memcpy(buf + len, name, sizeof(name));
+		len += sizeof(name);
+	}
+	(void)sendto(fd, buf, len, 0, (struct sockaddr *)to, sizeof(*to));
+}
+
+/*
+ * send a clock synchronization message with the given count and
+ * timestamps
+ */
+void
+rtpmidi_sendck(struct rtpmidi *dev, unsigned count, unsigned long long *ts)
+{
+	unsigned char buf[36];
+	unsigned i;
+
+	rtpmidi_put16(buf, 0xffff);
+	rtpmidi_put16(buf + 2, RTPMIDI_CK);
+	rtpmidi_put32(buf + 4, dev->ssrc);
+	buf[8] = count;
+	buf[9] = buf[10] = buf[11] = 0;
+	for (i = 0; i < 3; i++)
+		rtpmidi_put64(buf + 12 + 8 * i, ts[i]);
+	(void)sendto(dev->dfd, buf, sizeof(buf), 0,
+	    (struct sockaddr *)&dev->daddr, sizeof(dev->daddr));
+}
+
+/*
+ * send receiver feedback, so the peer can move its checkpoint
+ */
+void
+rtpmidi_sendrs(struct rtpmidi *dev)
+{
+	unsigned char buf[12];
+
+	rtpmidi_put16(buf, 0xffff);
+	rtpmidi_put16(buf + 2, RTPMIDI_RS);
+	rtpmidi_put32(buf + 4, dev->ssrc);
+	rtpmidi_put32(buf + 8, (unsigned long)dev->iseq << 16);
+	(void)sendto(dev->cfd, buf, sizeof(buf), 0,
+	    (struct sockaddr *)&dev->caddr, sizeof(dev->caddr));
+}
+
+/*
+ * reset the notes state and the journal, called when the session
+ * is established
+ */
+void
+rtpmidi_start(struct rtpmidi *dev)
+{
+	dev->state = RTPMIDI_CONN;
+	dev->ckcount = 0;
+	dev->talive = dev->tsend = mdep_desp_clock();
+	dev->oseq = dev->ssrc & 0xffff;
+	dev->ockseq = (dev->oseq - 1) & 0xffff;
+	dev->onewseq = dev->oseq;
+	dev->osx = 0;
+	dev->omlen = 0;
+	memset(dev->ovel, 0, sizeof(dev->ovel));
+	memset(dev->ochg, 0, sizeof(dev->ochg));
+	dev->isync = 0;
+	dev->irs = 0;
+	dev->trs = dev->talive;
+	dev->istatus = 0;
+	dev->isx = 0;
+	memset(dev->ion, 0, sizeof(dev->ion));
+	if (mididev_debug) {
+		log_puts(dev->path);
+		log_puts(": session started\n");
+	}
+}
+
+/*
+ * terminate the session, the initiator will invite the peer again
+ */
+void
+rtpmidi_stop(struct rtpmidi *dev)
+{
+	if (dev->state == RTPMIDI_CONN && mididev_debug) {
+		log_puts(dev->path);
+		log_puts(": session ended\n");
+	}
+	dev->state = dev->initiator ? RTPMIDI_INVCTL : RTPMIDI_LISTEN;
+	dev->ntries = 0;
+	dev->tsend = mdep_desp_clock();
+}
+
+void
+rtpmidi_del(struct mididev *addr)
+{
+	struct rtpmidi *dev = (struct rtpmidi *)addr, **i;
+
+	if (dev->state == RTPMIDI_CONN)
+		rtpmidi_sendsess(dev, dev->cfd, &dev->caddr, RTPMIDI_BY);
+	for (i = &rtpmidi_list; *i != dev; i = &(*i)->next) {
+		if (*i == NULL) {
+			log_puts("rtpmidi_del: not on the list\n");
+			panic();
+		}
+	}
+	*i = dev->next;
+	close(dev->cfd);
+	close(dev->dfd);
+	mididev_done(&dev->mididev);
+	str_delete(dev->path);
+	xfree(dev);
+}
+
+void
+rtpmidi_open(struct mididev *addr)
+{
+}
+
+void
+rtpmidi_close(struct mididev *addr)
+{
+}
+
+/*
+ * input is pushed by rtpmidi_poll()
+ */
+unsigned
+rtpmidi_read(struct mididev *addr, unsigned char *buf, unsigned count)
+{
+	return 0;
+}
+
+/*
+ * record a note change for the journal
+ */
+void
+rtpmidi_notechg(struct rtpmidi *dev, unsigned ch, unsigned note, unsigned vel)
+{
+	dev->ovel[ch][note] = vel;
+	dev->ochg[0][ch][note >> 3] |= 0x80 >> (note & 7);
+	dev->ochg[1][ch][note >> 3] |= 0x80 >> (note & 7);
+}
+
+/*
+ * move the checkpoint to the next one, called when the peer
+ * acknowledged all packets before it
+ */
+void
+rtpmidi_checkpoint(struct rtpmidi *dev)
+{
+	dev->ockseq = (dev->onewseq - 1) & 0xffff;
+	memcpy(dev->ochg[0], dev->ochg[1], sizeof(dev->ochg[0]));
+	memset(dev->ochg[1], 0, sizeof(dev->ochg[1]));
+	dev->onewseq = dev->oseq;
+}
+
+/*
+ * store chapter N of the given channel, return its size or 0 if
+ * there's nothing to store or it doesn't fit
+ */
+unsigned
+rtpmidi_putchapn(struct rtpmidi *dev, unsigned ch, unsigned char *buf,
+    unsigned max)
+{
+	unsigned char *chg = dev->ochg[0][ch];
+	unsigned i, n, note, low, high, nlog;
+
+	low = 16;
+	high = 0;
+	nlog = 0;
+	n = 2;
+	for (note = 0; note < 128; note++) {
+		if (!(chg[note >> 3] & (0x80 >> (note & 7))))
+			continue;
+		if (dev->ovel[ch][note] > 0) {
+			if (nlog == 127)
+				continue;
+			if (n + 2 > max)
+				return 0;
+			buf[n++] = note;
+			buf[n++] = 0x80 | dev->ovel[ch][note];
+			nlog++;
+		} else {
+			if (low == 16)
+				low = note >> 3;
+			high = note >> 3;
+		}
+	}
+	if (low == 16 && nlog == 0)
+		return 0;
+	if (low == 16) {
+		low = 15;
+		high = 0;
+	} else {
+		if (n + high - low + 1 > max)
+			return 0;
+		for (i = low; i <= high; i++) {
+			buf[n] = 0;
+			for (note = i * 8; note < i * 8 + 8; note++) {
+				if ((chg[i] & (0x80 >> (note & 7))) &&
+				    dev->ovel[ch][note] == 0)
+					buf[n] |= 0x80 >> (note & 7);
+			}
+			n++;
+		}
+	}
+	buf[0] = nlog;
+	buf[1] = (low << 4) | high;
+	return n;
+}
+
+/*
+ * store the recovery journal, return its size or 0 if it's empty
+ */
+unsigned
+rtpmidi_putjournal(struct rtpmidi *dev, unsigned char *buf, unsigned max)
+{
+	unsigned ch, n, len, nchan;
+
+	if (max < 3)
+		return 0;
+	n = 3;
+	nchan = 0;
+	for (ch = 0; ch < 16; ch++) {
+		if (n + 3 > max)
+			goto toolong;
+		len = rtpmidi_putchapn(dev, ch, buf + n + 3, max - n - 3);
+		if (len == 0)
+			continue;
+		len += 3;
+		buf[n] = (ch << 3) | ((len >> 8) & 3);
+		buf[n + 1] = len & 0xff;
+		buf[n + 2] = 0x08;		/* chapter N only */
+		n += len;
+		nchan++;
+	}
+	if (nchan == 0)
+		return 0;
+	buf[0] = 0x20 | (nchan - 1);		/* channel journals only */
+	rtpmidi_put16(buf + 1, dev->ockseq);
+	return n;
+toolong:
+	/*
+	 * the peer doesn't acknowledge packets, so forget old
+	 * changes rather than sending huge packets
+	 */
+	rtpmidi_checkpoint(dev);
+	return 0;
+}
+
+/*
+ * append a command to the command list, preceded by a zero delta
+ * time if it's not the first one
+ */
+void
+rtpmidi_putcmd(unsigned char *cmd, unsigned *clen, unsigned char *buf,
+    unsigned n)
+{
+	if (*clen > 0)
+		cmd[(*clen)++] = 0;
+	memcpy(cmd + *clen, buf, n);
+	*clen += n;
+}
+
+/*
+ * convert MIDI bytes to an RTP packet and send it, return the number
+ * of bytes processed. If there's no session, data is discarded
+ */
+unsigned
+rtpmidi_write(struct mididev *addr, unsigned char *buf, unsigned count)
+{
+	struct rtpmidi *dev = (struct rtpmidi *)addr;
+	unsigned char pkt[RTPMIDI_PKTMAX], *cmd, c;
+	unsigned n, clen, jlen, incmd, s;
+
+	if (dev->state != RTPMIDI_CONN)
+		return count;
+	pkt[0] = 0x80;				/* RTP version 2 */
+	pkt[1] = RTPMIDI_PT;
+	rtpmidi_put16(pkt + 2, dev->oseq);
+	rtpmidi_put32(pkt + 4, rtpmidi_time());
+	rtpmidi_put32(pkt + 8, dev->ssrc);
+	cmd = pkt + 14;
+
+	/*
+	 * commands are sent with the same timestamp, ie. with a
+	 * zero delta time between them. A sysex continued in the next
+	 * packet is ended with 0xf0 and resumed with 0xf7
+	 */
+	clen = 0;
+	incmd = 0;
+	for (n = 0; n < count; n++) {
+		if (clen + 6 > RTPMIDI_CMDMAX)
+			break;
+		c = buf[n];
+		if (c >= 0xf8) {
+			if (dev->osx && incmd)
+				cmd[clen++] = c;
+			else
+				rtpmidi_putcmd(cmd, &clen, &c, 1);
+			continue;
+		}
+		if (dev->osx && c >= 0x80 && c != 0xf7) {
+			/* status byte within a sysex, cancel it */
+			if (incmd)
+				cmd[clen++] = 0xf4;
+			dev->osx = incmd = 0;
+		}
+		if (c == 0xf0) {
+			rtpmidi_putcmd(cmd, &clen, &c, 1);
+			dev->osx = incmd = 1;
+			dev->omlen = 0;
+		} else if (dev->osx) {
+			if (!incmd) {
+				rtpmidi_putcmd(cmd, &clen, (unsigned char *)"\xf7", 1);
+				incmd = 1;
+			}
+			cmd[clen++] = c;
+			if (c == 0xf7)
+				dev->osx = incmd = 0;
+		} else if (c >= 0x80) {
+			dev->omsg[0] = c;
+			dev->omlen = 1;
+			if (c < 0xf0)
+				dev->omneed = (c >= 0xc0 && c < 0xe0) ? 2 : 3;
+			else if (c == 0xf1 || c == 0xf3)
+				dev->omneed = 2;
+			else if (c == 0xf2)
+				dev->omneed = 3;
+			else
+				dev->omneed = 1;
+		} else if (dev->omlen > 0 && dev->omlen < dev->omneed)
+			dev->omsg[dev->omlen++] = c;
+		if (dev->omlen > 0 && dev->omlen == dev->omneed) {
+			rtpmidi_putcmd(cmd, &clen, dev->omsg, dev->omlen);
+			s = dev->omsg[0] & 0xf0;
+			if (dev->omlen == 3 && (s == 0x80 || s == 0x90)) {
+				rtpmidi_notechg(dev, dev->omsg[0] & 0x0f,
+				    dev->omsg[1], s == 0x90 ? dev->omsg[2] : 0);
+			}
+			dev->omlen = 0;
+		}
+	}
+	if (dev->osx && incmd)
+		cmd[clen++] = 0xf0;
+	if (clen == 0)
+		return n;
+
+	/*
+	 * always use the long header, its length field is 12-bit
+	 */
+	jlen = rtpmidi_putjournal(dev, cmd + clen, sizeof(pkt) - 14 - clen);
+	pkt[12] = 0x80 | (jlen ? 0x40 : 0) | (clen >> 8);
+	pkt[13] = clen & 0xff;
+	(void)sendto(dev->dfd, pkt, 14 + clen + jlen, 0,
+	    (struct sockaddr *)&dev->daddr, sizeof(dev->daddr));
+	dev->oseq = (dev->oseq + 1) & 0xffff;
+	return n;
+}
+
+unsigned
+rtpmidi_nfds(struct mididev *addr)
+{
+	return 0;
+}
+
+unsigned
+rtpmidi_pollfd(struct mididev *addr, struct pollfd *pfd, int events)
+{
+	return 0;
+}
+
+int
+rtpmidi_revents(struct mididev *addr, struct pollfd *pfd)
+{
+	return 0;
+}
+
+/*
+ * pass the given bytes to the parser, and keep track of notes that
+ * are on
+ */
+void
+rtpmidi_input(struct rtpmidi *dev, unsigned char *buf, unsigned n)
+{
+	unsigned ch, note, s;
+
+	if (n == 0)
+		return;
+	s = buf[0] & 0xf0;
+	if (n == 3 && (s == 0x80 || s == 0x90)) {
+		ch = buf[0] & 0x0f;
+		note = buf[1] & 0x7f;
+		if (s == 0x90 && buf[2] != 0)
+			dev->ion[ch][note >> 3] |= 0x80 >> (note & 7);
+		else
+			dev->ion[ch][note >> 3] &= ~(0x80 >> (note & 7));
+	}
+	mididev_inputcb(&dev->mididev, buf, n);
+}
+
+/*
+ * parse the recovery journal, after packets were lost: turn off
+ * notes the journal reports as released
+ */
+void
+rtpmidi_recover(struct rtpmidi *dev, unsigned char *p, unsigned n)
+{
+	unsigned char ev[3], *chap, *end;
+	unsigned nchan, ch, len, nlog, low, high, i, note, map;
+
+	if (n < 3 || !(p[0] & 0x20))
+		return;
+	nchan = (p[0] & 0x0f) + 1;
+	p += 3;
+	n -= 3;
+	if (p[-3] & 0x40) {
+		/* skip the system journal */
+		if (n < 2)
+			return;
+		len = rtpmidi_get16(p) & 0x3ff;
+		if (len > n)
+			return;
+		p += len;
+		n -= len;
+	}
+	while (nchan-- > 0 && n >= 3) {
+		ch = (p[0] >> 3) & 0x0f;
+		len = ((p[0] & 3) << 8) | p[1];
+		map = p[2];
+		if (len < 3 || len > n)
+			return;
+		chap = p + 3;
+		end = p + len;
+		p += len;
+		n -= len;
+		if (!(map & 0x08))
+			continue;
+		/*
+		 * skip chapters P, C, M and W
+		 */
+		if (map & 0x80)
+			chap += 3;
+		if ((map & 0x40) && chap < end)
+			chap += 1 + 2 * ((chap[0] & 0x7f) + 1);
+		if ((map & 0x20) && chap + 2 <= end)
+			chap += rtpmidi_get16(chap) & 0x3ff;
+		if (map & 0x10)
+			chap += 2;
+		if (chap + 2 > end)
+			continue;
+		nlog = chap[0] & 0x7f;
+		low = chap[1] >> 4;
+		high = chap[1] & 0x0f;
+		if (nlog == 127 && low == 15 && high == 0)
+			nlog = 128;
+		chap += 2 + 2 * nlog;
+		for (i = low; i <= high && chap < end; i++, chap++) {
+			for (note = i * 8; note < i * 8 + 8; note++) {
+				if (!(*chap & (0x80 >> (note & 7))) ||
+				    !(dev->ion[ch][i] & (0x80 >> (note & 7))))
+					continue;
+				ev[0] = 0x80 | ch;
+				ev[1] = note;
+				ev[2] = 64;
+				rtpmidi_input(dev, ev, 3);
+			}
+		}
+	}
+}
+
+/*
+ * parse the MIDI command section of a received packet, delta times
+ * are ignored: commands are delivered when the packet arrives
+ */
+void
+rtpmidi_rxcmds(struct rtpmidi *dev, unsigned char *p, unsigned n, unsigned z)
+{
+	unsigned char ev[3];
+	unsigned i, len, c, first;
+
+	first = 1;
+	while (n > 0) {
+		if (!first || z) {
+			/* skip the delta time */
+			for (i = 0; i < 4 && n > 0; i++) {
+				n--;
+				if (!(*p++ & 0x80))
+					break;
+			}
+			if (n == 0)
+				break;
+		}
+		first = 0;
+		c = *p;
+		if (c == 0xf0 || c == 0xf7) {
+			/*
+			 * sysex segment: starts with 0xf0 (begin) or
+			 * 0xf7 (continue), ends with 0xf7 (end), 0xf0
+			 * (to be continued) or 0xf4 (cancel)
+			 */
+			for (i = 1; i < n && (p[i] < 0x80 || p[i] >= 0xf8); i++)
+				;
+			if (c == 0xf0) {
+				dev->isx = 1;
+				mididev_inputcb(&dev->mididev, p, i);
+			} else if (dev->isx)
+				mididev_inputcb(&dev->mididev, p + 1, i - 1);
+			if (i < n) {
+				if (p[i] == 0xf7 && dev->isx)
+					mididev_inputcb(&dev->mididev, p + i, 1);
+				if (p[i] != 0xf0)
+					dev->isx = 0;
+				i++;
+			}
+			p += i;
+			n -= i;
+			continue;
+		}
+		if (c >= 0x80) {
+			if (c < 0xf0)
+				dev->istatus = c;
+			else if (c < 0xf8)
+				dev->istatus = 0;
+			p++;
+			n--;
+		} else if (dev->istatus == 0) {
+			/* data byte without status, skip it */
+			p++;
+			n--;
+			continue;
+		} else
+			c = dev->istatus;
+		if (c < 0xf0)
+			len = (c >= 0xc0 && c < 0xe0) ? 1 : 2;
+		else if (c == 0xf1 || c == 0xf3)
+			len = 1;
+		else if (c == 0xf2)
+			len = 2;
+		else
+			len = 0;
+		if (len > n)
+			break;
+		ev[0] = c;
+		for (i = 0; i < len; i++)
+			ev[i + 1] = p[i];
+		rtpmidi_input(dev, ev, len + 1);
+		p += len;
+		n -= len;
+	}
+}
+
+/*
+ * handle a received RTP packet
+ */
+void
+rtpmidi_rxrtp(struct rtpmidi *dev, unsigned char *p, unsigned n)
+{
+	unsigned seq, len, hlen, lost;
+
+	if (n < 13 || (p[0] & 0xc0) != 0x80 ||
+	    (p[1] & 0x7f) != RTPMIDI_PT ||
+	    rtpmidi_get32(p + 8) != dev->peerssrc)
+		return;
+	seq = rtpmidi_get16(p + 2);
+	lost = dev->isync && seq != ((dev->iseq + 1) & 0xffff);
+	if (dev->isync && ((seq - dev->iseq) & 0x8000))
+		return;				/* late or duplicate */
+	dev->iseq = seq;
+	dev->isync = 1;
+	dev->irs = 1;
+	dev->talive = mdep_desp_clock();
+	p += 12;
+	n -= 12;
+	if (p[0] & 0x80) {
+		if (n < 2)
+			return;
+		len = ((p[0] & 0x0f) << 8) | p[1];
+		hlen = 2;
+	} else {
+		len = p[0] & 0x0f;
+		hlen = 1;
+	}
+	if (hlen + len > n)
+		return;
+	dev->mididev.ilast = timo_abstime;
+	mididev_istamp = mdep_desp_clock();
+	if (lost && (p[0] & 0x40)) {
+		if (mididev_debug) {
+			log_puts(dev->path);
+			log_puts(": packets lost, using journal\n");
+		}
+		dev->istatus = 0;
+		rtpmidi_recover(dev, p + hlen + len, n - hlen - len);
+	}
+	/*
+	 * unless the phantom status flag is set, running status
+	 * doesn't span packets
+	 */
+	if (!(p[0] & 0x10))
+		dev->istatus = 0;
+	rtpmidi_rxcmds(dev, p + hlen, len, p[0] & 0x20);
+}
+
+/*
+ * handle an AppleMIDI message received on the control (data == 0)
+ * or data (data == 1) port
+ */
+void
+rtpmidi_rxsess(struct rtpmidi *dev, unsigned data, unsigned char *p,
+    unsigned n, struct sockaddr_in *from)
+{
+	unsigned long long ts[3];
+	unsigned cmd, seq, i;
+	unsigned long token, ssrc;
+
+	if (n < 8)
+		return;
+	cmd = rtpmidi_get16(p + 2);
+	switch (cmd) {
+	case RTPMIDI_IN:
+		if (n < 16 || dev->initiator)
+			return;
+		token = rtpmidi_get32(p + 8);
+		ssrc = rtpmidi_get32(p + 12);
+		if (!data) {
+			if (dev->state == RTPMIDI_CONN &&
+			    ssrc != dev->peerssrc) {
+				/* single peer per session */
+				dev->token = token;
+				rtpmidi_sendsess(dev, dev->cfd, from,
+				    RTPMIDI_NO);
+				return;
+			}
+			dev->token = token;
+			dev->peerssrc = ssrc;
+			dev->caddr = *from;
+			dev->state = RTPMIDI_INVDATA;
+			rtpmidi_sendsess(dev, dev->cfd, from, RTPMIDI_OK);
+		} else {
+			if (dev->state != RTPMIDI_INVDATA || token != dev->token)
+				return;
+			dev->daddr = *from;
+			rtpmidi_sendsess(dev, dev->dfd, from, RTPMIDI_OK);
+			rtpmidi_start(dev);
+		}
+		break;
+	case RTPMIDI_OK:
+		if (n < 16 || !dev->initiator ||
+		    rtpmidi_get32(p + 8) != dev->token)
+			return;
+		if (!data && dev->state == RTPMIDI_INVCTL) {
+			dev->peerssrc = rtpmidi_get32(p + 12);
+			dev->state = RTPMIDI_INVDATA;
+			dev->ntries = 0;
+			rtpmidi_sendsess(dev, dev->dfd, &dev->daddr,
+			    RTPMIDI_IN);
+			dev->tsend = mdep_desp_clock();
+		} else if (data && dev->state == RTPMIDI_INVDATA) {
+			rtpmidi_start(dev);
+			ts[0] = rtpmidi_time();
+			ts[1] = ts[2] = 0;
+			rtpmidi_sendck(dev, 0, ts);
+		}
+		break;
+	case RTPMIDI_NO:
+		if (dev->initiator && dev->state != RTPMIDI_CONN)
+			dev->ntries = RTPMIDI_INVMAX;
+		break;
+	case RTPMIDI_BY:
+		if (dev->state == RTPMIDI_CONN)
+			rtpmidi_stop(dev);
+		break;
+	case RTPMIDI_CK:
+		if (n < 36 || dev->state != RTPMIDI_CONN)
+			return;
+		for (i = 0; i < 3; i++)
+			ts[i] = rtpmidi_get64(p + 12 + 8 * i);
+		dev->talive = mdep_desp_clock();
+		if (p[8] == 0) {
+			ts[1] = rtpmidi_time();
+			rtpmidi_sendck(dev, 1, ts);
+		} else if (p[8] == 1) {
+			ts[2] = rtpmidi_time();
+			rtpmidi_sendck(dev, 2, ts);
+			dev->ckcount++;
+		}
+		break;
+	case RTPMIDI_RS:
+		if (n < 12 || dev->state != RTPMIDI_CONN)
+			return;
+		seq = rtpmidi_get32(p + 8) >> 16;
+		dev->talive = mdep_desp_clock();
+		if (!(((seq + 1) - dev->onewseq) & 0x8000))
+			rtpmidi_checkpoint(dev);
+		break;
+	}
+}
+
+/*
+ * handle all packets waiting on the given socket
+ */
+void
+rtpmidi_rx(struct rtpmidi *dev, unsigned data)
+{
+	unsigned char buf[RTPMIDI_PKTMAX];
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	ssize_t n;
+
+	for (;;) {
+		fromlen = sizeof(from);
+		n = recvfrom(data ? dev->dfd : dev->cfd, buf, sizeof(buf), 0,
+		    (struct sockaddr *)&from, &fromlen);
+		if (n <= 0)
+			break;
+		if (n >= 4 && buf[0] == 0xff && buf[1] == 0xff)
+			rtpmidi_rxsess(dev, data, buf, n, &from);
+		else if (data && dev->state == RTPMIDI_CONN &&
+		    (dev->mididev.mode & MIDIDEV_MODE_IN) &&
+		    !dev->mididev.eof)
+			rtpmidi_rxrtp(dev, buf, n);
+	}
+}
+
+/*
+ * run the session timers
+ */
+void
+rtpmidi_timo(struct rtpmidi *dev, unsigned long now)
+{
+	unsigned long long ts[3];
+
+	switch (dev->state) {
+	case RTPMIDI_INVCTL:
+	case RTPMIDI_INVDATA:
+		if (!dev->initiator)
+			break;
+		if (now - dev->tsend < (dev->ntries < RTPMIDI_INVMAX ?
+			RTPMIDI_INVRETRY : RTPMIDI_INVIDLE))
+			break;
+		if (dev->ntries >= RTPMIDI_INVMAX)
+			dev->state = RTPMIDI_INVCTL;
+		if (dev->state == RTPMIDI_INVCTL) {
+			dev->token = mdep_desp_cycles() & 0xffffffff;
+			rtpmidi_sendsess(dev, dev->cfd, &dev->caddr,
+			    RTPMIDI_IN);
+		} else {
+			rtpmidi_sendsess(dev, dev->dfd, &dev->daddr,
+			    RTPMIDI_IN);
+		}
+		dev->ntries++;
+		dev->tsend = now;
+		break;
+	case RTPMIDI_CONN:
+		if (now - dev->talive >= RTPMIDI_TIMEOUT) {
+			rtpmidi_stop(dev);
+			break;
+		}
+		if (dev->initiator && now - dev->tsend >=
+		    (dev->ckcount < RTPMIDI_CKNFAST ?
+			RTPMIDI_CKFAST : RTPMIDI_CKSLOW)) {
+			ts[0] = rtpmidi_time();
+			ts[1] = ts[2] = 0;
+			rtpmidi_sendck(dev, 0, ts);
+			dev->tsend = now;
+		}
+		if (dev->irs && now - dev->trs >= RTPMIDI_RSPERIOD) {
+			rtpmidi_sendrs(dev);
+			dev->irs = 0;
+			dev->trs = now;
+		}
+		break;
+	}
+}
+
+/*
+ * return 1 if rtpmidi_poll() must be called periodically: sockets
+ * don't wake up the realtime loop, so it's the case if there are
+ * sessions
+ */
+unsigned
+rtpmidi_busy(void)
+{
+	return rtpmidi_list != NULL;
+}
+
+/*
+ * handle received packets and run timers of all sessions, called
+ * by the realtime loop
+ */
+void
+rtpmidi_poll(void)
+{
+	struct rtpmidi *dev;
+	unsigned long now;
+
+	for (dev = rtpmidi_list; dev != NULL; dev = dev->next) {
+		rtpmidi_rx(dev, 0);
+		rtpmidi_rx(dev, 1);
+		now = mdep_desp_clock();
+		rtpmidi_timo(dev, now);
+	}
+}
@@ -0,0 +1,356 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * class compliant USB-MIDI device, using TinyUSB, available on chips
+ * with a native USB port (ESP32-S2/S3). The device is created with
+ * the "usb" path, eg:
+ *
+ *	dnew 1 "usb" rw
+ *
+ * MIDI bytes written by mididev_flush() are packed into 4-byte
+ * USB-MIDI event packets, queued in the TinyUSB transmit FIFO and
+ * sent by the USB stack in bulk transfers. Received packets are
+ * unpacked and passed to mididev_inputcb() by usbmidi_poll().
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "utils.h"
+#include "cons.h"
+#include "mididev.h"
+#include "str.h"
+#include "mdep_desp.h"
+
+#if defined(ESP_PLATFORM) && defined(CONFIG_TINYUSB_MIDI_ENABLED)
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "tusb.h"
+
+/*
+ * code index numbers from the USB-MIDI spec, ie. packet types
+ */
+#define USBMIDI_CIN_COMMON2	0x2	/* 2-byte system common */
+#define USBMIDI_CIN_COMMON3	0x3	/* 3-byte system common */
+#define USBMIDI_CIN_SXSTART	0x4	/* sysex start or continue */
+#define USBMIDI_CIN_SXEND1	0x5	/* sysex end with 1 byte */
+#define USBMIDI_CIN_SXEND2	0x6	/* sysex end with 2 bytes */
+#define USBMIDI_CIN_SXEND3	0x7	/* sysex end with 3 bytes */
+#define USBMIDI_CIN_BYTE	0xf	/* single byte */
+
+/*
+ * number of MIDI bytes in a packet, indexed by code index number
+ */
+unsigned usbmidi_cinlen[16] = {
+	0, 0, 2, 3, 3, 1, 2, 3, 3, 3, 3, 3, 2, 2, 3, 1
+};
+
+/*
+ * state of the byte stream to packets converter
+ */
+struct usbmidi_ostate {
+	unsigned status;		/* running status, or 0 */
+	unsigned need;			/* data bytes of the message */
+	unsigned insx;			/* within a sysex */
+	unsigned n;			/* bytes in pkt[1..3] */
+	unsigned char pkt[4];		/* packet being built */
+};
+
+struct usbmidi {
+	struct mididev mididev;		/* device stuff */
+	unsigned cable;			/* virtual cable number */
+	struct usbmidi_ostate ost;	/* output converter */
+};
+
+/*
+ * there's a single USB port, so only one device can use it
+ */
+struct usbmidi *usbmidi_dev = NULL;
+
+void	 usbmidi_open(struct mididev *);
+unsigned usbmidi_read(struct mididev *, unsigned char *, unsigned);
+unsigned usbmidi_write(struct mididev *, unsigned char *, unsigned);
+unsigned usbmidi_nfds(struct mididev *);
+unsigned usbmidi_pollfd(struct mididev *, struct pollfd *, int);
+int	 usbmidi_revents(struct mididev *, struct pollfd *);
+void	 usbmidi_close(struct mididev *);
+void	 usbmidi_del(struct mididev *);
+
+struct devops usbmidi_ops = {
+	usbmidi_open,
+	usbmidi_read,
+	usbmidi_write,
+	usbmidi_nfds,
+	usbmidi_pollfd,
+	usbmidi_revents,
+	usbmidi_close,
+	usbmidi_del
+};
+
+struct mididev *
+usbmidi_new(char *path, unsigned mode)
+{
+	struct usbmidi *dev;
+
+	if (usbmidi_dev != NULL) {
+		cons_err("usb midi port already in use");
+		return NULL;
+	}
+	dev = xmalloc(sizeof(struct usbmidi), "usbmidi");
+	mididev_init(&dev->mididev, &usbmidi_ops, mode);
+
+	/*
+	 * running status saves nothing, since packets have a
+	 * fixed size
+	 */
+	dev->mididev.runst = 0;
+	dev->cable = 0;
+	usbmidi_dev = dev;
+	return (struct mididev *)&dev->mididev;
+}
+
+void
+usbmidi_del(struct mididev *addr)
+{
+	struct usbmidi *dev = (struct usbmidi *)addr;
+
+	mididev_done(&dev->mididev);
+	if (usbmidi_dev == dev)
+		usbmidi_dev = NULL;
+	xfree(dev);
+}
+
+void
+usbmidi_open(struct mididev *addr)
+{
+	struct usbmidi *dev = (struct usbmidi *)addr;
+
+	dev->ost.status = 0;
+	dev->ost.insx = 0;
+	dev->ost.n = 0;
+
+	/*
+	 * discard packets received while the device was closed
+	 */
+	while (tud_midi_available())
+		(void)tud_midi_packet_read(dev->ost.pkt);
+}
+
+void
+usbmidi_close(struct mididev *addr)
+{
+}
+
+/*
+ * input is pushed by usbmidi_poll()
+ */
+unsigned
+usbmidi_read(struct mididev *addr, unsigned char *buf, unsigned count)
+{
+	return 0;
+}
+
+/*
+ * queue a packet of the given type with the bytes stored in the
+ * given state, return 0 if the FIFO is full
+ */
+unsigned
+usbmidi_putpkt(struct usbmidi *dev, struct usbmidi_ostate *s, unsigned cin)
+{
+	unsigned i;
+
+	s->pkt[0] = (dev->cable << 4) | cin;
+	for (i = 1 + s->n; i < 4; i++)
+		s->pkt[i] = 0;
+	s->n = 0;
+	return tud_midi_packet_write(s->pkt);
+}
+
+/*
+ * convert a byte to packets and queue them, return 0 if the FIFO is
+ * full, in which case the byte must be given again later
+ */
+unsigned
+usbmidi_putbyte(struct usbmidi *dev, unsigned c)
+{
+	struct usbmidi_ostate s;
+
+	s = dev->ost;
+	if (c >= 0xf8) {
+		s.pkt[1] = c;
+		s.n = 1;
+		if (!usbmidi_putpkt(dev, &s, USBMIDI_CIN_BYTE))
+			return 0;
+		return 1;
+	}
+	if (c == 0xf7) {
+		if (s.insx) {
+			s.pkt[++s.n] = c;
+			if (!usbmidi_putpkt(dev, &s, USBMIDI_CIN_SXEND1 + s.n - 1))
+				return 0;
+		}
+		s.insx = 0;
+		s.status = 0;
+	} else if (c >= 0x80) {
+		/*
+		 * a status byte aborts the current sysex
+		 */
+		s.insx = 0;
+		s.n = 0;
+		s.status = c;
+		if (c == 0xf0) {
+			s.insx = 1;
+			s.pkt[++s.n] = c;
+			s.status = 0;
+		} else if (c < 0xf0) {
+			s.need = (c >= 0xc0 && c < 0xe0) ? 1 : 2;
+		} else if (c == 0xf1 || c == 0xf3) {
+			s.need = 1;
+		} else if (c == 0xf2) {
+			s.need = 2;
+		} else {
+			s.pkt[++s.n] = c;
+			s.status = 0;
+			if (c == 0xf6 &&
+			    !usbmidi_putpkt(dev, &s, USBMIDI_CIN_SXEND1))
+				return 0;
+			s.n = 0;
+		}
+	} else if (s.insx) {
+		s.pkt[++s.n] = c;
+		if (s.n == 3 &&
+		    !usbmidi_putpkt(dev, &s, USBMIDI_CIN_SXSTART))
+			return 0;
+	} else if (s.status) {
+		if (s.n == 0)
+			s.pkt[++s.n] = s.status;
+		s.pkt[++s.n] = c;
+		if (s.n == 1 + s.need) {
+			if (s.status < 0xf0) {
+				if (!usbmidi_putpkt(dev, &s, s.status >> 4))
+					return 0;
+			} else {
+				if (!usbmidi_putpkt(dev, &s, s.need == 1 ?
+					USBMIDI_CIN_COMMON2 : USBMIDI_CIN_COMMON3))
+					return 0;
+				s.status = 0;
+			}
+		}
+	}
+	dev->ost = s;
+	return 1;
+}
+
+/*
+ * convert bytes to packets, return the number of bytes processed,
+ * which is less than 'count' only if the FIFO is full. If nobody
+ * listens on the port, data is discarded
+ */
+unsigned
+usbmidi_write(struct mididev *addr, unsigned char *buf, unsigned count)
+{
+	struct usbmidi *dev = (struct usbmidi *)addr;
+	unsigned n;
+
+	if (!tud_midi_mounted())
+		return count;
+	for (n = 0; n < count; n++) {
+		if (!usbmidi_putbyte(dev, buf[n]))
+			break;
+	}
+	if (n < count) {
+		/*
+		 * let the USB task drain the FIFO
+		 */
+		vTaskDelay(1);
+	}
+	return n;
+}
+
+unsigned
+usbmidi_nfds(struct mididev *addr)
+{
+	return 0;
+}
+
+unsigned
+usbmidi_pollfd(struct mididev *addr, struct pollfd *pfd, int events)
+{
+	return 0;
+}
+
+int
+usbmidi_revents(struct mididev *addr, struct pollfd *pfd)
+{
+	return 0;
+}
+
+/*
+ * called by the USB stack when packets are received
+ */
+void
+tud_midi_rx_cb(uint8_t itf)
+{
+	mdep_wakeup();
+}
+
+/*
+ * unpack received packets and give them to the parser, called by
+ * the realtime loop
+ */
+void
+usbmidi_poll(void)
+{
+	struct usbmidi *dev = usbmidi_dev;
+	unsigned char pkt[4], buf[4 * 16];
+	unsigned len, n;
+
+	if (dev == NULL || dev->mididev.eof ||
+	    !(dev->mididev.mode & MIDIDEV_MODE_IN))
+		return;
+	for (;;) {
+		n = 0;
+		while (n + 3 <= sizeof(buf) && tud_midi_packet_read(pkt)) {
+			if ((pkt[0] >> 4) != dev->cable)
+				continue;
+			len = usbmidi_cinlen[pkt[0] & 0xf];
+			memcpy(buf + n, pkt + 1, len);
+			n += len;
+		}
+		if (n == 0)
+			break;
+		dev->mididev.ilast = timo_abstime;
+		mididev_istamp = mdep_desp_clock();
+		mididev_inputcb(&dev->mididev, buf, n);
+	}
+}
+
+#else
+
+struct mididev *
+usbmidi_new(char *path, unsigned mode)
+{
+	cons_err("usb midi not supported");
+	return NULL;
+}
+
+void
+usbmidi_poll(void)
+{
+}
+
+#endif
@@ -43,6 +43,7 @@
  *
  */
 
+#include <string.h>
 #include "utils.h"
 #include "defs.h"
 #include "mididev.h"
@@ -54,6 +55,9 @@
 #include "mux.h"
 #include "timo.h"
 #include "conv.h"
+#include "mdep_desp.h"
+#include "ticprof.h"
+#include "sim.h"
 
 #define MIDI_SYSEXSTART	0xf0
 #define MIDI_QFRAME	0xf1
@@ -76,6 +80,29 @@ unsigned mididev_evlen[] = { 2, 2, 2, 2, 1, 1, 2, 0 };
 struct mididev *mididev_list, *mididev_clksrc, *mididev_mtcsrc;
 struct mididev *mididev_byunit[DEFAULT_MAXNDEVS];
 
+/*
+ * number of devices with held events (npend > 0), so the timer
+ * callback doesn't have to walk the device list when it's zero
+ */
+unsigned mididev_nheld = 0;
+
+/*
+ * arrival time (in microseconds) of the bytes passed to
+ * mididev_inputcb(), set by the caller. While an input voice event
+ * is processed, output devices it's sent to record it, so the
+ * latency can be measured when they are flushed
+ */
+unsigned long mididev_istamp;
+
+/*
+ * nominal time (in microseconds) the output being generated is due
+ * at, set by the clock before running callbacks: for a tick it's the
+ * time the tick should have occurred, even if it's processed late.
+ * Backends use it for devices with lookahead
+ */
+unsigned long mididev_ostamp;
+unsigned mididev_ilatpend = 0;
+
 /*
  * initialize the mtc "parser" to a state, when a full message or 2 complete
  * frames are needed to lock to the master
@@ -87,7 +114,7 @@ mtc_init(struct mtc *mtc)
 	mtc->qfr = 0;
 	mtc->pos = 0xdeadbeef;
 	mtc->state = MTC_STOP;
-	mtc->timo = 0;
+	timo_set(&mtc->timo, mtc_timo, mtc);
 };
 
 /*
@@ -122,8 +149,10 @@ mtc_setfps(struct mtc *mtc, unsigned id)
  * called when timeout expires, ie MTC stopped
  */
 void
-mtc_timo(struct mtc *mtc)
+mtc_timo(void *arg)
 {
+	struct mtc *mtc = arg;
+
 	if (mididev_debug)
 		log_puts("mtc_timo: stopped\n");
 	mtc->state = MTC_STOP;
@@ -158,7 +187,8 @@ mtc_tick(struct mtc *mtc, unsigned data)
 	mtc->nibble[mtc->qfr++] = data & 0xf;
 	if (mtc->qfr < 8)
 		return;
-	mtc->timo = 24000000 / 4;
+	timo_del(&mtc->timo);
+	timo_add(&mtc->timo, 24000000 / 4);
 	pos = mtc->tps * 4 * (mtc->nibble[0] +  (mtc->nibble[1]      << 4)) +
 	    MTC_SEC *        (mtc->nibble[2] +  (mtc->nibble[3]      << 4)) +
 	    MTC_SEC * 60 *   (mtc->nibble[4] +  (mtc->nibble[5]      << 4)) +
@@ -249,7 +279,13 @@ mididev_init(struct mididev *o, struct devops *ops, unsigned mode)
 	o->istatus = o->ostatus = 0;
 	o->isysex = NULL;
 	o->runst = 1;
-	o->sync = 0;
+	o->ixthru = -1;
+	o->olatpend = 0;
+	o->obaud = 0;
+	o->npend = 0;
+	o->ocoal = 0;
+	o->olook = 0;
+	mididev_latreset(o);
 }
 
 /*
@@ -261,6 +297,10 @@ mididev_done(struct mididev *o)
 {
 	if (mux_isopen)
 		mididev_close(o);
+	if (o->npend > 0) {
+		mididev_nheld--;
+		o->npend = 0;
+	}
 }
 
 /*
@@ -273,7 +313,20 @@ mididev_open(struct mididev *o)
 	o->oused = 0;
 	o->istatus = o->ostatus = 0;
 	o->isysex = NULL;
+	o->isxlong = 0;
+	o->olatpend = 0;
+	if (o->npend > 0) {
+		mididev_nheld--;
+		o->npend = 0;
+	}
+	o->ocredit = 0;
+	o->ocredstamp = mdep_desp_clock();
 	mtc_init(&o->imtc);
+	timo_set(&o->isenstimo, mididev_isenstimo, o);
+	timo_set(&o->osenstimo, mididev_osenstimo, o);
+	o->ilast = o->olast = timo_abstime;
+	if (o->mode & MIDIDEV_MODE_OUT)
+		timo_add(&o->osenstimo, MIDIDEV_OSENSTO);
 	o->ops->open(o);
 }
 
@@ -283,11 +336,107 @@ mididev_open(struct mididev *o)
 void
 mididev_close(struct mididev *o)
 {
+	mididev_putpend(o, 0);
 	mididev_flush(o);
+	timo_del(&o->isenstimo);
+	timo_del(&o->osenstimo);
+	timo_del(&o->imtc.timo);
 	o->ops->close(o);
 	o->eof = 1;
 }
 
+/*
+ * input sensing timeout: unless input was received since it was
+ * scheduled, the device is considered disconnected
+ */
+void
+mididev_isenstimo(void *arg)
+{
+	struct mididev *o = arg;
+	unsigned idle;
+
+	idle = timo_abstime - o->ilast;
+	if (idle < MIDIDEV_ISENSTO) {
+		timo_add(&o->isenstimo, MIDIDEV_ISENSTO - idle);
+		return;
+	}
+	cons_erru(o->unit, "sensing timeout, disabled");
+}
+
+/*
+ * output sensing timeout: send an active sensing message if nothing
+ * was sent since it was scheduled
+ */
+void
+mididev_osenstimo(void *arg)
+{
+	struct mididev *o = arg;
+	unsigned idle;
+
+	idle = timo_abstime - o->olast;
+	if (idle >= MIDIDEV_OSENSTO) {
+		mididev_putack(o);
+		mididev_flush(o);
+		idle = 0;
+	}
+	timo_add(&o->osenstimo, MIDIDEV_OSENSTO - idle);
+}
+
+/*
+ * clear latency stats of the given device
+ */
+void
+mididev_latreset(struct mididev *o)
+{
+	struct mididev_lat *l = &o->lat;
+	unsigned i;
+
+	l->n = l->sum = l->min = l->max = l->last = 0;
+	for (i = 0; i < MIDIDEV_LATNBKT; i++)
+		l->hist[i] = l->jhist[i] = 0;
+}
+
+/*
+ * return the histogram bucket of the given time in microseconds
+ */
+unsigned
+mididev_latbkt(unsigned long usec)
+{
+	unsigned long lim;
+	unsigned b;
+
+	lim = MIDIDEV_LATBKT0;
+	for (b = 0; b < MIDIDEV_LATNBKT - 1; b++) {
+		if (usec < lim)
+			break;
+		lim <<= 1;
+	}
+	return b;
+}
+
+/*
+ * add a latency sample to the stats of the given device
+ */
+void
+mididev_latadd(struct mididev *o, unsigned long usec)
+{
+	struct mididev_lat *l = &o->lat;
+	unsigned long jit;
+
+	if (l->n > 0) {
+		jit = usec > l->last ? usec - l->last : l->last - usec;
+		l->jhist[mididev_latbkt(jit)]++;
+	}
+	if (l->n == 0 || usec < l->min)
+		l->min = usec;
+	if (usec > l->max)
+		l->max = usec;
+	l->sum += usec;
+	l->last = usec;
+	l->hist[mididev_latbkt(usec)]++;
+	l->n++;
+}
+
 /*
  * flush the given midi device
  */
@@ -299,6 +448,10 @@ mididev_flush(struct mididev *o)
 	unsigned i;
 
 	if (!o->eof) {
+		if (o->obaud > 0) {
+			mididev_credit(o);
+			mididev_putpend(o, 1);
+		}
 		if (mididev_debug && o->oused > 0) {
 			log_puts("mididev_flush: ");
 			log_putu(timo_abstime / 24);
@@ -311,6 +464,9 @@ mididev_flush(struct mididev *o)
 			}
 			log_puts("\n");
 		}
+		ticprof_out(o->oused);
+		if (sim_active)
+			sim_out(o, o->obuf, o->oused);
 		todo = o->oused;
 		buf = o->obuf;
 		while (todo > 0) {
@@ -321,11 +477,90 @@ mididev_flush(struct mididev *o)
 			buf += count;
 		}
 		if (o->oused)
-			o->osensto = MIDIDEV_OSENSTO;
+			o->olast = timo_abstime;
+		if (o->obaud > 0)
+			o->ocredit -= o->oused;
+		if (o->olatpend && o->oused)
+			mididev_latadd(o, mdep_desp_clock() - o->olatstamp);
 	}
+	o->olatpend = 0;
 	o->oused = 0;
 }
 
+/*
+ * return the device input sysex messages of the given device are
+ * forwarded to, or NULL if none
+ */
+struct mididev *
+mididev_xthru(struct mididev *o)
+{
+	if (o->ixthru < 0)
+		return NULL;
+	return mididev_byunit[o->ixthru];
+}
+
+/*
+ * add a byte to the input sysex. Messages fitting in a single chunk
+ * are buffered and handled by mux_sysexcb() once complete, because
+ * they may be custom events. Longer ones are forwarded to the thru
+ * device as they arrive, and buffered only if they are recorded.
+ * Return 1 if bytes were forwarded.
+ */
+unsigned
+mididev_sxbyte(struct mididev *o, unsigned data)
+{
+	struct mididev *thru;
+	struct chunk *ck;
+	unsigned char c;
+
+	thru = mididev_xthru(o);
+	if (!o->isxlong) {
+		ck = o->isysex->last;
+		if (ck->used < CHUNK_SIZE) {
+			sysex_add(o->isysex, data);
+			return 0;
+		}
+		o->isxlong = 1;
+		if (thru)
+			mididev_sendraw(thru, ck->data, ck->used);
+		if (!mux_sysexrec()) {
+			sysex_del(o->isysex);
+			o->isysex = NULL;
+		}
+	}
+	if (o->isysex)
+		sysex_add(o->isysex, data);
+	if (thru == NULL)
+		return 0;
+	c = data;
+	mididev_sendraw(thru, &c, 1);
+	return 1;
+}
+
+/*
+ * abort the current input sysex. If it was being forwarded,
+ * terminate it, so the thru device doesn't wait for the end
+ */
+void
+mididev_sxabort(struct mididev *o)
+{
+	struct mididev *thru;
+	unsigned char c;
+
+	if (o->isxlong) {
+		thru = mididev_xthru(o);
+		if (thru) {
+			c = MIDI_SYSEXSTOP;
+			mididev_sendraw(thru, &c, 1);
+		}
+		o->isxlong = 0;
+	}
+	if (o->isysex) {
+		sysex_del(o->isysex);
+		o->isysex = NULL;
+	}
+}
+
 /*
  * mididev_inputcb is called when midi data becomes available
  * it calls mux_evcb
@@ -333,13 +568,15 @@ mididev_flush(struct mididev *o)
 void
 mididev_inputcb(struct mididev *o, unsigned char *buf, unsigned count)
 {
+	struct mididev *thru;
 	struct ev ev;
-	unsigned i, data;
+	unsigned i, data, sxout;
 
 	if (!(o->mode & MIDIDEV_MODE_IN)) {
 		log_puts("received data from output only device\n");
 		return;
 	}
+	mux_indrop(o->unit, o->idrop);
 	if (mididev_debug) {
 		log_puts("mididev_inputcb: ");
 		log_putu(timo_abstime / 24);
@@ -352,6 +589,7 @@ mididev_inputcb(struct mididev *o, unsigned char *buf, unsigned count)
 		}
 		log_puts("\n");
 	}
+	sxout = 0;
 	while (count != 0) {
 		data = *buf;
 		count--;
@@ -360,7 +598,7 @@ mididev_inputcb(struct mididev *o, unsigned char *buf, unsigned count)
 			switch(data) {
 			case MIDI_TIC:
 				if (o == mididev_clksrc)
-					mux_ticcb();
+					mux_clkcb();
 				break;
 			case MIDI_START:
 				if (o == mididev_clksrc) {
@@ -399,17 +637,20 @@ mididev_inputcb(struct mididev *o, unsigned char *buf, unsigned count)
 			o->icount = 0;
 			switch(data) {
 			case MIDI_SYSEXSTART:
-				if (o->isysex) {
+				if (o->isysex || o->isxlong) {
 					if (mididev_debug)
 						log_puts("mididev_inputcb: previous sysex aborted\n");
-					sysex_del(o->isysex);
+					mididev_sxabort(o);
 				}
 				o->isysex = sysex_new(o->unit);
 				sysex_add(o->isysex, data);
 				break;
 			case MIDI_SYSEXSTOP:
+				if (o->isysex || o->isxlong) {
+					sxout |= mididev_sxbyte(o, data);
+					o->isxlong = 0;
+				}
 				if (o->isysex) {
-					sysex_add(o->isysex, data);
 					if (o == mididev_mtcsrc)
 						mtc_full(&o->imtc, o->isysex);
 					mux_sysexcb(o->unit, o->isysex);
@@ -422,11 +663,11 @@ mididev_inputcb(struct mididev *o, unsigned char *buf, unsigned count)
 				 * sysex message without the stop byte
 				 * is considered as aborted.
 				 */
-				if (o->isysex) {
+				if (o->isysex || o->isxlong) {
 					if (mididev_debug)
 						log_puts("mididev_inputcb: current sysex aborted\n");
-					sysex_del(o->isysex);
-					o->isysex = NULL;
+					sxout |= o->isxlong;
+					mididev_sxabort(o);
 				}
 				break;
 			}
@@ -436,6 +677,16 @@ mididev_inputcb(struct mididev *o, unsigned char *buf, unsigned count)
 
 			if (o->icount == MIDIDEV_EVLEN(o->istatus)) {
 				o->icount = 0;
+
+				/*
+				 * drop events the filter would discard,
+				 * except note-offs, see song_indrop()
+				 */
+				if ((o->idrop[(o->istatus >> 4) & 7] &
+					(1U << (o->istatus & 0x0f))) &&
+				    (o->istatus >> 4 != EV_NON ||
+					o->idata[1] != 0))
+					continue;
 				ev.cmd = o->istatus >> 4;
 				ev.dev = o->unit;
 				ev.ch = o->istatus & 0x0f;
@@ -449,10 +700,12 @@ mididev_inputcb(struct mididev *o, unsigned char *buf, unsigned count)
 					ev.v0 = o->idata[0];
 					ev.v1 = o->idata[1];
 				}
+				mididev_ilatpend = 1;
 				mux_evcb(o->unit, &ev);
+				mididev_ilatpend = 0;
 			}
 		} else if (o->istatus == MIDI_SYSEXSTART) {
-			sysex_add(o->isysex, data);
+			sxout |= mididev_sxbyte(o, data);
 		} else if (o->istatus == MIDI_QFRAME) {
 			/*
 			 * NOTE: MIDI uses running status only for voice events
@@ -464,6 +717,11 @@ mididev_inputcb(struct mididev *o, unsigned char *buf, unsigned count)
 			o->istatus = 0;
 		}
 	}
+	if (sxout) {
+		thru = mididev_xthru(o);
+		if (thru)
+			mididev_flush(thru);
+	}
 }
 
 /*
@@ -487,32 +745,52 @@ void
 mididev_putstart(struct mididev *o)
 {
 	mididev_out(o, MIDI_START);
-	if (o->sync)
-		mididev_flush(o);
 }
 
 void
 mididev_putstop(struct mididev *o)
 {
 	mididev_out(o, MIDI_STOP);
-	if (o->sync)
-		mididev_flush(o);
 }
 
 void
 mididev_puttic(struct mididev *o)
 {
 	mididev_out(o, MIDI_TIC);
-	if (o->sync)
-		mididev_flush(o);
 }
 
 void
 mididev_putack(struct mididev *o)
 {
 	mididev_out(o, MIDI_ACK);
-	if (o->sync)
+}
+
+/*
+ * queue the message of the given sysex pattern event: copy the
+ * pattern and store the parameters at the offsets of its atoms
+ */
+void
+mididev_putpat(struct mididev *o, struct ev *ev)
+{
+	struct evinfo *ei = &evinfo[ev->cmd];
+	unsigned char *p;
+
+	if (!(o->mode & MIDIDEV_MODE_OUT))
+		return;
+	o->ostatus = 0;
+	if (o->oused + ei->patlen > MIDIDEV_BUFLEN)
 		mididev_flush(o);
+	p = o->obuf + o->oused;
+	memcpy(p, ei->pattern, ei->patlen);
+	if (ei->patoffs[0])
+		p[ei->patoffs[0]] = ev->v0 >> 7;
+	if (ei->patoffs[1])
+		p[ei->patoffs[1]] = ev->v0 & 0x7f;
+	if (ei->patoffs[2])
+		p[ei->patoffs[2]] = ev->v1 >> 7;
+	if (ei->patoffs[3])
+		p[ei->patoffs[3]] = ev->v1 & 0x7f;
+	o->oused += ei->patlen;
 }
 
 /*
@@ -522,37 +800,40 @@ mididev_putack(struct mididev *o)
 void
 mididev_putev(struct mididev *o, struct ev *ev)
 {
-	unsigned char *p;
-	unsigned s;
-
+	if (mididev_ilatpend && !o->olatpend) {
+		o->olatpend = 1;
+		o->olatstamp = mididev_istamp;
+	}
 	if (EV_ISSX(ev)) {
-		o->ostatus = 0;
-		p = evinfo[ev->cmd].pattern;
-		for (;;) {
-			switch (*p) {
-			case EV_PATV0_HI:
-				mididev_out(o, ev->v0 >> 7);
-				break;
-			case EV_PATV0_LO:
-				mididev_out(o, ev->v0 & 0x7f);
-				break;
-			case EV_PATV1_HI:
-				mididev_out(o, ev->v1 >> 7);
-				break;
-			case EV_PATV1_LO:
-				mididev_out(o, ev->v1 & 0x7f);
-				break;
-			default:
-				mididev_out(o, *p);
-				if (*p == 0xf7)
-					goto end;
-			}
-			p++;
-		}
+		mididev_putpat(o, ev);
+		return;
 	}
 	if (!EV_ISVOICE(ev)) {
 		return;
 	}
+	if (o->obaud > 0) {
+		if (mididev_pendable(ev)) {
+			mididev_hold(o, ev);
+			return;
+		}
+		/*
+		 * notes go first, other events must not be sent
+		 * before continuous events of their channel
+		 */
+		if (ev->cmd != EV_NON && ev->cmd != EV_NOFF)
+			mididev_putpendch(o, ev->ch);
+	}
+	mididev_putvoice(o, ev);
+}
+
+/*
+ * queue the given voice event, using running status if enabled
+ */
+void
+mididev_putvoice(struct mididev *o, struct ev *ev)
+{
+	unsigned s;
+
 	if (ev->cmd == EV_NOFF) {
 		s = ev->ch + (EV_NON << 4);
 		if (!o->runst || s != o->ostatus) {
@@ -580,9 +861,157 @@ mididev_putev(struct mididev *o, struct ev *ev)
 			mididev_out(o, ev->v1);
 		}
 	}
-end:
-	if (o->sync)
-		mididev_flush(o);
+}
+
+/*
+ * return true if the given event may be held by the output
+ * scheduler: pitch bends, aftertouch and continuous
+ * controllers. Bank select, data entry, (N)RPN, switches and
+ * channel mode messages are sent in order
+ */
+unsigned
+mididev_pendable(struct ev *ev)
+{
+	unsigned c;
+
+	switch (ev->cmd) {
+	case EV_BEND:
+	case EV_CAT:
+	case EV_KAT:
+		return 1;
+	case EV_CTL:
+		c = ev->ctl_num;
+		if (c == 0 || c == 6 || c == 32 || c == 38 ||
+		    (c >= 64 && c <= 69) || (c >= 96 && c <= 101) || c >= 120)
+			return 0;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * hold the given event until the end of the tick, replacing the
+ * one it supersedes, if any
+ */
+void
+mididev_hold(struct mididev *o, struct ev *ev)
+{
+	struct mididev_pend *p;
+	unsigned i;
+
+	for (i = 0; i < o->npend; i++) {
+		p = &o->opend[i];
+		if (p->cmd == ev->cmd && p->ch == ev->ch &&
+		    (ev->cmd == EV_BEND || ev->cmd == EV_CAT ||
+		    p->v0 == ev->v0)) {
+			p->v0 = ev->v0;
+			p->v1 = ev->v1;
+			o->ocoal++;
+			return;
+		}
+	}
+	if (o->npend == MIDIDEV_NPEND) {
+		/*
+		 * no room, send the oldest one now
+		 */
+		mididev_putpend1(o, 0);
+	}
+	if (o->npend == 0)
+		mididev_nheld++;
+	p = &o->opend[o->npend++];
+	p->cmd = ev->cmd;
+	p->ch = ev->ch;
+	p->v0 = ev->v0;
+	p->v1 = ev->v1;
+}
+
+/*
+ * send the given held event and remove it from the list
+ */
+void
+mididev_putpend1(struct mididev *o, unsigned i)
+{
+	struct ev ev;
+
+	ev.cmd = o->opend[i].cmd;
+	ev.ch = o->opend[i].ch;
+	ev.dev = o->unit;
+	ev.v0 = o->opend[i].v0;
+	ev.v1 = o->opend[i].v1;
+	o->npend--;
+	if (o->npend == 0)
+		mididev_nheld--;
+	for (; i < o->npend; i++)
+		o->opend[i] = o->opend[i + 1];
+	mididev_putvoice(o, &ev);
+}
+
+/*
+ * send all held events of the given channel
+ */
+void
+mididev_putpendch(struct mididev *o, unsigned ch)
+{
+	unsigned i;
+
+	for (i = 0; i < o->npend; ) {
+		if (o->opend[i].ch == ch)
+			mididev_putpend1(o, i);
+		else
+			i++;
+	}
+}
+
+/*
+ * send held events, in the order they were queued. If 'budget' is
+ * set, stop once the byte budget of the port is spent, remaining
+ * events are sent at the next flush
+ */
+void
+mididev_putpend(struct mididev *o, unsigned budget)
+{
+	while (o->npend > 0) {
+		if (o->oused + 3 > MIDIDEV_BUFLEN)
+			break;
+		if (budget && o->ocredit - (long)o->oused <= 0)
+			break;
+		mididev_putpend1(o, 0);
+	}
+}
+
+/*
+ * add the bytes the port has transmitted since the last call to
+ * the budget, the budget is bounded, so the port can't send large
+ * bursts after being idle
+ */
+void
+mididev_credit(struct mididev *o)
+{
+	unsigned long now, delta, bytes;
+	long max;
+
+	now = mdep_desp_clock();
+	max = (unsigned long long)MIDIDEV_BURSTUS * o->obaud / 10 / 1000000;
+	if (max < 3)
+		max = 3;
+	delta = now - o->ocredstamp;
+	if (delta >= 1000000) {
+		o->ocredit = max;
+		o->ocredstamp = now;
+		return;
+	}
+
+	/*
+	 * only move the stamp by the time of whole bytes, so
+	 * fractions of bytes are not lost
+	 */
+	bytes = (unsigned long long)delta * o->obaud / 10 / 1000000;
+	o->ocredstamp += (unsigned long long)bytes * 10 * 1000000 / o->obaud;
+	o->ocredit += bytes;
+	if (o->ocredit > max) {
+		o->ocredit = max;
+		o->ocredstamp = now;
+	}
 }
 
 /*
@@ -607,8 +1036,6 @@ mididev_sendraw(struct mididev *o, unsigned char *buf, unsigned len)
 	 * since we don't parse the buffer, reset running status
 	 */
 	o->ostatus = 0;
-	if (o->sync)
-		mididev_flush(o);
 }
 
 /*
@@ -669,7 +1096,14 @@ mididev_attach(unsigned unit, char *path, unsigned mode)
 #elif defined(USE_RAW)
 	dev = raw_new(path, mode);
 #else
-	dev = desp_new(path, mode);
+	if (path != NULL && str_eq(path, "usb"))
+		dev = usbmidi_new(path, mode);
+	else if (path != NULL && str_eq(path, "ble"))
+		dev = blemidi_new(path, mode);
+	else if (path != NULL && strncmp(path, "rtp:", 4) == 0)
+		dev = rtpmidi_new(path, mode);
+	else
+		dev = desp_new(path, mode);
 #endif
 	if (dev == NULL)
 		return 0;
@@ -699,6 +1133,10 @@ mididev_detach(unsigned unit)
 		return 0;
 	}
 
+	for (dev = mididev_list; dev != NULL; dev = dev->next) {
+		if (dev->ixthru == (int)unit)
+			dev->ixthru = -1;
+	}
 	for (i = &mididev_list; *i != NULL; i = &(*i)->next) {
 		dev = *i;
 		if (dev->unit == unit) {
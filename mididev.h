@@ -17,6 +17,8 @@
 #ifndef MIDISH_MIDIDEV_H
 #define MIDISH_MIDIDEV_H
 
+#include "timo.h"
+
 /*
  * timeouts for active sensing
  * (as usual units are 24th of microsecond)
@@ -35,6 +37,29 @@
  */
 #define MIDIDEV_BUFLEN	0x400
 
+/*
+ * max number of continuous events (controllers, bends, aftertouch)
+ * the output scheduler holds until the end of the tick; the max
+ * number of bytes it sends at once after the port was idle, in
+ * microseconds of line time; line rate of serial MIDI ports
+ */
+#define MIDIDEV_NPEND		32
+#define MIDIDEV_BURSTUS		10000
+#define MIDIDEV_BAUD		31250
+
+/*
+ * max output lookahead, in milliseconds
+ */
+#define MIDIDEV_MAXLOOK		100
+
+/*
+ * number of buckets of latency histograms, and width of the first
+ * bucket in microseconds; each bucket is twice as wide as the
+ * previous one, the last one has no upper bound
+ */
+#define MIDIDEV_LATNBKT		12
+#define MIDIDEV_LATBKT0		64
+
 struct pollfd;
 struct mididev;
 struct ev;
@@ -91,7 +116,27 @@ struct mtc {
 #define MTC_START	1		/* got a full frame but no tick yet */
 #define MTC_RUN		2		/* got at least 1 tick */
 	unsigned state;			/* one of above */
-	unsigned timo;
+	struct timo timo;		/* expires when MTC stops */
+};
+
+/*
+ * latency of input events sent to an output device, measured from
+ * the arrival of the input bytes to the flush of the output buffer
+ */
+struct mididev_lat {
+	unsigned long n;			/* number of samples */
+	unsigned long sum, min, max;		/* in microseconds */
+	unsigned long last;			/* last sample, for jitter */
+	unsigned long hist[MIDIDEV_LATNBKT];	/* latency histogram */
+	unsigned long jhist[MIDIDEV_LATNBKT];	/* jitter histogram */
+};
+
+/*
+ * continuous event held by the output scheduler, see struct ev
+ */
+struct mididev_pend {
+	unsigned char cmd, ch;
+	unsigned v0, v1;
 };
 
 struct mididev {
@@ -110,13 +155,15 @@ struct mididev {
 	unsigned ticrate, ticdelta;	/* tick rate (default 96) */
 	unsigned sendclk;		/* send MIDI clock */
 	unsigned sendmmc;		/* send MMC start/stop/relocate */
-	unsigned isensto, osensto;	/* active sensing timeouts */
+	struct timo isenstimo;		/* input sensing, set if enabled */
+	struct timo osenstimo;		/* output sensing */
+	unsigned ilast, olast;		/* timo_abstime of last i/o */
 	unsigned mode;			/* read, write */
 	unsigned ixctlset, oxctlset;	/* bitmap of 14bit controllers */
 	unsigned ievset, oevset;	/* bitmap of CONV_{XPC,NRPN,RPN} */
 	unsigned eof;			/* i/o error pending */
 	unsigned runst;			/* use running status for output */
-	unsigned sync;			/* flush buffer after each message */
+	int ixthru;			/* forward input sysex, or -1 */
 
 	/*
 	 * midi events parser state
@@ -125,10 +172,37 @@ struct mididev {
 	unsigned 	  icount;		/* bytes in idata[] */
 	unsigned char	  idata[2];		/* current event's data */
 	struct sysex	 *isysex;		/* input sysex */
+	unsigned	  isxlong;		/* sysex doesn't fit a chunk */
 	struct mtc	  imtc;			/* MTC parser */
+	unsigned short	  idrop[8];	/* channels to drop, by status */
 	unsigned 	  oused;		/* bytes in obuf */
 	unsigned	  ostatus;		/* output running status */
 	unsigned char	  obuf[MIDIDEV_BUFLEN];	/* output buffer */
+
+	/*
+	 * output scheduler: continuous events held until the end of
+	 * the tick, superseded ones are dropped; byte budget of the
+	 * port, so held events don't delay notes
+	 */
+	unsigned	  obaud;		/* line rate, 0 = no scheduler */
+	long		  ocredit;		/* bytes we may send now */
+	unsigned long	  ocredstamp;		/* last credit update */
+	unsigned	  npend;		/* events in opend[] */
+	struct mididev_pend opend[MIDIDEV_NPEND]; /* held events */
+	unsigned long	  ocoal;		/* superseded events */
+
+	/*
+	 * output lookahead: bytes are queued with their nominal time
+	 * plus this delay and sent by the timer when due
+	 */
+	unsigned long	  olook;		/* delay in us, 0 = none */
+
+	/*
+	 * thru latency measurement
+	 */
+	unsigned	  olatpend;		/* obuf has input events */
+	unsigned long	  olatstamp;		/* arrival of the oldest */
+	struct mididev_lat lat;			/* stats */
 };
 
 void mididev_init(struct mididev *, struct devops *, unsigned);
@@ -139,14 +213,31 @@ void mididev_putstop(struct mididev *);
 void mididev_puttic(struct mididev *);
 void mididev_putack(struct mididev *);
 void mididev_putev(struct mididev *, struct ev *);
+void mididev_putpat(struct mididev *, struct ev *);
+void mididev_putvoice(struct mididev *, struct ev *);
+unsigned mididev_pendable(struct ev *);
+void mididev_hold(struct mididev *, struct ev *);
+void mididev_putpend1(struct mididev *, unsigned);
+void mididev_putpendch(struct mididev *, unsigned);
+void mididev_putpend(struct mididev *, unsigned);
+void mididev_credit(struct mididev *);
 void mididev_sendraw(struct mididev *, unsigned char *, unsigned);
 void mididev_open(struct mididev *);
 void mididev_close(struct mididev *);
 void mididev_inputcb(struct mididev *, unsigned char *, unsigned);
+struct mididev *mididev_xthru(struct mididev *);
+void mididev_latreset(struct mididev *);
+unsigned mididev_latbkt(unsigned long);
 
-void mtc_timo(struct mtc *); /* XXX, use timeouts */
+void mididev_isenstimo(void *);
+void mididev_osenstimo(void *);
+void mtc_timo(void *);
 
 extern unsigned mididev_debug;
+extern unsigned long mididev_istamp;
+extern unsigned long mididev_ostamp;
+extern unsigned mididev_ilatpend;
+extern unsigned mididev_nheld;
 
 extern struct mididev *mididev_list;
 extern struct mididev *mididev_clksrc;
@@ -157,6 +248,14 @@ struct mididev *raw_new(char *, unsigned);
 struct mididev *alsa_new(char *, unsigned);
 struct mididev *sndio_new(char *, unsigned);
 struct mididev *desp_new(char *, unsigned);
+struct mididev *usbmidi_new(char *, unsigned);
+void usbmidi_poll(void);
+struct mididev *blemidi_new(char *, unsigned);
+void blemidi_poll(void);
+unsigned blemidi_busy(void);
+struct mididev *rtpmidi_new(char *, unsigned);
+void rtpmidi_poll(void);
+unsigned rtpmidi_busy(void);
 
 
 void mididev_listinit(void);
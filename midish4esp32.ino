@@ -23,24 +23,184 @@
 #include "user.h" 
 #include "mdep_desp.h"
 
+#if CONFIG_TINYUSB_MIDI_ENABLED
+#include "USB.h"
+#include "USBMIDI.h"
+
+// registers the class compliant MIDI interface, midish uses it as
+// the "usb" device (see mdep_usbmidi.c)
+USBMIDI usbMidi;
+#endif
+
+// set to 1 to register the Bluetooth LE MIDI service, midish uses
+// it as the "ble" device (see mdep_blemidi.c)
+#define BLEMIDI_ENABLE 0
+
+#if BLEMIDI_ENABLE
+#include <BLEDevice.h>
+#include <BLEServer.h>
+#include <BLE2902.h>
+
+#define BLEMIDI_SERVICE "03b80e5a-ede8-4b33-a751-6ce34ec4c700"
+#define BLEMIDI_CHAR    "7772e5db-3868-4112-a1a9-f2669d106bf3"
+
+BLECharacteristic *bleMidiChar;
+unsigned long bleMidiIntvl;
+
+size_t bleMidiNotify(const unsigned char *buffer, size_t size){
+  bleMidiChar->setValue((uint8_t *)buffer, size);
+  bleMidiChar->notify();
+  return size;
+}
+
+class BleMidiServerCallbacks: public BLEServerCallbacks {
+  void onConnect(BLEServer *server, esp_ble_gatts_cb_param_t *param) {
+    // connection interval is in 1.25ms units
+    bleMidiIntvl = param->connect.conn_params.interval * 1250UL;
+    mdep_ble_connect(server->getPeerMTU(param->connect.conn_id), bleMidiIntvl);
+  }
+  void onMtuChanged(BLEServer *server, esp_ble_gatts_cb_param_t *param) {
+    mdep_ble_connect(param->mtu.mtu, bleMidiIntvl);
+  }
+  void onDisconnect(BLEServer *server) {
+    mdep_ble_disconnect();
+    server->startAdvertising();
+  }
+};
+
+// called from the BLE task for each received packet, the packet is
+// queued along with its arrival time, see mdep_ble_rxput()
+class BleMidiCharCallbacks: public BLECharacteristicCallbacks {
+  void onWrite(BLECharacteristic *c) {
+    mdep_ble_rxput(c->getData(), c->getLength());
+  }
+};
+
+void bleMidiBegin(){
+  BLEServer *server;
+  BLEService *service;
+  BLEAdvertising *adv;
+
+  BLEDevice::init("midish");
+  BLEDevice::setMTU(247);
+  server = BLEDevice::createServer();
+  server->setCallbacks(new BleMidiServerCallbacks());
+  service = server->createService(BLEMIDI_SERVICE);
+  bleMidiChar = service->createCharacteristic(BLEMIDI_CHAR,
+    BLECharacteristic::PROPERTY_READ |
+    BLECharacteristic::PROPERTY_WRITE_NR |
+    BLECharacteristic::PROPERTY_NOTIFY);
+  bleMidiChar->addDescriptor(new BLE2902());
+  bleMidiChar->setCallbacks(new BleMidiCharCallbacks());
+  service->start();
+  adv = BLEDevice::getAdvertising();
+  adv->addServiceUUID(BLEMIDI_SERVICE);
+  BLEDevice::startAdvertising();
+  mdep_ble_register(&bleMidiNotify);
+}
+#endif
+
 #define RXD2 16
 #define TXD2 17
 
+// set to 1 to use Serial1 as a second MIDI port, midish uses it as
+// the "serial1" device. Each UART registered with mdep_desp_register()
+// gets its own rings, up to DESP_NPORTS ports
+#define SERIAL1_MIDI_ENABLE 0
+#define RXD1 25
+#define TXD1 26
+
+// port numbers returned by mdep_desp_register()
+unsigned serial1Port, serial2Port;
+
 size_t serial2Write(const char *buffer, size_t size){ 
   return(Serial2.write(buffer, size));
 }
 
-size_t serial2ReadBytes( char *buffer, size_t length){
-  return(Serial2.readBytes(buffer, length));
+size_t serial2Avail(){
+  return(Serial2.availableForWrite());
+}
+
+// called from the UART event task as soon as bytes arrive, moves them
+// into midish's receive ring, which is drained by mux_mdep_wait()
+void serial2Receive(){
+  char buffer[64];
+  size_t n;
+
+  while ((n = Serial2.available()) > 0) {
+    if (n > sizeof(buffer))
+      n = sizeof(buffer);
+    n = Serial2.read((uint8_t *)buffer, n);
+    mdep_desp_rxput(serial2Port, buffer, n);
+  }
+}
+
+#if SERIAL1_MIDI_ENABLE
+size_t serial1Write(const char *buffer, size_t size){
+  return(Serial1.write(buffer, size));
+}
+
+size_t serial1Avail(){
+  return(Serial1.availableForWrite());
+}
+
+void serial1Receive(){
+  char buffer[64];
+  size_t n;
+
+  while ((n = Serial1.available()) > 0) {
+    if (n > sizeof(buffer))
+      n = sizeof(buffer);
+    n = Serial1.read((uint8_t *)buffer, n);
+    mdep_desp_rxput(serial1Port, buffer, n);
+  }
+}
+#endif
+
+// called from the UART event task when console input arrives, queues
+// it for mux_mdep_wait() so that the clock never waits for the user
+void serialReceive(){
+  char buffer[64];
+  size_t n;
+
+  while ((n = Serial.available()) > 0) {
+    if (n > sizeof(buffer))
+      n = sizeof(buffer);
+    n = Serial.read((uint8_t *)buffer, n);
+    mdep_cons_rxput(buffer, n);
+  }
 }
 
 void setup() {
 
   // Set MIDI baud rate on Serial 2 and register Device in Midish
+  // let the UART driver queue output, so writes don't wait for the line
+  Serial2.setTxBufferSize(512);
   Serial2.begin(31250, SERIAL_8N1, RXD2, TXD2);
-  mdep_desp_register(&serial2Write, &serial2ReadBytes);
+  // get a callback after each byte rather than after a full FIFO
+  Serial2.setRxFIFOFull(1);
+  Serial2.onReceive(serial2Receive);
+  serial2Port = mdep_desp_register("serial2", &serial2Write, &serial2Avail);
+
+#if SERIAL1_MIDI_ENABLE
+  Serial1.setTxBufferSize(512);
+  Serial1.begin(31250, SERIAL_8N1, RXD1, TXD1);
+  Serial1.setRxFIFOFull(1);
+  Serial1.onReceive(serial1Receive);
+  serial1Port = mdep_desp_register("serial1", &serial1Write, &serial1Avail);
+#endif
+
+#if CONFIG_TINYUSB_MIDI_ENABLED
+  usbMidi.begin();
+  USB.begin();
+#endif
+
+#if BLEMIDI_ENABLE
+  bleMidiBegin();
+#endif
 
   Serial.begin(115200);
+  Serial.onReceive(serialReceive);
   Serial.write("midish4esp32 first Version\r\n");
 
   playHello();
@@ -30,6 +30,11 @@
  * realtime while a track using the same controller is playing (input
  * ID is zero, and has precedence over tracks).
  *
+ * The last program, controller, bend and aftertouch values sent on
+ * each channel are kept. Between mixout_defer() and mixout_commit()
+ * such events are only stored, and mixout_commit() sends the values
+ * that differ from the ones already sent. This way, relocating or
+ * looping doesn't resend the parameters that don't change.
  */
 
 #include "utils.h"
@@ -39,6 +44,7 @@
 #include "mux.h"
 #include "timo.h"
 #include "state.h"
+#include "mixout.h"
 
 #define MIXOUT_TIMO (1000000UL)
 #define MIXOUT_MAXTICS 24
@@ -48,10 +54,201 @@ void mixout_timocb(void *);
 struct statelist mixout_slist;
 struct timo mixout_timo;
 unsigned mixout_debug = 0;
+struct mixout_chan *mixout_chans;
+struct pool mixout_pool;
+unsigned mixout_deferred = 0;
+
+/*
+ * return the slot of the given event in the arrays of its channel,
+ * or MIXOUT_NVAL if it's not cached
+ */
+unsigned
+mixout_slot(struct ev *ev)
+{
+	switch (ev->cmd) {
+	case EV_XCTL:
+		return ev->ctl_num;
+	case EV_XPC:
+		return MIXOUT_PROG;
+	case EV_BEND:
+		return MIXOUT_BEND;
+	case EV_CAT:
+		return MIXOUT_CAT;
+	}
+	return MIXOUT_NVAL;
+}
+
+/*
+ * return the cached values of the channel of the given event, create
+ * them if they don't exist. The channel is moved at the head of the
+ * list, since it's likely to be used again
+ */
+struct mixout_chan *
+mixout_getchan(struct ev *ev)
+{
+	struct mixout_chan **pc, *c;
+	unsigned i;
+
+	for (pc = &mixout_chans; (c = *pc) != NULL; pc = &c->next) {
+		if (c->dev == ev->dev && c->ch == ev->ch) {
+			if (pc != &mixout_chans) {
+				*pc = c->next;
+				c->next = mixout_chans;
+				mixout_chans = c;
+			}
+			return c;
+		}
+	}
+	c = pool_new(&mixout_pool);
+	c->dev = ev->dev;
+	c->ch = ev->ch;
+	for (i = 0; i < MIXOUT_NVAL; i++)
+		c->sent[i] = c->want[i] = EV_UNDEF;
+	c->dirty = 0;
+	c->next = mixout_chans;
+	mixout_chans = c;
+	return c;
+}
+
+/*
+ * store the given value in the given array
+ */
+void
+mixout_setval(unsigned short *val, unsigned slot, struct ev *ev)
+{
+	switch (ev->cmd) {
+	case EV_XCTL:
+		val[slot] = ev->ctl_val;
+		break;
+	case EV_XPC:
+		val[MIXOUT_PROG] = ev->pc_prog;
+		val[MIXOUT_BANK] = ev->pc_bank;
+		break;
+	case EV_BEND:
+		val[slot] = ev->bend_val;
+		break;
+	case EV_CAT:
+		val[slot] = ev->cat_val;
+		break;
+	}
+}
+
+/*
+ * send the given event to the output, or defer it if it's a
+ * cached parameter and mixout_defer() was called
+ */
+void
+mixout_send(struct ev *ev)
+{
+	struct mixout_chan *c;
+	unsigned slot;
+
+	slot = mixout_slot(ev);
+	if (slot == MIXOUT_NVAL) {
+		mux_putev(ev);
+		return;
+	}
+	c = mixout_getchan(ev);
+	if (mixout_deferred) {
+		mixout_setval(c->want, slot, ev);
+		c->dirty = 1;
+		return;
+	}
+	mixout_setval(c->sent, slot, ev);
+	mux_putev(ev);
+}
+
+/*
+ * start storing parameters instead of sending them
+ */
+void
+mixout_defer(void)
+{
+	mixout_deferred = 1;
+}
+
+/*
+ * send the parameters stored since mixout_defer() that differ from
+ * the ones already sent: the program first, then the controllers,
+ * the bend and the aftertouch
+ */
+void
+mixout_commit(void)
+{
+	struct mixout_chan *c;
+	unsigned i;
+	struct ev ev;
+
+	mixout_deferred = 0;
+	for (c = mixout_chans; c != NULL; c = c->next) {
+		if (!c->dirty)
+			continue;
+		c->dirty = 0;
+		ev.dev = c->dev;
+		ev.ch = c->ch;
+		if (c->want[MIXOUT_PROG] != EV_UNDEF) {
+			if (c->want[MIXOUT_PROG] != c->sent[MIXOUT_PROG] ||
+			    c->want[MIXOUT_BANK] != c->sent[MIXOUT_BANK]) {
+				ev.cmd = EV_XPC;
+				ev.pc_prog = c->want[MIXOUT_PROG];
+				ev.pc_bank = c->want[MIXOUT_BANK];
+				mux_putev(&ev);
+				c->sent[MIXOUT_PROG] = ev.pc_prog;
+				c->sent[MIXOUT_BANK] = ev.pc_bank;
+			}
+			c->want[MIXOUT_PROG] = EV_UNDEF;
+			c->want[MIXOUT_BANK] = EV_UNDEF;
+		}
+		for (i = 0; i < MIXOUT_NCTL; i++) {
+			if (c->want[i] == EV_UNDEF)
+				continue;
+			if (c->want[i] != c->sent[i]) {
+				ev.cmd = EV_XCTL;
+				ev.ctl_num = i;
+				ev.ctl_val = c->want[i];
+				mux_putev(&ev);
+				c->sent[i] = c->want[i];
+			}
+			c->want[i] = EV_UNDEF;
+		}
+		if (c->want[MIXOUT_BEND] != EV_UNDEF) {
+			if (c->want[MIXOUT_BEND] != c->sent[MIXOUT_BEND]) {
+				ev.cmd = EV_BEND;
+				ev.bend_val = c->want[MIXOUT_BEND];
+				mux_putev(&ev);
+				c->sent[MIXOUT_BEND] = ev.bend_val;
+			}
+			c->want[MIXOUT_BEND] = EV_UNDEF;
+		}
+		if (c->want[MIXOUT_CAT] != EV_UNDEF) {
+			if (c->want[MIXOUT_CAT] != c->sent[MIXOUT_CAT]) {
+				ev.cmd = EV_CAT;
+				ev.cat_val = c->want[MIXOUT_CAT];
+				mux_putev(&ev);
+				c->sent[MIXOUT_CAT] = ev.cat_val;
+			}
+			c->want[MIXOUT_CAT] = EV_UNDEF;
+		}
+	}
+}
+
+void
+mixout_pool_init(unsigned size)
+{
+	pool_init(&mixout_pool, "mixout", sizeof(struct mixout_chan), size);
+}
+
+void
+mixout_pool_done(void)
+{
+	pool_done(&mixout_pool);
+}
 
 void
 mixout_start(void)
 {
+	mixout_chans = NULL;
+	mixout_deferred = 0;
 	statelist_init(&mixout_slist);
 	timo_set(&mixout_timo, mixout_timocb, NULL);
 	timo_add(&mixout_timo, MIXOUT_TIMO);
@@ -63,11 +260,18 @@ mixout_start(void)
 void
 mixout_stop(void)
 {
+	struct mixout_chan *c, *cnext;
+
 	if (mixout_debug) {
 		log_puts("mixout_stop()\n");
 	}
 	timo_del(&mixout_timo);
 	statelist_done(&mixout_slist);
+	for (c = mixout_chans; c != NULL; c = cnext) {
+		cnext = c->next;
+		pool_del(&mixout_pool, c);
+	}
+	mixout_chans = NULL;
 }
 
 void
@@ -113,7 +317,7 @@ mixout_putev(struct ev *ev, unsigned id)
 				log_puts(")\n");
 			}
 			statelist_update(&mixout_slist, &ca);
-			mux_putev(&ca);
+			mixout_send(&ca);
 		}
 		if (mixout_debug) {
 			log_puts("mixout_putev: ");
@@ -125,7 +329,7 @@ mixout_putev(struct ev *ev, unsigned id)
 	os->tag = id;
 	os->tic = 0;
 	if ((os->flags & (STATE_BOGUS | STATE_NESTED)) == 0)
-		mux_putev(ev);
+		mixout_send(ev);
 	else {
 		if (mixout_debug) {
 			log_puts("mixout_putev: ");
@@ -20,9 +20,35 @@
 #include "state.h"
 #include "timo.h"
 
+/*
+ * slots of the cached values of a channel: the 14-bit controllers
+ * first, indexed by number, then the other parameters
+ */
+#define MIXOUT_NCTL	(EV_MAXCOARSE + 1)
+#define MIXOUT_PROG	(MIXOUT_NCTL + 0)
+#define MIXOUT_BANK	(MIXOUT_NCTL + 1)
+#define MIXOUT_BEND	(MIXOUT_NCTL + 2)
+#define MIXOUT_CAT	(MIXOUT_NCTL + 3)
+#define MIXOUT_NVAL	(MIXOUT_NCTL + 4)
+
+/*
+ * parameters of a device/channel pair, EV_UNDEF if unknown
+ */
+struct mixout_chan {
+	struct mixout_chan *next;	/* last used first */
+	unsigned dev, ch;
+	unsigned short sent[MIXOUT_NVAL];	/* last sent values */
+	unsigned short want[MIXOUT_NVAL];	/* deferred values */
+	unsigned dirty;			/* if 'want' is not empty */
+};
+
+void mixout_pool_init(unsigned);
+void mixout_pool_done(void);
 void mixout_start(void);
 void mixout_stop(void);
 void mixout_putev(struct ev *, unsigned);
+void mixout_defer(void);
+void mixout_commit(void);
 
 extern unsigned mixout_debug;
 
@@ -79,6 +79,22 @@
  */
 #define MUX_START_DELAY	  (24000000UL / 3)
 
+/*
+ * parameters of the software PLL following the external clock:
+ * number of tic intervals measured before the generator starts,
+ * fraction of the phase error corrected on each tic, fraction of it
+ * added to the period, max phase error (in tics) before resyncing,
+ * max number of tics generated without input, and range of
+ * accepted tic periods (1ms to 1s, in 24th of microseconds)
+ */
+#define MUX_PLL_NLOCK		4
+#define MUX_PLL_PHASEDIV	8
+#define MUX_PLL_FREQDIV		128
+#define MUX_PLL_MAXERR		3
+#define MUX_PLL_MAXBRIDGE	24
+#define MUX_PLL_MINPER		24000UL
+#define MUX_PLL_MAXPER		24000000UL
+
 unsigned mux_isopen = 0;
 unsigned mux_debug = 0;
 unsigned mux_ticrate;
@@ -88,9 +104,11 @@ unsigned mux_phase, mux_reqphase;
 unsigned mux_manualstart = 1;
 void *mux_addr;
 unsigned long mux_wallclock;
+unsigned mux_pllmode = 0;
+struct mux_pll mux_pll;
 
 
-struct statelist mux_istate, mux_ostate;
+struct conv mux_iconv, mux_oconv;
 
 /*
  * the following are defined in mdep.c
@@ -111,8 +129,8 @@ mux_open(void)
 	struct mididev *i;
 
 	timo_init();
-	statelist_init(&mux_istate);
-	statelist_init(&mux_ostate);
+	conv_init(&mux_iconv);
+	conv_init(&mux_oconv);
 	mixout_start();
 	norm_start();
 
@@ -133,8 +151,6 @@ mux_open(void)
 	mux_isopen = 1;
 	for (i = mididev_list; i != NULL; i = i->next) {
 		i->ticdelta = i->ticrate;
-		i->isensto = 0;
-		i->osensto = MIDIDEV_OSENSTO;
 		mididev_open(i);
 	}
 	mux_mdep_open();
@@ -144,6 +160,7 @@ mux_open(void)
 	mux_reqphase = MUX_STOP;
 	mux_phase = MUX_STOP;
 	mux_wallclock = 0;
+	mux_pllreset();
 	log_sync = 1;
 }
 
@@ -168,8 +185,8 @@ mux_close(void)
 	}
 	mux_mdep_close();
 	mux_isopen = 0;
-	statelist_done(&mux_ostate);
-	statelist_done(&mux_istate);
+	conv_done(&mux_oconv);
+	conv_done(&mux_iconv);
 	timo_done();
 }
 
@@ -308,7 +325,7 @@ mux_putev(struct ev *ev)
 	}
 	dev = mididev_byunit[unit];
 	if (dev != NULL) {
-		nev = conv_unpackev(&mux_ostate,
+		nev = conv_unpackev(&mux_oconv,
 		    dev->oxctlset, dev->oevset, ev, rev);
 		for (i = 0; i < nev; i++) {
 			mididev_putev(dev, &rev[i]);
@@ -390,12 +407,19 @@ mux_mtcstart(unsigned mtcpos)
 void
 mux_mtctick(unsigned delta)
 {
+	unsigned long now = mididev_ostamp;
+
 	mux_curpos += delta;
 
 	while (mux_curpos >= mux_nextpos) {
 		mux_curpos -= mux_nextpos;
 		mux_nextpos = mux_ticlength;
 
+		/*
+		 * the tick occurred mux_curpos ago, (24th of us)
+		 */
+		mididev_ostamp = now - mux_curpos / 24;
+
 		/*
 		 * if in manual mode, dont trigger the 0-th tick (ie
 		 * the start signal).
@@ -403,6 +427,7 @@ mux_mtctick(unsigned delta)
 		if (!mux_manualstart || mux_phase != MUX_START)
 			mux_ticcb();
 	}
+	mididev_ostamp = now;
 }
 
 /*
@@ -444,38 +469,6 @@ mux_timercb(unsigned long delta)
 	 */
 	timo_update(delta);
 
-	/*
-	 * handle timeouts not using the timo.c interface
-	 * XXX: convert this to timo_xxx() routines
-	 */
-	for (dev = mididev_list; dev != NULL; dev = dev->next) {
-		if (dev->isensto) {
-			if (dev->isensto <= delta) {
-				dev->isensto = 0;
-				cons_erru(dev->unit, "sensing timeout, disabled");
-			} else {
-				dev->isensto -= delta;
-			}
-		}
-		if (dev->osensto) {
-			if (dev->osensto <= delta) {
-				mididev_putack(dev);
-				mididev_flush(dev);
-				dev->osensto = MIDIDEV_OSENSTO;
-			} else {
-				dev->osensto -= delta;
-			}
-		}
-		if (dev->imtc.timo) {
-			if (dev->imtc.timo <= delta) {
-				dev->imtc.timo = 0;
-				mtc_timo(&dev->imtc);
-			} else {
-				dev->imtc.timo -= delta;
-			}
-		}
-	}
-
 	/*
 	 * if there's no ext MTC source, then generate one internally
 	 * using the current sequencer state as hints
@@ -501,6 +494,152 @@ mux_timercb(unsigned long delta)
 			mux_mtctick(delta);
 			break;
 		}
+	} else if (mididev_clksrc && mux_pllmode)
+		mux_pllgen(delta);
+
+	/*
+	 * send continuous events held by the output scheduler; it's
+	 * done after the tick, so if one was generated, its flush
+	 * already sent them and they are not written separately
+	 */
+	if (mididev_nheld > 0) {
+		for (dev = mididev_list; dev != NULL; dev = dev->next) {
+			if (dev->npend > 0)
+				mididev_flush(dev);
+		}
+	}
+}
+
+/*
+ * reset the PLL, so it measures the tic period again: until it's
+ * locked, received tics are passed through
+ */
+void
+mux_pllreset(void)
+{
+	mux_pll.lock = 0;
+	mux_pll.nlock = 0;
+	mux_pll.nin = mux_pll.nout = 0;
+	mux_pll.sum = 0;
+	mux_pll.pos = 0;
+}
+
+/*
+ * advance the PLL tic generator by the given amount of time, and
+ * generate tics that are due. If the input stops, only generate
+ * MUX_PLL_MAXBRIDGE tics, then wait for input to resume
+ */
+void
+mux_pllgen(unsigned long delta)
+{
+	unsigned long now = mididev_ostamp;
+
+	if (!mux_pll.lock)
+		return;
+	mux_pll.pos += delta;
+	while (mux_pll.pos >= mux_pll.gper) {
+		if ((int)(mux_pll.nout - mux_pll.nin) >= MUX_PLL_MAXBRIDGE) {
+			if (mux_debug)
+				log_puts("mux_pllgen: clock lost\n");
+			mux_pll.lock = 0;
+			mux_pll.nlock = 0;
+			mux_pll.sum = 0;
+			mux_pll.pos = 0;
+			break;
+		}
+		if ((int)(mux_pll.nout - mux_pll.nin) > 0)
+			mux_pll.nbridged++;
+		mux_pll.pos -= mux_pll.gper;
+		mux_pll.gper = mux_pll.period;
+		mux_pll.nout++;
+		mididev_ostamp = now - mux_pll.pos / 24;
+		mux_ticcb();
+	}
+	mididev_ostamp = now;
+}
+
+/*
+ * called when a MIDI TICK is received from the clock source. If the
+ * PLL is enabled, use it to correct the period and the phase of the
+ * tic generator, else process the tic immediately
+ */
+void
+mux_clkcb(void)
+{
+	unsigned long dt, dif;
+	long err, per;
+
+	if (!mux_pllmode) {
+		mux_ticcb();
+		return;
+	}
+	dt = mux_wallclock - mux_pll.last;
+	mux_pll.last = mux_wallclock;
+	mux_pll.nin++;
+	if (mux_pll.lock) {
+		/*
+		 * phase error: how late the generator is (or how early
+		 * if negative) compared to the received tic
+		 */
+		/*
+		 * if tics were lost, account for the ones we bridged
+		 */
+		per = mux_pll.period;
+		if (dt > mux_pll.period + mux_pll.period / 2 &&
+		    dt < MUX_PLL_MAXBRIDGE * mux_pll.period)
+			mux_pll.nin += (dt + mux_pll.period / 2) / per - 1;
+		err = (long)(int)(mux_pll.nin - mux_pll.nout) * per -
+		    (long)mux_pll.pos;
+		if (err <= MUX_PLL_MAXERR * per &&
+		    err >= -MUX_PLL_MAXERR * per) {
+			dif = dt > mux_pll.period ?
+			    dt - mux_pll.period : mux_pll.period - dt;
+			mux_pll.jitter = (15 * mux_pll.jitter + dif) / 16;
+			per -= err / MUX_PLL_FREQDIV;
+			if (per < (long)MUX_PLL_MINPER)
+				per = MUX_PLL_MINPER;
+			if (per > (long)MUX_PLL_MAXPER)
+				per = MUX_PLL_MAXPER;
+			mux_pll.period = per;
+			per -= err / MUX_PLL_PHASEDIV;
+			if (per < (long)mux_pll.period / 2)
+				per = mux_pll.period / 2;
+			if (per > 2 * (long)mux_pll.period)
+				per = 2 * mux_pll.period;
+			mux_pll.gper = per;
+			mux_pllgen(0);
+			return;
+		}
+		if (mux_debug)
+			log_puts("mux_clkcb: phase error too large\n");
+		mux_pll.lock = 0;
+		mux_pll.nlock = 0;
+		mux_pll.sum = 0;
+	}
+
+	/*
+	 * not locked: pass tics through, but skip those that were
+	 * already generated, and measure the period
+	 */
+	while ((int)(mux_pll.nin - mux_pll.nout) > 0) {
+		mux_pll.nout++;
+		mux_ticcb();
+	}
+	if (mux_pll.nin == 1)
+		return;
+	if (dt < MUX_PLL_MINPER || dt > MUX_PLL_MAXPER) {
+		mux_pll.nlock = 0;
+		mux_pll.sum = 0;
+		return;
+	}
+	mux_pll.sum += dt;
+	if (++mux_pll.nlock == MUX_PLL_NLOCK) {
+		mux_pll.period = mux_pll.gper = mux_pll.sum / MUX_PLL_NLOCK;
+		mux_pll.jitter = 0;
+		mux_pll.pos = 0;
+		mux_pll.lock = 1;
+		if (mux_debug)
+			log_puts("mux_clkcb: locked\n");
 	}
 }
 
@@ -558,6 +697,7 @@ mux_startcb(void)
 	if (mididev_clksrc) {
 		mux_curpos = 0;
 		mux_nextpos = mux_ticlength;
+		mux_pllreset();
 		song_gotocb(usong, LOC_MTC, 0);
 	}
 	mux_chgphase(MUX_START);
@@ -575,6 +715,7 @@ mux_stopcb(void)
 		log_puts("mux_stopcb: got stop\n");
 	if (mux_phase >= MUX_START && mux_phase <= MUX_NEXT)
 		mux_sendstop();
+	mux_pllreset();
 	mux_chgphase(mux_reqphase);
 	song_stopcb(usong);
 	mux_flush();
@@ -588,9 +729,10 @@ mux_ackcb(unsigned unit)
 {
 	struct mididev *dev = mididev_byunit[unit];
 
-	if (dev->isensto == 0) {
+	if (!dev->isenstimo.set) {
 		cons_erru(dev->unit, "sensing enabled");
-		dev->isensto = MIDIDEV_ISENSTO;
+		dev->ilast = timo_abstime;
+		timo_add(&dev->isenstimo, MIDIDEV_ISENSTO);
 	}
 }
 
@@ -610,7 +752,7 @@ mux_evcb(unsigned unit, struct ev *ev)
 		log_puts("\n");
 	}
 #endif
-	if (conv_packev(&mux_istate, dev->ixctlset, dev->ievset, ev, &rev)) {
+	if (conv_packev(&mux_iconv, dev->ixctlset, dev->ievset, ev, &rev)) {
 		norm_evcb(&rev);
 	}
 }
@@ -635,9 +777,9 @@ mux_errorcb(unsigned unit)
 void
 mux_sysexcb(unsigned unit, struct sysex *sysex)
 {
-	unsigned char *p, *q, *data;
+	unsigned char *data;
+	struct mididev *thru;
 	struct ev ev;
-	unsigned cmd;
 
 	if (sysex->first != NULL &&
 	    sysex->first->next == NULL) {
@@ -658,42 +800,46 @@ mux_sysexcb(unsigned unit, struct sysex *sysex)
 		/*
 		 * handle custom events
 		 */
-		for (cmd = EV_PAT0; cmd < EV_PAT0 + EV_NPAT; cmd++) {
-			if (evinfo[cmd].ev == NULL)
-				continue;
-			ev.v0 = ev.v1 = 0;
-			p = evinfo[cmd].pattern;
-			q = data;
-			for (;; p++, q++) {
-				switch (*p) {
-				case EV_PATV0_HI:
-					ev.v0 |= *q << 7;
-					continue;
-				case EV_PATV0_LO:
-					ev.v0 |= *q;
-					continue;
-				case EV_PATV1_HI:
-					ev.v1 |= *q << 7;
-					continue;
-				case EV_PATV1_LO:
-					ev.v1 |= *q;
-					continue;
-				}
-				if (*p != *q)
-					break;
-				if (*p == 0xf7) {
-					ev.cmd = cmd;
-					ev.dev = unit;
-					norm_evcb(&ev);
-					sysex_del(sysex);
-					return;
-				}
-			}
+		if (evpat_match(data, sysex->first->used, &ev)) {
+			ev.dev = unit;
+			norm_evcb(&ev);
+			sysex_del(sysex);
+			return;
+		}
+
+		/*
+		 * longer messages are forwarded by mididev_inputcb()
+		 * as they arrive
+		 */
+		thru = mididev_xthru(mididev_byunit[unit]);
+		if (thru) {
+			mididev_sendraw(thru, data, sysex->first->used);
+			mididev_flush(thru);
 		}
 	}
 	song_sysexcb(usong, sysex);
 }
 
+/*
+ * return 1 if input sysex messages are to be kept, else they
+ * are discarded once handled
+ */
+unsigned
+mux_sysexrec(void)
+{
+	return song_sysexrec(usong);
+}
+
+/*
+ * store in the given array the channels of the voice messages of
+ * the given device that may be dropped as soon as they're received
+ */
+void
+mux_indrop(unsigned unit, unsigned short *drop)
+{
+	song_indrop(usong, unit, drop);
+}
+
 /*
  * flush all devices
  */
@@ -716,6 +862,43 @@ mux_getphase(void)
 	return mux_phase;
 }
 
+/*
+ * return 1 if the clock doesn't need to be updated periodically, ie.
+ * if nothing is playing or waiting for an external clock and no
+ * output is held, and store in 'rdelta' the time until the next
+ * timeout, or ~0U if none is scheduled. Input updates the clock
+ * anyway
+ */
+unsigned
+mux_idle(unsigned *rdelta)
+{
+	if (mux_phase != MUX_STOP || mididev_clksrc || mididev_nheld > 0)
+		return 0;
+	if (!timo_next(rdelta))
+		*rdelta = ~0U;
+	return 1;
+}
+
+/*
+ * return 1 if the current time is closer to the next tick than to
+ * the last one. Input is processed at the time it was received at,
+ * so events recorded now are more accurate if they are placed on the
+ * next tick. Return 0 if the tick period is not known (external
+ * clock without PLL)
+ */
+unsigned
+mux_ticlate(void)
+{
+	if (mux_phase != MUX_FIRST && mux_phase != MUX_NEXT)
+		return 0;
+	if (mididev_clksrc) {
+		if (!mux_pllmode || !mux_pll.lock)
+			return 0;
+		return 2 * mux_pll.pos >= mux_pll.gper;
+	}
+	return 2 * mux_curpos >= mux_nextpos;
+}
+
 /*
  * change the tempo, the argument is tic length in 24th of
  * microseconds
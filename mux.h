@@ -44,12 +44,37 @@ extern struct song *usong;
 extern unsigned mux_isopen;
 extern unsigned mux_manualstart;
 extern unsigned long mux_wallclock;
+extern unsigned long mux_ticlength;
+extern unsigned long mux_curpos, mux_nextpos;
+extern unsigned mux_phase;
+
+/*
+ * state of the software PLL following the external clock; times
+ * are in 24th of microseconds
+ */
+struct mux_pll {
+	unsigned lock;			/* generator running */
+	unsigned nlock;			/* intervals measured so far */
+	unsigned nin, nout;		/* received and generated tics */
+	unsigned long last;		/* arrival of the last tic */
+	unsigned long sum;		/* of measured intervals */
+	unsigned long period;		/* estimated tic period */
+	unsigned long gper;		/* length of the current tic */
+	unsigned long pos;		/* time since the last generated tic */
+	unsigned long jitter;		/* mean deviation of intervals */
+	unsigned long nbridged;		/* tics generated without input */
+};
+
+extern unsigned mux_pllmode;
+extern struct mux_pll mux_pll;
 
 void song_startcb(struct song *);
 void song_stopcb(struct song *);
 void song_movecb(struct song *);
 void song_evcb(struct song *, struct ev *);
 void song_sysexcb(struct song *, struct sysex *);
+unsigned song_sysexrec(struct song *);
+void song_indrop(struct song *, unsigned, unsigned short *);
 unsigned song_gotocb(struct song *, int, unsigned);
 
 struct norm;
@@ -71,6 +96,8 @@ void mux_shut(void);
 void mux_putev(struct ev *);
 void mux_sendraw(unsigned, unsigned char *, unsigned);
 unsigned mux_getphase(void);
+unsigned mux_ticlate(void);
+unsigned mux_idle(unsigned *);
 struct sysex *mux_getsysex(void);
 void mux_chgtempo(unsigned long);
 void mux_chgticrate(unsigned);
@@ -78,6 +105,11 @@ void mux_startreq(int);
 void mux_stopreq(void);
 void mux_gotoreq(unsigned);
 int mux_mdep_wait(int); /* XXX: hide this prototype */
+void mux_mdep_yield(void);
+void mux_mdep_unlock(void);
+void mux_mdep_lock(void);
+void mux_mdep_take(void);
+void mux_mdep_give(void);
 
 /*
  * call-backs called by midi device drivers
@@ -86,13 +118,19 @@ void mux_timercb(unsigned long);
 void mux_startcb(void);
 void mux_stopcb(void);
 void mux_ticcb(void);
+void mux_clkcb(void);
 void mux_ackcb(unsigned);
 void mux_evcb(unsigned, struct ev *);
 void mux_sysexcb(unsigned, struct sysex *);
+unsigned mux_sysexrec(void);
+void mux_indrop(unsigned, unsigned short *);
 void mux_errorcb(unsigned);
 
 void mux_mtcstart(unsigned);
 void mux_mtctick(unsigned);
 void mux_mtcstop(void);
 
+void mux_pllreset(void);
+void mux_pllgen(unsigned long);
+
 #endif /* MIDISH_MUX_H */
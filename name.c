@@ -16,21 +16,98 @@
 
 /*
  * name is a singly-linked list of strings
+ *
+ * names of indexed lists are also in a hash table shared by all
+ * lists, the key being the (list, string) pair. Since strings are
+ * interned, the hash of the string is computed only once
  */
 
 #include "utils.h"
 #include "name.h"
 
+#define NAME_NHASH	256
+
+struct name *name_htab[NAME_NHASH];
+struct name **name_idx[NAME_MAXIDX];
+unsigned name_nidx = 0;
+
+/*
+ * return the hash bucket of the given interned string in the given list
+ */
+struct name **
+name_bucket(struct name **first, char *str)
+{
+	unsigned h;
+
+	h = str_hash(str) ^ (unsigned)((unsigned long)first >> 3);
+	return &name_htab[h % NAME_NHASH];
+}
+
+/*
+ * return 1 if the given list is indexed
+ */
+unsigned
+name_isindexed(struct name **first)
+{
+	unsigned i;
+
+	for (i = 0; i < name_nidx; i++) {
+		if (name_idx[i] == first)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * add the given name of the given list to the hash table, either
+ * at the beginning or at the end of the bucket, so names with the
+ * same string are in the same order as in the list
+ */
+void
+name_hash(struct name **first, struct name *v, unsigned atend)
+{
+	struct name **p;
+
+	p = name_bucket(first, v->str);
+	if (atend) {
+		while (*p != NULL)
+			p = &(*p)->hnext;
+	}
+	v->hnext = *p;
+	v->hlist = first;
+	*p = v;
+}
+
+void
+name_unhash(struct name *v)
+{
+	struct name **p;
+
+	for (p = name_bucket(v->hlist, v->str); *p != v; p = &(*p)->hnext) {
+		if (*p == NULL) {
+			log_puts("name_unhash: not found\n");
+			panic();
+		}
+	}
+	*p = v->hnext;
+	v->hnext = NULL;
+	v->hlist = NULL;
+}
+
 void
 name_init(struct name *o, char *name)
 {
-	o->str = str_new(name);
+	o->str = str_intern(name);
+	o->hnext = NULL;
+	o->hlist = NULL;
 }
 
 void
 name_done(struct name *o)
 {
-	str_delete(o->str);
+	if (o->hlist)
+		name_unhash(o);
+	str_release(o->str);
 }
 
 struct name *
@@ -75,6 +152,8 @@ name_insert(struct name **first, struct name *i)
 {
 	i->next = *first;
 	*first = i;
+	if (name_isindexed(first))
+		name_hash(first, i, 0);
 }
 
 void
@@ -88,6 +167,8 @@ name_add(struct name **first, struct name *v)
 	}
 	v->next = NULL;
 	*i = v;
+	if (name_isindexed(first))
+		name_hash(first, v, 1);
 }
 
 void
@@ -100,6 +181,8 @@ name_remove(struct name **first, struct name *v)
 		if (*i == v) {
 			*i = v->next;
 			v->next = NULL;
+			if (v->hlist)
+				name_unhash(v);
 			return;
 		}
 		i = &(*i)->next;
@@ -141,7 +224,7 @@ name_eq(struct name **first1, struct name **first2)
 	for (;;) {
 		if (n1 == NULL && n2 == NULL) {
 			return 1;
-		} else if (n1 == NULL || n2 == NULL || !str_eq(n1->str, n2->str)) {
+		} else if (n1 == NULL || n2 == NULL || n1->str != n2->str) {
 			return 0;
 		}
 		n1 = n1->next;
@@ -149,16 +232,87 @@ name_eq(struct name **first1, struct name **first2)
 	}
 }
 
+/*
+ * find the name with the given string in the given list. If the string
+ * is not interned, there's no such name
+ */
 struct name *
 name_lookup(struct name **first, char *str)
 {
 	struct name *i;
 
+	str = str_find(str);
+	if (str == NULL || *first == NULL)
+		return NULL;
+	if ((*first)->hlist == first) {
+		for (i = *name_bucket(first, str); i != NULL; i = i->hnext) {
+			if (i->str == str && i->hlist == first)
+				return i;
+		}
+		return NULL;
+	}
 	for (i = *first; i != NULL; i = i->next) {
-		if (i->str == NULL)
-			continue;
-		if (str_eq(i->str, str))
+		if (i->str == str)
 			return i;
 	}
-	return 0;
+	return NULL;
+}
+
+/*
+ * change the string of the given name
+ */
+void
+name_rename(struct name *o, char *str)
+{
+	struct name **first;
+	char *old;
+
+	old = o->str;
+	first = o->hlist;
+	if (first) {
+		name_unhash(o);
+		o->str = str_intern(str);
+		name_hash(first, o, 1);
+	} else
+		o->str = str_intern(str);
+	str_release(old);
+}
+
+/*
+ * index the given list, so name_lookup() uses the hash table
+ */
+void
+name_index(struct name **first)
+{
+	struct name *i;
+
+	if (name_nidx == NAME_MAXIDX) {
+		log_puts("name_index: too many lists\n");
+		panic();
+	}
+	name_idx[name_nidx++] = first;
+	for (i = *first; i != NULL; i = i->next)
+		name_hash(first, i, 1);
+}
+
+/*
+ * stop indexing the given list
+ */
+void
+name_unindex(struct name **first)
+{
+	struct name *i;
+	unsigned n;
+
+	for (n = 0; ; n++) {
+		if (n == name_nidx) {
+			log_puts("name_unindex: not indexed\n");
+			panic();
+		}
+		if (name_idx[n] == first)
+			break;
+	}
+	name_idx[n] = name_idx[--name_nidx];
+	for (i = *first; i != NULL; i = i->next)
+		name_unhash(i);
 }
@@ -22,13 +22,24 @@
 /*
  * a name is an entry in a simple list of strings the string buffer is
  * owned by the name, so it need not to be allocated if name_xxx
- * routines are used
+ * routines are used. Strings are interned (see str.c) so names
+ * can be compared by address.
+ *
+ * Lists registered with name_index() are indexed by a hash table,
+ * so name_lookup() need not to scan them
  */
 struct name {
 	char *str;
 	struct name *next;
+	struct name *hnext;		/* next in the hash bucket */
+	struct name **hlist;		/* indexed list, NULL if none */
 };
 
+/*
+ * max number of indexed lists
+ */
+#define NAME_MAXIDX	16
+
 void	     name_init(struct name *, char *);
 void	     name_done(struct name *);
 struct name *name_new(char *);
@@ -42,5 +53,8 @@ void	     name_empty(struct name **);
 void         name_cat(struct name **, struct name **);
 unsigned     name_eq(struct name **, struct name **);
 struct name *name_lookup(struct name **, char *);
+void	     name_rename(struct name *, char *);
+void	     name_index(struct name **);
+void	     name_unindex(struct name **);
 
 #endif /* MIDISH_NAME_H */
@@ -27,13 +27,29 @@
 #include "cons.h"
 #include "user.h"
 #include "textio.h"
+#include "vm.h"
+#include "pool.h"
+
+struct pool node_pool;
+
+void
+node_pool_init(unsigned size)
+{
+	pool_init(&node_pool, "node", sizeof(struct node), size);
+}
+
+void
+node_pool_done(void)
+{
+	pool_done(&node_pool);
+}
 
 struct node *
 node_new(struct node_vmt *vmt, struct data *data)
 {
 	struct node *o;
 
-	o = xmalloc(sizeof(struct node), "node");
+	o = (struct node *)pool_new(&node_pool);
 	o->vmt = vmt;
 	o->data = data;
 	o->list = o->next = NULL;
@@ -54,7 +70,7 @@ node_delete(struct node *o)
 	if (o->data) {
 		data_delete(o->data);
 	}
-	xfree(o);
+	pool_del(&node_pool, o);
 }
 
 void
@@ -201,12 +217,14 @@ node_exec_proc(struct node *o, struct exec *x, struct data **r)
 	if (p != NULL) {
 		name_empty(&p->args);
 		node_delete(p->code);
+		vm_free(p->vm);
 	} else {
 		p = proc_new(o->data->val.list->val.ref);
 		name_insert((struct name **)&x->procs, (struct name *)p);
 	}
 	p->args = args;
 	p->code = o->list;
+	p->vm = vm_compile(p);
 	o->list = NULL;
 	return RESULT_OK;
 }
@@ -232,16 +250,23 @@ node_exec_slist(struct node *o, struct exec *x, struct data **r)
 
 /*
  * execute a builtin function
- * if the function didn't set 'r', then set it to 'nil'
+ * if the function didn't set 'r', then set it to 'nil'. If pools are
+ * fixed and the function used the reserve of a pool, fail
  */
 unsigned
 node_exec_builtin(struct node *o, struct exec *x, struct data **r)
 {
-
+	pool_short = NULL;
 	if (!((unsigned (*)(struct exec *, struct data **))
 	    o->data->val.user)(x, r)) {
 		return RESULT_ERR;
 	}
+	if (pool_short) {
+		cons_errss(x->procname, pool_short->name,
+		    "memory budget exhausted");
+		pool_short = NULL;
+		return RESULT_ERR;
+	}
 	if (!*r) {
 		*r = data_newnil();
 	}
@@ -311,7 +336,7 @@ node_exec_call(struct node *o, struct exec *x, struct data **r)
 	struct node *argv;
 	struct var *valist;
 	char *procname_save;
-	unsigned result;
+	unsigned result, nargs;
 
 	newlocals = NULL;
 	result = RESULT_ERR;
@@ -321,6 +346,22 @@ node_exec_call(struct node *o, struct exec *x, struct data **r)
 		cons_errs(o->data->val.ref, "no such proc");
 		goto finish;
 	}
+	if (p->vm) {
+		/*
+		 * compiled proc, pass arguments on the stack
+		 */
+		nargs = 0;
+		for (argv = o->list; argv != NULL; argv = argv->next) {
+			if (node_exec(argv, x, r) == RESULT_ERR ||
+			    !vm_pushdata(*r)) {
+				vm_pop(nargs);
+				goto finish;
+			}
+			*r = NULL;
+			nargs++;
+		}
+		return vm_call(x, p, nargs, r);
+	}
 	valist = NULL;
 	argv = o->list;
 	for (argn = p->args; argn != NULL; argn = argn->next) {
@@ -713,3 +754,19 @@ node_vmt_bitand = { "bitand", node_exec_bitand },
 node_vmt_bitor = { "bitor", node_exec_bitor },
 node_vmt_bitxor = { "bitxor", node_exec_bitxor },
 node_vmt_bitnot = { "bitnot", node_exec_bitnot };
+
+/*
+ * all node types, used to save and restore code
+ */
+struct node_vmt *const node_vmttab[] = {
+	&node_vmt_proc, &node_vmt_slist, &node_vmt_cst, &node_vmt_var,
+	&node_vmt_call, &node_vmt_ignore, &node_vmt_builtin, &node_vmt_if,
+	&node_vmt_for, &node_vmt_return, &node_vmt_exit, &node_vmt_assign,
+	&node_vmt_nop, &node_vmt_list, &node_vmt_range, &node_vmt_eq,
+	&node_vmt_neq, &node_vmt_le, &node_vmt_lt, &node_vmt_ge,
+	&node_vmt_gt, &node_vmt_and, &node_vmt_or, &node_vmt_not,
+	&node_vmt_add, &node_vmt_sub, &node_vmt_mul, &node_vmt_div,
+	&node_vmt_mod, &node_vmt_neg, &node_vmt_lshift, &node_vmt_rshift,
+	&node_vmt_bitand, &node_vmt_bitor, &node_vmt_bitxor, &node_vmt_bitnot,
+	NULL
+};
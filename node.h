@@ -32,6 +32,8 @@ struct node_vmt {
 	unsigned (*exec)(struct node *, struct exec *, struct data **);
 };
 
+void	     node_pool_init(unsigned);
+void	     node_pool_done(void);
 struct node *node_new(struct node_vmt *, struct data *);
 void	     node_delete(struct node *);
 void	     node_log(struct node *, unsigned);
@@ -54,4 +56,6 @@ extern struct node_vmt
 	node_vmt_lshift, node_vmt_rshift,
 	node_vmt_bitand, node_vmt_bitor, node_vmt_bitxor, node_vmt_bitnot;
 
+extern struct node_vmt *const node_vmttab[];
+
 #endif /* MIDISH_NODE_H */
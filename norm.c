@@ -43,6 +43,14 @@ struct song;
 unsigned norm_debug = 0;
 struct statelist norm_slist;		/* state of the normilizer */
 struct timo norm_timo;			/* for throtteling */
+unsigned norm_slice;			/* current time slice number */
+
+/*
+ * max number of events of each type passed per time slice, 0 means
+ * unlimited. Events in excess are not dropped: the last one is sent
+ * at the beginning of the next slice
+ */
+unsigned norm_maxev[EV_NUMCMD];
 
 /* --------------------------------------------------------------------- */
 
@@ -60,6 +68,18 @@ norm_putev(struct ev *ev)
 	mux_flush();
 }
 
+/*
+ * set the default rate limits
+ */
+void
+norm_init(void)
+{
+	unsigned i;
+
+	for (i = 0; i < EV_NUMCMD; i++)
+		norm_maxev[i] = NORM_MAXEV;
+}
+
 /*
  * configure the normalizer so that output events are passed to the
  * given callback
@@ -67,6 +87,7 @@ norm_putev(struct ev *ev)
 void
 norm_start(void)
 {
+	norm_slice = 0;
 	statelist_init(&norm_slist);
 	timo_set(&norm_timo, norm_timocb, NULL);
 	timo_add(&norm_timo, NORM_TIMO);
@@ -192,8 +213,10 @@ norm_evcb(struct ev *ev)
 	 */
 	st = statelist_update(&norm_slist, ev);
 	if (st->phase & EV_PHASE_FIRST) {
-		if (st->flags & STATE_NEW)
+		if (st->flags & STATE_NEW) {
 			st->nevents = 0;
+			st->tic = norm_slice;
+		}
 
 		if (st->flags & (STATE_BOGUS | STATE_NESTED)) {
 			st->tag = 0;
@@ -214,11 +237,22 @@ norm_evcb(struct ev *ev)
 		return;
 
 	/*
-	 * throttling: if we played more than MAXEV
-	 * events skip this event only if it doesnt change the
-	 * phase of the frame
+	 * the event counter is for the slice the state was last
+	 * counted in, so the timeout doesn't need to reset it
+	 */
+	if (st->tic != norm_slice) {
+		st->tic = norm_slice;
+		st->nevents = 0;
+	}
+
+	/*
+	 * throttling: if we played MAXEV events in this slice, skip
+	 * this event only if it doesnt change the phase of the
+	 * frame. The state keeps the last value, which is sent by the
+	 * timeout
 	 */
-	if (st->nevents > NORM_MAXEV &&
+	if (norm_maxev[ev->cmd] > 0 &&
+	    st->nevents >= norm_maxev[ev->cmd] &&
 	    (st->phase == EV_PHASE_NEXT ||
 	     st->phase == (EV_PHASE_FIRST | EV_PHASE_LAST))) {
 		st->tag |= TAG_PENDING;
@@ -226,26 +260,32 @@ norm_evcb(struct ev *ev)
 	}
 
 	norm_putev(&st->ev);
-	st->nevents++;
+	if (st->nevents < 0xffff)
+		st->nevents++;
 }
 
 /*
- * timeout: outdate all events, so throttling will enable
- * output again.
+ * timeout: start a new slice and send the last value of throttled
+ * frames. Only states changed during the slice may be pending, so
+ * others are not walked. The changed list must be walked anyway to
+ * purge terminated states, so pending values are sent on the way
+ * rather than with a timeout per state, which would cost a heap
+ * insertion and a struct timo in each state of the pool
  */
 void
 norm_timocb(void *addr)
 {
 	struct state *i;
 
-	statelist_outdate(&norm_slist);
-	for (i = norm_slist.first; i != NULL; i = i->next) {
-		i->nevents = 0;
+	norm_slice++;
+	for (i = norm_slist.changed; i != NULL; i = i->cnext) {
 		if (i->tag & TAG_PENDING) {
 			i->tag &= ~TAG_PENDING;
+			i->tic = norm_slice;
+			i->nevents = 1;
 			norm_putev(&i->ev);
-			i->nevents++;
 		}
 	}
+	statelist_outdate(&norm_slist);
 	timo_add(&norm_timo, NORM_TIMO);
 }
@@ -17,11 +17,13 @@
 #ifndef MIDISH_NORM_H
 #define MIDISH_NORM_H
 
-#define NORM_MAXEV	1			/* max events per time slice */
+#define NORM_MAXEV	2			/* default max events per slice */
+#define NORM_MAXRATE	1000			/* max value of the above */
 
 struct filt;
 struct ev;
 
+void norm_init(void);
 void norm_start(void);
 void norm_shut(void);
 void norm_stop(void);
@@ -31,5 +33,6 @@ void norm_evcb(struct ev *);
 void norm_timercb(void);
 
 extern unsigned norm_debug;
+extern unsigned norm_maxev[];
 
 #endif /* MIDISH_NORM_H */
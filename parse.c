@@ -142,7 +142,9 @@ unsigned parse_debug = 0;
 struct tokname {
 	unsigned id;		/* token id */
 	char *str;		/* corresponding string */
-} lex_kw[] = {
+};
+
+const struct tokname lex_kw[] = {
 	{ TOK_IF,		"if" 		},
 	{ TOK_ELSE,		"else" 		},
 	{ TOK_PROC,		"proc"		},
@@ -197,7 +199,7 @@ struct tokname {
 /*
  * names of parser pstates (debug only)
  */
-char *parse_pstates[] = {
+char *const parse_pstates[] = {
 	"PARSE_RANGE", "PARSE_RANGE_1",
 	"PARSE_OR", "PARSE_OR_1",
 	"PARSE_AND", "PARSE_AND_1",
@@ -15,26 +15,91 @@
  */
 
 /*
- * a pool is a large memory block (the pool) that is split into
+ * a pool is a set of large memory blocks (slabs) that are split into
  * small blocks of equal size (pools entries). Its used for
  * fast allocation of pool entries. Free enties are on a singly
- * linked list
+ * linked list. When the free list is empty a new slab is allocated,
+ * so the initial pool size is only a hint; slabs that become
+ * completely free can be given back with pool_shrink().
+ *
+ * Once 'pool_fixed' is set, pools neither grow nor shrink: their
+ * size is the memory budget, reserved at startup, and nothing is
+ * allocated on the heap afterwards, so it can't get fragmented. When
+ * an entry is allocated from the reserve at the end of the pool, the
+ * pool is stored in 'pool_short', so the interpreter can make the
+ * current command fail, while the realtime paths keep going. Only if
+ * the reserve is used up too, the pool grows, as this can't fail.
+ *
+ * While tracks are processed on several threads by work_run(),
+ * entries are allocated and freed through caches of the threads,
+ * and while the interpreter runs without the realtime lock, with
+ * the lock held, see work.c
  */
 
 #include "utils.h"
 #include "pool.h"
+#include "work.h"
 
 unsigned pool_debug = 0;
+unsigned pool_fixed = 0;
+struct pool *pool_list = NULL;
+struct pool *pool_short = NULL;
+
+/*
+ * allocate a new slab and link its entries on the free list
+ */
+void
+pool_grow(struct pool *o)
+{
+	struct poolslab *slab;
+	unsigned char *p;
+	size_t size;
+	unsigned i;
+
+	size = sizeof(struct poolslab) + o->itemsize * o->slabsize;
+	slab = xmalloc_class(size, o->name, o->memcls);
+	slab->itemnum = o->slabsize;
+	slab->next = o->slabs;
+	o->slabs = slab;
+	o->nslabs++;
+	o->itemnum += o->slabsize;
+
+	/*
+	 * create a linked list of all entries
+	 */
+	p = (unsigned char *)(slab + 1);
+	for (i = o->slabsize; i != 0; i--) {
+		((struct poolent *)p)->next = o->first;
+		o->first = (struct poolent *)p;
+		p += o->itemsize;
+	}
+	if (pool_debug) {
+		log_puts("pool_grow(");
+		log_puts(o->name);
+		log_puts("): ");
+		log_putu(o->itemnum);
+		log_puts(" entries\n");
+	}
+}
 
 /*
  * initialises a pool of "itemnum" elements of size "itemsize"
+ * allocated in fast memory
  */
 void
 pool_init(struct pool *o, char *name, unsigned itemsize, unsigned itemnum)
 {
-	unsigned i;
-	unsigned char *p;
+	pool_initclass(o, name, itemsize, itemnum, MEM_FAST);
+}
 
+/*
+ * initialises a pool of "itemnum" elements of size "itemsize"
+ * allocated in memory of the given class
+ */
+void
+pool_initclass(struct pool *o, char *name,
+    unsigned itemsize, unsigned itemnum, unsigned memcls)
+{
 	/*
 	 * round item size to sizeof unsigned
 	 */
@@ -44,33 +109,22 @@ pool_init(struct pool *o, char *name, unsigned itemsize, unsigned itemnum)
 	itemsize += sizeof(unsigned) - 1;
 	itemsize &= ~(sizeof(unsigned) - 1);
 
-	o->data = xmalloc(itemsize * itemnum, "pool");
-	if (!o->data) {
-		log_puts("pool_init(");
-		log_puts(name);
-		log_puts("): out of memory\n");
-		panic();
-	}
+	o->slabs = NULL;
 	o->first = NULL;
 	o->itemsize = itemsize;
-	o->itemnum = itemnum;
+	o->slabsize = itemnum;
+	o->itemnum = 0;
+	o->nslabs = 0;
+	o->memcls = memcls;
 	o->name = name;
-#ifdef POOL_DEBUG
 	o->maxused = 0;
 	o->used = 0;
 	o->newcnt = 0;
-#endif
+	o->nover = 0;
+	pool_grow(o);
 
-	/*
-	 * create a linked list of all entries
-	 */
-	p = o->data;
-	for (i = itemnum; i != 0; i--) {
-		((struct poolent *)p)->next = o->first;
-		o->first = (struct poolent *)p;
-		p += itemsize;
-		o->itemnum++;
-	}
+	o->next = pool_list;
+	pool_list = o;
 }
 
 
@@ -80,7 +134,9 @@ pool_init(struct pool *o, char *name, unsigned itemsize, unsigned itemnum)
 void
 pool_done(struct pool *o)
 {
-	xfree(o->data);
+	struct poolslab *slab, *snext;
+	struct pool **p;
+
 #ifdef POOL_DEBUG
 	if (o->used != 0) {
 		log_puts("pool_done(");
@@ -89,6 +145,7 @@ pool_done(struct pool *o)
 		log_putu(o->used);
 		log_puts(" items still allocated\n");
 	}
+#endif
 	if (pool_debug) {
 		log_puts("pool_done(");
 		log_puts(o->name);
@@ -100,7 +157,154 @@ pool_done(struct pool *o)
 		log_putu(100 * o->newcnt / o->itemnum);
 		log_puts("%\n");
 	}
-#endif
+	for (slab = o->slabs; slab != NULL; slab = snext) {
+		snext = slab->next;
+		xfree(slab);
+	}
+	for (p = &pool_list; *p != NULL; p = &(*p)->next) {
+		if (*p == o) {
+			*p = o->next;
+			break;
+		}
+	}
+}
+
+/*
+ * return the slab containing the given entry
+ */
+struct poolslab *
+pool_slab(struct pool *o, void *p)
+{
+	struct poolslab *slab;
+	unsigned char *start;
+
+	for (slab = o->slabs; slab != NULL; slab = slab->next) {
+		start = (unsigned char *)(slab + 1);
+		if ((unsigned char *)p >= start &&
+		    (unsigned char *)p < start + slab->itemnum * o->itemsize)
+			return slab;
+	}
+	log_puts("pool_slab(");
+	log_puts(o->name);
+	log_puts("): entry not in pool\n");
+	panic();
+	return NULL;
+}
+
+/*
+ * free slabs with no allocated entries, except the first one (ie the
+ * one allocated by pool_init()). This walks the whole free list, so
+ * it's meant to be called once a large structure is freed, not in
+ * real-time
+ */
+void
+pool_shrink(struct pool *o)
+{
+	struct poolslab *slab, **ps;
+	struct poolent *e, **pe;
+
+	if (o->nslabs == 1 || pool_fixed)
+		return;
+	for (slab = o->slabs; slab != NULL; slab = slab->next)
+		slab->nfree = 0;
+	for (e = o->first; e != NULL; e = e->next)
+		pool_slab(o, e)->nfree++;
+
+	/*
+	 * unlink free entries of empty slabs, then free the slabs;
+	 * the last slab of the list is the initial one
+	 */
+	for (pe = &o->first; (e = *pe) != NULL; ) {
+		slab = pool_slab(o, e);
+		if (slab->next != NULL && slab->nfree == slab->itemnum)
+			*pe = e->next;
+		else
+			pe = &e->next;
+	}
+	for (ps = &o->slabs; (slab = *ps)->next != NULL; ) {
+		if (slab->nfree == slab->itemnum) {
+			*ps = slab->next;
+			o->itemnum -= slab->itemnum;
+			o->nslabs--;
+			xfree(slab);
+		} else
+			ps = &slab->next;
+	}
+}
+
+/*
+ * replace the slabs of the given pool, which must have no entries in
+ * use, by a single one of the given number of entries
+ */
+void
+pool_resize(struct pool *o, unsigned itemnum)
+{
+	struct poolslab *slab, *snext;
+
+	if (o->used != 0) {
+		log_puts("pool_resize(");
+		log_puts(o->name);
+		log_puts("): entries in use\n");
+		panic();
+	}
+	for (slab = o->slabs; slab != NULL; slab = snext) {
+		snext = slab->next;
+		xfree(slab);
+	}
+	o->slabs = NULL;
+	o->first = NULL;
+	o->itemnum = 0;
+	o->nslabs = 0;
+	o->slabsize = itemnum;
+	pool_grow(o);
+}
+
+/*
+ * sort the free list by address, so entries allocated next are
+ * consecutive in memory. This is a merge sort of the list: at each
+ * pass, runs of 'insize' entries are merged, until a single run is
+ * left
+ */
+void
+pool_sort(struct pool *o)
+{
+	struct poolent *list, *p, *q, *e, **tail;
+	unsigned insize, nmerges, psize, qsize;
+
+	list = o->first;
+	if (list == NULL)
+		return;
+	for (insize = 1; ; insize *= 2) {
+		p = list;
+		tail = &list;
+		nmerges = 0;
+		while (p != NULL) {
+			nmerges++;
+			q = p;
+			for (psize = 0; psize < insize && q != NULL; psize++)
+				q = q->next;
+			qsize = insize;
+			while (psize > 0 || (qsize > 0 && q != NULL)) {
+				if (psize > 0 && (qsize == 0 || q == NULL ||
+				    (char *)p < (char *)q)) {
+					e = p;
+					p = p->next;
+					psize--;
+				} else {
+					e = q;
+					q = q->next;
+					qsize--;
+				}
+				*tail = e;
+				tail = &e->next;
+			}
+			p = q;
+		}
+		*tail = NULL;
+		if (nmerges <= 1)
+			break;
+	}
+	o->first = list;
 }
 
 /*
@@ -108,7 +312,7 @@ pool_done(struct pool *o)
  * it from the free list and return the pointer
  */
 void *
-pool_new(struct pool *o)
+pool_get(struct pool *o)
 {
 #ifdef POOL_DEBUG
 	unsigned i;
@@ -117,12 +321,18 @@ pool_new(struct pool *o)
 
 	struct poolent *e;
 
-	if (!o->first) {
-		log_puts("pool_new(");
-		log_puts(o->name);
-		log_puts("): pool is empty\n");
-		panic();
+	if (pool_fixed) {
+		if (o->itemnum - o->used <= o->itemnum / POOL_RESERVE)
+			pool_short = o;
+		if (!o->first) {
+			log_puts("pool_new(");
+			log_puts(o->name);
+			log_puts("): budget exceeded\n");
+			o->nover++;
+		}
 	}
+	if (!o->first)
+		pool_grow(o);
 
 	/*
 	 * unlink from the free list
@@ -130,12 +340,12 @@ pool_new(struct pool *o)
 	e = o->first;
 	o->first = e->next;
 
-#ifdef POOL_DEBUG
 	o->newcnt++;
 	o->used++;
 	if (o->used > o->maxused)
 		o->maxused = o->used;
 
+#ifdef POOL_DEBUG
 	/*
 	 * overwrite the entry with garbage so any attempt to use
 	 * uninitialized memory will probably segfault
@@ -151,7 +361,7 @@ pool_new(struct pool *o)
  * free an entry: just link it again on the free list
  */
 void
-pool_del(struct pool *o, void *p)
+pool_put(struct pool *o, void *p)
 {
 	struct poolent *e = (struct poolent *)p;
 #ifdef POOL_DEBUG
@@ -168,7 +378,6 @@ pool_del(struct pool *o, void *p)
 		log_puts("): pool is full\n");
 		panic();
 	}
-	o->used--;
 
 	/*
 	 * overwrite the entry with garbage so any attempt to use a
@@ -178,9 +387,35 @@ pool_del(struct pool *o, void *p)
 	for (i = o->itemsize; i > 0; i--)
 		*(buf++) = 0xdf;
 #endif
+	o->used--;
+
 	/*
 	 * link on the free list
 	 */
 	e->next = o->first;
 	o->first = e;
 }
+
+/*
+ * allocate an entry, through work.c if operations run concurrently
+ */
+void *
+pool_new(struct pool *o)
+{
+	if (work_active)
+		return work_poolnew(o);
+	return pool_get(o);
+}
+
+/*
+ * free an entry, through work.c if operations run concurrently
+ */
+void
+pool_del(struct pool *o, void *p)
+{
+	if (work_active) {
+		work_pooldel(o, p);
+		return;
+	}
+	pool_put(o, p);
+}
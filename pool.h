@@ -27,26 +27,63 @@ struct poolent {
 };
 
 /*
- * the pool is a linked list of 'itemnum' blocks of size
- * 'itemsize'. The pool name is for debugging prurposes only
+ * memory block holding 'itemnum' pool entries; entries follow
+ * the header
+ */
+struct poolslab {
+	struct poolslab *next;	/* next slab of the same pool */
+	unsigned itemnum;	/* number of entries in this slab */
+	unsigned nfree;		/* used by pool_shrink() only */
+};
+
+/*
+ * the pool is a linked list of free blocks of size 'itemsize',
+ * stored in one or more slabs. The first slab is allocated by
+ * pool_init(), next ones are added by pool_new() when the pool is
+ * empty. The pool name is for debugging prurposes only
  */
 struct pool {
-	unsigned char *data;	/* memory block of the pool */
+	struct pool *next;	/* list of all pools */
+	struct poolslab *slabs;	/* memory blocks of the pool */
 	struct poolent *first;	/* head of linked list */
-#ifdef POOL_DEBUG
 	unsigned maxused;	/* max pool usage */
 	unsigned used;		/* current pool usage */
 	unsigned newcnt;	/* current items allocated */
-#endif
+	unsigned nslabs;	/* number of slabs */
+	unsigned slabsize;	/* entries per slab */
 	unsigned itemnum;	/* total number of entries */
 	unsigned itemsize;	/* size of a sigle entry */
+	unsigned memcls;	/* memory class of slabs, see xmalloc_class() */
+	unsigned nover;		/* slabs added beyond the budget */
 	char *name;		/* name of the pool */
 };
 
+/*
+ * once pools are fixed, the last 1/POOL_RESERVE of each pool is kept
+ * for the realtime paths: commands that allocate from it fail
+ */
+#define POOL_RESERVE	16
+
+/*
+ * max entries poolsize can reserve
+ */
+#define POOL_MAXSIZE	1000000
+
 void  pool_init(struct pool *, char *, unsigned, unsigned);
+void  pool_initclass(struct pool *, char *, unsigned, unsigned, unsigned);
 void  pool_done(struct pool *);
+void  pool_shrink(struct pool *);
+void  pool_grow(struct pool *);
+void  pool_sort(struct pool *);
+void  pool_resize(struct pool *, unsigned);
 
+void *pool_get(struct pool *);
+void  pool_put(struct pool *, void *);
 void *pool_new(struct pool *);
 void  pool_del(struct pool *, void *);
 
+extern struct pool *pool_list;
+extern struct pool *pool_short;
+extern unsigned pool_fixed;
+
 #endif /* MIDISH_POOL_H */
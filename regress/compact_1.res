@@ -0,0 +1,97 @@
+#
+# midish 1.3.3
+#
+{
+	format 1
+	tics_per_unit 96
+	tempo_factor 256
+	meta {
+		timesig 4 24
+		tempo 500000
+	}
+	songtrk t {
+		mute 0
+		track {
+			96
+			non {0 0} 65 100
+			24
+			noff {0 0} 65 100
+			24
+			non {0 0} 69 90
+			24
+			noff {0 0} 69 90
+			24
+			non {0 0} 60 100
+			24
+			noff {0 0} 60 100
+			24
+			non {0 0} 64 90
+			24
+			noff {0 0} 64 90
+			24
+			non {0 0} 60 100
+			24
+			noff {0 0} 60 100
+			24
+			non {0 0} 64 90
+			24
+			noff {0 0} 64 90
+			24
+			non {0 0} 60 100
+			24
+			noff {0 0} 60 100
+			24
+			non {0 0} 64 90
+			24
+			noff {0 0} 64 90
+		}
+	}
+	songtrk u {
+		mute 0
+		track {
+			96
+			non {0 0} 60 100
+			24
+			noff {0 0} 60 100
+			24
+			non {0 0} 64 90
+			24
+			noff {0 0} 64 90
+			24
+			non {0 0} 60 100
+			24
+			noff {0 0} 60 100
+			24
+			non {0 0} 64 90
+			24
+			noff {0 0} 64 90
+			24
+			non {0 0} 60 100
+			24
+			noff {0 0} 60 100
+			24
+			non {0 0} 64 90
+			24
+			noff {0 0} 64 90
+			24
+			non {0 0} 60 100
+			24
+			noff {0 0} 60 100
+			24
+			non {0 0} 64 90
+			24
+			noff {0 0} 64 90
+		}
+	}
+	curpos 0
+	curlen 0
+	curquant 0
+	curev any {0..15 0..15}
+	metro {
+		mask	rec
+		lo	non {0 9} 68 90
+		hi	non {0 9} 67 127
+	}
+	tap off
+	tapev none
+}
@@ -0,0 +1,6 @@
+load "pat.msh"
+ct t; g 1; sel 1; tcopy; ct u; g 2; tpaste
+ct t; g 0; sel 2; ttransp 5
+compact
+u
+g 0; sel 0; ct nil; ci nil; co nil
@@ -0,0 +1,8 @@
+load "note.msh"
+savebin "mapload.tmp2"
+reset
+mapload "mapload.tmp2"
+tnew u
+ct t; g 0; sel 1; tcopy; ct u; g 0; tpaste
+ct t; g 0; sel 1; ttransp 12
+g 0; sel 0; ct nil; ci nil; co nil
@@ -0,0 +1,26 @@
+{
+	songtrk t {
+		track {
+			48
+			non {0 0} 77 100
+			48
+			kat {0 0} 77 123
+			96
+			kat {0 0} 77 124
+			48
+			noff {0 0} 77 100
+		}
+	}
+	songtrk u {
+		track {
+			48
+			non {0 0} 65 100
+			48
+			kat {0 0} 65 123
+			96
+			kat {0 0} 65 124
+			48
+			noff {0 0} 65 100
+		}
+	}
+}
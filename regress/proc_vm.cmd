@@ -0,0 +1,34 @@
+#
+# build a track with procs, to check the bytecode interpreter
+#
+proc note pos key vel ... {
+	let len = 4
+	for i in ... {
+		let len = $len * $i
+	}
+	taddev $pos / 4 $pos % 4 0 {non {0 0} $key $vel}
+	taddev $pos / 4 $pos % 4 $len {noff {0 0} $key 100}
+}
+proc arp pos keys {
+	for k in $keys {
+		if $k < 0 {
+			return $pos
+		}
+		note $pos $k 80 + ($k & 7)
+		let pos = $pos + 1
+	}
+	return $pos
+}
+proc scale n step {
+	if $n == 0 {
+		return {}
+	}
+	return [scale $n - 1 $step] + {60 + $n * $step}
+}
+tnew t
+ct t
+let p = [arp 0 {60 64 67}]
+let p = [arp $p [scale 6 2]]
+let p = [arp $p {72 (-1) 48}]
+note $p 36 127 2 2
+g 0; sel 0; ct nil; ci nil; co nil
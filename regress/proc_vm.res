@@ -0,0 +1,49 @@
+{
+	songtrk t {
+		track {
+			non {0 0} 60 84
+			4
+			noff {0 0} 60 100
+			20
+			non {0 0} 64 80
+			4
+			noff {0 0} 64 100
+			20
+			non {0 0} 67 83
+			4
+			noff {0 0} 67 100
+			20
+			non {0 0} 62 86
+			4
+			noff {0 0} 62 100
+			20
+			non {0 0} 64 80
+			4
+			noff {0 0} 64 100
+			20
+			non {0 0} 66 82
+			4
+			noff {0 0} 66 100
+			20
+			non {0 0} 68 84
+			4
+			noff {0 0} 68 100
+			20
+			non {0 0} 70 86
+			4
+			noff {0 0} 70 100
+			20
+			non {0 0} 72 80
+			4
+			noff {0 0} 72 100
+			20
+			non {0 0} 72 80
+			4
+			noff {0 0} 72 100
+			20
+			non {0 0} 36 127
+			16
+			noff {0 0} 36 100
+		}
+	}
+}
@@ -0,0 +1,6 @@
+load "note.msh"
+fnew f
+fmap {any {7 9}} {any {3 8}}
+savebin "savebin.tmp2"
+reset
+load "savebin.tmp2"
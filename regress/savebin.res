@@ -0,0 +1,21 @@
+{
+	songfilt f {
+		filt {
+			evmap any {7 9} > any {3 8}
+		}
+	}
+	songtrk t {
+		track {
+			48
+			non {0 0} 65 100
+			48
+			kat {0 0} 65 123
+			96
+			kat {0 0} 65 124
+			48
+			noff {0 0} 65 100
+			48
+		}
+	}
+	curfilt f
+}
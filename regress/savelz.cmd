@@ -0,0 +1,6 @@
+load "note.msh"
+fnew f
+fmap {any {7 9}} {any {3 8}}
+savelz "savelz.tmp2"
+reset
+load "savelz.tmp2"
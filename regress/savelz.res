@@ -0,0 +1,43 @@
+#
+# midish 1.3.3
+#
+{
+	format 1
+	tics_per_unit 96
+	tempo_factor 256
+	meta {
+		timesig 4 24
+		tempo 500000
+	}
+	songfilt f {
+		filt {
+			evmap any {7 9} > any {3 8}
+		}
+	}
+	songtrk t {
+		mute 0
+		track {
+			48
+			non {0 0} 65 100
+			48
+			kat {0 0} 65 123
+			96
+			kat {0 0} 65 124
+			48
+			noff {0 0} 65 100
+			48
+		}
+	}
+	curfilt f
+	curpos 0
+	curlen 0
+	curquant 0
+	curev any {0..15 0..15}
+	metro {
+		mask	rec
+		lo	non {0 9} 68 90
+		hi	non {0 9} 67 127
+	}
+	tap off
+	tapev none
+}
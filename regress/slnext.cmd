@@ -0,0 +1,4 @@
+load "bank.msh"
+slload "note.msh"
+slnext
+g 0; sel 0; ct nil; ci nil; co nil
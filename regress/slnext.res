@@ -0,0 +1,15 @@
+{
+	songtrk t {
+		track {
+			48
+			non {0 0} 65 100
+			48
+			kat {0 0} 65 123
+			96
+			kat {0 0} 65 124
+			48
+			noff {0 0} 65 100
+			48
+		}
+	}
+}
@@ -0,0 +1,9 @@
+load "note_e1.msh"
+fnew f
+fmap {any {0 0}} {any {0 1}}
+snapshot "snapshot.tmp2"
+ct t; g 2; sel 2; ttransp 12
+ct t2; tdel
+cf f; fdel
+restore "snapshot.tmp2"
+g 0; sel 0; ct nil; ci nil; co nil
@@ -0,0 +1,9 @@
+load "quant.msh"
+g 0
+ct t
+sel 16
+setq 24
+tedit {{quanta 100} {transp 3} {vcurve 10}}
+sel 0
+setq nil
+g 0; sel 0; ct nil; ci nil; co nil
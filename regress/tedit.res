@@ -0,0 +1,34 @@
+{
+	songtrk t {
+		track {
+			48
+			non {0 0} 63 108
+			48
+			noff {0 0} 63 100
+			48
+			non {0 0} 64 108
+			48
+			noff {0 0} 64 100
+			52
+			non {0 0} 65 108
+			44
+			noff {0 0} 65 100
+			52
+			non {0 0} 66 108
+			44
+			noff {0 0} 66 100
+			48
+			non {0 0} 62 108
+			48
+			noff {0 0} 62 100
+			48
+			non {0 0} 61 108
+			48
+			noff {0 0} 61 100
+			44
+			non {0 0} 60 108
+			52
+			noff {0 0} 60 100
+		}
+	}
+}
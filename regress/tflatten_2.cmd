@@ -0,0 +1,6 @@
+load "note_e1.msh"
+tnew u
+ct t2; g 0; sel 1; tcopy; ct u; g 1; tpaste; g 1; sel 1; ttransp -5
+tnew m
+ct m; tflatten {u t t2}
+g 0; sel 0; ct nil; ci nil; co nil
@@ -0,0 +1,6 @@
+load "pat.msh"
+ct t; tpack
+ct u; tpack
+ct t; g 2; sel 1; ttransp 12
+ct u; g 1; sel 2; ttransp 5; u
+g 0; sel 0; ct nil
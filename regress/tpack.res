@@ -0,0 +1,75 @@
+{
+	songtrk t {
+		track {
+			96
+			non {0 0} 60 100
+			24
+			noff {0 0} 60 100
+			24
+			non {0 0} 64 90
+			24
+			noff {0 0} 64 90
+			24
+			non {0 0} 72 100
+			24
+			noff {0 0} 72 100
+			24
+			non {0 0} 76 90
+			24
+			noff {0 0} 76 90
+			24
+			non {0 0} 60 100
+			24
+			noff {0 0} 60 100
+			24
+			non {0 0} 64 90
+			24
+			noff {0 0} 64 90
+			24
+			non {0 0} 60 100
+			24
+			noff {0 0} 60 100
+			24
+			non {0 0} 64 90
+			24
+			noff {0 0} 64 90
+		}
+	}
+	songtrk u {
+		track {
+			96
+			non {0 0} 60 100
+			24
+			noff {0 0} 60 100
+			24
+			non {0 0} 64 90
+			24
+			noff {0 0} 64 90
+			24
+			non {0 0} 60 100
+			24
+			noff {0 0} 60 100
+			24
+			non {0 0} 64 90
+			24
+			noff {0 0} 64 90
+			24
+			non {0 0} 60 100
+			24
+			noff {0 0} 60 100
+			24
+			non {0 0} 64 90
+			24
+			noff {0 0} 64 90
+			24
+			non {0 0} 60 100
+			24
+			noff {0 0} 60 100
+			24
+			non {0 0} 64 90
+			24
+			noff {0 0} 64 90
+			24
+		}
+	}
+}
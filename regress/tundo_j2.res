@@ -0,0 +1,42 @@
+#
+# midish 1.3.3
+#
+{
+	format 1
+	tics_per_unit 96
+	tempo_factor 256
+	meta {
+		timesig 4 24
+		tempo 500000
+	}
+	songtrk t2 {
+		mute 0
+		track {
+			non {0 0} 65 50
+			96
+			noff {0 0} 65 50
+		}
+	}
+	songtrk t {
+		mute 0
+		track {
+			192
+			non {0 0} 77 100
+			192
+			kat {0 0} 77 124
+			96
+			noff {0 0} 77 100
+		}
+	}
+	curpos 0
+	curlen 0
+	curquant 0
+	curev any {0..15 0..15}
+	metro {
+		mask	rec
+		lo	non {0 9} 68 90
+		hi	non {0 9} 67 127
+	}
+	tap off
+	tapev none
+}
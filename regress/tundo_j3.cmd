@@ -0,0 +1,6 @@
+load "note_e1.msh"
+ct t; g 2; sel 2; ttransp 12
+ct t2; g 0; sel 1; tclr
+ct t; g 1; sel 1; tins 1
+u; u; u
+g 0; sel 0; ct nil; ci nil; co nil
@@ -0,0 +1,6 @@
+load "pat.msh"
+undosize 800 800
+ct t; g 3; sel 1; ttransp 2
+tnew x
+u; u
+g 0; sel 0; ct nil; ci nil; co nil
@@ -0,0 +1,8 @@
+load "pat.msh"
+undosize 800 800
+ct t; g 3; sel 1; ttransp 2
+ct t; g 0; sel 99; ttransp 12
+tnew x
+fnew f
+u; u
+g 0; sel 0; ct nil; ci nil; co nil
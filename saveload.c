@@ -15,6 +15,8 @@
  */
 
 #include <limits.h>
+#include <stdio.h>
+#include <string.h>
 #include "utils.h"
 #include "name.h"
 #include "mididev.h"
@@ -26,9 +28,32 @@
 #include "conv.h"
 #include "version.h"
 #include "cons.h"
+#include "data.h"
+#include "node.h"
+#include "exec.h"
+#include "vm.h"
+#include "mux.h"
 
 #define FORMAT_VERSION	1
 
+/*
+ * if saveload_yield is set, loaders and song_save() call
+ * mux_mdep_yield() every SAVELOAD_YIELDEVS events, so a song can be
+ * loaded while another one is playing, or saved while it's playing
+ */
+#define SAVELOAD_YIELDEVS	64
+
+unsigned saveload_yield = 0;
+unsigned saveload_nevs = 0;
+
+void
+saveload_yieldev(void)
+{
+	if (saveload_yield && mux_isopen &&
+	    ++saveload_nevs % SAVELOAD_YIELDEVS == 0)
+		mux_mdep_yield();
+}
+
 void
 chan_output(unsigned dev, unsigned ch, struct textout *f)
 {
@@ -196,12 +221,14 @@ evspec_output(struct evspec *o, struct textout *f)
 void
 track_output(struct track *t, struct textout *f)
 {
+	struct trackiter it;
 	struct seqev *i;
 
 	textout_putstr(f, "{\n");
 	textout_shiftright(f);
 
-	for (i = t->first; i != NULL; i = i->next) {
+	trackiter_init(&it, t);
+	while ((i = trackiter_next(&it)) != NULL) {
 		if (i->delta != 0) {
 			textout_putlong(f, i->delta);
 			textout_putstr(f, "\n");
@@ -211,6 +238,7 @@ track_output(struct track *t, struct textout *f)
 		}
 		ev_output(&i->ev, f);
 		textout_putstr(f, "\n");
+		saveload_yieldev();
 	}
 
 	textout_shiftleft(f);
@@ -1190,8 +1218,7 @@ unsigned
 load_track(struct load *o, struct track *t)
 {
 	unsigned delta;
-	struct seqev *pos, *se;
-	struct statelist slist;
+	struct conv conv;
 	struct ev ev, rev;
 	struct mididev *dev;
 	unsigned int xctlset, evset;
@@ -1203,11 +1230,10 @@ load_track(struct load *o, struct track *t)
 		return 0;
 	}
 	track_clear(t);
-	statelist_init(&slist);
-	pos = t->first;
+	conv_init(&conv);
 	for (;;) {
 		if (!load_getsym(o)) {
-			statelist_done(&slist);
+			conv_done(&conv);
 			return 0;
 		}
 		if (o->id == TOK_ENDLINE) {
@@ -1217,14 +1243,14 @@ load_track(struct load *o, struct track *t)
 		} else if (o->id == TOK_NUM) {
 			load_ungetsym(o);
 			if (!load_delta(o, &delta)) {
-				statelist_done(&slist);
+				conv_done(&conv);
 				return 0;
 			}
-			pos->delta += delta;
+			t->eot.delta += delta;
 		} else {
 			load_ungetsym(o);
 			if (!load_ev(o, &ev)) {
-				statelist_done(&slist);
+				conv_done(&conv);
 				return 0;
 			}
 			if (ev.cmd != EV_NULL) {
@@ -1244,16 +1270,14 @@ load_track(struct load *o, struct track *t)
 					xctlset = 0;
 					evset = CONV_XPC | CONV_NRPN | CONV_RPN;
 				}
-				if (conv_packev(&slist, xctlset, evset,
-					&ev, &rev)) {
-					se = seqev_new();
-					se->ev = rev;
-					seqev_ins(pos, se);
-				}
+				if (conv_packev(&conv, xctlset, evset,
+					&ev, &rev))
+					track_append(t, &rev);
+				saveload_yieldev();
 			}
 		}
 	}
-	statelist_done(&slist);
+	conv_done(&conv);
 	return 1;
 }
 
@@ -1818,6 +1842,7 @@ load_songtrk(struct load *o, struct song *s, struct songtrk *t)
 			} else if (str_eq(o->strval, "track")) {
 				if (!load_track(o, &t->track))
 					return 0;
+				track_pack(&t->track);
 				if (!load_nl(o))
 					return 0;
 			} else if (str_eq(o->strval, "mute")) {
@@ -1906,6 +1931,7 @@ load_songsx(struct load *o, struct song *s, struct songsx *g)
 			if (str_eq(o->strval, "sysex")) {
 				if (!load_sysex(o, &sx))
 					return 0;
+				sysex_pack(sx);
 				sysexlist_put(&g->sx, sx);
 			} else {
 				goto unknown;
@@ -2307,6 +2333,30 @@ song_save(struct song *o, char *name)
 	if (f == NULL) {
 		return;
 	}
+	song_savetext(o, f);
+}
+
+/*
+ * save the song in the text format, compressed
+ */
+void
+song_savelz(struct song *o, char *name)
+{
+	struct textout *f;
+
+	f = textout_newlz(name);
+	if (f == NULL) {
+		return;
+	}
+	song_savetext(o, f);
+}
+
+/*
+ * write the song in the given file and close it
+ */
+void
+song_savetext(struct song *o, struct textout *f)
+{
 	textout_putstr(f,
 	    "#\n"
 	    "# " VERSION "\n"
@@ -2321,8 +2371,11 @@ unsigned
 song_load(struct song *o, char *filename)
 {
 	struct load p;
-	unsigned res;
+	unsigned res, isbin;
 
+	res = song_loadbin(o, filename, &isbin);
+	if (isbin || !res)
+		return res;
 	if (!load_init(&p, filename))
 		return 0;
 	res = load_empty(&p);
@@ -2332,3 +2385,1484 @@ song_load(struct song *o, char *filename)
 	load_done(&p);
 	return res;
 }
+
+/* ------------------------------------------------------ binary --- */
+
+/*
+ * binary song images. The file starts with the SAVELOAD_MAGIC bytes
+ * and a version number, followed by the same sections as the text
+ * format, in the same order. Numbers are stored with seqev_packnum(),
+ * strings as a length followed by the characters, and track events
+ * as records written by seqev_pack(), terminated by an EV_NULL record
+ * holding the delta of the end-of-track
+ */
+#define SAVELOAD_MAGIC		"MSHB"
+#define SAVELOAD_MAGICLEN	4
+#define SAVELOAD_BINVERSION	1
+#define SAVELOAD_BUFSZ		0x1000
+
+#define SAVELOAD_RULE_END	0
+#define SAVELOAD_RULE_MAP	1
+#define SAVELOAD_RULE_TRANSP	2
+#define SAVELOAD_RULE_VCURVE	3
+
+struct binload {
+	FILE *file;
+	char *path;			/* for error reporting */
+	unsigned char *buf;		/* SAVELOAD_BUFSZ bytes */
+	unsigned pos, len;
+	unsigned patmap[EV_NPAT];	/* file pattern slot -> cmd */
+};
+
+void
+binout_putnum(FILE *f, unsigned val)
+{
+	unsigned char buf[5];
+
+	fwrite(buf, seqev_packnum(buf, val), 1, f);
+}
+
+void
+binout_putstr(FILE *f, char *str)
+{
+	unsigned len;
+
+	len = str ? strlen(str) : 0;
+	binout_putnum(f, len);
+	if (len > 0)
+		fwrite(str, len, 1, f);
+}
+
+void
+binout_evspec(FILE *f, struct evspec *es)
+{
+	binout_putnum(f, es->cmd);
+	binout_putnum(f, es->dev_min);
+	binout_putnum(f, es->dev_max);
+	binout_putnum(f, es->ch_min);
+	binout_putnum(f, es->ch_max);
+	binout_putnum(f, es->v0_min);
+	binout_putnum(f, es->v0_max);
+	binout_putnum(f, es->v1_min);
+	binout_putnum(f, es->v1_max);
+}
+
+void
+binout_ev(FILE *f, unsigned delta, struct ev *ev)
+{
+	unsigned char buf[SEQEV_PACKMAX];
+
+	fwrite(buf, seqev_pack(buf, delta, ev), 1, f);
+}
+
+void
+binout_track(FILE *f, struct track *t)
+{
+	struct trackiter it;
+	struct seqev *i;
+
+	trackiter_init(&it, t);
+	while ((i = trackiter_next(&it)) != NULL)
+		binout_ev(f, i->delta, &i->ev);
+}
+
+void
+binout_filt(FILE *f, struct filt *o)
+{
+	struct filtnode *s, *snext;
+	struct filtnode *d;
+
+	/*
+	 * same order as filt_output(), so rules are created in the
+	 * same order as by the text loader
+	 */
+	snext = 0;
+	for (;;) {
+		if (snext == o->map)
+			break;
+		for (s = o->map; s->next != snext; s = s->next) {
+			/* nothing */
+		}
+		for (d = s->dstlist; d != NULL; d = d->next) {
+			binout_putnum(f, SAVELOAD_RULE_MAP);
+			binout_evspec(f, &s->es);
+			binout_evspec(f, &d->es);
+		}
+		snext = s;
+	}
+	for (d = o->transp; d != NULL; d = d->next) {
+		binout_putnum(f, SAVELOAD_RULE_TRANSP);
+		binout_evspec(f, &d->es);
+		binout_putnum(f, d->u.transp.plus & 0x7f);
+	}
+	for (d = o->vcurve; d != NULL; d = d->next) {
+		binout_putnum(f, SAVELOAD_RULE_VCURVE);
+		binout_evspec(f, &d->es);
+		binout_putnum(f, (64 - d->u.vel.nweight) & 0x7f);
+	}
+	binout_putnum(f, SAVELOAD_RULE_END);
+}
+
+void
+binout_sysex(FILE *f, struct sysex *o)
+{
+	struct chunk *c;
+	unsigned len;
+
+	len = 0;
+	for (c = o->first; c != NULL; c = c->next)
+		len += c->used;
+	binout_putnum(f, o->unit);
+	binout_putnum(f, len);
+	for (c = o->first; c != NULL; c = c->next)
+		fwrite(c->data, c->used, 1, f);
+}
+
+void
+binout_song(FILE *f, struct song *o)
+{
+	struct songtrk *t;
+	struct songchan *i;
+	struct songfilt *g;
+	struct songsx *s;
+	struct sysex *x;
+	unsigned char *p;
+	unsigned n, k;
+
+	fwrite(SAVELOAD_MAGIC, SAVELOAD_MAGICLEN, 1, f);
+	binout_putnum(f, SAVELOAD_BINVERSION);
+	binout_putnum(f, o->tics_per_unit);
+	binout_putnum(f, o->tempo_factor);
+	binout_track(f, &o->meta);
+
+	n = 0;
+	for (k = 0; k < EV_NPAT; k++) {
+		if (evinfo[EV_PAT0 + k].ev != NULL)
+			n++;
+	}
+	binout_putnum(f, n);
+	for (k = 0; k < EV_NPAT; k++) {
+		if (evinfo[EV_PAT0 + k].ev == NULL)
+			continue;
+		binout_putnum(f, k);
+		binout_putstr(f, evinfo[EV_PAT0 + k].ev);
+		p = evinfo[EV_PAT0 + k].pattern;
+		for (n = 1; p[n - 1] != 0xf7; n++)
+			; /* nothing */
+		binout_putnum(f, n);
+		fwrite(p, n, 1, f);
+	}
+
+	n = 0;
+	SONG_FOREACH_CHAN(o, i)
+		n++;
+	binout_putnum(f, n);
+	SONG_FOREACH_CHAN(o, i) {
+		binout_putstr(f, i->name.str);
+		binout_putnum(f, i->isinput);
+		binout_putnum(f, i->dev);
+		binout_putnum(f, i->ch);
+		binout_track(f, &i->conf);
+	}
+
+	n = 0;
+	SONG_FOREACH_FILT(o, g)
+		n++;
+	binout_putnum(f, n);
+	SONG_FOREACH_FILT(o, g) {
+		binout_putstr(f, g->name.str);
+		binout_filt(f, &g->filt);
+	}
+
+	n = 0;
+	SONG_FOREACH_TRK(o, t)
+		n++;
+	binout_putnum(f, n);
+	SONG_FOREACH_TRK(o, t) {
+		binout_putstr(f, t->name.str);
+		binout_putstr(f, t->curfilt ? t->curfilt->name.str : NULL);
+		binout_putnum(f, t->mute);
+		binout_track(f, &t->track);
+	}
+
+	n = 0;
+	SONG_FOREACH_SX(o, s)
+		n++;
+	binout_putnum(f, n);
+	SONG_FOREACH_SX(o, s) {
+		binout_putstr(f, s->name.str);
+		n = 0;
+		for (x = s->sx.first; x != NULL; x = x->next)
+			n++;
+		binout_putnum(f, n);
+		for (x = s->sx.first; x != NULL; x = x->next)
+			binout_sysex(f, x);
+	}
+
+	binout_putstr(f, o->curtrk ? o->curtrk->name.str : NULL);
+	binout_putstr(f, o->curfilt ? o->curfilt->name.str : NULL);
+	binout_putstr(f, o->cursx ? o->cursx->name.str : NULL);
+	binout_putstr(f, o->curin ? o->curin->name.str : NULL);
+	binout_putstr(f, o->curout ? o->curout->name.str : NULL);
+	binout_putnum(f, o->curpos);
+	binout_putnum(f, o->curlen);
+	binout_putnum(f, o->curquant);
+	binout_evspec(f, &o->curev);
+	binout_putnum(f, o->metro.mask);
+	binout_ev(f, 0, &o->metro.lo);
+	binout_ev(f, 0, &o->metro.hi);
+	binout_putnum(f, o->tap_mode);
+	binout_evspec(f, &o->tap_evspec);
+}
+
+void
+song_savebin(struct song *o, char *name)
+{
+	FILE *f;
+
+	f = fopen(name, "wb");
+	if (f == NULL) {
+		cons_errs(name, "failed to open output file");
+		return;
+	}
+	binout_song(f, o);
+	if (ferror(f))
+		cons_errs(name, "failed to write output file");
+	fclose(f);
+}
+
+void
+binload_err(struct binload *o, char *msg)
+{
+	cons_errs(o->path, msg);
+}
+
+unsigned
+binload_getc(struct binload *o, unsigned *c)
+{
+	if (o->pos == o->len) {
+		if (o->file == NULL) {
+			binload_err(o, "unexpected end of image");
+			return 0;
+		}
+		o->len = fread(o->buf, 1, SAVELOAD_BUFSZ, o->file);
+		o->pos = 0;
+		if (o->len == 0) {
+			binload_err(o, "unexpected end of file");
+			return 0;
+		}
+	}
+	*c = o->buf[o->pos++];
+	return 1;
+}
+
+unsigned
+binload_getnum(struct binload *o, unsigned *val)
+{
+	unsigned n, c;
+
+	*val = 0;
+	for (n = 0; ; n++) {
+		if (n == 5) {
+			binload_err(o, "bad number in file");
+			return 0;
+		}
+		if (!binload_getc(o, &c))
+			return 0;
+		*val = (*val << 7) | (c & 0x7f);
+		if (!(c & 0x80))
+			break;
+	}
+	return 1;
+}
+
+unsigned
+binload_getlim(struct binload *o, unsigned min, unsigned max, unsigned *val)
+{
+	if (!binload_getnum(o, val))
+		return 0;
+	if (*val < min || *val > max) {
+		binload_err(o, "number out of range in file");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * read an event parameter, which may be undefined (eg. the bank of
+ * a program change)
+ */
+unsigned
+binload_getparam(struct binload *o, unsigned min, unsigned max, unsigned *val)
+{
+	if (!binload_getnum(o, val))
+		return 0;
+	if ((*val < min || *val > max) && *val != EV_UNDEF) {
+		binload_err(o, "event parameter out of range in file");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * read a name, an empty string means no name
+ */
+unsigned
+binload_getstr(struct binload *o, char *str)
+{
+	unsigned i, len, c;
+
+	if (!binload_getlim(o, 0, TOK_MAXLEN, &len))
+		return 0;
+	for (i = 0; i < len; i++) {
+		if (!binload_getc(o, &c))
+			return 0;
+		str[i] = c;
+	}
+	str[i] = '\0';
+	return 1;
+}
+
+/*
+ * translate the given command number of the file, so that
+ * sysex patterns match the slots they were loaded into
+ */
+unsigned
+binload_cmd(struct binload *o, unsigned *cmd)
+{
+	if (*cmd >= EV_NUMCMD) {
+		binload_err(o, "unknown event in file");
+		return 0;
+	}
+	if (*cmd >= EV_PAT0)
+		*cmd = o->patmap[*cmd - EV_PAT0];
+	return 1;
+}
+
+unsigned
+binload_evspec(struct binload *o, struct evspec *es)
+{
+	struct evinfo *ei;
+
+	if (!binload_getnum(o, &es->cmd) || !binload_cmd(o, &es->cmd))
+		return 0;
+	ei = &evinfo[es->cmd];
+	if (es->cmd != EVSPEC_EMPTY && ei->spec == NULL) {
+		binload_err(o, "unknown event set in file");
+		return 0;
+	}
+	if (!binload_getlim(o, 0, EV_MAXDEV, &es->dev_min) ||
+	    !binload_getlim(o, es->dev_min, EV_MAXDEV, &es->dev_max) ||
+	    !binload_getlim(o, 0, EV_MAXCH, &es->ch_min) ||
+	    !binload_getlim(o, es->ch_min, EV_MAXCH, &es->ch_max) ||
+	    !binload_getnum(o, &es->v0_min) ||
+	    !binload_getnum(o, &es->v0_max) ||
+	    !binload_getnum(o, &es->v1_min) ||
+	    !binload_getnum(o, &es->v1_max))
+		return 0;
+	if ((ei->nranges >= 1 && (es->v0_min > es->v0_max ||
+		es->v0_max > ei->v0_max)) ||
+	    (ei->nranges >= 2 && (es->v1_min > es->v1_max ||
+		es->v1_max > ei->v1_max))) {
+		binload_err(o, "bad event set range in file");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * read an event stored with seqev_pack(), checking that it's valid
+ */
+unsigned
+binload_ev(struct binload *o, unsigned *delta, struct ev *ev)
+{
+	struct evinfo *ei;
+	unsigned cmd, dev, ch, v1;
+
+	if (!binload_getnum(o, delta) ||
+	    !binload_getc(o, &cmd) ||
+	    !binload_cmd(o, &cmd))
+		return 0;
+	ev->cmd = cmd;
+	ev->dev = ev->ch = 0;
+	ev->v0 = ev->v1 = 0;
+	if (cmd == EV_NULL)
+		return 1;
+	ei = &evinfo[cmd];
+	if (ei->ev == NULL) {
+		binload_err(o, "unknown event in file");
+		return 0;
+	}
+	if ((ei->flags & EV_HAS_DEV) && (ei->flags & EV_HAS_CH)) {
+		if (!binload_getc(o, &dev))
+			return 0;
+		ev->dev = dev >> 4;
+		ev->ch = dev & 0xf;
+	} else if (ei->flags & EV_HAS_DEV) {
+		if (!binload_getlim(o, 0, EV_MAXDEV, &dev))
+			return 0;
+		ev->dev = dev;
+	} else if (ei->flags & EV_HAS_CH) {
+		if (!binload_getlim(o, 0, EV_MAXCH, &ch))
+			return 0;
+		ev->ch = ch;
+	}
+	if (cmd == EV_TIMESIG) {
+		if (!binload_getlim(o, 1, TIMESIG_BEATS_MAX, &ev->v0) ||
+		    !binload_getlim(o, 1, TIMESIG_TICS_MAX, &v1))
+			return 0;
+		ev->v1 = v1;
+		return 1;
+	}
+	if (ei->nparams > 0 &&
+	    !binload_getparam(o, ei->v0_min, ei->v0_max, &ev->v0))
+		return 0;
+	if (ei->nparams > 1) {
+		if (!binload_getparam(o, ei->v1_min, ei->v1_max, &v1))
+			return 0;
+		ev->v1 = v1;
+	}
+	return 1;
+}
+
+unsigned
+binload_track(struct binload *o, struct track *t)
+{
+	unsigned delta;
+	struct ev ev;
+
+	track_clear(t);
+	for (;;) {
+		if (!binload_ev(o, &delta, &ev))
+			return 0;
+		t->eot.delta += delta;
+		if (ev.cmd == EV_NULL)
+			break;
+		track_append(t, &ev);
+		saveload_yieldev();
+	}
+	return 1;
+}
+
+/*
+ * read a track of a mapped image, its events are checked and then
+ * read in place. If sysex patterns were loaded into other slots,
+ * events must be translated, so they are copied
+ */
+unsigned
+binload_trackmap(struct binload *o, struct track *t)
+{
+	unsigned char *rom;
+	unsigned i, delta;
+	struct ev ev;
+
+	if (o->file != NULL)
+		return binload_track(o, t);
+	for (i = 0; i < EV_NPAT; i++) {
+		if (o->patmap[i] != EV_PAT0 + i)
+			return binload_track(o, t);
+	}
+	rom = o->buf + o->pos;
+	do {
+		if (!binload_ev(o, &delta, &ev))
+			return 0;
+		saveload_yieldev();
+	} while (ev.cmd != EV_NULL);
+	track_map(t, rom);
+	return 1;
+}
+
+unsigned
+binload_filt(struct binload *o, struct filt *f)
+{
+	struct evspec from, to;
+	unsigned type, val;
+
+	for (;;) {
+		if (!binload_getnum(o, &type))
+			return 0;
+		switch (type) {
+		case SAVELOAD_RULE_END:
+			return 1;
+		case SAVELOAD_RULE_MAP:
+			if (!binload_evspec(o, &from) ||
+			    !binload_evspec(o, &to))
+				return 0;
+			filt_mapnew(f, &from, &to);
+			break;
+		case SAVELOAD_RULE_TRANSP:
+			if (!binload_evspec(o, &to) ||
+			    !binload_getlim(o, 0, EV_MAXCOARSE, &val))
+				return 0;
+			filt_transp(f, &to, val);
+			break;
+		case SAVELOAD_RULE_VCURVE:
+			if (!binload_evspec(o, &to) ||
+			    !binload_getlim(o, 1, EV_MAXCOARSE, &val))
+				return 0;
+			filt_vcurve(f, &to, val);
+			break;
+		default:
+			binload_err(o, "unknown filter rule in file");
+			return 0;
+		}
+	}
+}
+
+unsigned
+binload_sysex(struct binload *o, struct sysex **res)
+{
+	struct sysex *sx;
+	unsigned unit, len, c;
+
+	if (!binload_getlim(o, 0, EV_MAXDEV, &unit) ||
+	    !binload_getnum(o, &len))
+		return 0;
+	sx = sysex_new(unit);
+	while (len-- > 0) {
+		if (!binload_getc(o, &c)) {
+			sysex_del(sx);
+			return 0;
+		}
+		sysex_add(sx, c);
+	}
+	*res = sx;
+	return 1;
+}
+
+unsigned
+binload_evpat(struct binload *o)
+{
+	char ref[TOK_MAXLEN + 1];
+	unsigned char *pattern;
+	char *name;
+	unsigned slot, size, i, c;
+	unsigned cmd;
+
+	if (!binload_getlim(o, 0, EV_NPAT - 1, &slot) ||
+	    !binload_getstr(o, ref) ||
+	    !binload_getlim(o, 2, EV_PATSIZE, &size))
+		return 0;
+	if (evpat_lookup(ref, &cmd))
+		evpat_unconf(cmd);
+	for (cmd = EV_PAT0;; cmd++) {
+		if (cmd == EV_PAT0 + EV_NPAT) {
+			binload_err(o, "too many sysex patterns");
+			return 0;
+		}
+		if (evinfo[cmd].ev == NULL)
+			break;
+	}
+	name = str_new(ref);
+	pattern = xmalloc(EV_PATSIZE, "evpat");
+	for (i = 0; i < size; i++) {
+		if (!binload_getc(o, &c))
+			goto err1;
+		pattern[i] = c;
+	}
+	if (!evpat_set(cmd, name, pattern, size))
+		goto err1;
+	o->patmap[slot] = cmd;
+	return 1;
+err1:
+	str_delete(name);
+	xfree(pattern);
+	return 0;
+}
+
+unsigned
+binload_song(struct binload *o, struct song *s)
+{
+	char name[TOK_MAXLEN + 1], fname[TOK_MAXLEN + 1];
+	struct songtrk *t;
+	struct songchan *i;
+	struct songfilt *g;
+	struct songsx *l;
+	struct sysex *sx;
+	struct evspec es;
+	struct ev ev;
+	unsigned n, m, val, delta, input, dev, ch;
+
+	if (!binload_getnum(o, &val))
+		return 0;
+	if (val > SAVELOAD_BINVERSION) {
+		binload_err(o, "midish version too old to read this file");
+		return 0;
+	}
+	if (!binload_getnum(o, &val))
+		return 0;
+	if (val < 96 || (val % 96) != 0) {
+		binload_err(o, "bad tics_per_unit in file");
+		return 0;
+	}
+	s->tics_per_unit = val;
+	if (!binload_getlim(o, 0x80, 0x200, &val))
+		return 0;
+	s->tempo_factor = val;
+	if (!binload_track(o, &s->meta))
+		return 0;
+
+	if (!binload_getlim(o, 0, EV_NPAT, &n))
+		return 0;
+	while (n-- > 0) {
+		if (!binload_evpat(o))
+			return 0;
+	}
+
+	if (!binload_getnum(o, &n))
+		return 0;
+	while (n-- > 0) {
+		if (!binload_getstr(o, name) ||
+		    !binload_getlim(o, 0, 1, &input) ||
+		    !binload_getlim(o, 0, EV_MAXDEV, &dev) ||
+		    !binload_getlim(o, 0, EV_MAXCH, &ch))
+			return 0;
+		i = song_chanlookup(s, name, input);
+		if (i == NULL) {
+			i = song_channew(s, name, 0, 0, input);
+			song_setcurchan(s, NULL, input);
+			if (i->filt)
+				filt_reset(&i->filt->filt);
+		}
+		i->dev = dev;
+		i->ch = ch;
+		if (!binload_track(o, &i->conf))
+			return 0;
+		track_setchan(&i->conf, i->dev, i->ch);
+	}
+
+	if (!binload_getnum(o, &n))
+		return 0;
+	while (n-- > 0) {
+		if (!binload_getstr(o, name))
+			return 0;
+		g = song_filtlookup(s, name);
+		if (!g) {
+			g = song_filtnew(s, name);
+			song_setcurfilt(s, NULL);
+		}
+		if (!binload_filt(o, &g->filt))
+			return 0;
+	}
+
+	if (!binload_getnum(o, &n))
+		return 0;
+	while (n-- > 0) {
+		if (!binload_getstr(o, name) || !binload_getstr(o, fname))
+			return 0;
+		t = song_trklookup(s, name);
+		if (t == NULL) {
+			t = song_trknew(s, name);
+			song_setcurtrk(s, NULL);
+		}
+		if (fname[0] != '\0') {
+			g = song_filtlookup(s, fname);
+			if (!g) {
+				g = song_filtnew(s, fname);
+				song_setcurfilt(s, NULL);
+			}
+			t->curfilt = g;
+		}
+		if (!binload_getlim(o, 0, 1, &val))
+			return 0;
+		t->mute = val;
+		if (!binload_trackmap(o, &t->track))
+			return 0;
+		if (t->track.rom == NULL)
+			track_pack(&t->track);
+	}
+
+	if (!binload_getnum(o, &n))
+		return 0;
+	while (n-- > 0) {
+		if (!binload_getstr(o, name) || !binload_getnum(o, &m))
+			return 0;
+		l = song_sxlookup(s, name);
+		if (!l) {
+			l = song_sxnew(s, name);
+			song_setcursx(s, NULL);
+		}
+		while (m-- > 0) {
+			if (!binload_sysex(o, &sx))
+				return 0;
+			sysex_pack(sx);
+			sysexlist_put(&l->sx, sx);
+		}
+	}
+
+	if (!binload_getstr(o, name))
+		return 0;
+	if (name[0] != '\0')
+		s->curtrk = song_trklookup(s, name);
+	if (!binload_getstr(o, name))
+		return 0;
+	if (name[0] != '\0')
+		s->curfilt = song_filtlookup(s, name);
+	if (!binload_getstr(o, name))
+		return 0;
+	if (name[0] != '\0')
+		s->cursx = song_sxlookup(s, name);
+	for (input = 1; ; input = 0) {
+		if (!binload_getstr(o, name))
+			return 0;
+		if (name[0] != '\0') {
+			i = song_chanlookup(s, name, input);
+			if (i)
+				song_setcurchan(s, i, input);
+		}
+		if (!input)
+			break;
+	}
+	if (!binload_getnum(o, &val))
+		return 0;
+	s->curpos = val;
+	if (!binload_getnum(o, &val))
+		return 0;
+	s->curlen = val;
+	if (!binload_getlim(o, 0, s->tics_per_unit, &val))
+		return 0;
+	s->curquant = val;
+	if (!binload_evspec(o, &es))
+		return 0;
+	s->curev = es;
+	if (!binload_getnum(o, &val))
+		return 0;
+	metro_setmask(&s->metro, val);
+	if (!binload_ev(o, &delta, &ev))
+		return 0;
+	if (ev.cmd == EV_NON)
+		s->metro.lo = ev;
+	if (!binload_ev(o, &delta, &ev))
+		return 0;
+	if (ev.cmd == EV_NON)
+		s->metro.hi = ev;
+	if (!binload_getlim(o, SONG_TAP_OFF, SONG_TAP_TEMPO, &val))
+		return 0;
+	s->tap_mode = val;
+	if (!binload_evspec(o, &es))
+		return 0;
+	s->tap_evspec = es;
+	return 1;
+}
+
+/*
+ * load a song saved with song_savebin(). If the file is not a
+ * binary image, *isbin is cleared and the caller should fallback
+ * to the text format
+ */
+unsigned
+song_loadbin(struct song *s, char *filename, unsigned *isbin)
+{
+	struct binload o;
+	char magic[SAVELOAD_MAGICLEN];
+	unsigned i, res;
+
+	*isbin = 0;
+	o.file = fopen(filename, "rb");
+	if (o.file == NULL) {
+		cons_errs(filename, "failed to open input file");
+		return 0;
+	}
+	if (fread(magic, SAVELOAD_MAGICLEN, 1, o.file) != 1 ||
+	    memcmp(magic, SAVELOAD_MAGIC, SAVELOAD_MAGICLEN) != 0) {
+		fclose(o.file);
+		return 1;
+	}
+	*isbin = 1;
+	o.path = filename;
+	o.buf = xmalloc(SAVELOAD_BUFSZ, "binload");
+	o.pos = o.len = 0;
+	for (i = 0; i < EV_NPAT; i++)
+		o.patmap[i] = EV_PAT0 + i;
+	res = binload_song(&o, s);
+	xfree(o.buf);
+	fclose(o.file);
+	return res;
+}
+
+/*
+ * load a song saved with song_savebin() from the given file or
+ * flash partition, mapped with mdep_map(). Events of the tracks are
+ * read in place, so the image stays mapped until the song is freed;
+ * the song must be new
+ */
+unsigned
+song_mapbin(struct song *s, char *name)
+{
+	struct binload o;
+	unsigned char *addr;
+	unsigned i, len;
+
+	s->map = mdep_map(name, &addr, &len);
+	if (s->map == NULL)
+		return 0;
+	if (len < SAVELOAD_MAGICLEN ||
+	    memcmp(addr, SAVELOAD_MAGIC, SAVELOAD_MAGICLEN) != 0) {
+		cons_errs(name, "not a binary song image");
+		return 0;
+	}
+	o.file = NULL;
+	o.path = name;
+	o.buf = addr;
+	o.pos = SAVELOAD_MAGICLEN;
+	o.len = len;
+	for (i = 0; i < EV_NPAT; i++)
+		o.patmap[i] = EV_PAT0 + i;
+	return binload_song(&o, s);
+}
+
+/* ---------------------------------------------------- snapshot --- */
+
+/*
+ * snapshot of the state built by the startup script: controller
+ * table, device settings, the song (as song_savebin() does, which
+ * includes sysex patterns), user procs and global variables. It
+ * can be restored at startup instead of running the script. The
+ * file starts with SNAPSHOT_MAGIC and a version number
+ */
+#define SNAPSHOT_MAGIC		"MSHS"
+#define SNAPSHOT_VERSION	1
+
+#define SNAPSHOT_DEV_CLKRX	1
+#define SNAPSHOT_DEV_MTCRX	2
+
+/*
+ * device settings read from a snapshot
+ */
+struct snapdev {
+	unsigned unit;			/* device number */
+	unsigned flags;			/* SNAPSHOT_DEV_xxx */
+	unsigned val[10];		/* parameters, as saved */
+};
+
+/*
+ * settings read by binload_snapshot(), kept until the whole file is
+ * read
+ */
+struct snapshot {
+	struct evctl ctl[EV_MAXCOARSE + 1];	/* as evctl_tab */
+	struct snapdev dev[DEFAULT_MAXNDEVS];	/* device settings */
+	unsigned ndev;			/* number of entries in 'dev' */
+	unsigned pllmode;		/* saved value of mux_pllmode */
+	struct name *procs;		/* procs, last read first */
+	struct name *vars;		/* variables, last read first */
+};
+
+void
+binout_long(FILE *f, long val)
+{
+	binout_putnum(f, val < 0);
+	binout_putnum(f, val < 0 ? -val : val);
+}
+
+unsigned
+binout_data(FILE *f, struct data *d)
+{
+	struct data *i;
+	unsigned n;
+
+	binout_putnum(f, d->type);
+	switch (d->type) {
+	case DATA_NIL:
+		break;
+	case DATA_LONG:
+		binout_long(f, d->val.num);
+		break;
+	case DATA_STRING:
+	case DATA_REF:
+		if (strlen(d->val.str) > TOK_MAXLEN) {
+			cons_errs(d->val.str, "string too long to be saved");
+			return 0;
+		}
+		binout_putstr(f, d->val.str);
+		break;
+	case DATA_LIST:
+		n = 0;
+		for (i = d->val.list; i != NULL; i = i->next)
+			n++;
+		binout_putnum(f, n);
+		for (i = d->val.list; i != NULL; i = i->next) {
+			if (!binout_data(f, i))
+				return 0;
+		}
+		break;
+	case DATA_RANGE:
+		binout_long(f, d->val.range.min);
+		binout_long(f, d->val.range.max);
+		break;
+	default:
+		cons_err("can't save variables of this type");
+		return 0;
+	}
+	return 1;
+}
+
+unsigned
+binout_node(FILE *f, struct node *o)
+{
+	struct node *i;
+	unsigned n;
+
+	for (n = 0; node_vmttab[n] != o->vmt; n++)
+		; /* nothing */
+	binout_putnum(f, n);
+	binout_putnum(f, o->data != NULL);
+	if (o->data && !binout_data(f, o->data))
+		return 0;
+	n = 0;
+	for (i = o->list; i != NULL; i = i->next)
+		n++;
+	binout_putnum(f, n);
+	for (i = o->list; i != NULL; i = i->next) {
+		if (!binout_node(f, i))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * save the procs of the list starting at the given one, last first,
+ * so they are restored in the same order
+ */
+unsigned
+binout_procs(FILE *f, struct proc *p)
+{
+	struct name *a;
+	unsigned n;
+
+	if (p == NULL)
+		return 1;
+	if (!binout_procs(f, (struct proc *)p->name.next))
+		return 0;
+	if (p->code->vmt == &node_vmt_builtin)
+		return 1;
+	binout_putnum(f, 1);
+	binout_putstr(f, p->name.str);
+	n = 0;
+	for (a = p->args; a != NULL; a = a->next)
+		n++;
+	binout_putnum(f, n);
+	for (a = p->args; a != NULL; a = a->next)
+		binout_putstr(f, a->str);
+	return binout_node(f, p->code);
+}
+
+/*
+ * save the variables of the list starting at the given one, last
+ * first, so they are restored in the same order
+ */
+unsigned
+binout_vars(FILE *f, struct var *v)
+{
+	if (v == NULL)
+		return 1;
+	if (!binout_vars(f, (struct var *)v->name.next))
+		return 0;
+	if (v->data->type == DATA_USER)
+		return 1;
+	binout_putnum(f, 1);
+	binout_putstr(f, v->name.str);
+	return binout_data(f, v->data);
+}
+
+void
+binout_devs(FILE *f)
+{
+	struct mididev *dev;
+	unsigned flags;
+
+	for (dev = mididev_list; dev != NULL; dev = dev->next) {
+		flags = 0;
+		if (dev == mididev_clksrc)
+			flags |= SNAPSHOT_DEV_CLKRX;
+		if (dev == mididev_mtcsrc)
+			flags |= SNAPSHOT_DEV_MTCRX;
+		binout_putnum(f, 1);
+		binout_putnum(f, dev->unit);
+		binout_putnum(f, flags);
+		binout_putnum(f, dev->ticrate);
+		binout_putnum(f, dev->sendclk);
+		binout_putnum(f, dev->sendmmc);
+		binout_putnum(f, dev->ixctlset);
+		binout_putnum(f, dev->oxctlset);
+		binout_putnum(f, dev->ievset);
+		binout_putnum(f, dev->oevset);
+		binout_putnum(f, dev->ixthru + 1);
+		binout_putnum(f, dev->obaud);
+		binout_putnum(f, dev->olook);
+	}
+	binout_putnum(f, 0);
+	binout_putnum(f, mux_pllmode);
+}
+
+/*
+ * save the given environment and song in the given file
+ */
+unsigned
+exec_snapshot(struct exec *x, struct song *s, char *name)
+{
+	struct evctl *ctl;
+	FILE *f;
+	unsigned i, res;
+
+	f = fopen(name, "wb");
+	if (f == NULL) {
+		cons_errs(name, "failed to open output file");
+		return 0;
+	}
+	fwrite(SNAPSHOT_MAGIC, SAVELOAD_MAGICLEN, 1, f);
+	binout_putnum(f, SNAPSHOT_VERSION);
+	for (i = 0; i <= EV_MAXCOARSE; i++) {
+		ctl = &evctl_tab[i];
+		if (ctl->name == NULL && ctl->defval == EV_UNDEF)
+			continue;
+		binout_putnum(f, 1);
+		binout_putnum(f, i);
+		binout_putstr(f, ctl->name);
+		binout_putnum(f, ctl->defval);
+	}
+	binout_putnum(f, 0);
+	binout_devs(f);
+	binout_song(f, s);
+	res = binout_procs(f, (struct proc *)x->procs);
+	binout_putnum(f, 0);
+	if (res)
+		res = binout_vars(f, (struct var *)x->globals);
+	binout_putnum(f, 0);
+	if (ferror(f)) {
+		cons_errs(name, "failed to write output file");
+		res = 0;
+	}
+	fclose(f);
+	if (!res)
+		remove(name);
+	return res;
+}
+
+unsigned
+binload_long(struct binload *o, long *val)
+{
+	unsigned neg, num;
+
+	if (!binload_getlim(o, 0, 1, &neg) || !binload_getnum(o, &num))
+		return 0;
+	*val = neg ? -(long)num : (long)num;
+	return 1;
+}
+
+unsigned
+binload_data(struct binload *o, struct data **res)
+{
+	char str[TOK_MAXLEN + 1];
+	struct data *d, *i;
+	unsigned type, n;
+	long min, max;
+
+	if (!binload_getnum(o, &type))
+		return 0;
+	switch (type) {
+	case DATA_NIL:
+		d = data_newnil();
+		break;
+	case DATA_LONG:
+		if (!binload_long(o, &min))
+			return 0;
+		d = data_newlong(min);
+		break;
+	case DATA_STRING:
+	case DATA_REF:
+		if (!binload_getstr(o, str))
+			return 0;
+		d = (type == DATA_STRING) ? data_newstring(str) : data_newref(str);
+		break;
+	case DATA_LIST:
+		if (!binload_getlim(o, 0, DATA_MAXNITEMS, &n))
+			return 0;
+		d = data_newlist(NULL);
+		while (n-- > 0) {
+			if (!binload_data(o, &i)) {
+				data_delete(d);
+				return 0;
+			}
+			data_listadd(d, i);
+		}
+		break;
+	case DATA_RANGE:
+		if (!binload_long(o, &min) || !binload_long(o, &max))
+			return 0;
+		d = data_newrange(min, max);
+		break;
+	default:
+		binload_err(o, "unknown value type in file");
+		return 0;
+	}
+	*res = d;
+	return 1;
+}
+
+unsigned
+binload_node(struct binload *o, struct node **res)
+{
+	struct node *n, **i;
+	struct data *d;
+	unsigned k, hasdata, nchild;
+
+	for (k = 0; node_vmttab[k] != NULL; k++)
+		; /* nothing */
+	if (!binload_getlim(o, 0, k - 1, &k) ||
+	    !binload_getlim(o, 0, 1, &hasdata))
+		return 0;
+	d = NULL;
+	if (hasdata && !binload_data(o, &d))
+		return 0;
+	n = node_new(node_vmttab[k], d);
+	if (n->vmt == &node_vmt_builtin) {
+		binload_err(o, "unexpected node in file");
+		node_delete(n);
+		return 0;
+	}
+	if (!binload_getnum(o, &nchild)) {
+		node_delete(n);
+		return 0;
+	}
+	i = &n->list;
+	while (nchild-- > 0) {
+		if (!binload_node(o, i)) {
+			node_delete(n);
+			return 0;
+		}
+		i = &(*i)->next;
+	}
+	*res = n;
+	return 1;
+}
+
+/*
+ * read a proc and add it to the given temporary list, it's defined
+ * by binload_setprocs() once the whole file is read
+ */
+unsigned
+binload_proc(struct binload *o, struct name **list)
+{
+	char name[TOK_MAXLEN + 1], arg[TOK_MAXLEN + 1];
+	struct name *args;
+	struct node *code;
+	struct proc *p;
+	unsigned n;
+
+	if (!binload_getstr(o, name) || !binload_getnum(o, &n))
+		return 0;
+	args = NULL;
+	while (n-- > 0) {
+		if (!binload_getstr(o, arg)) {
+			name_empty(&args);
+			return 0;
+		}
+		name_add(&args, name_new(arg));
+	}
+	if (!binload_node(o, &code)) {
+		name_empty(&args);
+		return 0;
+	}
+	p = proc_new(name);
+	p->args = args;
+	p->code = code;
+	name_insert(list, (struct name *)p);
+	return 1;
+}
+
+/*
+ * define the procs of the given list, read by binload_proc(), last
+ * first so they are defined in file order, and empty the list
+ */
+void
+binload_setprocs(struct exec *x, struct name **list)
+{
+	struct proc *p, *old;
+
+	if (*list == NULL)
+		return;
+	p = (struct proc *)*list;
+	binload_setprocs(x, &p->name.next);
+	name_remove(list, (struct name *)p);
+	old = exec_proclookup(x, p->name.str);
+	if (old != NULL) {
+		name_empty(&old->args);
+		node_delete(old->code);
+		vm_free(old->vm);
+		old->args = p->args;
+		old->code = p->code;
+		p->args = NULL;
+		p->code = NULL;
+		proc_delete(p);
+		p = old;
+	} else
+		name_insert(&x->procs, (struct name *)p);
+	p->vm = vm_compile(p);
+}
+
+/*
+ * read a variable and add it to the given temporary list, it's
+ * defined by binload_setvars() once the whole file is read
+ */
+unsigned
+binload_var(struct binload *o, struct name **list)
+{
+	char name[TOK_MAXLEN + 1];
+	struct data *d;
+
+	if (!binload_getstr(o, name) || !binload_data(o, &d))
+		return 0;
+	var_new(list, name, d);
+	return 1;
+}
+
+/*
+ * define the variables of the given list, read by binload_var(),
+ * last first so they are defined in file order, and empty the list
+ */
+void
+binload_setvars(struct exec *x, struct name **list)
+{
+	struct var *v, *old;
+
+	if (*list == NULL)
+		return;
+	v = (struct var *)*list;
+	binload_setvars(x, &v->name.next);
+	old = (struct var *)name_lookup(&x->globals, v->name.str);
+	if (old != NULL) {
+		data_delete(old->data);
+		old->data = v->data;
+		v->data = NULL;
+		var_delete(list, v);
+	} else {
+		name_remove(list, (struct name *)v);
+		name_insert(&x->globals, (struct name *)v);
+	}
+}
+
+/*
+ * read the device settings, they are set by binload_setdevs() once
+ * the whole file is read
+ */
+unsigned
+binload_devs(struct binload *o, struct snapshot *snap)
+{
+	struct snapdev *d;
+	unsigned more, i;
+
+	snap->ndev = 0;
+	for (;;) {
+		if (!binload_getlim(o, 0, 1, &more))
+			return 0;
+		if (!more)
+			break;
+		if (snap->ndev == DEFAULT_MAXNDEVS) {
+			binload_err(o, "too many devices in file");
+			return 0;
+		}
+		d = &snap->dev[snap->ndev];
+		if (!binload_getlim(o, 0, DEFAULT_MAXNDEVS - 1, &d->unit) ||
+		    !binload_getnum(o, &d->flags))
+			return 0;
+		for (i = 0; i < 10; i++) {
+			if (!binload_getnum(o, &d->val[i]))
+				return 0;
+		}
+		if (d->val[0] < DEFAULT_TPU || (d->val[0] % DEFAULT_TPU) ||
+		    d->val[7] > DEFAULT_MAXNDEVS ||
+		    d->val[9] > MIDIDEV_MAXLOOK * 1000) {
+			binload_err(o, "bad device settings in file");
+			return 0;
+		}
+		snap->ndev++;
+	}
+	return binload_getlim(o, 0, 1, &snap->pllmode);
+}
+
+/*
+ * set the device settings read by binload_devs()
+ */
+void
+binload_setdevs(struct snapshot *snap)
+{
+	struct mididev *dev;
+	struct snapdev *d;
+	unsigned i;
+
+	for (i = 0; i < snap->ndev; i++) {
+		d = &snap->dev[i];
+
+		/*
+		 * devices are created by the platform code or by the
+		 * startup script, we only restore their settings
+		 */
+		dev = mididev_byunit[d->unit];
+		if (dev == NULL)
+			continue;
+		if (d->flags & SNAPSHOT_DEV_CLKRX)
+			mididev_clksrc = dev;
+		if (d->flags & SNAPSHOT_DEV_MTCRX)
+			mididev_mtcsrc = dev;
+		dev->ticrate = d->val[0];
+		dev->sendclk = d->val[1];
+		dev->sendmmc = d->val[2];
+		dev->ixctlset = d->val[3];
+		dev->oxctlset = d->val[4];
+		dev->ievset = d->val[5];
+		dev->oevset = d->val[6];
+		dev->ixthru = (int)d->val[7] - 1;
+		dev->obaud = d->val[8];
+		dev->olook = d->val[9];
+	}
+	mux_pllmode = snap->pllmode;
+}
+
+unsigned
+binload_magic(struct binload *o, char *magic)
+{
+	unsigned i, c;
+
+	for (i = 0; i < SAVELOAD_MAGICLEN; i++) {
+		if (!binload_getc(o, &c))
+			return 0;
+		if (c != (unsigned char)magic[i]) {
+			binload_err(o, "bad file format");
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * read the controllers, they are configured by binload_setctls() once
+ * the whole file is read
+ */
+unsigned
+binload_ctls(struct binload *o, struct snapshot *snap)
+{
+	char name[TOK_MAXLEN + 1];
+	struct evctl *ctl;
+	unsigned more, num, defval;
+
+	for (;;) {
+		if (!binload_getlim(o, 0, 1, &more))
+			return 0;
+		if (!more)
+			break;
+		if (!binload_getlim(o, 0, EV_MAXCOARSE, &num) ||
+		    !binload_getstr(o, name) ||
+		    !binload_getparam(o, 0, EV_MAXFINE, &defval))
+			return 0;
+		ctl = &snap->ctl[num];
+		if (ctl->name != NULL)
+			str_delete(ctl->name);
+		ctl->name = (name[0] != '\0') ? str_new(name) : NULL;
+		ctl->defval = defval;
+	}
+	return 1;
+}
+
+/*
+ * configure the controllers read by binload_ctls(), others are
+ * unconfigured
+ */
+void
+binload_setctls(struct snapshot *snap)
+{
+	struct evctl *ctl;
+	unsigned i;
+
+	for (i = 0; i <= EV_MAXCOARSE; i++) {
+		ctl = &snap->ctl[i];
+		evctl_unconf(i);
+		evctl_conf(i, ctl->name, ctl->defval);
+	}
+}
+
+/*
+ * read a snapshot: the song is stored in the given song, other
+ * settings are applied only if the whole file could be read, so a
+ * truncated or corrupt file leaves them unchanged
+ */
+unsigned
+binload_snapshot(struct binload *o, struct exec *x, struct song *s)
+{
+	struct snapshot *snap;
+	unsigned i, more, res;
+
+	if (!binload_magic(o, SNAPSHOT_MAGIC) || !binload_getnum(o, &i))
+		return 0;
+	if (i > SNAPSHOT_VERSION) {
+		binload_err(o, "midish version too old to read this file");
+		return 0;
+	}
+	snap = xmalloc(sizeof(struct snapshot), "snapshot");
+	for (i = 0; i <= EV_MAXCOARSE; i++) {
+		snap->ctl[i].name = NULL;
+		snap->ctl[i].defval = EV_UNDEF;
+	}
+	snap->procs = NULL;
+	snap->vars = NULL;
+	res = 0;
+	if (!binload_ctls(o, snap) || !binload_devs(o, snap))
+		goto done;
+	if (!binload_magic(o, SAVELOAD_MAGIC) || !binload_song(o, s))
+		goto done;
+	for (;;) {
+		if (!binload_getlim(o, 0, 1, &more))
+			goto done;
+		if (!more)
+			break;
+		if (!binload_proc(o, &snap->procs))
+			goto done;
+	}
+	for (;;) {
+		if (!binload_getlim(o, 0, 1, &more))
+			goto done;
+		if (!more)
+			break;
+		if (!binload_var(o, &snap->vars))
+			goto done;
+	}
+	binload_setctls(snap);
+	binload_setdevs(snap);
+	binload_setprocs(x, &snap->procs);
+	binload_setvars(x, &snap->vars);
+	res = 1;
+done:
+	for (i = 0; i <= EV_MAXCOARSE; i++) {
+		if (snap->ctl[i].name != NULL)
+			str_delete(snap->ctl[i].name);
+	}
+	proc_empty(&snap->procs);
+	var_empty(&snap->vars);
+	xfree(snap);
+	return res;
+}
+
+/*
+ * restore the state saved with exec_snapshot()
+ */
+unsigned
+exec_restore(struct exec *x, struct song *s, char *filename)
+{
+	struct binload o;
+	unsigned i, res;
+
+	o.file = fopen(filename, "rb");
+	if (o.file == NULL) {
+		cons_errs(filename, "failed to open input file");
+		return 0;
+	}
+	o.path = filename;
+	o.buf = xmalloc(SAVELOAD_BUFSZ, "binload");
+	o.pos = o.len = 0;
+	for (i = 0; i < EV_NPAT; i++)
+		o.patmap[i] = EV_PAT0 + i;
+	res = binload_snapshot(&o, x, s);
+	xfree(o.buf);
+	fclose(o.file);
+	return res;
+}
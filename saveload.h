@@ -28,6 +28,8 @@ struct songtrk;
 struct songfilt;
 struct songsx;
 struct song;
+struct exec;
+struct mdep_map;
 
 void ev_output(struct ev *, struct textout *);
 void evspec_output(struct evspec *, struct textout *);
@@ -46,7 +48,19 @@ void track_save(struct track *, char *);
 unsigned track_load(struct track *, char *);
 
 void song_save(struct song *, char *);
+void song_savelz(struct song *, char *);
+void song_savetext(struct song *, struct textout *);
 unsigned song_load(struct song *, char *);
+void song_savebin(struct song *, char *);
+unsigned song_loadbin(struct song *, char *, unsigned *);
+unsigned song_mapbin(struct song *, char *);
+unsigned exec_snapshot(struct exec *, struct song *, char *);
+unsigned exec_restore(struct exec *, struct song *, char *);
+
+struct mdep_map *mdep_map(char *, unsigned char **, unsigned *);
+void mdep_unmap(struct mdep_map *);
+
+extern unsigned saveload_yield;
 
 
 #endif /* MIDISH_SAVELOAD_H */
@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * the setlist holds the next song: it's loaded while the current song
+ * is playing and, once armed, it replaces the current song at the
+ * beginning of the next measure, without stopping the clock.
+ *
+ * Arming prepares everything in the interpreter context: the track
+ * pointers of the next song and the list of channel config events to
+ * send. Only config events that differ from the ones of the current
+ * song are sent, so the swap (done by the realtime tick, see
+ * song_movecb()) only sends a few events and restarts the pointers.
+ * The replaced song is freed later, by setlist_poll().
+ */
+
+#include "utils.h"
+#include "defs.h"
+#include "pool.h"
+#include "state.h"
+#include "mux.h"
+#include "track.h"
+#include "frame.h"
+#include "song.h"
+#include "mixout.h"
+#include "norm.h"
+#include "metro.h"
+#include "saveload.h"
+#include "cons.h"
+#include "user.h"
+#include "setlist.h"
+
+struct song *setlist_next = NULL;	/* preloaded song */
+unsigned setlist_armed = 0;		/* replace usong at next measure */
+struct song *setlist_old = NULL;	/* replaced song, to free */
+struct track setlist_oconf;		/* config events of output chans */
+struct track setlist_iconf;		/* config events of input chans */
+
+/*
+ * free the replaced song
+ */
+void
+setlist_poll(void)
+{
+	struct pool *p;
+
+	if (setlist_old == NULL)
+		return;
+	song_delete(setlist_old);
+	setlist_old = NULL;
+	for (p = pool_list; p != NULL; p = p->next)
+		pool_shrink(p);
+}
+
+/*
+ * load the next song. The realtime task keeps running while the file is
+ * parsed, so the current song continues playing
+ */
+unsigned
+setlist_load(char *filename)
+{
+	struct song *n;
+	unsigned res;
+
+	if (setlist_armed) {
+		cons_err("song switch pending, can't load the next song");
+		return 0;
+	}
+	setlist_poll();
+	if (setlist_next) {
+		song_delete(setlist_next);
+		setlist_next = NULL;
+	}
+	n = song_new();
+	saveload_yield = 1;
+	res = song_load(n, filename);
+	saveload_yield = 0;
+	if (!res) {
+		song_delete(n);
+		return 0;
+	}
+	setlist_next = n;
+	return 1;
+}
+
+/*
+ * build the lists of config events of the next song to send on
+ * swap: events of output chans already sent by the current song
+ * are skipped
+ */
+void
+setlist_mkconf(struct song *o, struct song *n)
+{
+	struct statelist slist;
+	struct songchan *c;
+	struct seqptr *cp;
+	struct state *st, *s;
+	struct ev ev;
+
+	statelist_init(&slist);
+	SONG_FOREACH_CHAN(o, c) {
+		if (c->isinput)
+			continue;
+		cp = seqptr_new(&c->conf);
+		while ((st = seqptr_evget(cp)) != NULL) {
+			ev = st->ev;
+			ev.dev = c->dev;
+			ev.ch = c->ch;
+			statelist_update(&slist, &ev);
+		}
+		seqptr_del(cp);
+	}
+	track_init(&setlist_oconf);
+	track_init(&setlist_iconf);
+	SONG_FOREACH_CHAN(n, c) {
+		cp = seqptr_new(&c->conf);
+		while ((st = seqptr_evget(cp)) != NULL) {
+			if (!EV_ISVOICE(&st->ev))
+				continue;
+			ev = st->ev;
+			ev.dev = c->dev;
+			ev.ch = c->ch;
+			if (!c->isinput) {
+				s = statelist_lookup(&slist, &ev);
+				if (s != NULL && state_eq(s, &ev))
+					continue;
+			}
+			track_append(c->isinput ?
+			    &setlist_iconf : &setlist_oconf, &ev);
+		}
+		seqptr_del(cp);
+	}
+	statelist_empty(&slist);
+	statelist_done(&slist);
+}
+
+/*
+ * arm the next song: if the current song is playing, it will be
+ * replaced at the beginning of the next measure, else it's replaced
+ * immediately
+ */
+unsigned
+setlist_arm(void)
+{
+	struct song *n = setlist_next;
+	struct pool *p;
+
+	if (n == NULL) {
+		cons_err("no next song loaded");
+		return 0;
+	}
+	if (setlist_armed)
+		return 1;
+	if (usong->mode < SONG_PLAY) {
+		song_stop(usong);
+		song_delete(usong);
+		usong = n;
+		setlist_next = NULL;
+		for (p = pool_list; p != NULL; p = p->next)
+			pool_shrink(p);
+		cons_putpos(usong->curpos, 0, 0);
+		return 1;
+	}
+	if (usong->mode >= SONG_REC) {
+		cons_err("can't switch songs while recording");
+		return 0;
+	}
+	setlist_mkconf(usong, n);
+	song_ptrinit(n);
+	song_loop_init(n);
+	n->tap_cnt = 0;
+	n->complete = 0;
+	setlist_armed = 1;
+	return 1;
+}
+
+/*
+ * cancel a pending switch, the next song stays loaded
+ */
+void
+setlist_disarm(void)
+{
+	struct song *n = setlist_next;
+
+	song_loop_done(n);
+	song_ptrdone(n);
+	track_done(&setlist_oconf);
+	track_done(&setlist_iconf);
+	setlist_armed = 0;
+}
+
+/*
+ * called by the realtime tick at the beginning of a measure: stop the
+ * given song and start the next one at its first tick. Return the song
+ * to play
+ */
+struct song *
+setlist_swap(struct song *o)
+{
+	struct song *n = setlist_next;
+	struct seqev *se;
+
+	metro_setmode(&o->metro, 0);
+	song_loop_done(o);
+	song_ptrdone(o);
+	song_sxstop(o);
+	o->mode = 0;
+
+	n->mode = SONG_PLAY;
+	n->started = 1;
+	mux_chgticrate(n->tics_per_unit);
+	for (se = setlist_oconf.first; se != &setlist_oconf.eot; se = se->next)
+		mixout_putev(&se->ev, PRIO_CHAN);
+	for (se = setlist_iconf.first; se != &setlist_iconf.eot; se = se->next)
+		norm_evcb(&se->ev);
+	track_done(&setlist_oconf);
+	track_done(&setlist_iconf);
+	if (n->sx_async)
+		song_sxstart(n);
+	metro_setmode(&n->metro, SONG_PLAY);
+
+	usong = n;
+	setlist_old = o;
+	setlist_next = NULL;
+	setlist_armed = 0;
+	return n;
+}
+
+/*
+ * free the next and the replaced songs
+ */
+void
+setlist_done(void)
+{
+	setlist_poll();
+	if (setlist_next) {
+		song_delete(setlist_next);
+		setlist_next = NULL;
+	}
+}
@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * simulated clock, to measure the timing of the output. While a run
+ * is active, mux_mdep_wait() doesn't wait: it moves a virtual clock
+ * forward by a fixed period plus a pseudo-random jitter, and feeds
+ * scripted input to the devices at their exact times. Every byte
+ * written by mididev_flush() is recorded with the time it's due at.
+ *
+ * The song is played twice: once moving the clock exactly to the
+ * next tic or timeout (the ideal schedule), then with the given
+ * period and jitter. Both outputs are compared byte by byte, giving
+ * the timing error of each byte. Runs are deterministic, so results
+ * can be compared across scheduling changes
+ */
+
+#include <string.h>
+#include "utils.h"
+#include "defs.h"
+#include "mux.h"
+#include "mididev.h"
+#include "timo.h"
+#include "song.h"
+#include "mdep_desp.h"
+#include "sim.h"
+
+/*
+ * max clock step of the ideal run, used while there's no tic
+ */
+#define SIM_IDLEUSEC	10000
+
+/*
+ * max clock step of the ideal run, used while events are held by
+ * the output scheduler, less than a byte at the MIDI baud rate
+ */
+#define SIM_HELDUSEC	100
+
+unsigned sim_active = 0;
+unsigned long sim_now;			/* virtual time in microseconds */
+unsigned sim_period, sim_jitter;	/* clock step and its jitter */
+unsigned long sim_seed;			/* state of the generator */
+unsigned long sim_nticks;		/* clock updates so far */
+
+struct sim_in *sim_in;			/* scripted input */
+unsigned sim_nin, sim_inpos;
+
+struct sim_out *sim_buf;		/* recorded output */
+unsigned long sim_nbuf, sim_bufsz;
+
+/*
+ * return the virtual time, used instead of the real clock
+ */
+unsigned long
+sim_clock(void)
+{
+	return sim_now;
+}
+
+/*
+ * return a pseudo-random number between 0 and 'max'
+ */
+unsigned
+sim_rand(unsigned max)
+{
+	sim_seed = (sim_seed * 1103515245 + 12345) & 0xffffffff;
+	return (sim_seed >> 8) % (max + 1);
+}
+
+/*
+ * move the clock to the given time and run the timer callbacks
+ */
+void
+sim_advance(unsigned long usec)
+{
+	sim_now = usec;
+	mdep_clkadv(usec);
+	sim_nticks++;
+}
+
+/*
+ * return the time until the next clock update: the given period
+ * with its jitter or, for the ideal run, the time until the next
+ * tic or timeout, rounded up to the microsecond, or until held
+ * events may be sent
+ */
+unsigned long
+sim_step(void)
+{
+	unsigned long step, d;
+	unsigned delta;
+
+	if (sim_period > 0)
+		return sim_period + sim_rand(sim_jitter);
+	step = mididev_nheld > 0 ? SIM_HELDUSEC : SIM_IDLEUSEC;
+	if (mux_phase >= MUX_START && mux_phase <= MUX_NEXT) {
+		d = mux_nextpos > mux_curpos ?
+		    (mux_nextpos - mux_curpos + 23) / 24 : 0;
+		if (step > d)
+			step = d;
+	}
+	if (timo_next(&delta)) {
+		d = (delta + 23) / 24;
+		if (step > d)
+			step = d;
+	}
+	return step > 0 ? step : 1;
+}
+
+/*
+ * used instead of mux_mdep_wait(): feed input items due before the
+ * next clock update, then move the clock. Return 0 once the max
+ * duration is reached
+ */
+unsigned
+sim_wait(void)
+{
+	struct sim_in *in;
+	struct mididev *dev;
+	unsigned long next;
+
+	if (sim_now >= SIM_MAXUSEC)
+		return 0;
+	next = sim_now + sim_step();
+	while (sim_inpos < sim_nin && sim_in[sim_inpos].usec <= next) {
+		in = &sim_in[sim_inpos++];
+		if (in->usec > sim_now)
+			sim_advance(in->usec);
+		dev = mididev_byunit[in->unit];
+		if (dev == NULL || !(dev->mode & MIDIDEV_MODE_IN) || dev->eof)
+			continue;
+		mididev_istamp = sim_now;
+		dev->ilast = timo_abstime;
+		mididev_inputcb(dev, in->data, in->len);
+	}
+	if (next > sim_now)
+		sim_advance(next);
+	return 1;
+}
+
+/*
+ * used instead of mux_sleep(): time passes, but as with the real
+ * clock, timers run only at the next clock update
+ */
+void
+sim_sleep(unsigned millisecs)
+{
+	sim_now += millisecs * 1000UL;
+}
+
+/*
+ * record bytes written by mididev_flush(). They are due at the
+ * current time, or if the device has lookahead, at the time of the
+ * tic plus the lookahead, as backends do
+ */
+void
+sim_out(struct mididev *o, unsigned char *buf, unsigned count)
+{
+	struct sim_out *p;
+	unsigned long due;
+
+	if (!mididev_ilatpend && sim_now - mididev_ostamp < o->olook)
+		due = mididev_ostamp + o->olook;
+	else
+		due = sim_now;
+	if (sim_nbuf + count > sim_bufsz) {
+		while (sim_nbuf + count > sim_bufsz)
+			sim_bufsz = sim_bufsz > 0 ? 2 * sim_bufsz : 4096;
+		p = xmalloc(sim_bufsz * sizeof(struct sim_out), "simbuf");
+		if (sim_buf) {
+			memcpy(p, sim_buf, sim_nbuf * sizeof(struct sim_out));
+			xfree(sim_buf);
+		}
+		sim_buf = p;
+	}
+	while (count > 0) {
+		p = &sim_buf[sim_nbuf++];
+		p->usec = due;
+		p->unit = o->unit;
+		p->data = *buf++;
+		count--;
+	}
+}
+
+/*
+ * play the song from the current position to its end with the
+ * given clock period (0 for the ideal run) and record its output
+ */
+void
+sim_play(struct song *s, unsigned period, unsigned jitter,
+    unsigned long seed, struct sim_in *in, unsigned nin)
+{
+	sim_now = 0;
+	sim_period = period;
+	sim_jitter = jitter;
+	sim_seed = seed;
+	sim_nticks = 0;
+	sim_in = in;
+	sim_nin = nin;
+	sim_inpos = 0;
+	sim_buf = NULL;
+	sim_nbuf = sim_bufsz = 0;
+	sim_active = 1;
+	song_play(s);
+	while (!s->complete && sim_wait())
+		; /* nothing */
+	song_stop(s);
+	sim_active = 0;
+}
+
+/*
+ * compare the output of a run to the ideal one, device by device:
+ * bytes are matched in order, and once a byte differs, remaining
+ * bytes of the device are counted as missing
+ */
+void
+sim_cmp(struct sim_out *a, unsigned long na,
+    struct sim_out *b, unsigned long nb, struct simres *res)
+{
+	unsigned long i, j;
+	unsigned unit, match;
+	long err;
+
+	res->nbytes = res->ndiff = 0;
+	res->minerr = res->maxerr = 0;
+	res->sumerr = 0;
+	for (unit = 0; unit < DEFAULT_MAXNDEVS; unit++) {
+		i = j = 0;
+		match = 1;
+		for (;;) {
+			while (i < na && a[i].unit != unit)
+				i++;
+			while (j < nb && b[j].unit != unit)
+				j++;
+			if (i == na && j == nb)
+				break;
+			if (i == na || j == nb || a[i].data != b[j].data)
+				match = 0;
+			if (!match) {
+				res->ndiff += (i < na) + (j < nb);
+				i += (i < na);
+				j += (j < nb);
+				continue;
+			}
+			err = (long)(b[j].usec - a[i].usec);
+			if (res->nbytes == 0 || res->minerr > err)
+				res->minerr = err;
+			if (res->nbytes == 0 || res->maxerr < err)
+				res->maxerr = err;
+			res->sumerr += err > 0 ? err : -err;
+			res->nbytes++;
+			i++;
+			j++;
+		}
+	}
+}
+
+/*
+ * play the song with the ideal clock, then with the given period,
+ * jitter and seed, and compare the timing of their outputs. The
+ * song must be stopped
+ */
+void
+sim_run(struct song *s, unsigned period, unsigned jitter,
+    unsigned long seed, struct sim_in *in, unsigned nin, struct simres *res)
+{
+	struct sim_out *ideal;
+	unsigned long nideal;
+
+	sim_play(s, 0, 0, seed, in, nin);
+	ideal = sim_buf;
+	nideal = sim_nbuf;
+	sim_play(s, period, jitter, seed, in, nin);
+	sim_cmp(ideal, nideal, sim_buf, sim_nbuf, res);
+	res->ticks = sim_nticks;
+	if (ideal)
+		xfree(ideal);
+	if (sim_buf)
+		xfree(sim_buf);
+	sim_buf = NULL;
+	sim_nbuf = sim_bufsz = 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MIDISH_SIM_H
+#define MIDISH_SIM_H
+
+struct song;
+struct mididev;
+
+/*
+ * max number of bytes of a single input item
+ */
+#define SIM_INMAX	8
+
+/*
+ * max duration of a simulated run, in microseconds, so a song that
+ * never completes doesn't run forever
+ */
+#define SIM_MAXUSEC	(3600 * 1000000UL)
+
+/*
+ * max clock step, the clock ignores larger ones
+ */
+#define SIM_MAXSTEP	100000
+
+/*
+ * bytes received on the given unit at the given time
+ */
+struct sim_in {
+	unsigned long usec;
+	unsigned unit;
+	unsigned len;
+	unsigned char data[SIM_INMAX];
+};
+
+/*
+ * a byte written by mididev_flush(), and the time it's due at
+ */
+struct sim_out {
+	unsigned long usec;
+	unsigned char unit, data;
+};
+
+/*
+ * result of a run, compared to the ideal one
+ */
+struct simres {
+	unsigned long nbytes;	/* bytes compared */
+	unsigned long ndiff;	/* bytes missing in either run */
+	long minerr, maxerr;	/* in microseconds, late if positive */
+	long long sumerr;	/* sum of absolute errors */
+	unsigned long ticks;	/* clock updates of the run */
+};
+
+extern unsigned sim_active;
+
+unsigned long sim_clock(void);
+unsigned sim_wait(void);
+void sim_sleep(unsigned);
+void sim_out(struct mididev *, unsigned char *, unsigned);
+void sim_run(struct song *, unsigned, unsigned, unsigned long,
+    struct sim_in *, unsigned, struct simres *);
+
+#endif /* MIDISH_SIM_H */
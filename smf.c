@@ -39,12 +39,6 @@ unsigned smf_evlen[] = { 2, 2, 2, 2, 1, 1, 2, 0 };
 
 /* --------------------------------------------- chunk read/write --- */
 
-struct smf
-{
-	FILE *file;
-	unsigned length, index;		/* current chunk length/position */
-};
-
 /*
  * open a standard midi file and initialize
  * the smf structure
@@ -59,6 +53,11 @@ smf_open(struct smf *o, char *path, char *mode)
 	}
 	o->length = 0;
 	o->index = 0;
+	o->buf = xmalloc(SMF_BUFSZ, "smfbuf");
+	o->bufsz = SMF_BUFSZ;
+	o->bufpos = 0;
+	o->buflen = 0;
+	o->fpos = 0;
 	return 1;
 }
 
@@ -68,9 +67,44 @@ smf_open(struct smf *o, char *path, char *mode)
 void
 smf_close(struct smf *o)
 {
+	if (o->buf)
+		xfree(o->buf);
 	fclose(o->file);
 }
 
+/*
+ * read the given number of bytes from the file, refilling the
+ * read buffer as needed. As the file may be shared with other smf
+ * structures (see smfstream_new()), seek to the position of the
+ * last read if needed. Return 0 on error
+ */
+unsigned
+smf_read(struct smf *o, unsigned char *data, unsigned count)
+{
+	unsigned n;
+
+	while (count > 0) {
+		if (o->bufpos == o->buflen) {
+			if (ftell(o->file) != (long)o->fpos &&
+			    fseek(o->file, o->fpos, SEEK_SET) < 0)
+				return 0;
+			o->buflen = fread(o->buf, 1, o->bufsz, o->file);
+			o->bufpos = 0;
+			o->fpos += o->buflen;
+			if (o->buflen == 0)
+				return 0;
+		}
+		n = o->buflen - o->bufpos;
+		if (n > count)
+			n = count;
+		memcpy(data, o->buf + o->bufpos, n);
+		o->bufpos += n;
+		data += n;
+		count -= n;
+	}
+	return 1;
+}
+
 /*
  * read a 32bit fixed-size number, return 0 on error
  */
@@ -78,7 +112,7 @@ unsigned
 smf_get32(struct smf *o, unsigned *val)
 {
 	unsigned char buf[4];
-	if (o->index + 4 > o->length || fread(buf, 1, 4, o->file) != 4) {
+	if (o->index + 4 > o->length || !smf_read(o, buf, 4)) {
 		cons_err("failed to read 32bit number");
 		return 0;
 	}
@@ -94,7 +128,7 @@ unsigned
 smf_get24(struct smf *o, unsigned *val)
 {
 	unsigned char buf[4];
-	if (o->index + 3 > o->length || fread(buf, 1, 3, o->file) != 3) {
+	if (o->index + 3 > o->length || !smf_read(o, buf, 3)) {
 		cons_err("failed to read 24bit number");
 		return 0;
 	}
@@ -110,7 +144,7 @@ unsigned
 smf_get16(struct smf *o, unsigned *val)
 {
 	unsigned char buf[4];
-	if (o->index + 2 > o->length || fread(buf, 1, 2, o->file) != 2) {
+	if (o->index + 2 > o->length || !smf_read(o, buf, 2)) {
 		cons_err("failed to read 16bit number");
 		return 0;
 	}
@@ -125,13 +159,19 @@ smf_get16(struct smf *o, unsigned *val)
 unsigned
 smf_getc(struct smf *o, unsigned *res)
 {
-	int c;
-	if (o->index + 1 > o->length || (c = fgetc(o->file)) < 0) {
+	unsigned char c;
+
+	if (o->index < o->length && o->bufpos < o->buflen) {
+		*res = o->buf[o->bufpos++];
+		o->index++;
+		return 1;
+	}
+	if (o->index + 1 > o->length || !smf_read(o, &c, 1)) {
 		cons_err("failed to read one byte");
 		return 0;
 	}
 	o->index++;
-	*res = c & 0xff;
+	*res = c;
 	return 1;
 }
 
@@ -141,12 +181,14 @@ smf_getc(struct smf *o, unsigned *res)
 unsigned
 smf_getvar(struct smf *o, unsigned *val)
 {
-	int c;
+	unsigned char c;
 	unsigned bits;
 	*val = 0;
 	bits = 0;
 	for (;;) {
-		if (o->index + 1 > o->length || (c = fgetc(o->file)) == EOF) {
+		if (o->index < o->length && o->bufpos < o->buflen) {
+			c = o->buf[o->bufpos++];
+		} else if (o->index + 1 > o->length || !smf_read(o, &c, 1)) {
 			cons_err("failed to read varlength number");
 			return 0;
 		}
@@ -177,13 +219,13 @@ smf_getvar(struct smf *o, unsigned *val)
 unsigned
 smf_getheader(struct smf *o, char *hdr)
 {
-	char buf[4];
+	unsigned char buf[4];
 	unsigned len;
 	if (o->index != o->length) {
 		cons_err("chunk not finished");
 		return 0;
 	}
-	if (fread(buf, 1, 4, o->file) != 4) {
+	if (!smf_read(o, buf, 4)) {
 		cons_err("failed to read header");
 		return 0;
 	}
@@ -202,77 +244,73 @@ smf_getheader(struct smf *o, char *hdr)
 }
 
 /*
- * in smf_putxxx routines there is a 'unsigned *used' argument if
- * (used == NULL) then data is not written in the smf structure, only
- * *user is incremented by the number of bytes that would be written
- * otherwise.  This is used to determine chunk's length
+ * chunks are written in the write buffer, which grows as needed,
+ * then its length field is set and the chunk is written to the file
+ * at once, see smf_putend()
  */
 
+/*
+ * return a pointer to the given number of bytes at the end of the
+ * write buffer, growing it if needed
+ */
+unsigned char *
+smf_putbuf(struct smf *o, unsigned len)
+{
+	unsigned char *buf, *p;
+
+	if (o->bufpos + len > o->bufsz) {
+		while (o->bufpos + len > o->bufsz)
+			o->bufsz *= 2;
+		buf = xmalloc(o->bufsz, "smfbuf");
+		memcpy(buf, o->buf, o->bufpos);
+		xfree(o->buf);
+		o->buf = buf;
+	}
+	p = o->buf + o->bufpos;
+	o->bufpos += len;
+	return p;
+}
 
 /*
  * put a fixed-size 32-bit number
  */
 void
-smf_put32(struct smf *o, unsigned *used, unsigned val)
+smf_put32(struct smf *o, unsigned val)
 {
-	unsigned char buf[4];
-	if (used) {
-		(*used) += 4;
-	} else {
-		if (o->index + 4 > o->length) {
-			log_puts("smf_put32: bad chunk length\n");
-			panic();
-		}
-		buf[0] = (val >> 24) & 0xff;
-		buf[1] = (val >> 16) & 0xff;
-		buf[2] = (val >> 8) & 0xff;
-		buf[3] = val & 0xff;
-		fwrite(buf, 1, 4, o->file);
-		o->index += 4;
-	}
+	unsigned char *buf;
+
+	buf = smf_putbuf(o, 4);
+	buf[0] = (val >> 24) & 0xff;
+	buf[1] = (val >> 16) & 0xff;
+	buf[2] = (val >> 8) & 0xff;
+	buf[3] = val & 0xff;
 }
 
 /*
  * put a fixed-size 24-bit number
  */
 void
-smf_put24(struct smf *o, unsigned *used, unsigned val)
+smf_put24(struct smf *o, unsigned val)
 {
-	unsigned char buf[4];
-	if (used) {
-		(*used) += 3;
-	} else {
-		if (o->index + 3 > o->length) {
-			log_puts("smf_put24: bad chunk length\n");
-			panic();
-		}
-		buf[0] = (val >> 16) & 0xff;
-		buf[1] = (val >> 8) & 0xff;
-		buf[2] = val & 0xff;
-		fwrite(buf, 1, 3, o->file);
-		o->index += 3;
-	}
+	unsigned char *buf;
+
+	buf = smf_putbuf(o, 3);
+	buf[0] = (val >> 16) & 0xff;
+	buf[1] = (val >> 8) & 0xff;
+	buf[2] = val & 0xff;
 }
 
 /*
  * put a fixed-size 16-bit number
  */
 void
-smf_put16(struct smf *o, unsigned *used, unsigned val)
+smf_put16(struct smf *o, unsigned val)
 {
-	unsigned char buf[4];
-	if (used) {
-		(*used) += 2;
-	} else {
-		if (o->index + 2 > o->length) {
-			log_puts("smf_put16: bad chunk length\n");
-			panic();
-		}
-		buf[0] = (val >> 8) & 0xff;
-		buf[1] = val & 0xff;
-		fwrite(buf, 1, 2, o->file);
-		o->index += 2;
-	}
+	unsigned char *buf;
+
+	buf = smf_putbuf(o, 2);
+	buf[0] = (val >> 8) & 0xff;
+	buf[1] = val & 0xff;
 }
 
 
@@ -280,18 +318,9 @@ smf_put16(struct smf *o, unsigned *used, unsigned val)
  * put a fixed-size 8-bit number
  */
 void
-smf_putc(struct smf *o, unsigned *used, unsigned val)
+smf_putc(struct smf *o, unsigned val)
 {
-	if (used) {
-		(*used) ++;
-	} else {
-		if (o->index + 1 > o->length) {
-			log_puts("smf_putc: bad chunk length\n");
-			panic();
-		}
-		fputc((int)val & 0xff, o->file);
-		o->index++;
-	}
+	*smf_putbuf(o, 1) = val & 0xff;
 }
 
 
@@ -299,28 +328,19 @@ smf_putc(struct smf *o, unsigned *used, unsigned val)
  * put a variable length number
  */
 void
-smf_putvar(struct smf *o, unsigned *used, unsigned val)
+smf_putvar(struct smf *o, unsigned val)
 {
 #define MAXBYTES 5			/* 32bit / 7bit = 4bytes + 4bit */
-	unsigned char buf[MAXBYTES];
+	unsigned char *buf;
 	unsigned index = 0, bits;
 	for (bits = 7; bits < MAXBYTES * 7; bits += 7) {
 		if (val < (1U << bits)) {
+			buf = smf_putbuf(o, bits / 7);
 			bits -= 7;
 			for (; bits != 0; bits -= 7) {
 				buf[index++] = ((val >> bits) & 0x7f) | 0x80;
 			}
 			buf[index++] = val & 0x7f;
-			if (used) {
-				(*used) += index;
-			} else {
-				if (o->index + index > o->length) {
-					log_puts("smf_putvar: bad chunk length\n");
-					panic();
-				}
-				o->index += index;
-				fwrite(buf, 1, index, o->file);
-			}
 			return;
 		}
 	}
@@ -330,69 +350,95 @@ smf_putvar(struct smf *o, unsigned *used, unsigned val)
 }
 
 /*
- * put the given chunk header with the given magic and size field
+ * start a chunk with the given magic, its length field is set by
+ * smf_putend()
  */
 void
-smf_putheader(struct smf *o, char *hdr, unsigned len)
+smf_putheader(struct smf *o, char *hdr)
 {
-	fwrite(hdr, 1, 4, o->file);
-	o->length = 4;
-	o->index = 0;
-	smf_put32(o, NULL, len);
-	o->length = len;
-	o->index = 0;
+	if (o->bufpos != 0) {
+		log_puts("smf_putheader: chunk not finished\n");
+		panic();
+	}
+	memcpy(smf_putbuf(o, 4), hdr, 4);
+	smf_put32(o, 0);
+}
+
+/*
+ * set the length of the current chunk and write it to the file,
+ * return 0 on error
+ */
+unsigned
+smf_putend(struct smf *o)
+{
+	unsigned len;
+
+	len = o->bufpos - 8;
+	o->buf[4] = (len >> 24) & 0xff;
+	o->buf[5] = (len >> 16) & 0xff;
+	o->buf[6] = (len >> 8) & 0xff;
+	o->buf[7] = len & 0xff;
+	len = o->bufpos;
+	o->bufpos = 0;
+	if (fwrite(o->buf, 1, len, o->file) != len) {
+		cons_errs("smf_putend", "failed to write file");
+		return 0;
+	}
+	return 1;
 }
 
 /*
  * store a track in the smf
  */
 void
-smf_puttrack(struct smf *o, unsigned *used, struct song *s, struct track *t)
+smf_puttrack(struct smf *o, struct song *s, struct track *t)
 {
+	struct trackiter it;
 	struct seqev *pos;
 	unsigned status, newstatus, delta, chan, denom;
 	struct ev rev[CONV_NUMREV];
-	struct statelist slist;
+	struct conv conv;
 	unsigned i, nev;
 
 
-	statelist_init(&slist);
+	conv_init(&conv);
 	delta = 0;
 	status = 0;
-	for (pos = t->first; pos != NULL; pos = pos->next) {
+	trackiter_init(&it, t);
+	while ((pos = trackiter_next(&it)) != NULL) {
 		delta += pos->delta;
 		if (pos->ev.cmd == EV_NULL) {
 			break;
 		}
 		if (EV_ISVOICE(&pos->ev)) {
-			nev = conv_unpackev(&slist, 0U,
+			nev = conv_unpackev(&conv, 0U,
 			    CONV_XPC | CONV_NRPN | CONV_RPN, &pos->ev, rev);
 			for (i = 0; i < nev; i++) {
-				smf_putvar(o, used, delta);
+				smf_putvar(o, delta);
 				delta = 0;
 				chan = rev[i].ch;
 				newstatus = (rev[i].cmd << 4) + (chan & 0x0f);
 				if (newstatus != status) {
 					status = newstatus;
-					smf_putc(o, used, status);
+					smf_putc(o, status);
 				}
 				if (rev[i].cmd == EV_BEND) {
-					smf_putc(o, used, rev[i].bend_val & 0x7f);
-					smf_putc(o, used, rev[i].bend_val >> 7);
+					smf_putc(o, rev[i].bend_val & 0x7f);
+					smf_putc(o, rev[i].bend_val >> 7);
 				} else {
-					smf_putc(o, used, rev[i].v0);
+					smf_putc(o, rev[i].v0);
 					if (SMF_EVLEN(status) == 2) {
-						smf_putc(o, used, rev[i].v1);
+						smf_putc(o, rev[i].v1);
 					}
 				}
 			}
 		} else if (pos->ev.cmd == EV_TEMPO) {
-			smf_putvar(o, used, delta);
+			smf_putvar(o, delta);
 			delta = 0;
-			smf_putc(o, used, 0xff);
-			smf_putc(o, used, 0x51);
-			smf_putc(o, used, 0x03);
-			smf_put24(o, used, pos->ev.tempo_usec24 * s->tics_per_unit / 96);
+			smf_putc(o, 0xff);
+			smf_putc(o, 0x51);
+			smf_putc(o, 0x03);
+			smf_put24(o, pos->ev.tempo_usec24 * s->tics_per_unit / 96);
 		} else if (pos->ev.cmd == EV_TIMESIG) {
 			denom = s->tics_per_unit / pos->ev.timesig_tics;
 			switch(denom) {
@@ -415,45 +461,50 @@ smf_puttrack(struct smf *o, unsigned *used, struct song *s, struct track *t)
 				log_puts("smf_puttrack: bad time signature\n");
 				panic();
 			}
-			smf_putvar(o, used, delta);
+			smf_putvar(o, delta);
 			delta = 0;
-			smf_putc(o, used, 0xff);
-			smf_putc(o, used, 0x58);
-			smf_putc(o, used, 0x04);
-			smf_putc(o, used, pos->ev.timesig_beats);
-			smf_putc(o, used, denom);
+			smf_putc(o, 0xff);
+			smf_putc(o, 0x58);
+			smf_putc(o, 0x04);
+			smf_putc(o, pos->ev.timesig_beats);
+			smf_putc(o, denom);
 			/* metronome tics per metro beat */
-			smf_putc(o, used, pos->ev.timesig_tics);
+			smf_putc(o, pos->ev.timesig_tics);
 			/* metronome 1/32 notes per 24 tics */
-			smf_putc(o, used, 8 * s->tics_per_unit / 96);
+			smf_putc(o, 8 * s->tics_per_unit / 96);
 		}
 
 	}
-	smf_putvar(o, used, delta);
-	smf_putc(o, used, 0xff);
-	smf_putc(o, used, 0x2f);
-	smf_putc(o, used, 0x00);
-	statelist_done(&slist);
+	smf_putvar(o, delta);
+	smf_putc(o, 0xff);
+	smf_putc(o, 0x2f);
+	smf_putc(o, 0x00);
+	conv_done(&conv);
 }
 
 /*
- * store a sysex in the smf
+ * store a sysex in the smf, without the leading 0xf0 byte but
+ * preceded by its length
  */
 void
-smf_putsysex(struct smf *o, unsigned *used, struct sysex *sx)
+smf_putsysex(struct smf *o, struct sysex *sx)
 {
 	struct chunk *c;
-	unsigned i, first;
+	unsigned len;
 
-	first = 1;
+	len = 0;
+	for (c = sx->first; c != NULL; c = c->next)
+		len += c->used;
+	if (len == 0) {
+		smf_putvar(o, 0);
+		return;
+	}
+	smf_putvar(o, len - 1);
 	for (c = sx->first; c != NULL; c = c->next) {
-		for (i = 0; i < c->used; i++) {
-			if (first) {
-				first = 0;
-			} else {
-				smf_putc(o, used, c->data[i]);
-			}
-		}
+		if (c == sx->first)
+			memcpy(smf_putbuf(o, c->used - 1), c->data + 1, c->used - 1);
+		else
+			memcpy(smf_putbuf(o, c->used), c->data, c->used);
 	}
 }
 
@@ -461,23 +512,19 @@ smf_putsysex(struct smf *o, unsigned *used, struct sysex *sx)
  * store a sysex back in the smf
  */
 void
-smf_putsx(struct smf *o, unsigned *used, struct song *s, struct songsx *songsx)
+smf_putsx(struct smf *o, struct song *s, struct songsx *songsx)
 {
-	unsigned sysexused;
 	struct sysex *sx;
 
 	for (sx = songsx->sx.first; sx != NULL; sx = sx->next) {
-		sysexused = 0;
-		smf_putvar(o, used, 0);
-		smf_putc(o, used, 0xf0);
-		smf_putsysex(o, &sysexused, sx);
-		smf_putvar(o, used, sysexused);
-		smf_putsysex(o, used, sx);
-	}
-	smf_putvar(o, used, 0);
-	smf_putc(o, used, 0xff);
-	smf_putc(o, used, 0x2f);
-	smf_putc(o, used, 0x00);
+		smf_putvar(o, 0);
+		smf_putc(o, 0xf0);
+		smf_putsysex(o, sx);
+	}
+	smf_putvar(o, 0);
+	smf_putc(o, 0xff);
+	smf_putc(o, 0x2f);
+	smf_putc(o, 0x00);
 }
 
 /*
@@ -490,7 +537,7 @@ song_exportsmf(struct song *o, char *filename)
 	struct songtrk *t;
 	struct songchan *i;
 	struct songsx *s;
-	unsigned ntrks, nchan, nsx, used;
+	unsigned ntrks, nchan, nsx, res;
 
 	if (!smf_open(&f, filename, "w")) {
 		return 0;
@@ -513,52 +560,57 @@ song_exportsmf(struct song *o, char *filename)
 	/*
 	 * write the header
 	 */
-	smf_putheader(&f, smftype_header, 6);
-	smf_put16(&f, NULL, 1);				/* format = 1 */
-	smf_put16(&f, NULL, nsx + ntrks + nchan + 1);	/* +1 -> meta track */
-	smf_put16(&f, NULL, o->tics_per_unit / 4);		/* tics per quarter */
+	smf_putheader(&f, smftype_header);
+	smf_put16(&f, 1);				/* format = 1 */
+	smf_put16(&f, nsx + ntrks + nchan + 1);		/* +1 -> meta track */
+	smf_put16(&f, o->tics_per_unit / 4);		/* tics per quarter */
+	res = smf_putend(&f);
 
 	/*
 	 * write the tempo track
 	 */
-	used = 0;
-	smf_puttrack(&f, &used, o, &o->meta);
-	smf_putheader(&f, smftype_track, used);
-	smf_puttrack(&f, NULL, o, &o->meta);
+	if (res) {
+		smf_putheader(&f, smftype_track);
+		smf_puttrack(&f, o, &o->meta);
+		res = smf_putend(&f);
+	}
 
 	/*
 	 * write each sx
 	 */
 	SONG_FOREACH_SX(o, s) {
-		used = 0;
-		smf_putsx(&f, &used, o, s);
-		smf_putheader(&f, smftype_track, used);
-		smf_putsx(&f, NULL, o, s);
+		if (!res)
+			break;
+		smf_putheader(&f, smftype_track);
+		smf_putsx(&f, o, s);
+		res = smf_putend(&f);
 	}
 
 	/*
 	 * write each chan
 	 */
 	SONG_FOREACH_CHAN(o, i) {
+		if (!res)
+			break;
 		if (i->isinput)
 			continue;
-		used = 0;
-		smf_puttrack(&f, &used, o, &i->conf);
-		smf_putheader(&f, smftype_track, used);
-		smf_puttrack(&f, NULL, o, &i->conf);
+		smf_putheader(&f, smftype_track);
+		smf_puttrack(&f, o, &i->conf);
+		res = smf_putend(&f);
 	}
 
 	/*
 	 * write each track
 	 */
 	SONG_FOREACH_TRK(o, t) {
-		used = 0;
-		smf_puttrack(&f, &used, o, &t->track);
-		smf_putheader(&f, smftype_track, used);
-		smf_puttrack(&f, NULL, o, &t->track);
+		if (!res)
+			break;
+		smf_putheader(&f, smftype_track);
+		smf_puttrack(&f, o, &t->track);
+		res = smf_putend(&f);
 	}
 	smf_close(&f);
-	return 1;
+	return res;
 }
 
 /*
@@ -584,19 +636,178 @@ smf_getsysex(struct smf *o, struct sysex *sx)
 /*
  * parse a track 'varlen event varlen event ... varlen event'
  */
+/*
+ * read the next event of the current track chunk, the delta must
+ * have been read already. The 'status' argument holds the running
+ * status and 'tpu' the number of song tics per unit note, used to
+ * convert tempo and time signatures. Return SMF_EV if an event is
+ * stored in 'ev', SMF_SX if a sysex message is stored in '*psx' (if
+ * psx is NULL sysex messages are skipped), SMF_NONE if there's
+ * nothing to store, and 0 on error
+ */
 unsigned
-smf_gettrack(struct smf *o, struct song *s, struct songtrk *t)
+smf_getev(struct smf *o, unsigned *status, unsigned tpu,
+    struct ev *ev, struct sysex **psx)
 {
-	unsigned delta, i, status, type, length, abspos;
+	unsigned i, type, length;
 	unsigned tempo, num, den, dummy;
-	struct statelist slist;
-	struct songsx *songsx;
-	struct seqev *pos, *se;
 	struct sysex *sx;
+	unsigned c;
+
+	if (!smf_getc(o, &c)) {
+		return 0;
+	}
+	if (c == 0xff) {
+		*status = 0;
+		if (!smf_getc(o, &c)) {
+			return 0;
+		}
+		type = c;
+		if (!smf_getvar(o, &length)) {
+			return 0;
+		}
+		if (type == 0x2f && length == 0) {
+			/* end of track */
+			goto ignoremeta;
+		} else if (type == 0x51 && length == 3) {
+			/* tempo change */
+			if (!smf_get24(o, &tempo)) {
+				return 0;
+			}
+			ev->cmd = EV_TEMPO;
+			ev->tempo_usec24 = tempo * 96 / tpu;
+			return SMF_EV;
+		} else if (type == 0x58 && length == 4) {
+			/* time signature change */
+			if (!smf_getc(o, &num)) {
+				return 0;
+			}
+			if (!smf_getc(o, &den)) {
+				return 0;
+			}
+			ev->cmd = EV_TIMESIG;
+			ev->timesig_beats = num;
+			ev->timesig_tics = tpu / (1 << den);
+			if (!smf_getc(o, &dummy)) {
+				return 0;
+			}
+			if (!smf_getc(o, &dummy)) {
+				return 0;
+			}
+			return SMF_EV;
+		} else {
+		ignoremeta:
+			for (i = 0; i < length; i++) {
+				if (!smf_getc(o, &c)) {
+					return 0;
+				}
+			}
+		}
+	} else if (c == 0xf7) {
+		/* raw data */
+		cons_err("raw data (status = 0xF7) not implemented");
+		*status = 0;
+		if (!smf_getvar(o, &length)) {
+			return 0;
+		}
+		for (i = 0; i < length; i++) {
+			if (!smf_getc(o, &c)) {
+				return 0;
+			}
+		}
+	} else if (c == 0xf0) {
+		/* sys ex */
+		*status = 0;
+		if (psx == NULL) {
+			if (!smf_getvar(o, &length)) {
+				return 0;
+			}
+			for (i = 0; i < length; i++) {
+				if (!smf_getc(o, &c)) {
+					return 0;
+				}
+			}
+			return SMF_NONE;
+		}
+		sx = sysex_new(0);
+		sysex_add(sx, 0xf0);
+		if (!smf_getsysex(o, sx)) {
+			sysex_del(sx);
+			return 0;
+		}
+		*psx = sx;
+		return SMF_SX;
+	} else if (c >= 0x80 && c < 0xf0) {
+		*status = c;
+		if (!smf_getc(o, &c)) {
+			return 0;
+		}
+	runningstatus:
+		ev->cmd = (*status >> 4) & 0xf;
+		ev->dev = 0;
+		ev->ch = *status & 0xf;
+		ev->v0 = c & 0x7f;
+		if (SMF_EVLEN(*status) == 2) {
+			if (!smf_getc(o, &c)) {
+				return 0;
+			}
+			c &= 0x7f;
+			if (ev->cmd == EV_BEND) {
+				ev->v0 += c << 7;
+			} else {
+				ev->v1 = c;
+			}
+		}
+		if (ev->cmd == EV_NON && ev->note_vel == 0) {
+			ev->cmd = EV_NOFF;
+			ev->note_vel = EV_NOFF_DEFAULTVEL;
+		}
+		return SMF_EV;
+	} else if (c < 0x80) {
+		if (*status == 0) {
+			cons_err("bad status");
+			return 0;
+		}
+		goto runningstatus;
+	} else {
+		cons_err("bad event");
+		return 0;
+	}
+	return SMF_NONE;
+}
+
+/*
+ * pack the given event according to the device setup, return 1 if
+ * the packed event is stored in 'rev'
+ *
+ * XXX: this needs to be done in doevset/doxctl by converting
+ * the whole project whenever events configuration is changed.
+ */
+unsigned
+smf_packev(struct conv *conv, struct ev *ev, struct ev *rev)
+{
 	struct mididev *dev;
-	struct ev ev, rev;
 	unsigned xctlset, evset;
-	unsigned c;
+
+	if ((evinfo[ev->cmd].flags & EV_HAS_DEV) &&
+	    (dev = mididev_byunit[ev->dev]) != NULL) {
+		xctlset = dev->oxctlset;
+		evset = dev->oevset;
+	} else {
+		xctlset = 0;
+		evset = CONV_XPC | CONV_NRPN | CONV_RPN;
+	}
+	return conv_packev(conv, xctlset, evset, ev, rev);
+}
+
+unsigned
+smf_gettrack(struct smf *o, struct song *s, struct songtrk *t)
+{
+	unsigned delta, status, abspos;
+	struct conv conv;
+	struct songsx *songsx;
+	struct sysex *sx;
+	struct ev ev, rev;
 
 	if (!smf_getheader(o, smftype_track)) {
 		return 0;
@@ -604,180 +815,41 @@ smf_gettrack(struct smf *o, struct song *s, struct songtrk *t)
 	status = 0;
 	abspos = 0;
 	track_clear(&t->track);
-	pos = t->track.first;
 	songsx = (struct songsx *)s->sxlist;	/* first (and unique) sysex in song */
 	if (songsx == NULL) {
 		songsx = song_sxnew(s, "smf");
 	}
-	statelist_init(&slist);
+	conv_init(&conv);
 	for (;;) {
 		if (o->index >= o->length) {
-			statelist_done(&slist);
+			conv_done(&conv);
 			return 1;
 		}
 		if (!smf_getvar(o, &delta)) {
 			goto err;
 		}
 		abspos += delta;
-		pos->delta += delta;
-		if (!smf_getc(o, &c)) {
-			goto err;;
-		}
-		if (c == 0xff) {
-			status = 0;
-			if (!smf_getc(o, &c)) {
-				goto err;
-			}
-			type = c;
-			if (!smf_getvar(o, &length)) {
-				goto err;
-			}
-			if (type == 0x2f && length == 0) {
-				/* end of track */
-				goto ignoremeta;
-			} else if (type == 0x51 && length == 3) {
-				/* tempo change */
-				if (!smf_get24(o, &tempo)) {
-					goto err;
-				}
-				ev.cmd = EV_TEMPO;
-				ev.tempo_usec24 = tempo * 96 / s->tics_per_unit;
-				goto putev;
-			} else if (type == 0x58 && length == 4) {
-				/* time signature change */
-				if (!smf_getc(o, &num)) {
-					goto err;
-				}
-				if (!smf_getc(o, &den)) {
-					goto err;
-				}
-				ev.cmd = EV_TIMESIG;
-				ev.timesig_beats = num;
-				ev.timesig_tics = s->tics_per_unit / (1 << den);
-				if (!smf_getc(o, &dummy)) {
-					goto err;
-				}
-				/*
-				log_puts("cc=");
-				log_putu(dummy);
-				log_puts(", dd=");
-				*/
-				if (!smf_getc(o, &dummy)) {
-					goto err;
-				}
-				/*
-				log_putu(dummy);
-				log_puts("\n");
-				*/
-				goto putev;
-			} else {
-			ignoremeta:
-				for (i = 0; i < length; i++) {
-					if (!smf_getc(o, &c)) {
-						goto err;
-					}
-				}
-			}
-		} else if (c == 0xf7) {
-			/* raw data */
-			cons_err("raw data (status = 0xF7) not implemented");
-			status = 0;
-			if (!smf_getvar(o, &length)) {
-				goto err;
-			}
-			for (i = 0; i < length; i++) {
-				if (!smf_getc(o, &c)) {
-					goto err;
-				}
-			}
-		} else if (c == 0xf0) {
-			/* sys ex */
-			status = 0;
-			sx = sysex_new(0);
-			sysex_add(sx, 0xf0);
-			if (!smf_getsysex(o, sx)) {
-				sysex_del(sx);
-				goto err;
-			}
+		t->track.eot.delta += delta;
+		switch (smf_getev(o, &status, s->tics_per_unit, &ev, &sx)) {
+		case 0:
+			goto err;
+		case SMF_SX:
 			if (sysex_check(sx)) {
+				sysex_pack(sx);
 				sysexlist_put(&songsx->sx, sx);
 			} else {
 				cons_err("corrupted sysex message, ignored");
-				/*
-				sysex_log(sx);
-				log_puts("\n");
-				*/
 				sysex_del(sx);
 			}
-		} else if (c >= 0x80 && c < 0xf0) {
-			status = c;
-			if (!smf_getc(o, &c)) {
-				goto err;
-			}
-		runningstatus:
-			ev.cmd = (status >> 4) & 0xf;
-			ev.dev = 0;
-			ev.ch = status & 0xf;
-			ev.v0 = c & 0x7f;
-			if (SMF_EVLEN(status) == 2) {
-				if (!smf_getc(o, &c)) {
-					goto err;
-				}
-				c &= 0x7f;
-				if (ev.cmd == EV_BEND) {
-					ev.v0 += c << 7;
-				} else {
-					ev.v1 = c;
-				}
-			}
-		putev:
-			if (ev.cmd == EV_NON && ev.note_vel == 0) {
-				ev.cmd = EV_NOFF;
-				ev.note_vel = EV_NOFF_DEFAULTVEL;
-			}
-
-			/*
-			 * Pack events according to device setup.
-			 *
-			 * XXX: this needs to be done in
-			 * doevset/doxctl by converting the whole
-			 * project whenever events configuration
-			 * is changed.
-			 */
-			if ((evinfo[ev.cmd].flags & EV_HAS_DEV) &&
-			    (dev = mididev_byunit[ev.dev]) != NULL) {
-				xctlset = dev->oxctlset;
-				evset = dev->oevset;
-			} else {
-				xctlset = 0;
-				evset = CONV_XPC | CONV_NRPN | CONV_RPN;
-			}
-			if (conv_packev(&slist, xctlset, evset,
-				&ev, &rev)) {
-				se = seqev_new();
-				se->ev = rev;
-				seqev_ins(pos, se);
-			}
-			/*
-			log_puts("ev: ");
-			log_putu(abspos);
-			log_puts(" ");
-			ev_log(&ev);
-			log_puts("\n");
-			*/
-		} else if (c < 0x80) {
-			if (status == 0) {
-				cons_err("bad status");
-				goto err;
-			}
-			goto runningstatus;
-		} else {
-			cons_err("bad event");
-			goto err;
+			break;
+		case SMF_EV:
+			if (smf_packev(&conv, &ev, &rev))
+				track_append(&t->track, &rev);
+			break;
 		}
 	}
  err:
-	statelist_done(&slist);
+	conv_done(&conv);
 	return 0;
 }
 
@@ -787,20 +859,30 @@ smf_gettrack(struct smf *o, struct song *s, struct songtrk *t)
 void
 song_fix1(struct song *o)
 {
-	struct track copy;
+	struct track *copy, **copyptr;
 	struct seqptr *tp, *cp;
 	struct state *st;
 	struct statelist slist;
 	struct songtrk *t, *tnext;
-	unsigned delta;
+	unsigned delta, i, n;
 
+	n = 0;
+	SONG_FOREACH_TRK(o, t)
+		n++;
+	if (n == 0)
+		return;
+	copy = xmalloc(n * sizeof(struct track), "fix1trk");
+	copyptr = xmalloc(n * sizeof(struct track *), "fix1ptr");
+	i = 0;
 	SONG_FOREACH_TRK(o, t) {
 		/*
-		 * move meta events into meta track
+		 * move meta events into a copy, merged below into
+		 * the meta track with all other copies
 		 */
 		delta = 0;
-		track_init(&copy);
-		cp = seqptr_new(&copy);
+		copyptr[i] = &copy[i];
+		track_init(&copy[i]);
+		cp = seqptr_new(&copy[i]);
 		tp = seqptr_new(&t->track);
 		statelist_init(&slist);
 		for (;;) {
@@ -823,9 +905,13 @@ song_fix1(struct song *o)
 		statelist_done(&slist);
 		seqptr_del(tp);
 		seqptr_del(cp);
-		track_merge(&o->meta, &copy);
-		track_done(&copy);
+		i++;
 	}
+	track_mergek(&o->meta, copyptr, n);
+	for (i = 0; i < n; i++)
+		track_done(&copy[i]);
+	xfree(copyptr);
+	xfree(copy);
 
 	/*
 	 * remove the first track, if there are not events
@@ -942,15 +1028,16 @@ song_importsmf(char *filename)
 		if (!smf_gettrack(&f, o, t)) {
 			goto bad3;
 		}
-		track_check(&t->track);
 	}
 	smf_close(&f);
+	song_check(o);
 
 	if (format == 0) {
 		song_fix0(o);
 	} else if (format == 1) {
 		song_fix1(o);
 	}
+	song_pack(o);
 
 
 	/*
@@ -963,6 +1050,245 @@ bad2:	smf_close(&f);
 bad1:	return 0;
 }
 
+/* ------------------------------------------ playback from storage --- */
+
+/*
+ * return the song tic of the next event of the given track
+ */
+unsigned
+smfstream_tic(struct smfstream *s, struct smfstrk *t)
+{
+	return (unsigned long long)t->tic * s->tpu / (4 * s->timecode);
+}
+
+/*
+ * return true if the next event of track 'a' must be played before
+ * the next event of track 'b'; on the same tic, tracks are played in
+ * file order
+ */
+unsigned
+smfstream_before(void *arg_a, void *arg_b)
+{
+	struct smfstrk *a = arg_a, *b = arg_b;
+
+	return a->tic < b->tic || (a->tic == b->tic && a < b);
+}
+
+/*
+ * read the next event of the given track, return 0 if the end of
+ * the track is reached or on error
+ */
+unsigned
+smfstream_next(struct smfstream *s, struct smfstrk *t)
+{
+	unsigned delta;
+	struct ev ev;
+
+	for (;;) {
+		if (t->smf.index >= t->smf.length)
+			return 0;
+		if (!smf_getvar(&t->smf, &delta))
+			return 0;
+		t->tic += delta;
+		switch (smf_getev(&t->smf, &t->status, s->tpu, &ev, NULL)) {
+		case 0:
+			return 0;
+		case SMF_EV:
+			if (smf_packev(&t->conv, &ev, &t->ev))
+				return 1;
+			break;
+		}
+	}
+}
+
+/*
+ * open the given standard midi file for playback from storage, only
+ * the chunk headers are read
+ */
+struct smfstream *
+smfstream_new(char *path)
+{
+	struct smfstream *s;
+	struct smfstrk *t;
+	struct smf f;
+	unsigned char hdr[8];
+	unsigned format, ntrks, timecode, i;
+	unsigned long pos;
+
+	if (!smf_open(&f, path, "r")) {
+		return NULL;
+	}
+	if (!smf_getheader(&f, smftype_header)) {
+		goto bad;
+	}
+	pos = 8 + f.length;
+	if (!smf_get16(&f, &format)) {
+		goto bad;
+	}
+	if (format != 1 && format != 0) {
+		cons_err("only smf format 0 or 1 can be played");
+		goto bad;
+	}
+	if (!smf_get16(&f, &ntrks)) {
+		goto bad;
+	}
+	if (ntrks == 0 || ntrks >= 256) {
+		cons_err("bad number of tracks in midi file");
+		goto bad;
+	}
+	if (!smf_get16(&f, &timecode)) {
+		goto bad;
+	}
+	if ((timecode & 0x8000) != 0 || timecode == 0) {
+		cons_err("SMPTE timecode is not supported");
+		goto bad;
+	}
+	s = xmalloc(sizeof(struct smfstream), "smfstream");
+	s->file = f.file;
+	s->timecode = timecode;
+	s->tpu = DEFAULT_TPU;
+	s->ntrks = 0;
+	s->trks = xmalloc(ntrks * sizeof(struct smfstrk), "smfstrk");
+	heap_init(&s->heap, xmalloc(ntrks * sizeof(void *), "smfheap"),
+	    smfstream_before, NULL);
+	statelist_init(&s->statelist);
+	statelist_init(&s->metalist);
+	xfree(f.buf);
+
+	/*
+	 * locate track chunks
+	 */
+	for (i = 0; i < ntrks; i++) {
+		if (fseek(s->file, pos, SEEK_SET) < 0 ||
+		    fread(hdr, 1, 8, s->file) != 8) {
+			cons_err("failed to read header");
+			smfstream_del(s);
+			return NULL;
+		}
+		if (memcmp(hdr, smftype_track, 4) != 0) {
+			cons_err("header corrupted");
+			smfstream_del(s);
+			return NULL;
+		}
+		t = &s->trks[s->ntrks++];
+		t->start = pos + 8;
+		t->length = (hdr[4] << 24) + (hdr[5] << 16) +
+		    (hdr[6] << 8) + hdr[7];
+		t->smf.file = s->file;
+		t->smf.buf = xmalloc(SMFSTREAM_BUFSZ, "smfstrkbuf");
+		t->smf.bufsz = SMFSTREAM_BUFSZ;
+		conv_init(&t->conv);
+		pos = t->start + t->length;
+	}
+	smfstream_seek(s, s->tpu, 0);
+	return s;
+bad:
+	smf_close(&f);
+	return NULL;
+}
+
+/*
+ * close the file and free the player
+ */
+void
+smfstream_del(struct smfstream *s)
+{
+	struct smfstrk *t;
+	unsigned i;
+
+	for (i = 0; i < s->ntrks; i++) {
+		t = &s->trks[i];
+		conv_done(&t->conv);
+		xfree(t->smf.buf);
+	}
+	statelist_empty(&s->statelist);
+	statelist_done(&s->statelist);
+	statelist_empty(&s->metalist);
+	statelist_done(&s->metalist);
+	xfree(s->trks);
+	xfree(s->heap.ent);
+	fclose(s->file);
+	xfree(s);
+}
+
+/*
+ * return the state of the next event to play if it's not after the
+ * given song tic, else return NULL. The state lists are updated as
+ * in seqptr_evget()
+ */
+struct state *
+smfstream_evget(struct smfstream *s, unsigned tic)
+{
+	struct smfstrk *t;
+	struct state *st;
+
+	if (s->heap.n == 0)
+		return NULL;
+	t = s->heap.ent[0];
+	if (smfstream_tic(s, t) > tic)
+		return NULL;
+	st = statelist_update(EV_ISMETA(&t->ev) ?
+	    &s->metalist : &s->statelist, &t->ev);
+	if (!smfstream_next(s, t))
+		heap_rm(&s->heap, 0);
+	else
+		heap_fix(&s->heap, 0);
+	return st;
+}
+
+/*
+ * move to the next tic, return 0 if the end of the file is reached
+ */
+unsigned
+smfstream_ticskip(struct smfstream *s)
+{
+	statelist_outdate(&s->statelist);
+	statelist_outdate(&s->metalist);
+	return s->heap.n > 0;
+}
+
+/*
+ * restart playback at the given song tic, given the number of song
+ * tics per unit note. Events before the position are not played but
+ * enter the state lists, as in seqptr_skip()
+ */
+void
+smfstream_seek(struct smfstream *s, unsigned tpu, unsigned abspos)
+{
+	struct smfstrk *t;
+	unsigned i, tic, next;
+
+	s->tpu = tpu;
+	statelist_empty(&s->statelist);
+	statelist_empty(&s->metalist);
+	s->heap.n = 0;
+	for (i = 0; i < s->ntrks; i++) {
+		t = &s->trks[i];
+		t->smf.index = 0;
+		t->smf.length = t->length;
+		t->smf.bufpos = t->smf.buflen = 0;
+		t->smf.fpos = t->start;
+		t->status = 0;
+		t->tic = 0;
+		conv_done(&t->conv);
+		if (smfstream_next(s, t))
+			heap_put(&s->heap, t);
+	}
+	tic = 0;
+	while (s->heap.n > 0) {
+		next = smfstream_tic(s, s->heap.ent[0]);
+		if (next >= abspos)
+			break;
+		if (next != tic) {
+			(void)smfstream_ticskip(s);
+			tic = next;
+		}
+		(void)smfstream_evget(s, next);
+	}
+	if (abspos > tic)
+		(void)smfstream_ticskip(s);
+}
+
 int
 syx_import(char *path, struct sysexlist *l, int unit)
 {
@@ -989,6 +1315,7 @@ syx_import(char *path, struct sysexlist *l, int unit)
 		sysex_add(sx, c);
 		if (c == 0xf7) {
 			if (sysex_check(sx)) {
+				sysex_pack(sx);
 				sysexlist_put(l, sx);
 				sx = NULL;
 				continue;
@@ -17,11 +17,75 @@
 #ifndef MIDISH_SMF_H
 #define MIDISH_SMF_H
 
+#include <stdio.h>
+#include "state.h"
+#include "conv.h"
+#include "heap.h"
+
 struct song;
+struct sysex;
+struct sysexlist;
+
+/*
+ * files are read in blocks of this size, so that bytes are parsed
+ * from memory rather than with one stdio call each. When writing,
+ * the buffer holds the current chunk and grows as needed
+ */
+#define SMF_BUFSZ	4096
+
+struct smf
+{
+	FILE *file;
+	unsigned length, index;		/* current chunk length/position */
+	unsigned char *buf;		/* read or write buffer */
+	unsigned bufsz;			/* buffer size */
+	unsigned bufpos, buflen;	/* buffer position/length */
+	unsigned long fpos;		/* file offset of the next read */
+};
+
+/*
+ * return values of smf_getev()
+ */
+#define SMF_NONE	1
+#define SMF_EV		2
+#define SMF_SX		3
+
+/*
+ * track of a file being played from storage: only the next event is
+ * kept in memory, the rest of the track is in the file
+ */
+#define SMFSTREAM_BUFSZ	256
+
+struct smfstrk {
+	struct smf smf;			/* track chunk being read */
+	unsigned long start;		/* file offset of the chunk data */
+	unsigned length;		/* chunk length */
+	unsigned status;		/* running status */
+	unsigned tic;			/* tic of 'ev', in file units */
+	struct ev ev;			/* next event to play */
+	struct conv conv;		/* for smf_packev() */
+};
+
+struct smfstream {
+	FILE *file;
+	unsigned timecode;		/* file tics per quarter note */
+	unsigned tpu;			/* song tics per unit note */
+	unsigned ntrks;			/* number of tracks */
+	struct smfstrk *trks;		/* array of tracks */
+	struct heap heap;		/* tracks ordered by next event */
+	struct statelist statelist;	/* state of played events */
+	struct statelist metalist;	/* state of played meta events */
+};
 
 unsigned song_exportsmf(struct song *, char *);
 struct song *song_importsmf(char *);
 
+struct smfstream *smfstream_new(char *);
+void smfstream_del(struct smfstream *);
+void smfstream_seek(struct smfstream *, unsigned, unsigned);
+struct state *smfstream_evget(struct smfstream *, unsigned);
+unsigned smfstream_ticskip(struct smfstream *);
+
 int syx_import(char *, struct sysexlist *, int);
 int syx_export(char *, struct sysexlist *);
 
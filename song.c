@@ -27,6 +27,10 @@
 #include "mixout.h"
 #include "norm.h"
 #include "undo.h"
+#include "smf.h"
+#include "saveload.h"
+#include "setlist.h"
+#include "work.h"
 
 #define TAG_OFF		0
 #define TAG_PLAY	1
@@ -73,8 +77,18 @@ song_init(struct song *o)
 	o->chanlist = NULL;
 	o->filtlist = NULL;
 	o->sxlist = NULL;
+	name_index(&o->trklist);
+	name_index(&o->chanlist);
+	name_index(&o->filtlist);
+	name_index(&o->sxlist);
 	o->undo = NULL;
 	o->undo_size = 0;
+	o->stream = NULL;
+	o->map = NULL;
+	o->sx_async = 0;
+	o->sx_bank = NULL;
+	o->sx_nsent = o->sx_ntotal = 0;
+	timo_set(&o->sx_timo, song_sxtimo, o);
 	o->tics_per_unit = DEFAULT_TPU;
 	track_init(&o->meta);
 	track_init(&o->clip);
@@ -112,6 +126,7 @@ song_init(struct song *o)
 	evspec_reset(&o->tap_evspec);
 	o->tap_evspec.cmd = EVSPEC_EMPTY;
 	o->tap_mode = 0;
+	o->indrop_tap = -1;
 
 	/*
 	 * add default timesig/tempo so that setunit() works
@@ -133,7 +148,7 @@ song_init(struct song *o)
 void
 song_done(struct song *o)
 {
-	if (mux_isopen) {
+	if (mux_isopen && o->mode >= SONG_IDLE) {
 		song_stop(o);
 	}
 	undo_clear(o, &o->undo);
@@ -149,11 +164,21 @@ song_done(struct song *o)
 	while (o->sxlist) {
 		song_sxdel(o, (struct songsx *)o->sxlist);
 	}
+	name_unindex(&o->trklist);
+	name_unindex(&o->chanlist);
+	name_unindex(&o->filtlist);
+	name_unindex(&o->sxlist);
+	if (o->stream)
+		smfstream_del(o->stream);
 	track_done(&o->meta);
 	track_done(&o->clip);
 	track_done(&o->rec);
 	sysexlist_done(&o->recsx);
 	metro_done(&o->metro);
+	if (o->map) {
+		mdep_unmap(o->map);
+		o->map = NULL;
+	}
 	if (o->undo != NULL) {
 		log_puts("undo data not freed\n");
 		panic();
@@ -173,6 +198,7 @@ song_trknew(struct song *o, char *name)
 	track_init(&t->track);
 	t->curfilt = NULL;
 	t->mute = 0;
+	ticprof_cntreset(&t->prof);
 
 	name_add(&o->trklist, (struct name *)t);
 	song_getcurfilt(o, &t->curfilt);
@@ -454,9 +480,8 @@ song_setcurchan(struct song *o, struct songchan *c, int input)
 unsigned
 song_endpos(struct song *o)
 {
-	struct seqptr *mp;
 	struct songtrk *t;
-	unsigned m, tpm, tpb, bpm, len, maxlen, delta;
+	unsigned len, maxlen;
 
 	maxlen = 0;
 	SONG_FOREACH_TRK(o, t) {
@@ -464,25 +489,149 @@ song_endpos(struct song *o)
 		if (maxlen < len)
 			maxlen = len;
 	}
-	m = 0;
-	len = 0;
-	mp = seqptr_new(&o->meta);
-	while (len < maxlen) {
-		while (seqptr_evget(mp)) {
-			/* nothing */
-		}
-		seqptr_getsign(mp, &bpm, &tpb);
-		tpm = bpm * tpb;
-		delta = seqptr_skip(mp, tpm);
-		if (delta > 0) {
-			m += (maxlen - len + tpm - 1) / tpm;
-			break;
-		}
-		len += tpm;
-		m++;
+	return track_nmeasures(&o->meta, maxlen);
+}
+
+/*
+ * move the events of all tracks to consecutive memory, in time
+ * order, and update the undo entries referencing them. The song
+ * must be stopped
+ */
+void
+song_compact(struct song *o)
+{
+	struct songtrk *t;
+	struct songchan *c;
+	struct seqev_reloc *map;
+	unsigned n;
+
+	n = track_numev(&o->meta) + track_numev(&o->clip);
+	SONG_FOREACH_TRK(o, t)
+		n += track_numev(&t->track);
+	SONG_FOREACH_CHAN(o, c)
+		n += track_numev(&c->conf);
+	map = xmalloc(n * sizeof(struct seqev_reloc), "reloc");
+	seqev_pool_sort();
+	n = track_compact(&o->meta, map);
+	SONG_FOREACH_TRK(o, t)
+		n += track_compact(&t->track, map + n);
+	SONG_FOREACH_CHAN(o, c)
+		n += track_compact(&c->conf, map + n);
+	n += track_compact(&o->clip, map + n);
+	seqev_relocsort(map, n);
+	undo_reloc(o, map, n);
+	xfree(map);
+}
+
+/*
+ * operation applied to each track by song_trkmap()
+ */
+#define SONG_PRESCALE	0
+#define SONG_SCALE	1
+#define SONG_CHECK	2
+
+struct songop {
+	struct track **trks;
+	unsigned cmd;			/* one of above */
+	unsigned oldunit, newunit;	/* for scaling */
+};
+
+void
+song_trkop(void *arg, unsigned i)
+{
+	struct songop *op = arg;
+
+	switch (op->cmd) {
+	case SONG_PRESCALE:
+		track_prescale(op->trks[i], op->oldunit, op->newunit);
+		break;
+	case SONG_SCALE:
+		track_scale(op->trks[i], op->oldunit, op->newunit);
+		break;
+	default:
+		track_check(op->trks[i]);
 	}
-	seqptr_del(mp);
-	return m;
+}
+
+/*
+ * apply the given operation to all tracks, including the meta track
+ * if 'meta' is set, on several threads if available. Tracks are
+ * unmapped first, since mapped tracks may share patterns
+ */
+void
+song_trkmap(struct song *o, unsigned meta, struct songop *op)
+{
+	struct songtrk *t;
+	unsigned i, n;
+
+	n = meta;
+	SONG_FOREACH_TRK(o, t)
+		n++;
+	if (n == 0)
+		return;
+	op->trks = xmalloc(n * sizeof(struct track *), "songop");
+	n = 0;
+	if (meta)
+		op->trks[n++] = &o->meta;
+	SONG_FOREACH_TRK(o, t)
+		op->trks[n++] = &t->track;
+	for (i = 0; i < n; i++)
+		track_unmap(op->trks[i]);
+	work_run(song_trkop, op, n);
+	xfree(op->trks);
+}
+
+/*
+ * first step of time-scaling the song, see track_prescale()
+ */
+void
+song_prescale(struct song *o, unsigned oldunit, unsigned newunit)
+{
+	struct songop op;
+
+	op.cmd = SONG_PRESCALE;
+	op.oldunit = oldunit;
+	op.newunit = newunit;
+	song_trkmap(o, 1, &op);
+}
+
+/*
+ * time-scale the song, see track_scale()
+ */
+void
+song_scale(struct song *o, unsigned oldunit, unsigned newunit)
+{
+	struct songop op;
+
+	op.cmd = SONG_SCALE;
+	op.oldunit = oldunit;
+	op.newunit = newunit;
+	song_trkmap(o, 1, &op);
+}
+
+/*
+ * store the tracks of the song as packed records, so they don't use
+ * the event pool until they're modified, see track_pack()
+ */
+void
+song_pack(struct song *o)
+{
+	struct songtrk *t;
+
+	SONG_FOREACH_TRK(o, t)
+		track_pack(&t->track);
+}
+
+/*
+ * check and fix all tracks of the song, see track_check()
+ */
+void
+song_check(struct song *o)
+{
+	struct songop op;
+
+	op.cmd = SONG_CHECK;
+	song_trkmap(o, 0, &op);
 }
 
 void
@@ -553,6 +702,84 @@ song_playsysex(struct song *o)
 	}
 }
 
+/*
+ * timeout callback sending the next sysex message in background,
+ * then waiting the time it takes on the wire (or DEFAULT_SXWAIT
+ * for short messages) before sending the following one. Voice events
+ * are sent between messages, so notes are not delayed by more than
+ * a single message.
+ */
+void
+song_sxtimo(void *addr)
+{
+	struct song *o = (struct song *)addr;
+	struct songsx *l;
+	struct sysex *s;
+	struct chunk *c;
+	unsigned i, len, delay;
+
+	l = o->sx_bank;
+	for (s = l->sx.first, i = 0; s != NULL && i < o->sx_idx; s = s->next)
+		i++;
+	while (s == NULL) {
+		l = (struct songsx *)l->name.next;
+		if (l == NULL) {
+			o->sx_bank = NULL;
+			return;
+		}
+		s = l->sx.first;
+		o->sx_idx = 0;
+	}
+	len = 0;
+	for (c = s->first; c != NULL; c = c->next) {
+		mux_sendraw(s->unit, c->data, c->used);
+		len += c->used;
+	}
+	mux_flush();
+	o->sx_bank = l;
+	o->sx_idx++;
+	o->sx_nsent++;
+	delay = len * DEFAULT_SXBYTETIME;
+	if (delay < DEFAULT_SXWAIT * 24000)
+		delay = DEFAULT_SXWAIT * 24000;
+	timo_add(&o->sx_timo, delay);
+}
+
+/*
+ * start sending all sysex messages in background. Messages are
+ * located by their position in the bank, so banks may be changed
+ * in the meantime
+ */
+void
+song_sxstart(struct song *o)
+{
+	struct songsx *l;
+	struct sysex *s;
+
+	o->sx_nsent = o->sx_ntotal = 0;
+	SONG_FOREACH_SX(o, l) {
+		for (s = l->sx.first; s != NULL; s = s->next)
+			o->sx_ntotal++;
+	}
+	if (o->sx_ntotal == 0) {
+		o->sx_bank = NULL;
+		return;
+	}
+	o->sx_bank = (struct songsx *)o->sxlist;
+	o->sx_idx = 0;
+	song_sxtimo(o);
+}
+
+/*
+ * stop sending sysex messages in background
+ */
+void
+song_sxstop(struct song *o)
+{
+	timo_del(&o->sx_timo);
+	o->sx_bank = NULL;
+}
+
 /*
  * play a meta event
  */
@@ -583,6 +810,44 @@ song_metaput(struct song *o, struct state *s)
 	}
 }
 
+/*
+ * return true if the next event of track 'a' must be played before
+ * the next event of track 'b'; on the same tic, tracks are played in
+ * the order of the track list
+ */
+unsigned
+song_trkbefore(void *arg_a, void *arg_b)
+{
+	struct songtrk *a = arg_a, *b = arg_b;
+
+	return a->nexttic < b->nexttic ||
+	    (a->nexttic == b->nexttic && a->order < b->order);
+}
+
+/*
+ * put the tracks that didn't reach their end in the heap, ordered by
+ * the tic of their next event, so idle tracks are not handled at each
+ * tick. Track pointers must be at the current position
+ */
+void
+song_trkheap(struct song *o)
+{
+	struct songtrk *t;
+	struct seqptr *sp;
+	unsigned n;
+
+	n = 0;
+	o->trkheap.n = 0;
+	SONG_FOREACH_TRK(o, t) {
+		t->order = n++;
+		sp = t->trackptr;
+		if (seqptr_eot(sp))
+			continue;
+		t->nexttic = sp->tic + sp->pos->delta - sp->delta;
+		heap_put(&o->trkheap, t);
+	}
+}
+
 /*
  * save the state at the given start position, so that we can repeat
  * playback from there.
@@ -617,7 +882,8 @@ song_loop_init(struct song *o)
 	seqptr_skip(o->loop_metaptr, o->loop_tstart);
 
 	SONG_FOREACH_TRK(o, t) {
-		t->loop_trackptr = seqptr_new(&t->track);
+		track_mkidx(&t->track, o->loop_tstart);
+		t->loop_trackptr = seqptr_newro(&t->track);
 		seqptr_skip(t->loop_trackptr, o->loop_tstart);
 
 		/*
@@ -722,7 +988,12 @@ song_loop_track(struct song *o, struct songtrk *t)
 		}
 	}
 
-	sp->pos = lp->pos;
+	if (lp->rom) {
+		sp->romrep = lp->romrep;
+		seqptr_romget(sp, lp->rom);
+		sp->romev.delta = lp->romev.delta;
+	} else
+		sp->pos = lp->pos;
 	sp->delta = lp->delta;
 	sp->tic = lp->tic;
 }
@@ -758,15 +1029,24 @@ song_loop_repeat(struct song *o)
 	if (o->loop_mstart == o->loop_mend || o->abspos != o->loop_tend)
 		return 0;
 
+	SONG_FOREACH_TRK(o, t)
+		seqptr_ticskip(t->trackptr, o->abspos - t->trackptr->tic);
+
 	o->abspos = o->loop_tstart;
 	o->measure -= o->loop_mend - o->loop_mstart;
 
+	mixout_defer();
 	SONG_FOREACH_TRK(o, t) {
 		song_loop_track(o, t);
 	}
+	song_trkheap(o);
 
 	song_loop_track(o, NULL);
 
+	if (o->stream)
+		song_streamloc(o);
+	mixout_commit();
+
 	if (o->mode >= SONG_REC)
 		song_loop_rec(o);
 
@@ -774,9 +1054,26 @@ song_loop_repeat(struct song *o)
 }
 
 /*
- * move all track pointers 1 tick forward. Return true if at least one
- * track moved forward and 0 if no track moved forward (ie end of the
- * song was track reached)
+ * record events deferred to the current tick, see song_evcb()
+ */
+void
+song_recflush(struct song *o)
+{
+	struct ev rev;
+	unsigned i;
+
+	for (i = 0; i < o->rec_ndefer; i++) {
+		if (seqptr_evmerge2(o->recptr,
+			&o->rec_replay, &o->rec_defer[i], &rev))
+			mixout_putev(&rev, 0);
+	}
+	o->rec_ndefer = 0;
+}
+
+/*
+ * move the song 1 tick forward and set the 'complete' flag if the end
+ * of the song was reached. Track pointers are moved only when their
+ * next event is played, see song_ticplay()
  *
  * Note that must be no events available on any track, in other words,
  * this routine must be called after song_ticplay()
@@ -785,7 +1082,6 @@ void
 song_ticskip(struct song *o)
 {
 	struct ev ev;
-	struct songtrk *i;
 	struct state *s;
 	unsigned neot;
 	unsigned period;
@@ -804,15 +1100,17 @@ song_ticskip(struct song *o)
 		}
 	}
 	o->abspos++;
-	SONG_FOREACH_TRK(o, i) {
-		neot |= seqptr_ticskip(i->trackptr, 1);
-	}
+	if (o->trkheap.n > 0)
+		neot = 1;
+	if (o->stream)
+		neot |= smfstream_ticskip(o->stream);
 	if (o->mode >= SONG_REC) {
 		if (o->playptr) {
 			seqptr_ticdel(o->playptr, 1, &o->rec_replay);
 			seqptr_ticput(o->playptr, 1);
 		}
 		seqptr_ticput(o->recptr, 1);
+		song_recflush(o);
 		statelist_outdate(&o->rec_input);
 
 		/*
@@ -849,24 +1147,52 @@ void
 song_ticplay(struct song *o)
 {
 	struct songtrk *i;
+	struct seqptr *sp;
 	struct state *st, *sr;
-	unsigned id;
+	unsigned long c;
 
+	c = ticprof_now();
 	while ((st = seqptr_evget(o->metaptr)))
 		song_metaput(o, st);
+	c = ticprof_add(&ticprof.stage[TICPROF_META], c);
 
 	if (o->tic == 0) {
 		cons_putpos(o->measure, o->beat, o->tic);
 	}
 	metro_tic(&o->metro, o->beat, o->tic);
-	SONG_FOREACH_TRK(o, i) {
-		id = i->trackptr->statelist.serial;
-		while ((st = seqptr_evget(i->trackptr))) {
+	c = ticprof_add(&ticprof.stage[TICPROF_METRO], c);
+	while (o->trkheap.n > 0) {
+		i = o->trkheap.ent[0];
+		if (i->nexttic > o->abspos)
+			break;
+		sp = i->trackptr;
+		seqptr_ticskip(sp, o->abspos - sp->tic);
+		while ((st = seqptr_evget(sp))) {
 			if (st->phase & EV_PHASE_FIRST)
 				st->tag = i->mute ? 0 : 1;
 			if (st->tag)
 				mixout_putev(&st->ev, PRIO_TRACK);
 		}
+		if (seqptr_eot(sp))
+			heap_rm(&o->trkheap, 0);
+		else {
+			i->nexttic = sp->tic + sp->pos->delta - sp->delta;
+			heap_fix(&o->trkheap, 0);
+		}
+		c = ticprof_add(&i->prof, c);
+	}
+	if (o->stream) {
+		while ((st = smfstream_evget(o->stream, o->abspos))) {
+			if (EV_ISMETA(&st->ev)) {
+				if (st->ev.cmd == EV_TEMPO)
+					song_metaput(o, st);
+				continue;
+			}
+			if (st->phase & EV_PHASE_FIRST)
+				st->tag = 1;
+			mixout_putev(&st->ev, PRIO_TRACK);
+		}
+		c = ticprof_add(&ticprof.stage[TICPROF_STREAM], c);
 	}
 
 	if (o->mode >= SONG_REC) {
@@ -887,7 +1213,7 @@ song_ticplay(struct song *o)
 					mixout_putev(&st->ev, 0);
 			}
 		}
-
+		ticprof_add(&ticprof.stage[TICPROF_REC], c);
 	}
 }
 
@@ -1004,6 +1330,12 @@ song_mergerec(struct song *o)
 	struct ev ev;
 	unsigned period, offset;
 
+	/*
+	 * the next tick won't come, so record deferred events on
+	 * the current one
+	 */
+	song_recflush(o);
+
 	/*
 	 * if there is no filter for recording there may be
 	 * unterminated frames, so finalize them.
@@ -1094,6 +1426,7 @@ song_mergerec(struct song *o)
 			e = sysexlist_get(&o->recsx);
 			if (e == NULL)
 				break;
+			sysex_pack(e);
 			sysexlist_put(&x->sx, e);
 		}
 	}
@@ -1134,6 +1467,8 @@ song_stopcb(struct song *o)
 	SONG_FOREACH_TRK(o, t) {
 		song_confcancel(&t->trackptr->statelist, PRIO_TRACK);
 	}
+	if (o->stream)
+		song_confcancel(&o->stream->statelist, PRIO_TRACK);
 }
 
 /*
@@ -1142,11 +1477,20 @@ song_stopcb(struct song *o)
 void
 song_movecb(struct song *o)
 {
+	unsigned long start, c;
+
+	start = c = ticprof_start();
 	if (o->mode >= SONG_PLAY) {
 		(void)song_ticskip(o);
+		ticprof_add(&ticprof.stage[TICPROF_SKIP], c);
+		if (setlist_armed && o->beat == 0 && o->tic == 0)
+			o = setlist_swap(o);
 		song_ticplay(o);
+		c = ticprof_now();
 	}
 	mux_flush();
+	ticprof_add(&ticprof.stage[TICPROF_FLUSH], c);
+	ticprof_tic(start, mux_ticlength);
 }
 
 /*
@@ -1194,6 +1538,24 @@ song_evcb(struct song *o, struct ev *ev)
 		return;
 	}
 
+	/*
+	 * thru lane: if not recording, events only need to be
+	 * filtered and sent. The filter uses its compiled rules, see
+	 * filt_do(). Events still go through mixout_putev(): its
+	 * states arbitrate with playback, drop nested notes created by
+	 * the filter, and keep the values mixout_commit() relies on
+	 */
+	if (o->mode < SONG_REC) {
+		if (o->curfilt == NULL) {
+			mixout_putev(ev, 0);
+			return;
+		}
+		nev = filt_do(&o->curfilt->filt, ev, filtout);
+		for (i = 0; i < nev; i++)
+			mixout_putev(&filtout[i], 0);
+		return;
+	}
+
 	/*
 	 * apply filter, if any
 	 */
@@ -1205,33 +1567,41 @@ song_evcb(struct song *o, struct ev *ev)
 	}
 
 	/*
-	 * output and/or record resulting events
+	 * output and record resulting events
 	 */
 	ev = filtout;
 	for (i = 0; i < nev; i++) {
-		if (o->mode >= SONG_REC) {
-			s = statelist_update(&o->rec_input, ev);
-			if (s->phase & EV_PHASE_FIRST) {
-				s->tic = 0;
-				if (s->flags & (STATE_BOGUS | STATE_NESTED)) {
-					s->tag = TAG_OFF;
-				} else if ((mux_getphase() >= MUX_START) &&
-				    (o->loop_mstart == o->loop_mend ||
-					o->abspos >= o->loop_tstart)) {
-					s->tag = TAG_REC;
-				} else
-					s->tag = TAG_PLAY;
-			}
+		s = statelist_update(&o->rec_input, ev);
+		if (s->phase & EV_PHASE_FIRST) {
+			s->tic = 0;
+			if (s->flags & (STATE_BOGUS | STATE_NESTED)) {
+				s->tag = TAG_OFF;
+			} else if ((mux_getphase() >= MUX_START) &&
+			    (o->loop_mstart == o->loop_mend ||
+				o->abspos >= o->loop_tstart)) {
+				s->tag = TAG_REC;
+			} else
+				s->tag = TAG_PLAY;
+		}
 
-			if (s->tag == TAG_REC) {
+		/*
+		 * events received in the second half of the tick
+		 * are recorded on the next one. Once an event is
+		 * deferred, the following ones must be too, so
+		 * frames stay in order
+		 */
+		if (s->tag == TAG_REC) {
+			if (o->rec_ndefer == 0 && !mux_ticlate()) {
 				if (seqptr_evmerge2(o->recptr,
 					&o->rec_replay, ev, &rev))
 					mixout_putev(&rev, 0);
+			} else {
+				if (o->rec_ndefer == SONG_NRECDEFER)
+					song_recflush(o);
+				o->rec_defer[o->rec_ndefer++] = *ev;
 			}
-			if (s->tag == TAG_REC || s->tag == TAG_PLAY)
-				mixout_putev(ev, 0);
-
-		} else
+		}
+		if (s->tag == TAG_REC || s->tag == TAG_PLAY)
 			mixout_putev(ev, 0);
 		ev++;
 	}
@@ -1255,6 +1625,80 @@ song_sysexcb(struct song *o, struct sysex *sx)
 		sysex_del(sx);
 }
 
+/*
+ * return 1 if input sysex messages are recorded
+ */
+unsigned
+song_sysexrec(struct song *o)
+{
+	return o->mode >= SONG_REC;
+}
+
+/*
+ * rebuild the input prefilter from the current filter. Events are
+ * recorded after being filtered, so the filter alone decides which
+ * ones are used, unless there's none or input may trigger the start
+ */
+void
+song_indropupdate(struct song *o)
+{
+	struct filt *f;
+	unsigned short *drop;
+	unsigned unit, i;
+
+	o->indrop_filt = o->curfilt;
+	o->indrop_serial = filt_serial;
+	o->indrop_tap = o->tap_mode;
+	for (unit = 0; unit <= EV_MAXDEV; unit++) {
+		drop = o->indrop[unit];
+		for (i = 0; i < 8; i++)
+			drop[i] = 0;
+		if (o->curfilt == NULL || o->tap_mode != SONG_TAP_OFF)
+			continue;
+		f = &o->curfilt->filt;
+
+		/*
+		 * note-offs are never dropped, so notes started before
+		 * the filter changed are terminated
+		 */
+		drop[EV_NON & 7] = ~(filt_chmask(f, EV_NON, unit) |
+		    filt_chmask(f, EV_NOFF, unit));
+		drop[EV_KAT & 7] = ~filt_chmask(f, EV_KAT, unit);
+
+		/*
+		 * controllers and program changes may be combined into
+		 * 14-bit controllers, (N)RPNs and bank selects
+		 */
+		drop[EV_CTL & 7] = ~(filt_chmask(f, EV_CTL, unit) |
+		    filt_chmask(f, EV_XCTL, unit) |
+		    filt_chmask(f, EV_NRPN, unit) |
+		    filt_chmask(f, EV_RPN, unit) |
+		    filt_chmask(f, EV_XPC, unit));
+		drop[EV_PC & 7] = ~(filt_chmask(f, EV_PC, unit) |
+		    filt_chmask(f, EV_XPC, unit));
+		drop[EV_CAT & 7] = ~filt_chmask(f, EV_CAT, unit);
+		drop[EV_BEND & 7] = ~filt_chmask(f, EV_BEND, unit);
+	}
+}
+
+/*
+ * store in the given array the bitmaps of the channels of the voice
+ * messages of the given device the current filter discards, by
+ * (status >> 4) & 7. Bitmaps are rebuilt only if the filter changed
+ */
+void
+song_indrop(struct song *o, unsigned unit, unsigned short *drop)
+{
+	unsigned i;
+
+	if (o->indrop_filt != o->curfilt ||
+	    o->indrop_serial != filt_serial ||
+	    o->indrop_tap != o->tap_mode)
+		song_indropupdate(o);
+	for (i = 0; i < 8; i++)
+		drop[i] = o->indrop[unit][i];
+}
+
 unsigned
 song_mtcpos(struct song *o, unsigned where, unsigned offs)
 {
@@ -1391,8 +1835,10 @@ song_loc(struct song *o, unsigned how, unsigned where, unsigned offs)
 	o->complete = !seqptr_eot(o->metaptr);
 
 	/*
-	 * move all tracks to the current position
+	 * move all tracks to the current position, sending only
+	 * the parameters that change
 	 */
+	mixout_defer();
 	SONG_FOREACH_TRK(o, t) {
 		/*
 		 * cancel and free old states
@@ -1404,7 +1850,8 @@ song_loc(struct song *o, unsigned how, unsigned where, unsigned offs)
 		/*
 		 * allocate and restore new states
 		 */
-		t->trackptr = seqptr_new(&t->track);
+		track_mkidx(&t->track, o->abspos);
+		t->trackptr = seqptr_newro(&t->track);
 		seqptr_skip(t->trackptr, o->abspos);
 		for (s = t->trackptr->statelist.first; s != NULL; s = s->next)
 			s->tag = 0;
@@ -1417,6 +1864,13 @@ song_loc(struct song *o, unsigned how, unsigned where, unsigned offs)
 		if (!seqptr_eot(t->trackptr))
 			o->complete = 0;
 	}
+	song_trkheap(o);
+	if (o->stream) {
+		song_streamloc(o);
+		if (o->stream->heap.n > 0)
+			o->complete = 0;
+	}
+	mixout_commit();
 
 	if (o->mode >= SONG_REC)
 		track_clear(&o->rec);
@@ -1440,6 +1894,7 @@ song_loc(struct song *o, unsigned how, unsigned where, unsigned offs)
 	}
 	statelist_empty(&o->rec_input);
 	statelist_empty(&o->rec_replay);
+	o->rec_ndefer = 0;
 
 	/*
 	 * we've the tempo to be set, as in the LOC_MTC case, the return
@@ -1464,6 +1919,12 @@ song_loc(struct song *o, unsigned how, unsigned where, unsigned offs)
 			s->tag = 0;
 		}
 	}
+	if (o->stream) {
+		for (s = o->stream->metalist.first; s != NULL; s = s->next) {
+			if (s->ev.cmd == EV_TEMPO)
+				song_metaput(o, s);
+		}
+	}
 
 	if (o->complete)
 		cons_puttag("complete");
@@ -1508,13 +1969,90 @@ song_gotocb(struct song *o, int how, unsigned where)
 	return song_loc(o, how, where, 0);
 }
 
+/*
+ * cancel the state of the file played from storage and restore the
+ * state at the current position
+ */
+void
+song_streamloc(struct song *o)
+{
+	struct state *s;
+
+	song_confcancel(&o->stream->statelist, PRIO_TRACK);
+	smfstream_seek(o->stream, o->tics_per_unit, o->abspos);
+	for (s = o->stream->statelist.first; s != NULL; s = s->next)
+		s->tag = 0;
+	song_confrestore(&o->stream->statelist,
+	    o->mode >= SONG_PLAY, PRIO_TRACK);
+}
+
+/*
+ * create the seqptrs and the state lists used in real-time, at the
+ * beginning of the song
+ */
+void
+song_ptrinit(struct song *o)
+{
+	struct songtrk *t;
+	unsigned ntrks;
+
+	o->abspos = 0;
+	o->measure = 0;
+	o->beat = 0;
+	o->tic = 0;
+
+	/*
+	 * get empty states
+	 */
+	ntrks = 0;
+	SONG_FOREACH_TRK(o, t) {
+		t->trackptr = seqptr_newro(&t->track);
+		ntrks++;
+	}
+	heap_init(&o->trkheap, xmalloc((ntrks + 1) * sizeof(void *),
+	    "trkheap"), song_trkbefore, NULL);
+	song_trkheap(o);
+	o->metaptr = seqptr_new(&o->meta);
+	o->recptr = seqptr_new(&o->rec);
+	o->playptr = NULL;
+	statelist_init(&o->rec_replay);
+	statelist_init(&o->rec_input);
+	o->rec_ndefer = 0;
+}
+
+/*
+ * cancel and free the states and the seqptrs created by
+ * song_ptrinit()
+ */
+void
+song_ptrdone(struct song *o)
+{
+	struct songtrk *t;
+
+	SONG_FOREACH_TRK(o, t) {
+		song_confcancel(&t->trackptr->statelist, PRIO_TRACK);
+		statelist_empty(&t->trackptr->statelist);
+		seqptr_del(t->trackptr);
+	}
+	if (o->stream)
+		song_confcancel(&o->stream->statelist, PRIO_TRACK);
+	if (o->playptr)
+		seqptr_del(o->playptr);
+	statelist_empty(&o->rec_input);
+	statelist_done(&o->rec_input);
+	statelist_empty(&o->rec_replay);
+	statelist_done(&o->rec_replay);
+	seqptr_del(o->recptr);
+	seqptr_del(o->metaptr);
+	xfree(o->trkheap.ent);
+}
+
 /*
  * set the current mode
  */
 void
 song_setmode(struct song *o, unsigned newmode)
 {
-	struct songtrk *t;
 	unsigned oldmode;
 
 	oldmode = o->mode;
@@ -1522,6 +2060,8 @@ song_setmode(struct song *o, unsigned newmode)
 	if (oldmode >= SONG_PLAY) {
 		mux_stopreq();
 	}
+	if (oldmode >= SONG_PLAY && newmode < SONG_PLAY && setlist_armed)
+		setlist_disarm();
 	if (newmode < oldmode)
 		metro_setmode(&o->metro, newmode);
 	if (oldmode >= SONG_REC && newmode < SONG_REC)
@@ -1529,22 +2069,8 @@ song_setmode(struct song *o, unsigned newmode)
 	if (oldmode >= SONG_PLAY && newmode < SONG_PLAY)
 		song_loop_done(o);
 	if (oldmode >= SONG_IDLE && newmode < SONG_IDLE) {
-		/*
-		 * cancel and free states
-		 */
-		SONG_FOREACH_TRK(o, t) {
-			song_confcancel(&t->trackptr->statelist, PRIO_TRACK);
-			statelist_empty(&t->trackptr->statelist);
-			seqptr_del(t->trackptr);
-		}
-		if (o->playptr)
-			seqptr_del(o->playptr);
-		statelist_empty(&o->rec_input);
-		statelist_done(&o->rec_input);
-		statelist_empty(&o->rec_replay);
-		statelist_done(&o->rec_replay);
-		seqptr_del(o->recptr);
-		seqptr_del(o->metaptr);
+		song_ptrdone(o);
+		song_sxstop(o);
 		norm_shut();
 		mux_flush();
 		mux_close();
@@ -1555,30 +2081,17 @@ song_setmode(struct song *o, unsigned newmode)
 		song_loop_init(o);
 	}
 	if (oldmode < SONG_IDLE && newmode >= SONG_IDLE) {
-		o->abspos = 0;
-		o->measure = 0;
-		o->beat = 0;
-		o->tic = 0;
-
-		/*
-		 * get empty states
-		 */
-		SONG_FOREACH_TRK(o, t) {
-			t->trackptr = seqptr_new(&t->track);
-		}
-		o->metaptr = seqptr_new(&o->meta);
-		o->recptr = seqptr_new(&o->rec);
-		o->playptr = NULL;
-		statelist_init(&o->rec_replay);
-		statelist_init(&o->rec_input);
-
+		song_ptrinit(o);
 		mux_open();
 		mux_chgticrate(o->tics_per_unit);
 
 		/*
 		 * send sysex messages and channel config messages
 		 */
-		song_playsysex(o);
+		if (o->sx_async)
+			song_sxstart(o);
+		else
+			song_playsysex(o);
 		song_playconf(o);
 		mux_flush();
 	}
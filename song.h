@@ -27,12 +27,16 @@
 #include "filt.h"
 #include "sysex.h"
 #include "metro.h"
+#include "ticprof.h"
+#include "heap.h"
 
 struct songtrk;
 struct songchan;
 struct songfilt;
 struct songsx;
 struct undo;
+struct smfstream;
+struct mdep_map;
 
 struct songtrk {
 	struct name name;		/* identifier + list entry */
@@ -41,7 +45,10 @@ struct songtrk {
 	struct seqptr *loopstate;
 	struct songfilt *curfilt;	/* source and dest. channel */
 	struct seqptr *loop_trackptr;	/* backup of trackptr */
+	unsigned nexttic;		/* abs. tic of next event or eot */
+	unsigned order;			/* position in the track list */
 	unsigned mute;
+	struct ticprof_cnt prof;	/* time spent playing it */
 };
 
 struct songchan {
@@ -103,6 +110,7 @@ struct song {
 	 * temporary variables used in real-time operations
 	 */
 	struct seqptr *metaptr;		/* cur. pos in meta track */
+	struct heap trkheap;		/* tracks ordered by next event */
 	unsigned long tempo;		/* cur tempo in 24th of usec per tic */
 	unsigned bpm, tpb;		/* cur time signature */
 	struct track rec;		/* track being recorded */
@@ -110,7 +118,21 @@ struct song {
 	struct seqptr *playptr;		/* replay position in rec track */
 	struct statelist rec_input;	/* events to be recorded */
 	struct statelist rec_replay;	/* recorded events to be replayed */
+#define SONG_NRECDEFER	32
+	struct ev rec_defer[SONG_NRECDEFER]; /* to record on next tick */
+	unsigned rec_ndefer;		/* number of events in above */
 	struct sysexlist recsx;
+
+	/*
+	 * input prefilter: channels of voice messages discarded by
+	 * the current filter, by device and (status >> 4) & 7, and
+	 * the configuration they were derived from
+	 */
+	unsigned short indrop[EV_MAXDEV + 1][8];
+	struct songfilt *indrop_filt;	/* current filter */
+	unsigned indrop_serial;		/* filt_serial */
+	int indrop_tap;			/* tap_mode */
+
 	unsigned abspos;		/* cur postion in ticks */
 	unsigned measure, beat, tic;	/* cur position (for metronome) */
 #define SONG_IDLE	1		/* filter running */
@@ -127,6 +149,18 @@ struct song {
 	unsigned loop_tstart;		/* loop start tick */
 	unsigned loop_tend;		/* loop end tick */
 	struct seqptr *loop_metaptr;	/* backup of metaptr */
+
+	struct smfstream *stream;	/* file played from storage */
+	struct mdep_map *map;		/* image tracks are read from */
+
+	/*
+	 * sysex messages sent in background (see song_sxstart())
+	 */
+	unsigned sx_async;		/* don't wait for sysex messages */
+	struct timo sx_timo;		/* time to send the next message */
+	struct songsx *sx_bank;		/* bank being sent, NULL if done */
+	unsigned sx_idx;		/* next message in the bank */
+	unsigned sx_nsent, sx_ntotal;	/* progress, in messages */
 };
 
 extern char *song_tap_modestr[3];
@@ -186,9 +220,27 @@ void song_setcurfilt(struct song *, struct songfilt *);
 void song_getcurchan(struct song *, struct songchan **, int);
 void song_setcurchan(struct song *, struct songchan *, int);
 unsigned song_endpos(struct song *);
+void song_compact(struct song *);
+void song_prescale(struct song *, unsigned, unsigned);
+void song_scale(struct song *, unsigned, unsigned);
+void song_check(struct song *);
+void song_pack(struct song *);
 
+void song_recflush(struct song *);
+void song_ticskip(struct song *);
+void song_ticplay(struct song *);
 void song_setmode(struct song *, unsigned);
+unsigned song_trkbefore(void *, void *);
+void song_trkheap(struct song *);
+void song_ptrinit(struct song *);
+void song_ptrdone(struct song *);
+void song_loop_init(struct song *);
+void song_loop_done(struct song *);
+void song_sxtimo(void *);
+void song_sxstart(struct song *);
+void song_sxstop(struct song *);
 void song_goto(struct song *, unsigned);
+void song_streamloc(struct song *);
 void song_record(struct song *);
 void song_play(struct song *);
 void song_idle(struct song *);
@@ -26,16 +26,19 @@
  * state pool. In a typical performace, the maximum state list length
  * is roughly equal to the maximum sounding notes; the mean list
  * length is between 2 and 3 states and the maximum is between 10 and
- * 20 states. Currently we use a singly linked list, but for
- * performance reasons we shoud use a hash table in the future.
+ * 20 states. Currently we use a doubly linked list, and long lists
+ * are additionally indexed by a hash table.
  *
  */
 
 #include "utils.h"
+#include "defs.h"
 #include "pool.h"
 #include "state.h"
+#include "work.h"
 
 struct pool state_pool;
+struct pool statehash_pool;
 unsigned state_serial;
 
 void
@@ -43,18 +46,25 @@ state_pool_init(unsigned size)
 {
 	state_serial = 0;
 	pool_init(&state_pool, "state", sizeof(struct state), size);
+	pool_init(&statehash_pool, "statehash",
+	    STATE_NHASH * sizeof(struct state *), DEFAULT_MAXNSTATEHASHES);
 }
 
 void
 state_pool_done(void)
 {
+	pool_done(&statehash_pool);
 	pool_done(&state_pool);
 }
 
 struct state *
 state_new(void)
 {
-	return (struct state *)pool_new(&state_pool);
+	struct state *s;
+
+	s = (struct state *)pool_new(&state_pool);
+	s->cprev = NULL;
+	return s;
 }
 
 void
@@ -125,6 +135,45 @@ state_match(struct state *st, struct ev *ev)
 	return res;
 }
 
+/*
+ * return the hash bucket of the given event: all states matching
+ * the event, in the sense of state_match(), are in this bucket
+ */
+unsigned
+state_hash(struct ev *ev)
+{
+	unsigned h;
+
+	switch (ev->cmd) {
+	case EV_NON:
+	case EV_NOFF:
+	case EV_KAT:
+		h = EV_NON;
+		h = h * 31 + ev->dev;
+		h = h * 31 + ev->ch;
+		h = h * 31 + ev->note_num;
+		break;
+	case EV_XCTL:
+	case EV_NRPN:
+	case EV_RPN:
+		h = ev->cmd;
+		h = h * 31 + ev->dev;
+		h = h * 31 + ev->ch;
+		h = h * 31 + ev->v0;
+		break;
+	case EV_BEND:
+	case EV_CAT:
+	case EV_XPC:
+		h = ev->cmd;
+		h = h * 31 + ev->dev;
+		h = h * 31 + ev->ch;
+		break;
+	default:
+		h = ev->cmd;
+	}
+	return (h ^ (h >> 5)) & (STATE_NHASH - 1);
+}
+
 /*
  * check if the given state belongs to the event spec
  */
@@ -315,8 +364,83 @@ void
 statelist_init(struct statelist *o)
 {
 	o->first = NULL;
-	o->changed = 0;
+	o->hash = NULL;
+	o->nstates = 0;
+	o->changed = NULL;
+	work_lock();
 	o->serial = state_serial++;
+	work_unlock();
+#ifdef STATE_PROF
+	prof_reset(&o->prof, "statelist_lookup");
+#endif
+}
+
+/*
+ * link the given state to its hash bucket
+ */
+void
+statelist_hadd(struct statelist *o, struct state *st)
+{
+	struct state **b;
+
+	b = &o->hash[state_hash(&st->ev)];
+	st->hnext = *b;
+	st->hprev = b;
+	if (*b)
+		(*b)->hprev = &st->hnext;
+	*b = st;
+}
+
+/*
+ * link the given state to the list of states changed within the
+ * current tick, if not already there
+ */
+void
+statelist_cadd(struct statelist *o, struct state *st)
+{
+	if (st->cprev != NULL)
+		return;
+	st->cnext = o->changed;
+	st->cprev = &o->changed;
+	if (o->changed)
+		o->changed->cprev = &st->cnext;
+	o->changed = st;
+}
+
+/*
+ * start using the hash table: allocate buckets and index all states.
+ * States are indexed from the end of the list, so that within each
+ * bucket they are in the same order as in the list
+ */
+void
+statelist_hinit(struct statelist *o)
+{
+	struct state *i, **last;
+	unsigned n;
+
+	o->hash = pool_new(&statehash_pool);
+	for (n = 0; n < STATE_NHASH; n++)
+		o->hash[n] = NULL;
+	last = &o->first;
+	while (*last != NULL)
+		last = &(*last)->next;
+	while (last != &o->first) {
+		i = (struct state *)((char *)last - offsetof(struct state, next));
+		statelist_hadd(o, i);
+		last = i->prev;
+	}
+}
+
+/*
+ * stop using the hash table, called when the list is emptied
+ */
+void
+statelist_hdone(struct statelist *o)
+{
+	if (o->hash) {
+		pool_del(&statehash_pool, o->hash);
+		o->hash = NULL;
+	}
 }
 
 /*
@@ -346,7 +470,11 @@ statelist_done(struct statelist *o)
 		statelist_rm(o, i);
 		state_del(i);
 	}
-
+	statelist_hdone(o);
+#ifdef STATE_PROF
+	if (o->prof.n > 0)
+		prof_log(&o->prof);
+#endif
 }
 
 void
@@ -379,6 +507,38 @@ statelist_dup(struct statelist *o, struct statelist *src)
 	}
 }
 
+
+/*
+ * copy all states of the given list to an empty list. Unlike
+ * statelist_dup(), all fields are copied and the order of states is
+ * preserved, so the copy behaves exactly as the original one
+ */
+void
+statelist_copy(struct statelist *o, struct statelist *src)
+{
+	struct state *i, *n, **last;
+
+	last = &o->first;
+	for (i = src->first; i != NULL; i = i->next) {
+		n = state_new();
+		n->ev = i->ev;
+		n->phase = i->phase;
+		n->flags = i->flags;
+		n->nevents = i->nevents;
+		n->tag = i->tag;
+		n->tic = i->tic;
+		n->pos = i->pos;
+		n->next = NULL;
+		n->prev = last;
+		*last = n;
+		last = &n->next;
+		o->nstates++;
+		if (n->flags & STATE_CHANGED)
+			statelist_cadd(o, n);
+	}
+	if (o->nstates > STATE_HASHMIN)
+		statelist_hinit(o);
+}
 /*
  * remove and free all states from the state list
  */
@@ -392,10 +552,12 @@ statelist_empty(struct statelist *o)
 		statelist_rm(o, i);
 		state_del(i);
 	}
+	statelist_hdone(o);
 }
 
 /*
- * add a state to the state list
+ * add a state to the state list. The event of the state must be set,
+ * since it's used as hash key
  */
 void
 statelist_add(struct statelist *o, struct state *st)
@@ -405,6 +567,13 @@ statelist_add(struct statelist *o, struct state *st)
 	if (o->first)
 		o->first->prev = &st->next;
 	o->first = st;
+	o->nstates++;
+	if (st->flags & STATE_CHANGED)
+		statelist_cadd(o, st);
+	if (o->hash)
+		statelist_hadd(o, st);
+	else if (o->nstates > STATE_HASHMIN)
+		statelist_hinit(o);
 }
 
 /*
@@ -417,6 +586,18 @@ statelist_rm(struct statelist *o, struct state *st)
 	*st->prev = st->next;
 	if (st->next)
 		st->next->prev = st->prev;
+	if (o->hash) {
+		*st->hprev = st->hnext;
+		if (st->hnext)
+			st->hnext->hprev = st->hprev;
+	}
+	if (st->cprev) {
+		*st->cprev = st->cnext;
+		if (st->cnext)
+			st->cnext->cprev = st->cprev;
+		st->cprev = NULL;
+	}
+	o->nstates--;
 }
 
 /*
@@ -427,11 +608,30 @@ struct state *
 statelist_lookup(struct statelist *o, struct ev *ev)
 {
 	struct state *i;
-	for (i = o->first; i != NULL; i = i->next) {
-		if (state_match(i, ev)) {
-			break;
+#ifdef STATE_PROF
+	unsigned n = 0;
+#endif
+
+	if (o->hash) {
+		for (i = o->hash[state_hash(ev)]; i != NULL; i = i->hnext) {
+#ifdef STATE_PROF
+			n++;
+#endif
+			if (state_match(i, ev))
+				break;
+		}
+	} else {
+		for (i = o->first; i != NULL; i = i->next) {
+#ifdef STATE_PROF
+			n++;
+#endif
+			if (state_match(i, ev))
+				break;
 		}
 	}
+#ifdef STATE_PROF
+	prof_val(&o->prof, n);
+#endif
 	return i;
 }
 
@@ -451,16 +651,18 @@ statelist_update(struct statelist *statelist, struct ev *ev)
 
 	phase = ev_phase(ev);
 
-	st = statelist->first;
+	st = statelist->hash ?
+	    statelist->hash[state_hash(ev)] : statelist->first;
 	for (;;) {
 		if (st == NULL) {
 			st = state_new();
 			st->flags = STATE_NEW;
+			st->ev = *ev;
 			statelist_add(statelist, st);
 			break;
 		}
 
-		stnext = st->next;
+		stnext = statelist->hash ? st->hnext : st->next;
 
 		if (state_match(st, ev)) {
 			if (!(st->phase == EV_PHASE_LAST) &&
@@ -480,6 +682,7 @@ statelist_update(struct statelist *statelist, struct ev *ev)
 		if (st->flags != STATE_NEW) {
 			st = state_new();
 			st->flags = STATE_NEW | STATE_NESTED;
+			st->ev = *ev;
 			statelist_add(statelist, st);
 #ifdef STATE_DEBUG
 			log_puts("statelist_update: ");
@@ -514,7 +717,7 @@ statelist_update(struct statelist *statelist, struct ev *ev)
 	}
 
 	state_copyev(st, ev, phase);
-	statelist->changed = 1;
+	statelist_cadd(statelist, st);
 #ifdef STATE_DEBUG
 	log_puts("statelist_update: updated: ");
 	state_log(st);
@@ -526,19 +729,17 @@ statelist_update(struct statelist *statelist, struct ev *ev)
 /*
  * mark all states as not changed. This routine is called at the
  * beginning of a tick (track editting) or after a timeout (real-time
- * filter).
+ * filter). Only states changed since the last call are walked: other
+ * states are neither changed nor terminated
  */
 void
 statelist_outdate(struct statelist *o)
 {
 	struct state *i, *inext;
 
-	if (!o->changed)
-		return;
-
-	o->changed = 0;
-	for (i = o->first; i != NULL; i = inext) {
-		inext = i->next;
+	for (i = o->changed; i != NULL; i = inext) {
+		inext = i->cnext;
+		i->cprev = NULL;
 		/*
 		 * we purge states that are terminated, but we keep states
 		 * of unknown controllers, tempo changes etc... these
@@ -556,5 +757,6 @@ statelist_outdate(struct statelist *o)
 			i->flags &= ~STATE_CHANGED;
 		}
 	}
+	o->changed = NULL;
 }
 
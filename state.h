@@ -25,8 +25,14 @@ struct statelist;
 
 struct state  {
 	struct state *next, **prev;	/* for statelist */
+	struct state *hnext, **hprev;	/* for statelist hash bucket */
+	struct state *cnext, **cprev;	/* for statelist changed list */
 	struct ev ev;			/* last event */
-	unsigned phase;			/* current phase (of the 'ev' field) */
+	/*
+	 * phase, flags and nevents are small, so they share a
+	 * single word: there are lots of states in the pool
+	 */
+	unsigned phase:8;		/* current phase (of the 'ev' field) */
 	/*
 	 * the following flags are set by statelist_update() and
 	 * statelist_outdate() and can be read by other routines,
@@ -36,8 +42,8 @@ struct state  {
 #define STATE_CHANGED	2		/* updated within the current tick */
 #define STATE_BOGUS	4		/* frame detected as bogus */
 #define STATE_NESTED	8		/* nested frame */
-	unsigned flags;			/* bitmap of above */
-	unsigned nevents;		/* number of events before timeout */
+	unsigned flags:8;		/* bitmap of above */
+	unsigned nevents:16;		/* number of events before timeout */
 
 	/*
 	 * the following are general purpose fields that are ignored
@@ -51,16 +57,27 @@ struct state  {
 	struct seqev *pos;		/* pointer to the FIRST event */
 };
 
+/*
+ * number of hash buckets, must be a power of two, and the number of
+ * states above which the hash table is used
+ */
+#define STATE_NHASH	32
+#define STATE_HASHMIN	8
+
 struct statelist {
 	/*
-	 * instead of a simple list, we should use a hash table here,
-	 * but statistics on real-life cases seem to show that lookups
+	 * statistics on real-life cases seem to show that lookups
 	 * are very fast thanks to the state ordering (average lookup
 	 * time is around 1-2 iterations for a common MIDI file), so
-	 * we keep using a simple list
+	 * we use a simple list. However dense controller or note
+	 * traffic may create long lists, so once the list grows
+	 * beyond STATE_HASHMIN states, we also index states in a
+	 * hash table keyed by the fields used by state_match()
 	 */
 	struct state *first;	/* head of the state list */
-	unsigned changed;	/* if changed within this tick */
+	struct state **hash;	/* hash buckets, NULL if not used */
+	unsigned nstates;	/* number of states in the list */
+	struct state *changed;	/* states changed within this tick */
 	unsigned serial;	/* unique ID */
 #ifdef STATE_PROF
 	struct prof prof;
@@ -74,6 +91,7 @@ void	      state_del(struct state *);
 void	      state_log(struct state *);
 void	      state_copyev(struct state *, struct ev *, unsigned);
 unsigned      state_match(struct state *, struct ev *);
+unsigned      state_hash(struct ev *);
 unsigned      state_inspec(struct state *, struct evspec *);
 unsigned      state_eq(struct state *, struct ev *);
 unsigned      state_cancel(struct state *, struct ev *);
@@ -83,6 +101,7 @@ void	      statelist_init(struct statelist *);
 void	      statelist_done(struct statelist *);
 void	      statelist_dump(struct statelist *);
 void	      statelist_dup(struct statelist *, struct statelist *);
+void	      statelist_copy(struct statelist *, struct statelist *);
 void	      statelist_empty(struct statelist *);
 void	      statelist_add(struct statelist *, struct state *);
 void	      statelist_rm(struct statelist *, struct state *);
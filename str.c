@@ -24,6 +24,24 @@
 #include "utils.h"
 #include "str.h"
 
+/*
+ * interned strings: there's at most one copy of each interned string,
+ * so they can be compared by their address. Each string is stored in
+ * an entry of a hash table, with the number of references to it
+ */
+#define STR_NHASH	256
+
+struct str_ent {
+	struct str_ent *next;		/* next in the hash bucket */
+	unsigned hash;
+	unsigned refs;
+	char buf[1];			/* actual string */
+};
+
+#define STR_ENT(s) ((struct str_ent *)((s) - offsetof(struct str_ent, buf)))
+
+struct str_ent *str_htab[STR_NHASH];
+
 /*
  * allocate a new string and copy the string from the given argument
  * into the allocated buffer the argument cannot be NULL.
@@ -109,3 +127,97 @@ str_len(char *s)
 	}
 	return n;
 }
+
+/*
+ * return the hash of the given string
+ */
+unsigned
+str_hashof(char *s)
+{
+	unsigned h;
+
+	for (h = 2166136261U; *s != '\0'; s++)
+		h = (h ^ (unsigned char)*s) * 16777619U;
+	return h;
+}
+
+/*
+ * return the interned copy of the given string, or NULL if it's
+ * not interned. No reference is taken
+ */
+char *
+str_find(char *val)
+{
+	struct str_ent *e;
+	unsigned h;
+
+	h = str_hashof(val);
+	for (e = str_htab[h % STR_NHASH]; e != NULL; e = e->next) {
+		if (e->hash == h && str_eq(e->buf, val))
+			return e->buf;
+	}
+	return NULL;
+}
+
+/*
+ * return a reference to the interned copy of the given string,
+ * create it if necessary
+ */
+char *
+str_intern(char *val)
+{
+	struct str_ent *e;
+	unsigned h, cnt;
+	char *s;
+
+	if (val == NULL) {
+		log_puts("str_intern: NULL pointer argument\n");
+		panic();
+	}
+	h = str_hashof(val);
+	for (e = str_htab[h % STR_NHASH]; e != NULL; e = e->next) {
+		if (e->hash == h && str_eq(e->buf, val)) {
+			e->refs++;
+			return e->buf;
+		}
+	}
+	cnt = str_len(val) + 1;
+	e = xmalloc(offsetof(struct str_ent, buf) + cnt, "str_ent");
+	e->hash = h;
+	e->refs = 1;
+	for (s = e->buf; cnt > 0; cnt--)
+		*s++ = *val++;
+	e->next = str_htab[h % STR_NHASH];
+	str_htab[h % STR_NHASH] = e;
+	return e->buf;
+}
+
+/*
+ * drop a reference to the given interned string, free it if it's
+ * not used anymore
+ */
+void
+str_release(char *s)
+{
+	struct str_ent *e = STR_ENT(s), **p;
+
+	if (--e->refs > 0)
+		return;
+	for (p = &str_htab[e->hash % STR_NHASH]; *p != e; p = &(*p)->next) {
+		if (*p == NULL) {
+			log_puts("str_release: not found\n");
+			panic();
+		}
+	}
+	*p = e->next;
+	xfree(e);
+}
+
+/*
+ * return the hash of the given interned string
+ */
+unsigned
+str_hash(char *s)
+{
+	return STR_ENT(s)->hash;
+}
@@ -22,5 +22,10 @@ void	 str_delete(char *);
 void	 str_log(char *);
 unsigned str_eq(char *, char *);
 unsigned str_len(char *);
+unsigned str_hashof(char *);
+char	*str_find(char *);
+char	*str_intern(char *);
+void	 str_release(char *);
+unsigned str_hash(char *);
 
 #endif /* MIDISH_STR_H */
@@ -23,24 +23,40 @@
  * several sysex messages we use a pool for the sysex messages
  * themselves.
  *
+ * Chunks are used only while messages are received or built. Once
+ * complete, messages stored in the song are packed: their bytes are
+ * moved to a single chunk of the exact size, allocated in bulk
+ * memory. It's shared by all messages with the same bytes, in any
+ * bank or song, and reference counted. Packed messages are read as
+ * others, but must not be changed anymore.
+ *
  * the song contains a list of sysex message, so we group them in a
  * list.
  */
 
+#include <stddef.h>
+#include <string.h>
 #include "utils.h"
 #include "sysex.h"
 #include "defs.h"
 #include "pool.h"
 
+/*
+ * number of buckets of the table of shared data, power of two
+ */
+#define SYSEX_NHASH	64
+
 /* ------------------------------------------ sysex pool routines --- */
 
 struct pool chunk_pool;
 struct pool sysex_pool;
+struct sxshare *sxshare_hash[SYSEX_NHASH];
 
 void
 chunk_pool_init(unsigned size)
 {
-	pool_init(&chunk_pool, "chunk", sizeof(struct chunk), size);
+	pool_initclass(&chunk_pool, "chunk",
+	    sizeof(struct chunk) + CHUNK_SIZE, size, MEM_BULK);
 }
 
 void
@@ -88,9 +104,28 @@ sysex_new(unsigned unit)
 	o->next = NULL;
 	o->unit = unit;
 	o->first = o->last = NULL;
+	o->share = NULL;
 	return o;
 }
 
+/*
+ * drop a reference to shared data, and free it if it's not used
+ * anymore
+ */
+void
+sxshare_unref(struct sxshare *s)
+{
+	struct sxshare **ps;
+
+	if (--s->refs > 0)
+		return;
+	for (ps = &sxshare_hash[s->hash & (SYSEX_NHASH - 1)];
+	     *ps != s; ps = &(*ps)->next)
+		; /* nothing */
+	*ps = s->next;
+	xfree(s);
+}
+
 /*
  * free all chunks of a sysex message, and the message
  * itself
@@ -99,9 +134,14 @@ void
 sysex_del(struct sysex *o)
 {
 	struct chunk *i, *inext;
-	for (i = o->first; i != NULL; i = inext) {
-		inext = i->next;
-		chunk_del(i);
+
+	if (o->share) {
+		sxshare_unref(o->share);
+	} else {
+		for (i = o->first; i != NULL; i = inext) {
+			inext = i->next;
+			chunk_del(i);
+		}
 	}
 	pool_del(&sysex_pool, o);
 }
@@ -114,6 +154,10 @@ sysex_add(struct sysex *o, unsigned data)
 {
 	struct chunk *ck;
 
+	if (o->share) {
+		log_puts("sysex_add: message is packed\n");
+		panic();
+	}
 	ck = o->last;
 	if (!ck) {
 		ck = o->first = o->last = chunk_new();
@@ -187,6 +231,83 @@ sysex_check(struct sysex *o)
 	return 1;
 }
 
+/*
+ * return true if the bytes of the message are the given shared data
+ */
+unsigned
+sysex_eqshare(struct sysex *o, struct sxshare *s)
+{
+	struct chunk *ck;
+	unsigned char *p;
+
+	p = s->chunk->data;
+	for (ck = o->first; ck != NULL; ck = ck->next) {
+		if (memcmp(p, ck->data, ck->used) != 0)
+			return 0;
+		p += ck->used;
+	}
+	return 1;
+}
+
+/*
+ * pack the message: replace its chunks by shared data of the exact
+ * size, allocated if there are no messages with the same bytes yet.
+ * Empty messages are not packed. Packing allocates memory, so it's
+ * not done on the realtime paths (ex. recording), but once messages
+ * are stored in the song
+ */
+void
+sysex_pack(struct sysex *o)
+{
+	struct sxshare *s, **bucket;
+	struct chunk *ck, *cknext;
+	unsigned char *p;
+	unsigned hash, len, i;
+
+	if (o->share || o->first == NULL)
+		return;
+
+	/*
+	 * FNV-1a hash of the bytes
+	 */
+	hash = 2166136261U;
+	len = 0;
+	for (ck = o->first; ck != NULL; ck = ck->next) {
+		for (i = 0; i < ck->used; i++)
+			hash = (hash ^ ck->data[i]) * 16777619U;
+		len += ck->used;
+	}
+	bucket = &sxshare_hash[hash & (SYSEX_NHASH - 1)];
+	for (s = *bucket; s != NULL; s = s->next) {
+		if (s->hash == hash && s->chunk->used == len &&
+		    sysex_eqshare(o, s))
+			break;
+	}
+	if (s == NULL) {
+		s = xmalloc_class(sizeof(struct sxshare) +
+		    sizeof(struct chunk) + len, "sysex", MEM_BULK);
+		s->refs = 0;
+		s->hash = hash;
+		s->chunk = (struct chunk *)(s + 1);
+		s->chunk->next = NULL;
+		s->chunk->used = len;
+		p = s->chunk->data;
+		for (ck = o->first; ck != NULL; ck = ck->next) {
+			memcpy(p, ck->data, ck->used);
+			p += ck->used;
+		}
+		s->next = *bucket;
+		*bucket = s;
+	}
+	s->refs++;
+	for (ck = o->first; ck != NULL; ck = cknext) {
+		cknext = ck->next;
+		chunk_del(ck);
+	}
+	o->first = o->last = s->chunk;
+	o->share = s;
+}
+
 /*
  * initialize a list of sysex messages
  */
@@ -224,6 +345,30 @@ sysexlist_clear(struct sysexlist *o)
 	o->lastptr = &o->first;
 }
 
+/*
+ * return the memory used by the messages of the list. Shared data
+ * is divided among the messages using it
+ */
+unsigned long
+sysexlist_memsize(struct sysexlist *o)
+{
+	struct sysex *i;
+	struct chunk *c;
+	unsigned long size = 0;
+
+	for (i = o->first; i != NULL; i = i->next) {
+		size += sizeof(struct sysex);
+		if (i->share) {
+			size += (sizeof(struct sxshare) + sizeof(struct chunk) +
+			    i->share->chunk->used) / i->share->refs;
+			continue;
+		}
+		for (c = i->first; c != NULL; c = c->next)
+			size += sizeof(struct chunk) + CHUNK_SIZE;
+	}
+	return size;
+}
+
 /*
  * put a sysex message at the end of the list
  */
@@ -17,17 +17,33 @@
 #ifndef MIDISH_SYSEX_H
 #define MIDISH_SYSEX_H
 
+/*
+ * chunks from the pool have CHUNK_SIZE bytes of data, chunks of
+ * packed messages have the exact size of the message
+ */
 struct chunk {
 	struct chunk *next;
 	unsigned used;			/* bytes used in 'data' */
 #define CHUNK_SIZE	0x100
-	unsigned char data[CHUNK_SIZE];
+	unsigned char data[];
+};
+
+/*
+ * data of packed messages, shared by all messages with the same
+ * bytes, the chunk follows this structure
+ */
+struct sxshare {
+	struct sxshare *next;		/* next with the same hash */
+	unsigned refs;			/* number of messages using it */
+	unsigned hash;			/* hash of the data */
+	struct chunk *chunk;		/* the data, a single chunk */
 };
 
 struct sysex {
 	struct sysex *next;
 	unsigned unit;			/* device number */
 	struct chunk *first, *last;
+	struct sxshare *share;		/* shared data, if packed */
 };
 
 struct sysexlist {
@@ -53,10 +69,12 @@ void	      sysex_del(struct sysex *);
 void	      sysex_add(struct sysex *, unsigned);
 void	      sysex_log(struct sysex *);
 unsigned      sysex_check(struct sysex *);
+void	      sysex_pack(struct sysex *);
 
 void 	      sysexlist_init(struct sysexlist *);
 void	      sysexlist_done(struct sysexlist *);
 void	      sysexlist_clear(struct sysexlist *);
+unsigned long sysexlist_memsize(struct sysexlist *);
 void	      sysexlist_put(struct sysexlist *, struct sysex *);
 struct sysex *sysexlist_get(struct sysexlist *);
 void	      sysexlist_log(struct sysexlist *);
@@ -19,7 +19,12 @@
  * (open/close, line numbering, etc...). Used by lex
  *
  * textout implements outputs into text files (or stdout)
- * (open/close, indentation...)
+ * (open/close, indentation...). Files are written by blocks of
+ * TEXTOUT_BLKSIZE bytes, without holding the realtime lock, so
+ * slow file systems don't delay playback
+ *
+ * Files starting with TEXTIO_LZMAGIC are compressed (see lz.c); they
+ * are decompressed while read, and written by textout_newlz()
  *
  */
 
@@ -30,17 +35,32 @@
 #include "utils.h"
 #include "textio.h"
 #include "cons.h"
+#include "mux.h"
+#include "lz.h"
+
+#define TEXTOUT_BLKSIZE	512
+
+/*
+ * text files never contain a nul byte
+ */
+#define TEXTIO_LZMAGIC		"\0MSZ"
+#define TEXTIO_LZMAGICLEN	4
 
 struct textin
 {
 	FILE *file;
+	struct lzdec *lz;			/* if compressed */
 	unsigned line, col;
 };
 
 struct textout
 {
 	FILE *file;
+	struct lzenc *lz;			/* if compressed */
+	unsigned char *lzbuf;			/* compressed block */
 	unsigned indent, isconsole, col;
+	unsigned blklen;			/* bytes used in 'blk' */
+	char blk[TEXTOUT_BLKSIZE];
 };
 
 /* -------------------------------------------------------- input --- */
@@ -50,7 +70,10 @@ textin_new(char *filename)
 {
 	struct textin *o;
 
+	char magic[TEXTIO_LZMAGICLEN];
+
 	o = xmalloc(sizeof(struct textin), "textin");
+	o->lz = NULL;
 	if (filename == NULL) {
 		o->file = stdin;
 	} else {
@@ -60,6 +83,12 @@ textin_new(char *filename)
 			xfree(o);
 			return 0;
 		}
+		if (fread(magic, TEXTIO_LZMAGICLEN, 1, o->file) == 1 &&
+		    memcmp(magic, TEXTIO_LZMAGIC, TEXTIO_LZMAGICLEN) == 0) {
+			o->lz = xmalloc(sizeof(struct lzdec), "lzdec");
+			lzdec_init(o->lz);
+		} else
+			rewind(o->file);
 	}
 	o->line = o->col = 0;
 	return o;
@@ -68,6 +97,8 @@ textin_new(char *filename)
 void
 textin_delete(struct textin *o)
 {
+	if (o->lz)
+		xfree(o->lz);
 	fclose(o->file);
 	xfree(o);
 }
@@ -75,7 +106,14 @@ textin_delete(struct textin *o)
 unsigned
 textin_getchar(struct textin *o, int *c)
 {
-	*c = fgetc(o->file);
+	if (o->lz) {
+		*c = lzdec_getc(o->lz, o->file);
+		if (*c == -2) {
+			cons_err("corrupted compressed file");
+			return 0;
+		}
+	} else
+		*c = fgetc(o->file);
 	if (*c == EOF) {
 		*c = CHAR_EOF;
 		if (ferror(o->file)) {
@@ -117,25 +155,105 @@ textout_new(char *filename)
 			xfree(o);
 			return 0;
 		}
+		setvbuf(o->file, NULL, _IONBF, 0);
 		o->isconsole = 0;
 	} else {
 		o->file = stdout;
 		o->isconsole = 1;
 	}
+	o->lz = NULL;
 	o->indent = 0;
 	o->col = 0;
+	o->blklen = 0;
+	return o;
+}
+
+/*
+ * create a compressed text file
+ */
+struct textout *
+textout_newlz(char *filename)
+{
+	struct textout *o;
+
+	o = textout_new(filename);
+	if (o == NULL)
+		return NULL;
+	o->lz = xmalloc(sizeof(struct lzenc), "lzenc");
+	o->lzbuf = xmalloc(LZ_OUTSZ(TEXTOUT_BLKSIZE), "lzbuf");
+	lzenc_init(o->lz);
+	fwrite(TEXTIO_LZMAGIC, TEXTIO_LZMAGICLEN, 1, o->file);
 	return o;
 }
 
 void
 textout_delete(struct textout *o)
 {
+	unsigned len;
+
 	if (!o->isconsole) {
+		textout_flush(o);
+		if (o->lz) {
+			len = lzenc_end(o->lz, o->lzbuf);
+			fwrite(o->lzbuf, len, 1, o->file);
+			xfree(o->lzbuf);
+			xfree(o->lz);
+		}
 		fclose(o->file);
 	}
 	xfree(o);
 }
 
+/*
+ * write the buffered block to the file, the realtime task
+ * keeps running meanwhile
+ */
+void
+textout_flush(struct textout *o)
+{
+	unsigned len;
+
+	if (o->blklen == 0)
+		return;
+	if (o->lz) {
+		len = lzenc_put(o->lz, (unsigned char *)o->blk, o->blklen,
+		    o->lzbuf);
+		mux_mdep_unlock();
+		fwrite(o->lzbuf, len, 1, o->file);
+		mux_mdep_lock();
+	} else {
+		mux_mdep_unlock();
+		fwrite(o->blk, o->blklen, 1, o->file);
+		mux_mdep_lock();
+	}
+	o->blklen = 0;
+}
+
+/*
+ * append the given bytes to the output
+ */
+void
+textout_write(struct textout *o, char *buf, unsigned len)
+{
+	unsigned n;
+
+	if (o->isconsole) {
+		log_putc(buf, len);
+		return;
+	}
+	while (len > 0) {
+		n = TEXTOUT_BLKSIZE - o->blklen;
+		if (n > len)
+			n = len;
+		memcpy(o->blk + o->blklen, buf, n);
+		o->blklen += n;
+		buf += n;
+		len -= n;
+		if (o->blklen == TEXTOUT_BLKSIZE)
+			textout_flush(o);
+	}
+}
+
 void
 textout_shiftleft(struct textout *o)
 {
@@ -161,10 +279,7 @@ textout_putstr(struct textout *o, char *str)
 
 		if (o->col == 0) {
 			for (i = 0; i < o->indent; i++) {
-				if (o->isconsole)
-					log_putc(buf, sizeof(buf));
-				else
-					fwrite(buf, sizeof(buf), 1, o->file);
+				textout_write(o, buf, sizeof(buf));
 				o->col += 8;
 			}
 		}
@@ -178,10 +293,7 @@ textout_putstr(struct textout *o, char *str)
 			o->col++;
 		}
 
-		if (o->isconsole)
-			log_putc(str, p - str);
-		else
-			fwrite(str, p - str, 1, o->file);
+		textout_write(o, str, p - str);
 		str = p;
 	}
 }
@@ -28,7 +28,10 @@ unsigned textin_getchar(struct textin *, int *);
 void textin_getpos(struct textin *, unsigned *, unsigned *);
 
 struct textout *textout_new(char *);
+struct textout *textout_newlz(char *);
 void textout_delete(struct textout *);
+void textout_flush(struct textout *);
+void textout_write(struct textout *, char *, unsigned);
 void textout_shiftleft(struct textout *);
 void textout_shiftright(struct textout *);
 void textout_putstr(struct textout *, char *);
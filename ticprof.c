@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * the profiler measures the time spent in each stage of the sequencer
+ * tick (see song_movecb()), and in each track. It's always running,
+ * the cost is a read of the cycle counter per stage and per track.
+ * Ticks that take longer than the tick period are counted as late.
+ * The number of bytes sent to devices on each tick is counted as well.
+ *
+ * Counters are updated only between ticprof_start() and ticprof_tic(), so
+ * the same routines can be used outside the realtime path (eg. to
+ * relocate the song) without being accounted.
+ */
+
+#include "utils.h"
+#include "ticprof.h"
+#include "mdep_desp.h"
+
+struct ticprof ticprof;
+
+char *ticprof_stagename[TICPROF_NSTAGES] = {
+	"meta", "metro", "stream", "rec", "skip", "flush"
+};
+
+/*
+ * clear the given counter
+ */
+void
+ticprof_cntreset(struct ticprof_cnt *c)
+{
+	c->sum = 0;
+	c->max = 0;
+}
+
+/*
+ * start a new tick, and return its start time
+ */
+unsigned long
+ticprof_start(void)
+{
+	ticprof.active = 1;
+	return mdep_desp_cycles();
+}
+
+/*
+ * return the start time of the next stage
+ */
+unsigned long
+ticprof_now(void)
+{
+	return ticprof.active ? mdep_desp_cycles() : 0;
+}
+
+/*
+ * add to the given counter the time elapsed since the given
+ * start time, and return the current time, so it can be used as start
+ * time of the next stage
+ */
+unsigned long
+ticprof_add(struct ticprof_cnt *c, unsigned long start)
+{
+	unsigned long now, delta;
+
+	if (!ticprof.active)
+		return 0;
+	now = mdep_desp_cycles();
+	delta = now - start;
+	c->sum += delta;
+	if (c->max < delta)
+		c->max = delta;
+	return now;
+}
+
+/*
+ * account a whole tick that started at the given time; the tick
+ * period is in 24th of microsecond
+ */
+void
+ticprof_tic(unsigned long start, unsigned long ticlength)
+{
+	unsigned long long period;
+	unsigned long now;
+
+	now = ticprof_add(&ticprof.tic, start);
+	period = (unsigned long long)ticlength * DESP_CYCLES_PER_USEC / 24;
+	if (now - start > period)
+		ticprof.nlate++;
+	ticprof.ntics++;
+	ticprof.bytes.sum += ticprof.nbytes;
+	if (ticprof.bytes.max < ticprof.nbytes)
+		ticprof.bytes.max = ticprof.nbytes;
+	ticprof.nbytes = 0;
+	ticprof.active = 0;
+}
+
+/*
+ * account the given number of bytes sent to a device during the
+ * current tick
+ */
+void
+ticprof_out(unsigned n)
+{
+	if (ticprof.active)
+		ticprof.nbytes += n;
+}
+
+/*
+ * clear all global counters
+ */
+void
+ticprof_reset(void)
+{
+	unsigned i;
+
+	ticprof.active = 0;
+	ticprof.ntics = 0;
+	ticprof.nlate = 0;
+	ticprof.nbytes = 0;
+	ticprof_cntreset(&ticprof.tic);
+	ticprof_cntreset(&ticprof.bytes);
+	for (i = 0; i < TICPROF_NSTAGES; i++)
+		ticprof_cntreset(&ticprof.stage[i]);
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MIDISH_TICPROF_H
+#define MIDISH_TICPROF_H
+
+/*
+ * stages of the sequencer tick, tracks have their own counters
+ */
+#define TICPROF_META	0	/* meta track events */
+#define TICPROF_METRO	1	/* metronome */
+#define TICPROF_STREAM	2	/* standard MIDI file being streamed */
+#define TICPROF_REC	3	/* merge of recorded events */
+#define TICPROF_SKIP	4	/* move all pointers to the next tick */
+#define TICPROF_FLUSH	5	/* flush of MIDI devices */
+#define TICPROF_NSTAGES	6
+
+/*
+ * time spent in a stage, in mdep_desp_cycles() units
+ */
+struct ticprof_cnt {
+	unsigned long long sum;		/* total of all ticks */
+	unsigned long max;		/* longest tick */
+};
+
+struct ticprof {
+	unsigned active;		/* in a tick, counters enabled */
+	unsigned long ntics;		/* ticks processed */
+	unsigned long nlate;		/* ticks longer than the tick period */
+	struct ticprof_cnt tic;		/* whole tick */
+	struct ticprof_cnt stage[TICPROF_NSTAGES];
+	struct ticprof_cnt bytes;	/* bytes sent to devices */
+	unsigned long nbytes;		/* bytes sent in the current tick */
+};
+
+void ticprof_cntreset(struct ticprof_cnt *);
+unsigned long ticprof_start(void);
+unsigned long ticprof_now(void);
+unsigned long ticprof_add(struct ticprof_cnt *, unsigned long);
+void ticprof_tic(unsigned long, unsigned long);
+void ticprof_out(unsigned);
+void ticprof_reset(void);
+
+extern struct ticprof ticprof;
+extern char *ticprof_stagename[];
+
+#endif /* MIDISH_TICPROF_H */
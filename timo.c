@@ -15,10 +15,10 @@
  */
 
 /*
- * trivial timeouts implementation.
+ * timeouts implementation.
  *
  * A timeout is used to schedule the call of a routine (the callback)
- * there is a global list of timeouts that is processed inside the
+ * there is a global queue of timeouts that is processed inside the
  * event loop ie mux_run(). Timeouts work as follows:
  *
  *	first the timo structure must be initialized with timo_set()
@@ -32,15 +32,65 @@
  *	the timeout can be aborted with timo_del(), it is OK to try to
  *	abort a timout that has expired
  *
+ * The queue is a binary heap ordered by expiration time, so adding a
+ * timeout or running the next one takes O(log n). Each timeout stores
+ * its position in the heap, so it can be removed without searching.
+ * Timeouts expiring at the same time run in the order they were
+ * added. The heap is allocated once by timo_init(), so timo_add()
+ * never allocates memory on the realtime path.
  */
 
 #include "utils.h"
+#include "defs.h"
+#include "heap.h"
 #include "timo.h"
 
 unsigned timo_debug = 0;
-struct timo *timo_queue;
+struct heap timo_heap;
+unsigned timo_seq;
 unsigned timo_abstime;
 
+/*
+ * return true if 'a' must expire before 'b'. There is no overflow
+ * here because + and - are modulo 2^32, they are the same for both
+ * signed and unsigned integers
+ */
+unsigned
+timo_before(void *arg_a, void *arg_b)
+{
+	struct timo *a = arg_a, *b = arg_b;
+	int diff;
+
+	diff = a->val - b->val;
+	if (diff != 0)
+		return diff < 0;
+	diff = a->seq - b->seq;
+	return diff < 0;
+}
+
+/*
+ * store the new heap position of the given timeout
+ */
+void
+timo_moved(void *arg, unsigned i)
+{
+	struct timo *o = arg;
+
+	o->idx = i;
+}
+
+/*
+ * remove the timeout at the given heap position
+ */
+void
+timo_rm(unsigned i)
+{
+	struct timo *o = timo_heap.ent[i];
+
+	o->set = 0;
+	heap_rm(&timo_heap, i);
+}
+
 /*
  * initialise a timeout structure, arguments are callback and argument
  * that will be passed to the callback
@@ -60,10 +110,6 @@ timo_set(struct timo *o, void (*cb)(void *), void *arg)
 void
 timo_add(struct timo *o, unsigned delta)
 {
-	struct timo **i;
-	unsigned val;
-	int diff;
-
 #ifdef TIMO_DEBUG
 	if (o->set) {
 		log_puts("timo_add: already set\n");
@@ -74,17 +120,14 @@ timo_add(struct timo *o, unsigned delta)
 		panic();
 	}
 #endif
-	val = timo_abstime + delta;
-	for (i = &timo_queue; *i != NULL; i = &(*i)->next) {
-		diff = (*i)->val - val;
-		if (diff > 0) {
-			break;
-		}
+	if (timo_heap.n == DEFAULT_MAXNTIMOS) {
+		log_puts("timo_add: too many timeouts\n");
+		panic();
 	}
 	o->set = 1;
-	o->val = val;
-	o->next = *i;
-	*i = o;
+	o->val = timo_abstime + delta;
+	o->seq = timo_seq++;
+	heap_put(&timo_heap, o);
 }
 
 /*
@@ -93,17 +136,30 @@ timo_add(struct timo *o, unsigned delta)
 void
 timo_del(struct timo *o)
 {
-	struct timo **i;
-
-	for (i = &timo_queue; *i != NULL; i = &(*i)->next) {
-		if (*i == o) {
-			*i = o->next;
-			o->set = 0;
-			return;
-		}
+	if (!o->set || o->idx >= timo_heap.n || timo_heap.ent[o->idx] != o) {
+		if (timo_debug)
+			log_puts("timo_del: not found\n");
+		return;
 	}
-	if (timo_debug)
-		log_puts("timo_del: not found\n");
+	timo_rm(o->idx);
+}
+
+/*
+ * store in 'rdelta' the time until the next timeout expires, and
+ * return 1, or return 0 if no timeout is scheduled
+ */
+unsigned
+timo_next(unsigned *rdelta)
+{
+	struct timo *o;
+	int diff;
+
+	if (timo_heap.n == 0)
+		return 0;
+	o = timo_heap.ent[0];
+	diff = o->val - timo_abstime;
+	*rdelta = diff > 0 ? diff : 0;
+	return 1;
 }
 
 /*
@@ -125,18 +181,12 @@ timo_update(unsigned delta)
 	/*
 	 * remove from the queue and run expired timeouts
 	 */
-	while (timo_queue != NULL) {
-		/*
-		 * there is no overflow here because + and - are
-		 * modulo 2^32, they are the same for both signed and
-		 * unsigned integers
-		 */
-		diff = timo_queue->val - timo_abstime;
+	while (timo_heap.n > 0) {
+		to = timo_heap.ent[0];
+		diff = to->val - timo_abstime;
 		if (diff > 0)
 			break;
-		to = timo_queue;
-		timo_queue = to->next;
-		to->set = 0;
+		timo_rm(0);
 		to->cb(to->arg);
 	}
 }
@@ -147,7 +197,9 @@ timo_update(unsigned delta)
 void
 timo_init(void)
 {
-	timo_queue = NULL;
+	heap_init(&timo_heap, xmalloc(DEFAULT_MAXNTIMOS * sizeof(void *),
+	    "timo"), timo_before, timo_moved);
+	timo_seq = 0;
 	timo_abstime = 0;
 }
 
@@ -157,9 +209,10 @@ timo_init(void)
 void
 timo_done(void)
 {
-	if (timo_queue != NULL) {
+	if (timo_heap.n != 0) {
 		log_puts("timo_done: timo_queue not empty!\n");
 		panic();
 	}
-	timo_queue = (struct timo *)0xdeadbeef;
+	xfree(timo_heap.ent);
+	timo_heap.ent = NULL;
 }
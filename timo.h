@@ -18,7 +18,8 @@
 #define MIDISH_TIMO_H
 
 struct timo {
-	struct timo *next;
+	unsigned idx;			/* position in the heap */
+	unsigned seq;			/* order of timo_add() calls */
 	unsigned val;			/* time to wait before the callback */
 	unsigned set;			/* true if the timeout is set */
 	void (*cb)(void *arg);		/* routine to call on expiration */
@@ -29,6 +30,7 @@ void timo_set(struct timo *, void (*)(void *), void *);
 void timo_add(struct timo *, unsigned);
 void timo_del(struct timo *);
 void timo_update(unsigned);
+unsigned timo_next(unsigned *);
 void timo_init(void);
 void timo_done(void);
 
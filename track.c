@@ -27,18 +27,34 @@
  *	- each clock tick marks the begining of a delta
  *	- each event (struct ev) is played after delta ticks
  *
+ * A track may also be mapped: its events are then read in place from
+ * records written by seqev_pack() (eg. in flash) and the list only
+ * contains the end-of-track event. Readers use trackiter_next() or
+ * seqptr_newro(); anything else copies the events into the list
+ * first, see track_unmap().
+ *
+ * The records of a mapped track are described by a pattern, played a
+ * given number of times. Patterns created by track_pack() are
+ * allocated, reference counted and shared by tracks with the same
+ * events, so a section repeated many times takes the memory of a
+ * single copy, and identical tracks take the memory of one.
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include "utils.h"
 #include "pool.h"
 #include "track.h"
+#include "work.h"
 
 struct pool seqev_pool;
+struct pool seqev_scratch;		/* events of temporary tracks */
+struct trackpat *trackpat_list;		/* patterns allocated by track_pack() */
 
 void
 seqev_pool_init(unsigned size)
 {
-	pool_init(&seqev_pool, "seqev", sizeof(struct seqev), size);
+	pool_initclass(&seqev_pool, "seqev", sizeof(struct seqev), size, MEM_BULK);
 }
 
 void
@@ -54,10 +70,130 @@ seqev_new(void)
 	return (struct seqev *)pool_new(&seqev_pool);
 }
 
+/*
+ * free an event, to the pool it was allocated from. Only threads of
+ * work_run() change the scratch arena concurrently, so the lock is
+ * taken in threaded builds only, and only while they run
+ */
 void
 seqev_del(struct seqev *se)
 {
-	pool_del(&seqev_pool, se);
+	struct poolslab *slab;
+	unsigned char *start;
+	struct pool *pool = &seqev_pool;
+
+#ifdef USE_THREADS
+	work_lock();
+#endif
+	if (seqev_scratch.used > 0) {
+		for (slab = seqev_scratch.slabs; slab != NULL; slab = slab->next) {
+			start = (unsigned char *)(slab + 1);
+			if ((unsigned char *)se >= start && (unsigned char *)se <
+			    start + slab->itemnum * seqev_scratch.itemsize) {
+				pool = &seqev_scratch;
+				break;
+			}
+		}
+	}
+#ifdef USE_THREADS
+	work_unlock();
+#endif
+	pool_del(pool, se);
+}
+
+/*
+ * the scratch arena holds the events of the temporary tracks used
+ * by editing functions, so they don't take entries of the song
+ * pool. It's separate from the song pool, so an edit doesn't fail
+ * because the song is nearly full
+ */
+void
+seqev_scratch_init(unsigned size)
+{
+	pool_initclass(&seqev_scratch, "scratch",
+	    sizeof(struct seqev), size, MEM_BULK);
+}
+
+void
+seqev_scratch_done(void)
+{
+	pool_done(&seqev_scratch);
+}
+
+/*
+ * allocate an event from the scratch arena, or from the song pool
+ * if it's full. The arena has no reserve, so it never makes the
+ * current command fail
+ */
+struct seqev *
+seqev_scratchnew(void)
+{
+	struct pool *save;
+	struct seqev *se;
+
+#ifdef USE_THREADS
+	work_lock();
+#endif
+	if (seqev_scratch.first != NULL) {
+		save = pool_short;
+		se = pool_new(&seqev_scratch);
+		pool_short = save;
+	} else
+		se = NULL;
+#ifdef USE_THREADS
+	work_unlock();
+#endif
+	return se != NULL ? se : seqev_new();
+}
+
+/*
+ * sort free events by address, so the events allocated next are
+ * consecutive in memory, see track_compact()
+ */
+void
+seqev_pool_sort(void)
+{
+	pool_sort(&seqev_pool);
+}
+
+int
+seqev_reloccmp(const void *a, const void *b)
+{
+	const struct seqev_reloc *ra = a, *rb = b;
+
+	if ((char *)ra->from < (char *)rb->from)
+		return -1;
+	return (char *)ra->from > (char *)rb->from;
+}
+
+/*
+ * sort the given table of moved events by old location
+ */
+void
+seqev_relocsort(struct seqev_reloc *map, unsigned n)
+{
+	qsort(map, n, sizeof(struct seqev_reloc), seqev_reloccmp);
+}
+
+/*
+ * return the new location of the given event, in the given table
+ * of moved events sorted by old location
+ */
+struct seqev *
+seqev_reloc(struct seqev_reloc *map, unsigned n, struct seqev *se)
+{
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if ((char *)map[mid].from < (char *)se)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo < n && map[lo].from == se) ? map[lo].to : se;
 }
 
 void
@@ -68,6 +204,100 @@ seqev_dump(struct seqev *i)
 	ev_log(&i->ev);
 }
 
+/*
+ * store a variable length number, 7 bits per byte, most significant
+ * first, with the high bit set on all bytes but the last one
+ */
+unsigned
+seqev_packnum(unsigned char *p, unsigned val)
+{
+	unsigned n, i;
+
+	for (n = 1; n < 5 && (val >> (7 * n)) != 0; n++)
+		; /* nothing */
+	for (i = n; i > 0; i--)
+		*p++ = ((val >> (7 * (i - 1))) & 0x7f) | (i > 1 ? 0x80 : 0);
+	return n;
+}
+
+/*
+ * read a number stored with seqev_packnum()
+ */
+unsigned
+seqev_unpacknum(unsigned char *p, unsigned *val)
+{
+	unsigned n, c;
+
+	*val = 0;
+	for (n = 0;;) {
+		c = p[n++];
+		*val = (*val << 7) | (c & 0x7f);
+		if (!(c & 0x80))
+			break;
+	}
+	return n;
+}
+
+/*
+ * store the given delta and event in the given buffer, which must
+ * be at least SEQEV_PACKMAX bytes long, and return the number of
+ * bytes used. Fields ignored by ev_eq() are not stored, and the
+ * most common MIDI events (delta < 128, 7-bit parameters) take 5
+ * bytes rather that the size of a 'struct seqev'
+ */
+unsigned
+seqev_pack(unsigned char *buf, unsigned delta, struct ev *ev)
+{
+	struct evinfo *ei = &evinfo[ev->cmd];
+	unsigned char *p = buf;
+
+	p += seqev_packnum(p, delta);
+	*p++ = ev->cmd;
+	if ((ei->flags & EV_HAS_DEV) && (ei->flags & EV_HAS_CH))
+		*p++ = (ev->dev << 4) | ev->ch;
+	else if (ei->flags & EV_HAS_DEV)
+		*p++ = ev->dev;
+	else if (ei->flags & EV_HAS_CH)
+		*p++ = ev->ch;
+	if (ei->nparams > 0)
+		p += seqev_packnum(p, ev->v0);
+	if (ei->nparams > 1)
+		p += seqev_packnum(p, ev->v1);
+	return p - buf;
+}
+
+/*
+ * read an event stored with seqev_pack() and return the
+ * number of bytes used
+ */
+unsigned
+seqev_unpack(unsigned char *buf, unsigned *delta, struct ev *ev)
+{
+	struct evinfo *ei;
+	unsigned char *p = buf;
+	unsigned v1;
+
+	p += seqev_unpacknum(p, delta);
+	ev->cmd = *p++;
+	ev->dev = ev->ch = 0;
+	ev->v0 = ev->v1 = 0;
+	ei = &evinfo[ev->cmd];
+	if ((ei->flags & EV_HAS_DEV) && (ei->flags & EV_HAS_CH)) {
+		ev->dev = *p >> 4;
+		ev->ch = *p++ & 0xf;
+	} else if (ei->flags & EV_HAS_DEV)
+		ev->dev = *p++;
+	else if (ei->flags & EV_HAS_CH)
+		ev->ch = *p++;
+	if (ei->nparams > 0)
+		p += seqev_unpacknum(p, &ev->v0);
+	if (ei->nparams > 1) {
+		p += seqev_unpacknum(p, &v1);
+		ev->v1 = v1;
+	}
+	return p - buf;
+}
+
 /*
  * initialise the track
  */
@@ -79,6 +309,40 @@ track_init(struct track *o)
 	o->eot.next = NULL;
 	o->eot.prev = &o->first;
 	o->first = &o->eot;
+	o->marks = NULL;
+	o->nmarks = 0;
+	o->idxtic = 0;
+	o->segs = NULL;
+	o->nsegs = 0;
+	o->nevs = 0;
+	o->undo = NULL;
+	o->rom = NULL;
+	o->pat = NULL;
+	o->scratch = 0;
+}
+
+/*
+ * initialize a temporary track, whose events are allocated from
+ * the scratch arena. If it's not in use, the arena is resized to
+ * hold the given number of events, unless pools are fixed
+ */
+void
+track_inittmp(struct track *o, unsigned nevs)
+{
+	track_init(o);
+	o->scratch = 1;
+	if (!pool_fixed && seqev_scratch.used == 0 &&
+	    seqev_scratch.itemnum < nevs)
+		pool_resize(&seqev_scratch, nevs);
+}
+
+/*
+ * allocate an event to be linked to the given track
+ */
+struct seqev *
+track_evnew(struct track *o)
+{
+	return o->scratch ? seqev_scratchnew() : seqev_new();
 }
 
 /*
@@ -89,6 +353,8 @@ track_done(struct track *o)
 {
 	struct seqev *i, *inext;
 
+	track_unpat(o);
+	track_outdate(o);
 	for (i = o->first;  i != &o->eot;  i = inext) {
 		inext = i->next;
 		seqev_del(i);
@@ -104,10 +370,12 @@ track_done(struct track *o)
 void
 track_dump(struct track *o)
 {
+	struct trackiter it;
 	struct seqev *i;
 	unsigned tic = 0, num = 0;
 
-	for (i = o->first; i != NULL; i = i->next) {
+	trackiter_init(&it, o);
+	while ((i = trackiter_next(&it)) != NULL) {
 		tic += i->delta;
 		log_putu(num);
 		log_puts("\t");
@@ -125,7 +393,12 @@ track_dump(struct track *o)
 unsigned
 track_isempty(struct track *o)
 {
-	return o->first->ev.cmd == EV_NULL && o->first->delta == 0;
+	struct trackiter it;
+	struct seqev *se;
+
+	trackiter_init(&it, o);
+	se = trackiter_next(&it);
+	return se->ev.cmd == EV_NULL && se->delta == 0;
 }
 
 /*
@@ -134,6 +407,8 @@ track_isempty(struct track *o)
 void
 track_chomp(struct track *o)
 {
+	track_outdate(o);
+	track_undodelta(o, &o->eot);
 	o->eot.delta = 0;
 }
 
@@ -143,6 +418,8 @@ track_chomp(struct track *o)
 void
 track_shift(struct track *o, unsigned ntics)
 {
+	track_outdate(o);
+	track_undodelta(o, o->first);
 	o->first->delta += ntics;
 }
 
@@ -151,9 +428,53 @@ track_shift(struct track *o, unsigned ntics)
  */
 void
 track_swap(struct track *t1, struct track *t2)
+{
+	struct track *t, old;
+	struct seqev *i, *se;
+
+	if (t2->undo) {
+		t = t1;
+		t1 = t2;
+		t2 = t;
+	}
+	if (t1->undo == NULL) {
+		track_swapevs(t1, t2);
+		return;
+	}
+	if (t2->undo) {
+		log_puts("track_swap: both tracks have undo journals\n");
+		panic();
+	}
+
+	/*
+	 * the journal keeps the events of t1, so give copies to t2
+	 */
+	track_init(&old);
+	for (i = t1->first; i != &t1->eot; i = i->next) {
+		se = seqev_new();
+		se->ev = i->ev;
+		old.eot.delta = i->delta;
+		seqev_ins(&old.eot, se);
+	}
+	old.eot.delta = t1->eot.delta;
+	track_clear(t1);
+	track_swapevs(t1, t2);
+	track_undofill(t1);
+	track_swapevs(t2, &old);
+	track_done(&old);
+}
+
+/*
+ * swap the lists of events of two tracks, ignoring undo journals
+ */
+void
+track_swapevs(struct track *t1, struct track *t2)
 {
 	struct seqev *se, eot;
 
+	track_outdate(t1);
+	track_outdate(t2);
+
 	/* swap list of events */
 	se = t1->first;
 	t1->first = t2->first;
@@ -171,6 +492,305 @@ track_swap(struct track *t1, struct track *t2)
 	*t2->eot.prev = &t2->eot;
 }
 
+/*
+ * discard the seek index, the tempo map and the statistics, must be
+ * called each time the track is modified. Mapped tracks are copied
+ * into the list first
+ */
+void
+track_outdate(struct track *o)
+{
+	unsigned i;
+
+	if (o->rom) {
+		track_unmap(o);
+		return;
+	}
+	o->nevs = 0;
+	if (o->segs != NULL) {
+		xfree(o->segs);
+		o->segs = NULL;
+		o->nsegs = 0;
+	}
+	if (o->marks == NULL)
+		return;
+	for (i = 0; i < o->nmarks; i++) {
+		statelist_empty(&o->marks[i].statelist);
+		statelist_done(&o->marks[i].statelist);
+	}
+	xfree(o->marks);
+	o->marks = NULL;
+	o->nmarks = 0;
+	o->idxtic = 0;
+}
+
+/*
+ * create a pattern for the given records, played 'nrep' times after
+ * 'offs' tics of silence. If 'size' is 0, the records are not copied
+ * and must stay valid until the pattern is freed. The pattern is
+ * freed when its last reference is dropped
+ */
+struct trackpat *
+trackpat_new(unsigned char *data, unsigned size,
+    unsigned nrep, unsigned offs)
+{
+	struct trackpat *p;
+
+	p = xmalloc(sizeof(struct trackpat) + size, "trackpat");
+	p->refs = 0;
+	p->size = size;
+	p->nrep = nrep;
+	p->offs = offs;
+	if (size > 0) {
+		p->data = (unsigned char *)(p + 1);
+		memcpy(p->data, data, size);
+		p->next = trackpat_list;
+		trackpat_list = p;
+	} else {
+		p->data = data;
+		p->next = NULL;
+	}
+	return p;
+}
+
+void
+trackpat_ref(struct trackpat *p)
+{
+	p->refs++;
+}
+
+void
+trackpat_unref(struct trackpat *p)
+{
+	struct trackpat **pp;
+
+	if (--p->refs > 0)
+		return;
+	if (p->size > 0) {
+		for (pp = &trackpat_list; *pp != p; pp = &(*pp)->next)
+			; /* nothing */
+		*pp = p->next;
+	}
+	xfree(p);
+}
+
+/*
+ * make the given track play the given pattern, its events are
+ * removed
+ */
+void
+track_setpat(struct track *o, struct trackpat *pat)
+{
+	track_clear(o);
+	trackpat_ref(pat);
+	o->pat = pat;
+	o->rom = pat->data;
+	track_undomap(o);
+}
+
+/*
+ * make the given track stop using its pattern, without copying its
+ * events. If a journal is recorded, it keeps the pattern, so the
+ * change can be undone
+ */
+void
+track_unpat(struct track *o)
+{
+	if (o->pat == NULL)
+		return;
+	if (!track_undounmap(o))
+		trackpat_unref(o->pat);
+	o->pat = NULL;
+	o->rom = NULL;
+}
+
+/*
+ * make the given empty track read its events from the given
+ * records, which must stay valid until the track is freed
+ * or unmapped
+ */
+void
+track_map(struct track *o, unsigned char *rom)
+{
+	track_setpat(o, trackpat_new(rom, 0, 1, 0));
+}
+
+/*
+ * copy the events of a mapped track into its list, so it can be
+ * modified. Seqptrs reading the track in place are not affected
+ */
+void
+track_unmap(struct track *o)
+{
+	struct trackiter it;
+	struct trackpat *pat;
+	struct seqev *i, *se;
+
+	if (o->rom == NULL)
+		return;
+	trackiter_init(&it, o);
+	pat = o->pat;
+	trackpat_ref(pat);
+	track_unpat(o);
+	track_outdate(o);
+	for (;;) {
+		i = trackiter_next(&it);
+		o->eot.delta += i->delta;
+		if (i->ev.cmd == EV_NULL)
+			break;
+		se = seqev_new();
+		se->ev = i->ev;
+		seqev_ins(&o->eot, se);
+	}
+	trackpat_unref(pat);
+}
+
+/*
+ * return true if the events of the given track are the repetition
+ * of its first 'n' events, in which case, store in 'rgap' the delta of
+ * the first event of each repetition but the first one
+ */
+unsigned
+track_isrep(struct track *o, unsigned n, unsigned *rgap)
+{
+	struct seqev *a, *b;
+	unsigned i, gap;
+
+	b = o->first;
+	for (i = 0; i < n; i++)
+		b = b->next;
+	gap = b->delta;
+	for (a = o->first, i = 0; b != &o->eot; a = a->next, b = b->next) {
+		if (!ev_eq(&a->ev, &b->ev))
+			return 0;
+		if (b->delta != ((i == 0) ? gap : a->delta))
+			return 0;
+		if (++i == n)
+			i = 0;
+	}
+	*rgap = gap;
+	return 1;
+}
+
+/*
+ * store the events of the track as packed records and play them
+ * in place. If the track is made of a section repeated several
+ * times, the section is stored once. If another track has the same
+ * events, its pattern is used. Modifying the track copies its
+ * events back into the list, see track_unmap()
+ */
+void
+track_pack(struct track *o)
+{
+	unsigned char buf[SEQEV_PACKMAX], *data, *p;
+	struct trackpat *pat;
+	struct seqev *se;
+	unsigned nev, n, gap, first, offs, size, i;
+
+	track_unmap(o);
+	nev = 0;
+	for (se = o->first; se != &o->eot; se = se->next)
+		nev++;
+	if (nev == 0)
+		return;
+
+	/*
+	 * find the shortest section the track is the repetition of:
+	 * the delta of its first event is split in the silence before
+	 * the first repetition and the silence before each next one
+	 */
+	for (n = 1; n < nev; n++) {
+		if (nev % n != 0 || !track_isrep(o, n, &gap))
+			continue;
+		if (gap < o->eot.delta || gap - o->eot.delta > o->first->delta)
+			continue;
+		break;
+	}
+	if (n == nev) {
+		first = o->first->delta;
+		offs = 0;
+	} else {
+		first = gap - o->eot.delta;
+		offs = o->first->delta - first;
+	}
+
+	size = 0;
+	se = o->first;
+	for (i = 0; i < n; i++) {
+		size += seqev_pack(buf, i == 0 ? first : se->delta, &se->ev);
+		se = se->next;
+	}
+	size += seqev_pack(buf, o->eot.delta, &o->eot.ev);
+	data = xmalloc(size, "trackpack");
+	p = data;
+	se = o->first;
+	for (i = 0; i < n; i++) {
+		p += seqev_pack(p, i == 0 ? first : se->delta, &se->ev);
+		se = se->next;
+	}
+	seqev_pack(p, o->eot.delta, &o->eot.ev);
+
+	for (pat = trackpat_list; pat != NULL; pat = pat->next) {
+		if (pat->size == size && pat->nrep == nev / n &&
+		    pat->offs == offs && memcmp(pat->data, data, size) == 0)
+			break;
+	}
+	if (pat == NULL)
+		pat = trackpat_new(data, size, nev / n, offs);
+	xfree(data);
+	track_setpat(o, pat);
+}
+
+void
+trackiter_init(struct trackiter *it, struct track *o)
+{
+	it->rom = o->rom;
+	it->pos = o->rom ? NULL : o->first;
+	it->pat = o->pat;
+	if (o->pat) {
+		it->rep = o->pat->nrep - 1;
+		it->delta = o->pat->offs;
+	}
+}
+
+/*
+ * return the next event of the track, the end-of-track included,
+ * or NULL if there are no more events. Events of mapped tracks are
+ * unpacked in the iterator, so they can't be modified
+ */
+struct seqev *
+trackiter_next(struct trackiter *it)
+{
+	struct seqev *se;
+
+	if (it->rom) {
+		for (;;) {
+			it->rom += seqev_unpack(it->rom,
+			    &it->se.delta, &it->se.ev);
+			it->se.delta += it->delta;
+			it->delta = 0;
+			if (it->se.ev.cmd != EV_NULL)
+				break;
+			if (it->rep == 0) {
+				it->rom = NULL;
+				break;
+			}
+
+			/*
+			 * end of the pattern, play it again
+			 */
+			it->rep--;
+			it->delta = it->se.delta;
+			it->rom = it->pat->data;
+		}
+		return &it->se;
+	}
+	se = it->pos;
+	if (se != NULL)
+		it->pos = se->next;
+	return se;
+}
+
 /*
  * return true if an event is available on the track
  */
@@ -180,6 +800,24 @@ seqev_avail(struct seqev *pos)
 	return (pos->ev.cmd != EV_NULL);
 }
 
+/*
+ * append a copy of the given event at the end of the track, after
+ * its trailing blank space, which is extended by adding to the
+ * delta of the eot. This is how tracks are built from files: no
+ * state is tracked, so if events may be out of order or frames
+ * not terminated, the caller calls track_check() once the track
+ * is complete
+ */
+void
+track_append(struct track *o, struct ev *ev)
+{
+	struct seqev *se;
+
+	se = seqev_new();
+	se->ev = *ev;
+	seqev_ins(&o->eot, se);
+}
+
 /*
  * insert an event (stored in an already allocated seqev structure)
  * just before the event of the given position (the delta field of the
@@ -217,17 +855,100 @@ seqev_rm(struct seqev *pos)
 }
 
 /*
- * return the number of events in the track
+ * count the events and the tics of the track in a single pass; the
+ * result is kept until the track is outdated
+ */
+void
+track_mkstat(struct track *o)
+{
+	struct trackiter it;
+	struct seqev *i;
+	unsigned cmd;
+
+	o->nevs = 0;
+	o->ntics = 0;
+	for (cmd = 0; cmd < EV_NUMCMD; cmd++)
+		o->evcnt[cmd] = 0;
+	trackiter_init(&it, o);
+	while ((i = trackiter_next(&it)) != NULL) {
+		o->nevs++;
+		o->ntics += i->delta;
+		if (i->ev.cmd < EV_NUMCMD)
+			o->evcnt[i->ev.cmd]++;
+	}
+}
+
+/*
+ * return the number of events in the track (eot included)
  */
 unsigned
 track_numev(struct track *o)
 {
-	unsigned n;
-	struct seqev *i;
+	if (o->nevs == 0)
+		track_mkstat(o);
+	return o->nevs;
+}
+
+/*
+ * return the memory used by the track: its events, or its share of
+ * the pattern it's mapped to, and its indexes
+ */
+unsigned long
+track_memsize(struct track *o)
+{
+	unsigned long size;
+
+	if (o->pat)
+		size = o->pat->size / o->pat->refs;
+	else if (o->rom)
+		size = 0;
+	else
+		size = (track_numev(o) - 1) * sizeof(struct seqev);
+	if (o->marks)
+		size += o->maxmarks * sizeof(struct trackmark);
+	if (o->segs)
+		size += o->nsegs * sizeof(struct trackseg);
+	return size;
+}
 
-	n = 0;
-	for (i = o->first; i != NULL; i = i->next)
-		n++;
+/*
+ * move the events of the track to new pool entries allocated in
+ * time order, so reading the track accesses memory sequentially;
+ * if the free list is sorted (see seqev_pool_sort()), they are
+ * consecutive. The old entries are freed in decreasing address order,
+ * so the next track may reuse them in increasing order. Store the
+ * old and new location of each event in 'map', sorted by old
+ * location, and return the number of events moved. Pointers to
+ * the events of the track other than the list itself are not updated.
+ * Mapped tracks are left as is, as are tracks that would take the
+ * reserve of fixed pools
+ */
+unsigned
+track_compact(struct track *o, struct seqev_reloc *map)
+{
+	struct seqev *se, *ne;
+	unsigned n, i;
+
+	if (o->rom)
+		return 0;
+	n = track_numev(o) - 1;
+	if (pool_fixed && seqev_pool.itemnum - seqev_pool.used <
+	    n + seqev_pool.itemnum / POOL_RESERVE)
+		return 0;
+	track_outdate(o);
+	i = 0;
+	for (se = o->first; se != &o->eot; se = ne->next) {
+		ne = seqev_new();
+		*ne = *se;
+		*ne->prev = ne;
+		ne->next->prev = &ne->next;
+		map[i].from = se;
+		map[i].to = ne;
+		i++;
+	}
+	seqev_relocsort(map, n);
+	while (i > 0)
+		seqev_del(map[--i].from);
 	return n;
 }
 
@@ -238,13 +959,9 @@ track_numev(struct track *o)
 unsigned
 track_numtic(struct track *o)
 {
-	unsigned ntics;
-	struct seqev *i;
-
-	ntics = 0;
-	for(i = o->first; i != NULL; i = i->next)
-		ntics += i->delta;
-	return ntics;
+	if (o->nevs == 0)
+		track_mkstat(o);
+	return o->ntics;
 }
 
 
@@ -256,6 +973,10 @@ track_clear(struct track *o)
 {
 	struct seqev *i, *inext;
 
+	track_unpat(o);
+	track_outdate(o);
+	if (track_undoclear(o))
+		return;
 	for (i = o->first;  i != &o->eot;  i = inext) {
 		inext = i->next;
 		seqev_del(i);
@@ -274,8 +995,10 @@ track_setchan(struct track *src, unsigned dev, unsigned ch)
 {
 	struct seqev *i;
 
+	track_outdate(src);
 	for (i = src->first; i != NULL; i = i->next) {
 		if (EV_ISVOICE(&i->ev)) {
+			track_undoev(src, i);
 			i->ev.dev = dev;
 			i->ev.ch = ch;
 		}
@@ -288,6 +1011,7 @@ track_setchan(struct track *src, unsigned dev, unsigned ch)
 void
 track_chanmap(struct track *o, char *map)
 {
+	struct trackiter it;
 	struct seqev *se;
 	unsigned dev, ch, i;
 
@@ -295,7 +1019,8 @@ track_chanmap(struct track *o, char *map)
 		map[i] = 0;
 	}
 
-	for (se = o->first; se != NULL; se = se->next) {
+	trackiter_init(&it, o);
+	while ((se = trackiter_next(&it)) != NULL) {
 		if (EV_ISVOICE(&se->ev)) {
 			dev = se->ev.dev;
 			ch  = se->ev.ch;
@@ -314,12 +1039,9 @@ track_chanmap(struct track *o, char *map)
 unsigned
 track_evcnt(struct track *o, unsigned cmd)
 {
-	struct seqev *se;
-	unsigned cnt = 0;
-
-	for (se = o->first; se != NULL; se = se->next) {
-		if (se->ev.cmd == cmd)
-			cnt++;
-	}
-	return cnt;
+	if (cmd >= EV_NUMCMD)
+		return 0;
+	if (o->nevs == 0)
+		track_mkstat(o);
+	return o->evcnt[cmd];
 }
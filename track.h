@@ -18,6 +18,7 @@
 #define MIDISH_TRACK_H
 
 #include "ev.h"
+#include "state.h"
 
 struct seqev {
 	unsigned delta;
@@ -25,46 +26,193 @@ struct seqev {
 	struct seqev *next, **prev;
 };
 
+/*
+ * new location of an event moved by track_compact()
+ */
+struct seqev_reloc {
+	struct seqev *from, *to;
+};
+
+/*
+ * position saved in the seek index of a track, see track_mkidx()
+ */
+struct trackmark {
+	struct seqev *pos;		/* next event */
+	unsigned char *rom;		/* next record, if track is mapped */
+	unsigned romrep;		/* repetitions left, if mapped */
+	unsigned romdelta;		/* delta of the record, if mapped */
+	unsigned delta;			/* tics elapsed since previous event */
+	unsigned tic;			/* absolute tic of the position */
+	struct statelist statelist;	/* state of the track at 'tic' */
+};
+
+/*
+ * number of events between marks of the seek index
+ */
+#define TRACK_MARKEVS	1024
+
+/*
+ * range of measures of a meta track with the same time signature
+ * and the same tempo at the beginning of each measure, see
+ * track_mktmap()
+ */
+struct trackseg {
+	unsigned meas;			/* first measure of the range */
+	unsigned tic;			/* absolute tic of 'meas' */
+	unsigned bpm, tpb;		/* time signature */
+	unsigned long usec24;		/* tempo */
+};
+
+/*
+ * change made to a track, recorded in the undo journal
+ */
+struct track_op {
+#define TRACK_OPINS	0		/* 'se' was inserted */
+#define TRACK_OPRM	1		/* 'se' was removed from before 'at' */
+#define TRACK_OPDELTA	2		/* se->delta was 'delta' */
+#define TRACK_OPEV	3		/* se->ev was 'ev' */
+#define TRACK_OPCLEAR	4		/* events 'se' to 'at' were removed */
+#define TRACK_OPFILL	5		/* events were added to empty track */
+#define TRACK_OPMAP	6		/* track was mapped to 'pat' */
+#define TRACK_OPUNMAP	7		/* track stopped using 'pat' */
+	unsigned type;
+	unsigned delta;			/* previous delta of 'se' or eot */
+	struct seqev *se, *at;
+	struct ev ev;
+	struct trackpat *pat;		/* pattern, referenced if OPUNMAP */
+};
+
+/*
+ * undo journal of a track, changes are in chronological order.
+ * Removed events are kept by the journal until it's freed
+ */
+struct track_data {
+	struct track_op *ops;
+	unsigned nops, maxops;
+	unsigned nevs;			/* number of events kept */
+};
+
+/*
+ * packed records shared by mapped tracks, see track_pack()
+ */
+struct trackpat {
+	struct trackpat *next;		/* list of allocated patterns */
+	unsigned refs;			/* tracks, seqptrs, journals using it */
+	unsigned size;			/* bytes in 'data', 0 if not owned */
+	unsigned nrep;			/* times the records are played */
+	unsigned offs;			/* tics before the first time */
+	unsigned char *data;		/* records, end-of-track included */
+};
+
 struct track {
 	struct seqev eot;		/* end-of-track event */
 	struct seqev *first;		/* head of the event list */
+	struct trackmark *marks;	/* seek index, NULL if outdated */
+	unsigned nmarks;		/* number of marks in the index */
+	unsigned maxmarks;		/* size of the 'marks' array */
+	unsigned idxtic;		/* index built up to this tic */
+	struct trackseg *segs;		/* tempo map, NULL if outdated */
+	unsigned nsegs;			/* number of ranges in the map */
+	unsigned nevs;			/* number of events, 0 if outdated */
+	unsigned ntics;			/* length, eot included */
+	unsigned evcnt[EV_NUMCMD];	/* number of events of each type */
+	struct track_data *undo;	/* journal being recorded or NULL */
+	unsigned char *rom;		/* packed events, see track_map() */
+	struct trackpat *pat;		/* pattern of 'rom', if mapped */
+	unsigned scratch;		/* temporary, see track_inittmp() */
 };
 
-struct track_data {
-	struct seqev_data {
-		unsigned delta;
-		struct ev ev;
-	} *evs;
-	unsigned int pos, nrm, nins;
+/*
+ * iterator over the events of a track, mapped or not, see
+ * trackiter_next()
+ */
+struct trackiter {
+	unsigned char *rom;		/* next record, if mapped */
+	struct trackpat *pat;		/* pattern being read, if any */
+	unsigned rep;			/* repetitions left */
+	unsigned delta;			/* to add to the next record */
+	struct seqev *pos;		/* next event, if not mapped */
+	struct seqev se;		/* unpacked record */
 };
 
+/*
+ * number of journal entries to look back for a change of the
+ * same delta
+ */
+#define TRACK_UNDOLOOK	8
+
+/*
+ * max size of a packed event
+ */
+#define SEQEV_PACKMAX	17
+
 void	      seqev_pool_init(unsigned);
 void	      seqev_pool_done(void);
 struct seqev *seqev_new(void);
 void	      seqev_del(struct seqev *);
+void	      seqev_scratch_init(unsigned);
+void	      seqev_scratch_done(void);
+struct seqev *seqev_scratchnew(void);
 void	      seqev_dump(struct seqev *);
+void	      seqev_pool_sort(void);
+void	      seqev_relocsort(struct seqev_reloc *, unsigned);
+struct seqev *seqev_reloc(struct seqev_reloc *, unsigned, struct seqev *);
+unsigned      seqev_packnum(unsigned char *, unsigned);
+unsigned      seqev_unpacknum(unsigned char *, unsigned *);
+unsigned      seqev_pack(unsigned char *, unsigned, struct ev *);
+unsigned      seqev_unpack(unsigned char *, unsigned *, struct ev *);
 
 void	      track_init(struct track *);
+void	      track_inittmp(struct track *, unsigned);
+struct seqev *track_evnew(struct track *);
 void	      track_done(struct track *);
 void	      track_dump(struct track *);
+void	      track_mkstat(struct track *);
 unsigned      track_numev(struct track *);
+unsigned long track_memsize(struct track *);
+unsigned      track_compact(struct track *, struct seqev_reloc *);
 unsigned      track_numtic(struct track *);
 void	      track_clear(struct track *);
 unsigned      track_isempty(struct track *);
 void	      track_chomp(struct track *);
 void	      track_shift(struct track *, unsigned);
 void	      track_swap(struct track *, struct track *);
+void	      track_swapevs(struct track *, struct track *);
+void	      track_outdate(struct track *);
+void	      track_map(struct track *, unsigned char *);
+void	      track_unmap(struct track *);
+void	      track_setpat(struct track *, struct trackpat *);
+void	      track_unpat(struct track *);
+unsigned      track_isrep(struct track *, unsigned, unsigned *);
+void	      track_pack(struct track *);
+struct trackpat *trackpat_new(unsigned char *, unsigned, unsigned, unsigned);
+void	      trackpat_ref(struct trackpat *);
+void	      trackpat_unref(struct trackpat *);
+void	      trackiter_init(struct trackiter *, struct track *);
+struct seqev *trackiter_next(struct trackiter *);
 
 unsigned      seqev_avail(struct seqev *);
 void	      seqev_ins(struct seqev *, struct seqev *);
+void	      track_append(struct track *, struct ev *);
 void	      seqev_rm(struct seqev *);
 
 void	      track_setchan(struct track *, unsigned, unsigned);
 void	      track_chanmap(struct track *, char *);
 unsigned      track_evcnt(struct track *, unsigned);
 
-unsigned track_undosave(struct track *, struct track_data *);
-unsigned track_undodiff(struct track *, struct track_data *);
+void track_undoins(struct track *, struct seqev *);
+unsigned track_undorm(struct track *, struct seqev *);
+struct seqev *track_undomove(struct track *, struct seqev *, struct track *);
+struct seqev *track_undoreuse(struct track *, struct seqev *, struct ev *);
+void track_undodelta(struct track *, struct seqev *);
+void track_undoev(struct track *, struct seqev *);
+unsigned track_undoclear(struct track *);
+void track_undofill(struct track *);
+void track_undomap(struct track *);
+unsigned track_undounmap(struct track *);
+void track_undotrim(struct track *);
+unsigned track_undosize(struct track_data *);
 void track_undorestore(struct track *, struct track_data *);
+void track_undofree(struct track_data *);
 
 #endif /* MIDISH_TRACK_H */
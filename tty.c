@@ -59,6 +59,11 @@
 #define EL_PROMPTMAX	64
 #define EL_HISTMAX	200
 
+/*
+ * max terminal width we keep track of, wider lines are redrawn
+ */
+#define TTY_LINEMAX	256
+
 struct textline {
 	struct textline *next, *prev;
 	char text[1];
@@ -81,6 +86,8 @@ int tty_nescpar;				/* number of params found */
 int tty_escval;					/* temp var to parse params */
 int tty_twidth;					/* terminal width */
 int tty_tcursx;					/* terminal cursor x pos */
+char tty_tline[TTY_LINEMAX];			/* what's on the terminal */
+int tty_tvalid;					/* tty_tline is up to date */
 
 char tty_obuf[1024];				/* output buffer */
 int tty_oused;					/* bytes used in tty_obuf */
@@ -470,14 +477,16 @@ el_setmode(int mode)
 	}
 }
 
+/*
+ * draw the prompt and the whole line; only what differs from the
+ * terminal is written
+ */
 void
 el_draw(void *arg)
 {
-	tty_tclear();
 	if (el_pos > 0)
 		tty_tputs(0, el_pos, el_getprompt(), el_pos);
 	el_refresh(el_offs, el_offs + el_width);
-	tty_tflush();
 }
 
 void
@@ -660,6 +669,7 @@ el_onkey(void *arg, int key)
 			el_setmode(EL_MODE_EDIT);
 		}
 	} else if (key == (TTY_KEY_CTRL | 'L')) {
+		tty_tinval();
 		el_resize(NULL, tty_twidth);
 	} else if (key == (TTY_KEY_CTRL | 'G')) {
 		if (el_mode != EL_MODE_EDIT)
@@ -724,6 +734,7 @@ el_setprompt(char *str)
 	memcpy(el_prompt, str, len);
 	el_prompt[len] = 0;
 	el_resize(NULL, tty_twidth);
+	tty_tflush();
 }
 
 void
@@ -1029,6 +1040,7 @@ tty_int(void)
 {
 	tty_tclear();
 	tty_ops->draw(tty_arg);
+	tty_tflush();
 }
 
 void
@@ -1094,30 +1106,100 @@ tty_tesc1(int cmd, int par0)
 	tty_toutput(buf, len);
 }
 
+/*
+ * forget what's on the terminal, so the next tty_tputs() calls
+ * redraw the whole line
+ */
+void
+tty_tinval(void)
+{
+	tty_tvalid = 0;
+}
+
+/*
+ * move the cursor using the shortest sequence: carriage return,
+ * relative moves, or when moving right by few chars, rewriting
+ * the chars already on the terminal
+ */
 void
 tty_tsetcurs(int x)
 {
+	char buf[32];
+	int n;
+
+	if (x == tty_tcursx)
+		return;
 	if (x < tty_tcursx) {
-		tty_toutput("\r", 1);
-		tty_tcursx = 0;
-	}
-	if (x > tty_tcursx)
+		if (x == 0) {
+			tty_toutput("\r", 1);
+		} else {
+			n = snprintf(buf, sizeof(buf), "\x1b[%uD", tty_tcursx - x);
+			if (n <= 1 + snprintf(buf, sizeof(buf), "\x1b[%uC", x))
+				tty_tesc1('D', tty_tcursx - x);
+			else {
+				tty_toutput("\r", 1);
+				tty_tesc1('C', x);
+			}
+		}
+	} else if (tty_tvalid && x - tty_tcursx <= 3 && x <= TTY_LINEMAX)
+		tty_toutput(tty_tline + tty_tcursx, x - tty_tcursx);
+	else
 		tty_tesc1('C', x - tty_tcursx);
 	tty_tcursx = x;
 }
 
+/*
+ * display the given text at the given position and blank the rest
+ * of the given width. Only the span that differs from what's on the
+ * terminal is written
+ */
 void
 tty_tputs(int x, int w, char *buf, int len)
 {
-	tty_tsetcurs(x);
-	if (len > 0) {
-		if (len > w)
-			len = w;
-		tty_toutput(buf, len);
-		tty_tcursx += len;
+	int a, b, e, i;
+
+	if (len > w)
+		len = w;
+	if (x + w > TTY_LINEMAX) {
+		tty_tsetcurs(x);
+		if (len > 0) {
+			tty_toutput(buf, len);
+			tty_tcursx += len;
+		}
+		if (len < w)
+			tty_tesc1('X', w - len);
+		tty_tvalid = 0;
+		return;
+	}
+	if (!tty_tvalid)
+		tty_tclear();
+
+	/*
+	 * find the first and the last chars that differ
+	 */
+	for (a = x; a < x + w; a++) {
+		if (tty_tline[a] != (a - x < len ? buf[a - x] : ' '))
+			break;
+	}
+	if (a == x + w)
+		return;
+	for (b = x + w; b > a; b--) {
+		if (tty_tline[b - 1] != (b - 1 - x < len ? buf[b - 1 - x] : ' '))
+			break;
+	}
+	e = b < x + len ? b : x + len;
+	if (a < e) {
+		tty_tsetcurs(a);
+		tty_toutput(buf + a - x, e - a);
+		memcpy(tty_tline + a, buf + a - x, e - a);
+		tty_tcursx = e;
+	}
+	if (b > x + len) {
+		i = a > x + len ? a : x + len;
+		tty_tsetcurs(i);
+		tty_tesc1('X', b - i);
+		memset(tty_tline + i, ' ', b - i);
 	}
-	if (len < w)
-		tty_tesc1('X', w - len);
 }
 
 void
@@ -1125,6 +1207,8 @@ tty_tendl(void)
 {
 	tty_toutput("\n\r", 2);
 	tty_tcursx = 0;
+	memset(tty_tline, ' ', TTY_LINEMAX);
+	tty_tvalid = 1;
 }
 
 void
@@ -1132,6 +1216,8 @@ tty_tclear(void)
 {
 	tty_toutput("\r\x1b[K", 4);
 	tty_tcursx = 0;
+	memset(tty_tline, ' ', TTY_LINEMAX);
+	tty_tvalid = 1;
 }
 
 int
@@ -1174,8 +1260,13 @@ tty_write(void *buf, size_t len)
 		write(STDERR_FILENO, buf, len);
 		return;
 	}
+	/*
+	 * the text may not end with a new line, so the edit line is
+	 * redrawn from scratch after it; all is sent with a single write
+	 */
 	tty_tclear();
-	tty_tflush();
-	write(STDOUT_FILENO, buf, len);
+	tty_toutput(buf, len);
+	tty_tinval();
 	tty_ops->draw(tty_arg);
+	tty_tflush();
 }
@@ -67,6 +67,7 @@ void tty_reset(void);
 void tty_write(void *, size_t);
 
 void tty_tflush(void);
+void tty_tinval(void);
 void tty_toutput(char *, int);
 void tty_tsetcurs(int);
 void tty_tputs(int, int, char *, int);
@@ -14,6 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <string.h>
 #include "utils.h"
 #include "mididev.h"
 #include "mux.h"
@@ -45,7 +46,6 @@ undo_new(struct song *s, int type, char *func, char *name)
 void
 undo_pop(struct song *s)
 {
-	struct songtrk *t;
 	struct undo_fdel_trk *p;
 	struct sysex *x;
 	struct undo *u;
@@ -71,13 +71,16 @@ undo_pop(struct song *s)
 		case UNDO_EMPTY:
 			break;
 		case UNDO_STR:
-			str_delete(*u->u.ren.ptr);
-			*u->u.ren.ptr = u->u.ren.val;
+			name_rename(u->u.ren.name, u->u.ren.val);
+			str_release(u->u.ren.val);
 			break;
 		case UNDO_UINT:
 			*u->u.uint.ptr = u->u.uint.val;
 			break;
 		case UNDO_TRACK:
+			if (u->u.track.spill)
+				undo_unspill(s, u);
+			u->u.track.track->undo = NULL;
 			track_undorestore(u->u.track.track, &u->u.track.data);
 			break;
 		case UNDO_TDEL:
@@ -137,12 +140,7 @@ undo_pop(struct song *s)
 			song_sxdel(s, u->u.xdel.sx);
 			break;
 		case UNDO_SCALE:
-			track_scale(&s->meta,
-			    u->u.scale.newunit, u->u.scale.oldunit);
-			SONG_FOREACH_TRK(s, t) {
-				track_scale(&t->track,
-				    u->u.scale.newunit, u->u.scale.oldunit);
-			}
+			song_scale(s, u->u.scale.newunit, u->u.scale.oldunit);
 			break;
 		default:
 			log_puts("undo_pop: bad type\n");
@@ -170,12 +168,15 @@ undo_clear(struct song *s, struct undo **pos)
 		case UNDO_EMPTY:
 			break;
 		case UNDO_STR:
-			str_delete(u->u.ren.val);
+			str_release(u->u.ren.val);
 			break;
 		case UNDO_UINT:
 			break;
 		case UNDO_TRACK:
-			xfree(u->u.track.data.evs);
+			if (u->u.track.spill)
+				undo_spillfree(u->u.track.spill);
+			else
+				track_undofree(&u->u.track.data);
 			break;
 		case UNDO_TDEL:
 			track_done(&u->u.tdel.trk->track);
@@ -235,8 +236,6 @@ undo_clear(struct song *s, struct undo **pos)
 void
 undo_push(struct song *s, struct undo *u)
 {
-	struct undo **pu;
-	size_t size;
 
 	u->next = s->undo;
 	s->undo = u;
@@ -248,10 +247,19 @@ undo_push(struct song *s, struct undo *u)
 	log_puti(s->undo_size);
 	log_puts("\n");
 #endif
+	undo_shrink(s);
+}
 
-	/*
-	 * free old entries exceeding memory usage limit
-	 */
+/*
+ * free old entries exceeding memory usage limit
+ */
+void
+undo_shrink(struct song *s)
+{
+	struct undo **pu, *u;
+	size_t size;
+
+	undo_spillold(s);
 	size = 0;
 	pu = &s->undo;
 	while (1) {
@@ -259,7 +267,7 @@ undo_push(struct song *s, struct undo *u)
 		if (u == NULL)
 			return;
 		size += u->size;
-		if (size > UNDO_MAXSIZE)
+		if (size > undo_maxsize)
 			break;
 		pu = &u->next;
 	}
@@ -267,6 +275,42 @@ undo_push(struct song *s, struct undo *u)
 	undo_clear(s, pu);
 }
 
+/*
+ * update the events referenced by the undo entries, after they are
+ * moved by track_compact(); only track entries have journals
+ */
+void
+undo_reloc(struct song *s, struct seqev_reloc *map, unsigned n)
+{
+	struct track_data *data;
+	struct track_op *op;
+	struct undo_spill *sp;
+	struct undo *u;
+	unsigned i;
+
+	for (u = s->undo; u != NULL; u = u->next) {
+		if (u->type != UNDO_TRACK)
+			continue;
+		sp = u->u.track.spill;
+		if (sp != NULL) {
+			for (i = 0; i < sp->nrefs; i++) {
+				if (sp->refs[i].se != NULL)
+					sp->refs[i].se = seqev_reloc(map,
+					    n, sp->refs[i].se);
+			}
+			continue;
+		}
+		data = &u->u.track.data;
+		for (i = 0; i < data->nops; i++) {
+			op = &data->ops[i];
+			if (op->se)
+				op->se = seqev_reloc(map, n, op->se);
+			if (op->type == TRACK_OPRM || op->type == TRACK_OPCLEAR)
+				op->at = seqev_reloc(map, n, op->at);
+		}
+	}
+}
+
 void
 undo_start(struct song *s, char *func, char *tag)
 {
@@ -277,14 +321,14 @@ undo_start(struct song *s, char *func, char *tag)
 }
 
 void
-undo_setstr(struct song *s, char *func, char **ptr, char *val)
+undo_setname(struct song *s, char *func, struct name *name, char *val)
 {
 	struct undo *u;
 
-	u = undo_new(s, UNDO_STR, func, *ptr);
-	u->u.ren.ptr = ptr;
-	u->u.ren.val = *ptr;
-	*ptr = str_new(val);
+	u = undo_new(s, UNDO_STR, func, name->str);
+	u->u.ren.name = name;
+	u->u.ren.val = str_intern(name->str);
+	name_rename(name, val);
 	undo_push(s, u);
 }
 
@@ -306,153 +350,814 @@ undo_scale(struct song *s, char *func, char *tag,
 	unsigned int oldunit, unsigned int newunit)
 {
 	struct undo *u;
-	struct songtrk *t;
 
 	u = undo_new(s, UNDO_SCALE, func, tag);
 	u->u.scale.oldunit = oldunit;
 	u->u.scale.newunit = newunit;
+	song_scale(s, oldunit, newunit);
+	undo_push(s, u);
+}
 
-	track_scale(&s->meta, oldunit, newunit);
-	SONG_FOREACH_TRK(s, t) {
-		track_scale(&t->track, oldunit, newunit);
+/*
+ * return a new entry at the end of the journal of the given track
+ */
+struct track_op *
+track_undoop(struct track *t, unsigned type, struct seqev *se)
+{
+	struct track_data *u = t->undo;
+	struct track_op *ops;
+
+	if (u->nops == u->maxops) {
+		u->maxops = u->maxops ? 2 * u->maxops : 16;
+		ops = xmalloc_class(u->maxops * sizeof(struct track_op),
+		    "track_op", MEM_BULK);
+		if (u->ops) {
+			memcpy(ops, u->ops, u->nops * sizeof(struct track_op));
+			xfree(u->ops);
+		}
+		u->ops = ops;
 	}
+	ops = &u->ops[u->nops++];
+	ops->type = type;
+	ops->se = se;
+	return ops;
+}
 
-	undo_push(s, u);
+/*
+ * record that the given event was just linked to the track
+ */
+void
+track_undoins(struct track *t, struct seqev *se)
+{
+	if (t->undo == NULL)
+		return;
+	track_undoop(t, TRACK_OPINS, se);
 }
 
+/*
+ * record that the given event was just unlinked from the track. Its
+ * 'next' and 'delta' fields must be unchanged. If the journal keeps
+ * the event, 1 is returned, else the caller must free it.
+ */
 unsigned
-track_undosave(struct track *t, struct track_data *u)
+track_undorm(struct track *t, struct seqev *se)
+{
+	struct track_op *op;
+
+	if (t->undo == NULL)
+		return 0;
+	op = track_undoop(t, TRACK_OPRM, se);
+	op->at = se->next;
+	op->delta = se->delta;
+	t->undo->nevs++;
+	return 1;
+}
+
+/*
+ * remove the given event from the track as seqev_rm() does, and
+ * return the event to use in place of it in the 'dst' track. If the
+ * journal keeps the event, a copy is returned
+ */
+struct seqev *
+track_undomove(struct track *t, struct seqev *se, struct track *dst)
+{
+	struct seqev *copy;
+	unsigned delta;
+
+	if (t->undo == NULL) {
+		seqev_rm(se);
+		return se;
+	}
+	copy = track_evnew(dst);
+	copy->ev = se->ev;
+	copy->delta = 0;
+	track_undodelta(t, se->next);
+	delta = se->delta;
+	seqev_rm(se);
+	se->delta = delta;
+	track_undorm(t, se);
+	return copy;
+}
+
+/*
+ * if the last change is the removal of an event equal to the given
+ * one from the given position, cancel the removal and return the
+ * event, so the caller can link it back rather than allocating a new
+ * one. This makes rewriting unchanged events free
+ */
+struct seqev *
+track_undoreuse(struct track *t, struct seqev *pos, struct ev *ev)
+{
+	struct track_data *u = t->undo;
+	struct track_op *op;
+	struct seqev *se;
+
+	if (u == NULL || u->nops == 0)
+		return NULL;
+	op = &u->ops[u->nops - 1];
+	if (op->type != TRACK_OPRM || op->at != pos || !ev_eq(&op->se->ev, ev))
+		return NULL;
+	se = op->se;
+	u->nevs--;
+	op->type = TRACK_OPDELTA;
+	return se;
+}
+
+/*
+ * record the delta of the given event, before it's changed
+ */
+void
+track_undodelta(struct track *t, struct seqev *se)
 {
+	struct track_data *u = t->undo;
+	struct track_op *op;
+	unsigned n;
+
+	if (u == NULL)
+		return;
+
+	/*
+	 * the oldest value is enough, as undo restores deltas
+	 * in reverse order
+	 */
+	for (n = u->nops; n > 0 && n + TRACK_UNDOLOOK > u->nops; n--) {
+		op = &u->ops[n - 1];
+		if (op->type == TRACK_OPDELTA && op->se == se)
+			return;
+	}
+	op = track_undoop(t, TRACK_OPDELTA, se);
+	op->delta = se->delta;
+}
+
+/*
+ * record the given event, before it's changed
+ */
+void
+track_undoev(struct track *t, struct seqev *se)
+{
+	struct track_op *op;
+
+	if (t->undo == NULL)
+		return;
+	op = track_undoop(t, TRACK_OPEV, se);
+	op->ev = se->ev;
+}
+
+/*
+ * if the track has a journal, move all its events to it and return
+ * 1, else return 0
+ */
+unsigned
+track_undoclear(struct track *t)
+{
+	struct track_op *op;
 	struct seqev *i;
-	struct seqev_data *e;
-	unsigned size;
-
-	u->nins = track_numev(t);
-	size = sizeof(struct seqev_data) * u->nins;
-	u->evs = xmalloc(size, "track_data");
-	e = u->evs;
-	for (i = t->first; i != NULL; i = i->next) {
-		e->delta = i->delta;
-		e->ev = i->ev;
-		e++;
+
+	if (t->undo == NULL)
+		return 0;
+	if (t->first == &t->eot) {
+		track_undodelta(t, &t->eot);
+	} else {
+		op = track_undoop(t, TRACK_OPCLEAR, t->first);
+		op->delta = t->eot.delta;
+		for (i = t->first; i->next != &t->eot; i = i->next)
+			t->undo->nevs++;
+		t->undo->nevs++;
+		op->at = i;
 	}
-	u->pos = 0;
-	u->nrm = 0;
-	return size;
+	t->eot.delta = 0;
+	t->eot.prev = &t->first;
+	t->first = &t->eot;
+	return 1;
 }
 
+/*
+ * record that events were added to the track at once, which
+ * must have been empty
+ */
 void
-track_diff(struct track_data *u1, struct track_data *u2,
-	unsigned *pos, unsigned *nrm, unsigned *nins)
+track_undofill(struct track *t)
 {
-	unsigned start, end1, end2;
+	if (t->undo == NULL)
+		return;
+	track_undoop(t, TRACK_OPFILL, NULL);
+}
 
-	start = 0;
-	while (1) {
-		if (start == u1->nins || start == u2->nins)
+/*
+ * record that the track was mapped to its current pattern
+ */
+void
+track_undomap(struct track *t)
+{
+	struct track_op *op;
+
+	if (t->undo == NULL)
+		return;
+	op = track_undoop(t, TRACK_OPMAP, NULL);
+	op->pat = t->pat;
+}
+
+/*
+ * if the track has a journal, record that it stops using its
+ * pattern and move the reference to the journal, then return 1,
+ * else return 0. Events added to the track just after are removed
+ * when the change is undone
+ */
+unsigned
+track_undounmap(struct track *t)
+{
+	struct track_op *op;
+
+	if (t->undo == NULL)
+		return 0;
+	op = track_undoop(t, TRACK_OPUNMAP, NULL);
+	op->pat = t->pat;
+	return 1;
+}
+
+/*
+ * drop trailing changes that restore the current state
+ */
+void
+track_undotrim(struct track *t)
+{
+	struct track_data *u = t->undo;
+	struct track_op *op;
+
+	if (u == NULL)
+		return;
+	while (u->nops > 0) {
+		op = &u->ops[u->nops - 1];
+		if (op->type == TRACK_OPDELTA) {
+			if (op->se->delta != op->delta)
+				break;
+		} else if (op->type == TRACK_OPEV) {
+			if (memcmp(&op->se->ev, &op->ev, sizeof(struct ev)) != 0)
+				break;
+		} else
+			break;
+		u->nops--;
+	}
+}
+
+/*
+ * return the memory used by the journal
+ */
+unsigned
+track_undosize(struct track_data *u)
+{
+	return u->maxops * sizeof(struct track_op) +
+	    u->nevs * sizeof(struct seqev);
+}
+
+/*
+ * revert all changes recorded in the journal and free it
+ */
+void
+track_undorestore(struct track *t, struct track_data *u)
+{
+	struct track_op *op;
+	struct seqev *se, *next;
+	unsigned n;
+
+	/*
+	 * if the track is mapped, the last change mapped it, so
+	 * there's nothing to copy
+	 */
+	if (t->rom == NULL)
+		track_outdate(t);
+	else if (u->nops == 0 || u->ops[u->nops - 1].type != TRACK_OPMAP) {
+		log_puts("track_undorestore: track mapped\n");
+		panic();
+	}
+	for (n = u->nops; n > 0; n--) {
+		op = &u->ops[n - 1];
+		se = op->se;
+		switch (op->type) {
+		case TRACK_OPINS:
+			*se->prev = se->next;
+			se->next->prev = se->prev;
+			seqev_del(se);
+			break;
+		case TRACK_OPRM:
+			se->delta = op->delta;
+			se->next = op->at;
+			se->prev = op->at->prev;
+			*se->prev = se;
+			op->at->prev = &se->next;
+			break;
+		case TRACK_OPDELTA:
+			se->delta = op->delta;
+			break;
+		case TRACK_OPEV:
+			se->ev = op->ev;
+			break;
+		case TRACK_OPCLEAR:
+			if (t->first != &t->eot) {
+				log_puts("track_undorestore: track not empty\n");
+				panic();
+			}
+			t->first = se;
+			se->prev = &t->first;
+			op->at->next = &t->eot;
+			t->eot.prev = &op->at->next;
+			t->eot.delta = op->delta;
 			break;
-		if (u1->evs[start].delta != u2->evs[start].delta)
+		case TRACK_OPFILL:
+			for (se = t->first; se != &t->eot; se = next) {
+				next = se->next;
+				seqev_del(se);
+			}
+			t->eot.delta = 0;
+			t->eot.prev = &t->first;
+			t->first = &t->eot;
 			break;
-		if (!ev_eq(&u1->evs[start].ev, &u2->evs[start].ev))
+		case TRACK_OPMAP:
+			/*
+			 * the track may have been unmapped by a reader
+			 * since, without journal, in which case remove
+			 * the copied events
+			 */
+			track_unpat(t);
+			track_outdate(t);
+			for (se = t->first; se != &t->eot; se = next) {
+				next = se->next;
+				seqev_del(se);
+			}
+			t->eot.delta = 0;
+			t->eot.prev = &t->first;
+			t->first = &t->eot;
+			break;
+		case TRACK_OPUNMAP:
+			track_outdate(t);
+			for (se = t->first; se != &t->eot; se = next) {
+				next = se->next;
+				seqev_del(se);
+			}
+			t->eot.delta = 0;
+			t->eot.prev = &t->first;
+			t->first = &t->eot;
+			t->pat = op->pat;
+			t->rom = op->pat->data;
 			break;
-		start++;
+		default:
+			log_puts("track_undorestore: bad op\n");
+			panic();
+		}
 	}
+	if (u->ops)
+		xfree(u->ops);
+}
 
-	end1 = u1->nins;
-	end2 = u2->nins;
-	while (1) {
-		if (end1 == start || end2 == start)
+/*
+ * free the journal and the events it keeps
+ */
+void
+track_undofree(struct track_data *u)
+{
+	struct track_op *op;
+	struct seqev *se, *next;
+	unsigned n;
+
+	for (n = 0; n < u->nops; n++) {
+		op = &u->ops[n];
+		switch (op->type) {
+		case TRACK_OPRM:
+			seqev_del(op->se);
 			break;
-		if (u1->evs[end1 - 1].delta != u2->evs[end2 - 1].delta)
+		case TRACK_OPCLEAR:
+			for (se = op->se;; se = next) {
+				next = se->next;
+				seqev_del(se);
+				if (se == op->at)
+					break;
+			}
 			break;
-		if (!ev_eq(&u1->evs[end1 - 1].ev, &u2->evs[end2 - 1].ev))
+		case TRACK_OPUNMAP:
+			trackpat_unref(op->pat);
 			break;
-		end1--;
-		end2--;
+		}
 	}
-	*pos = start;
-	*nrm = end1 - start;
-	*nins = end2 - start;
+	if (u->ops)
+		xfree(u->ops);
 }
 
+/*
+ * old track journals are spilled: their changes and the events they
+ * keep are packed in a single block of bulk memory (ie PSRAM on
+ * boards that have it), so they don't take entries of the seqev
+ * pool. They're unpacked when undo_pop() reaches them.
+ *
+ * Changes refer to events by address. Events in tracks don't move
+ * (except by song_compact(), see undo_reloc()), but events kept by
+ * a spilled journal are freed, so references to them, from the
+ * journal itself or from older spilled journals, are replaced by
+ * the journal id and the index of the event. Newer journals can't
+ * refer to them, as they were already removed from the track. This
+ * is why journals are spilled oldest first.
+ */
+
+unsigned undo_spillid;			/* id of the last spilled journal */
+unsigned undo_hotsize = UNDO_HOTSIZE;	/* max size of recent entries */
+unsigned undo_maxsize = UNDO_MAXSIZE;	/* max size of all entries */
+
+/*
+ * return the index of the given kept event in the given table
+ * sorted by address, or ~0U if not found
+ */
 unsigned
-track_undodiff(struct track *t, struct track_data *orig)
+undo_keptidx(struct seqev_reloc *kept, unsigned nkept, struct seqev *se)
 {
-	struct track_data mod;
-	unsigned int i, pos, nrm, nins;
-	struct seqev_data *evs;
-
-	track_undosave(t, &mod);
-	track_diff(orig, &mod, &pos, &nrm, &nins);
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = nkept;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if ((char *)kept[mid].from < (char *)se)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo < nkept && kept[lo].from == se) ? lo : ~0U;
+}
 
-	evs = xmalloc(sizeof(struct seqev_data) * nrm, "track_diff");
-	for (i = 0; i < nrm; i++)
-		evs[i] = orig->evs[pos + i];
-	xfree(mod.evs);
-	xfree(orig->evs);
-	orig->evs = evs;
-	orig->nins = nins;
-	orig->nrm = nrm;
-	orig->pos = pos;
-	return sizeof(struct seqev_data) * nrm;
+/*
+ * add a reference to the given event to the spilled journal
+ */
+void
+undo_spillref(struct undo_spill *sp, struct seqev_reloc *kept,
+    unsigned nkept, struct seqev *se)
+{
+	struct undo_ref *r = &sp->refs[sp->nrefs++];
+	unsigned idx;
+
+	idx = undo_keptidx(kept, nkept, se);
+	if (idx == ~0U) {
+		r->se = se;
+		r->id = 0;
+		r->idx = 0;
+	} else {
+		r->se = NULL;
+		r->id = sp->id;
+		r->idx = idx;
+	}
 }
 
+/*
+ * pack the journal of the given entry and free it
+ */
 void
-track_undorestore(struct track *t, struct track_data *u)
+undo_spill(struct song *s, struct undo *u)
 {
-	unsigned n;
-	struct seqev *pos, *se;
-	struct seqev_data *e;
-
-	/* go to pos */
-	pos = t->first;
-	for (n = u->pos; n > 0; n--)
-		pos = pos->next;
-
-	/* remove events that were inserted */
-	for (n = u->nins; n > 0; n--) {
-		if (pos->ev.cmd == EV_NULL) {
-			if (n != 1) {
-				log_puts("can't remove eot event\n");
+	struct track_data *d = &u->u.track.data;
+	struct seqev_reloc *kept;
+	struct track_op *op;
+	struct undo_spill *sp;
+	struct undo_ref *r;
+	struct undo *v;
+	struct seqev *se, *next;
+	unsigned char *buf, *p;
+	unsigned i, n, nrefs, nkept, idx;
+	size_t size;
+
+	/*
+	 * compute the number of references and an upper bound of
+	 * the size, then make the sorted table of kept events
+	 */
+	nrefs = 0;
+	size = 0;
+	for (i = 0; i < d->nops; i++) {
+		op = &d->ops[i];
+		size += 1 + sizeof(struct trackpat *) + 2 * SEQEV_PACKMAX;
+		switch (op->type) {
+		case TRACK_OPCLEAR:
+			for (se = op->se; se != op->at; se = se->next)
+				size += 5 + SEQEV_PACKMAX;
+			/* FALLTHROUGH */
+		case TRACK_OPRM:
+			nrefs += 2;
+			break;
+		case TRACK_OPINS:
+		case TRACK_OPDELTA:
+		case TRACK_OPEV:
+			nrefs++;
+			break;
+		}
+	}
+	kept = xmalloc((d->nevs > 0 ? d->nevs : 1) *
+	    sizeof(struct seqev_reloc), "undospill");
+	nkept = 0;
+	for (i = 0; i < d->nops; i++) {
+		op = &d->ops[i];
+		if (op->type != TRACK_OPRM && op->type != TRACK_OPCLEAR)
+			continue;
+		for (se = op->se;; se = se->next) {
+			if (nkept == d->nevs) {
+				log_puts("undo_spill: too many kept events\n");
 				panic();
 			}
-			pos->delta = 0;
+			kept[nkept++].from = se;
+			if (op->type == TRACK_OPRM || se == op->at)
+				break;
+		}
+	}
+	seqev_relocsort(kept, nkept);
+
+	sp = xmalloc(sizeof(struct undo_spill), "undospill");
+	sp->id = ++undo_spillid;
+	sp->nops = d->nops;
+	sp->nevs = d->nevs;
+	sp->nrefs = 0;
+	sp->refs = xmalloc_class((nrefs > 0 ? nrefs : 1) *
+	    sizeof(struct undo_ref), "undospill", MEM_BULK);
+	buf = xmalloc(size > 0 ? size : 1, "undospill");
+	p = buf;
+	for (i = 0; i < d->nops; i++) {
+		op = &d->ops[i];
+		*p++ = op->type;
+		switch (op->type) {
+		case TRACK_OPINS:
+			undo_spillref(sp, kept, nkept, op->se);
+			break;
+		case TRACK_OPRM:
+			undo_spillref(sp, kept, nkept, op->se);
+			undo_spillref(sp, kept, nkept, op->at);
+			p += seqev_pack(p, op->delta, &op->se->ev);
+			break;
+		case TRACK_OPDELTA:
+			undo_spillref(sp, kept, nkept, op->se);
+			p += seqev_packnum(p, op->delta);
+			break;
+		case TRACK_OPEV:
+			undo_spillref(sp, kept, nkept, op->se);
+			p += seqev_pack(p, 0, &op->ev);
+			break;
+		case TRACK_OPCLEAR:
+			undo_spillref(sp, kept, nkept, op->se);
+			undo_spillref(sp, kept, nkept, op->at);
+			n = 0;
+			for (se = op->se; se != op->at; se = se->next)
+				n++;
+			p += seqev_packnum(p, n + 1);
+			p += seqev_packnum(p, op->delta);
+			for (se = op->se;; se = se->next) {
+				idx = undo_keptidx(kept, nkept, se);
+				p += seqev_packnum(p, idx);
+				p += seqev_pack(p, se->delta, &se->ev);
+				if (se == op->at)
+					break;
+			}
+			break;
+		case TRACK_OPMAP:
+		case TRACK_OPUNMAP:
+			memcpy(p, &op->pat, sizeof(struct trackpat *));
+			p += sizeof(struct trackpat *);
 			break;
 		}
-		se = pos;
-		pos = se->next;
+	}
+	sp->size = p - buf;
+	sp->data = xmalloc_class(sp->size > 0 ? sp->size : 1,
+	    "undospill", MEM_BULK);
+	memcpy(sp->data, buf, sp->size);
+	xfree(buf);
 
-		/* remove seqev */
-		*se->prev = pos;
-		pos->prev = se->prev;
-		seqev_del(se);
+	/*
+	 * older spilled journals may refer to the kept events
+	 */
+	for (v = u->next; v != NULL; v = v->next) {
+		if (v->type != UNDO_TRACK || v->u.track.spill == NULL)
+			continue;
+		for (i = 0; i < v->u.track.spill->nrefs; i++) {
+			r = &v->u.track.spill->refs[i];
+			if (r->se == NULL)
+				continue;
+			idx = undo_keptidx(kept, nkept, r->se);
+			if (idx != ~0U) {
+				r->se = NULL;
+				r->id = sp->id;
+				r->idx = idx;
+			}
+		}
 	}
 
-	/* insert events that were removed */
-	e = u->evs;
-	for (n = u->nrm; n > 0; n--) {
-		if (e->ev.cmd == EV_NULL) {
-			if (n != 1) {
-				log_puts("can't insert eot event\n");
-				panic();
+	/*
+	 * free the kept events and the journal
+	 */
+	for (i = 0; i < d->nops; i++) {
+		op = &d->ops[i];
+		if (op->type == TRACK_OPRM)
+			seqev_del(op->se);
+		else if (op->type == TRACK_OPCLEAR) {
+			for (se = op->se;; se = next) {
+				next = se->next;
+				seqev_del(se);
+				if (se == op->at)
+					break;
 			}
-			t->eot.delta = e->delta;
+		}
+	}
+	if (d->ops)
+		xfree(d->ops);
+	d->ops = NULL;
+	d->nops = d->maxops = d->nevs = 0;
+	xfree(kept);
+
+	u->u.track.spill = sp;
+	s->undo_size -= u->size;
+	u->size = sizeof(struct undo_spill) + sp->size +
+	    sp->nrefs * sizeof(struct undo_ref);
+	s->undo_size += u->size;
+}
+
+/*
+ * free a spilled journal, dropping the references it holds
+ */
+void
+undo_spillfree(struct undo_spill *sp)
+{
+	struct trackpat *pat;
+	unsigned char *p;
+	unsigned i, n, val;
+	struct ev ev;
+
+	p = sp->data;
+	for (i = 0; i < sp->nops; i++) {
+		switch (*p++) {
+		case TRACK_OPRM:
+		case TRACK_OPEV:
+			p += seqev_unpack(p, &val, &ev);
+			break;
+		case TRACK_OPDELTA:
+			p += seqev_unpacknum(p, &val);
+			break;
+		case TRACK_OPCLEAR:
+			p += seqev_unpacknum(p, &n);
+			p += seqev_unpacknum(p, &val);
+			while (n-- > 0) {
+				p += seqev_unpacknum(p, &val);
+				p += seqev_unpack(p, &val, &ev);
+			}
+			break;
+		case TRACK_OPMAP:
+			p += sizeof(struct trackpat *);
+			break;
+		case TRACK_OPUNMAP:
+			memcpy(&pat, p, sizeof(struct trackpat *));
+			p += sizeof(struct trackpat *);
+			trackpat_unref(pat);
+			break;
+		}
+	}
+	xfree(sp->data);
+	xfree(sp->refs);
+	xfree(sp);
+}
+
+/*
+ * return the event of the given reference, kept events of the
+ * journal being unpacked are in 'kept'
+ */
+struct seqev *
+undo_spillget(struct undo_spill *sp, struct seqev **kept, struct undo_ref *r)
+{
+	if (r->se != NULL)
+		return r->se;
+	if (r->id != sp->id) {
+		log_puts("undo_spillget: reference to newer journal\n");
+		panic();
+	}
+	return kept[r->idx];
+}
+
+/*
+ * unpack the journal of the given entry, reverse of undo_spill()
+ */
+void
+undo_unspill(struct song *s, struct undo *u)
+{
+	struct undo_spill *sp = u->u.track.spill;
+	struct track_data *d = &u->u.track.data;
+	struct seqev **kept, *se, **prev;
+	struct track_op *op;
+	struct undo_ref *r;
+	struct undo *v;
+	unsigned char *p;
+	unsigned i, n, idx, delta;
+
+	kept = xmalloc((sp->nevs > 0 ? sp->nevs : 1) *
+	    sizeof(struct seqev *), "undospill");
+	for (i = 0; i < sp->nevs; i++)
+		kept[i] = seqev_new();
+	d->ops = NULL;
+	if (sp->nops > 0) {
+		d->ops = xmalloc_class(sp->nops * sizeof(struct track_op),
+		    "track_op", MEM_BULK);
+	}
+	d->nops = d->maxops = sp->nops;
+	d->nevs = sp->nevs;
+	p = sp->data;
+	r = sp->refs;
+	for (i = 0; i < sp->nops; i++) {
+		op = &d->ops[i];
+		op->type = *p++;
+		op->se = NULL;
+		switch (op->type) {
+		case TRACK_OPINS:
+			op->se = undo_spillget(sp, kept, r++);
+			break;
+		case TRACK_OPRM:
+			op->se = undo_spillget(sp, kept, r++);
+			op->at = undo_spillget(sp, kept, r++);
+			p += seqev_unpack(p, &op->delta, &op->se->ev);
+			break;
+		case TRACK_OPDELTA:
+			op->se = undo_spillget(sp, kept, r++);
+			p += seqev_unpacknum(p, &op->delta);
+			break;
+		case TRACK_OPEV:
+			op->se = undo_spillget(sp, kept, r++);
+			p += seqev_unpack(p, &delta, &op->ev);
+			break;
+		case TRACK_OPCLEAR:
+			op->se = undo_spillget(sp, kept, r++);
+			op->at = undo_spillget(sp, kept, r++);
+			p += seqev_unpacknum(p, &n);
+			p += seqev_unpacknum(p, &op->delta);
+			prev = NULL;
+			while (n-- > 0) {
+				p += seqev_unpacknum(p, &idx);
+				se = kept[idx];
+				p += seqev_unpack(p, &se->delta, &se->ev);
+				se->prev = prev;
+				if (prev)
+					*prev = se;
+				prev = &se->next;
+			}
+			break;
+		case TRACK_OPMAP:
+		case TRACK_OPUNMAP:
+			memcpy(&op->pat, p, sizeof(struct trackpat *));
+			p += sizeof(struct trackpat *);
 			break;
 		}
-		se = seqev_new();
-		se->ev = e->ev;
-		se->delta = e->delta;
-		e++;
-
-		/* insert seqev */
-		se->next = pos;
-		se->prev = pos->prev;
-		*(se->prev) = se;
-		pos->prev = &se->next;
 	}
-	xfree(u->evs);
+
+	/*
+	 * point older spilled journals to the new kept events
+	 */
+	for (v = u->next; v != NULL; v = v->next) {
+		if (v->type != UNDO_TRACK || v->u.track.spill == NULL)
+			continue;
+		for (i = 0; i < v->u.track.spill->nrefs; i++) {
+			r = &v->u.track.spill->refs[i];
+			if (r->se == NULL && r->id == sp->id) {
+				r->se = kept[r->idx];
+				r->id = 0;
+			}
+		}
+	}
+	xfree(kept);
+	undo_spillfree(sp);
+	u->u.track.spill = NULL;
+	s->undo_size -= u->size;
+	u->size = track_undosize(d);
+	s->undo_size += u->size;
+}
+
+/*
+ * spill the oldest track journals until recent entries take less
+ * than undo_hotsize bytes. The newest entry and the journal being
+ * recorded are never spilled
+ */
+void
+undo_spillold(struct song *s)
+{
+	struct undo *u, *last;
+	unsigned hot;
+
+	for (;;) {
+		hot = 0;
+		last = NULL;
+		for (u = s->undo; u != NULL; u = u->next) {
+			if (u->type == UNDO_TRACK && u->u.track.spill != NULL)
+				continue;
+			hot += u->size;
+			if (u != s->undo && u->type == UNDO_TRACK &&
+			    u->u.track.track->undo != &u->u.track.data)
+				last = u;
+		}
+		if (hot <= undo_hotsize || last == NULL)
+			break;
+		undo_spill(s, last);
+	}
 }
 
+/*
+ * start recording changes of the given track, if it's mapped its
+ * events are copied first, so the journal refers to them. Undoing
+ * the changes maps it again
+ */
 void
 undo_track_save(struct song *s, struct track *t, char *func, char *name)
 {
@@ -460,23 +1165,67 @@ undo_track_save(struct song *s, struct track *t, char *func, char *name)
 
 	u = undo_new(s, UNDO_TRACK, func, name);
 	u->u.track.track = t;
-	u->size = track_undosave(t, &u->u.track.data);
+	u->u.track.spill = NULL;
+	u->u.track.data.ops = NULL;
+	u->u.track.data.nops = 0;
+	u->u.track.data.maxops = 0;
+	u->u.track.data.nevs = 0;
 	undo_push(s, u);
+	t->undo = &u->u.track.data;
+	track_unmap(t);
 }
 
+/*
+ * stop recording changes of the 'n' tracks saved last with
+ * undo_track_save()
+ */
 void
-undo_track_diff(struct song *s)
+undo_track_diffn(struct song *s, unsigned n)
 {
 	struct undo *u = s->undo;
-	unsigned size;
+	struct track_data *d;
+	struct track_op *ops;
+	struct track *t;
 
-	if (u == NULL || u->type != UNDO_TRACK) {
-		log_puts("undo_track_diff: no data to diff\n");
-		return;
+	for (; n > 0; n--, u = u->next) {
+		if (u == NULL || u->type != UNDO_TRACK) {
+			log_puts("undo_track_diff: no data to diff\n");
+			return;
+		}
+		t = u->u.track.track;
+		d = &u->u.track.data;
+		track_undotrim(t);
+		t->undo = NULL;
+
+		/*
+		 * release unused journal entries
+		 */
+		if (d->nops < d->maxops) {
+			ops = NULL;
+			if (d->nops > 0) {
+				ops = xmalloc_class(d->nops *
+				    sizeof(struct track_op),
+				    "track_op", MEM_BULK);
+				memcpy(ops, d->ops,
+				    d->nops * sizeof(struct track_op));
+			}
+			xfree(d->ops);
+			d->ops = ops;
+			d->maxops = d->nops;
+		}
+		u->size = track_undosize(d);
+		s->undo_size += u->size;
 	}
-	size = track_undodiff(u->u.track.track, &u->u.track.data);
-	s->undo_size += size - u->size;
-	u->size = size;
+	undo_shrink(s);
+}
+
+/*
+ * stop recording changes of the track saved with undo_track_save()
+ */
+void
+undo_track_diff(struct song *s)
+{
+	undo_track_diffn(s, 1);
 }
 
 void
@@ -528,6 +1277,7 @@ filtnode_dup(struct filtnode **dloc, struct filtnode **sloc)
 	s = *sloc;
 	while (s != NULL) {
 		d = filtnode_new(&s->es, dloc);
+		d->u = s->u;
 		filtnode_dup(&d->dstlist, &s->dstlist);
 		dloc = &d->next;
 		s = s->next;
@@ -660,7 +1410,7 @@ sysex_undosave(struct sysex *x, struct sysex_data *data)
 	for (ck = x->first; ck != NULL; ck = ck->next)
 		data->size += ck->used;
 
-	data->data = xmalloc(data->size, "undo_sysex");
+	data->data = xmalloc_class(data->size, "undo_sysex", MEM_BULK);
 
 	p = data->data;
 	for (ck = x->first; ck != NULL; ck = ck->next) {
@@ -681,6 +1431,7 @@ sysex_undorestore(struct sysex_data *data)
 	for (i = 0; i < data->size; i++)
 		sysex_add(x, data->data[i]);
 	xfree(data->data);
+	sysex_pack(x);
 	return x;
 }
 
@@ -703,6 +1454,7 @@ undo_xadd_do(struct song *s, char *func, struct songsx *sx, struct sysex *x)
 	u->size = 0;
 	undo_push(s, u);
 
+	sysex_pack(x);
 	sysexlist_put(&sx->sx, x);
 }
 
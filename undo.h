@@ -20,6 +20,7 @@
 #include "track.h"
 #include "sysex.h"
 
+struct name;
 struct songtrk;
 struct songchan;
 struct songfilt;
@@ -44,6 +45,29 @@ enum {
 	UNDO_SCALE
 };
 
+/*
+ * event referenced by a spilled journal: either an event of a track,
+ * or an event kept by a spilled journal, see undo_spill()
+ */
+struct undo_ref {
+	struct seqev *se;		/* event, NULL if spilled */
+	unsigned id;			/* journal that keeps it */
+	unsigned idx;			/* index in the journal */
+};
+
+/*
+ * track journal packed by undo_spill()
+ */
+struct undo_spill {
+	unsigned id;			/* used by references to its events */
+	unsigned nops;			/* number of changes */
+	unsigned nevs;			/* number of kept events */
+	struct undo_ref *refs;		/* referenced events, in order */
+	unsigned nrefs;
+	unsigned char *data;		/* packed changes and kept events */
+	unsigned size;
+};
+
 struct undo {
 	struct undo *next;
 	int type;
@@ -51,8 +75,9 @@ struct undo {
 	char *name;
 	unsigned size;
 	union {
-		struct undo_setstr {
-			char **ptr, *val;
+		struct undo_setname {
+			struct name *name;
+			char *val;
 		} ren;
 		struct undo_setuint {
 			unsigned int *ptr, val;
@@ -60,6 +85,7 @@ struct undo {
 		struct undo_track {
 			struct track *track;
 			struct track_data data;
+			struct undo_spill *spill; /* if not NULL, 'data' is empty */
 		} track;
 		struct undo_tdel {
 			struct songtrk *trk;
@@ -96,13 +122,20 @@ struct undo {
 void undo_pop(struct song *);
 void undo_push(struct song *, struct undo *);
 void undo_clear(struct song *, struct undo **);
+void undo_shrink(struct song *);
+void undo_reloc(struct song *, struct seqev_reloc *, unsigned);
+void undo_spill(struct song *, struct undo *);
+void undo_unspill(struct song *, struct undo *);
+void undo_spillfree(struct undo_spill *);
+void undo_spillold(struct song *);
 void undo_start(struct song *, char *, char *);
-void undo_setstr(struct song *, char *, char **, char *);
+void undo_setname(struct song *, char *, struct name *, char *);
 void undo_setuint(struct song *, char *, char *, unsigned int *, unsigned int);
 void undo_scale(struct song *, char *, char *, unsigned int, unsigned int);
 
 void undo_track_save(struct song *, struct track *, char *, char *);
 void undo_track_diff(struct song *);
+void undo_track_diffn(struct song *, unsigned);
 void undo_tdel_do(struct song *, struct songtrk *, char *);
 struct songtrk *undo_tnew_do(struct song *, char *, char *);
 void undo_filt_save(struct song *, struct filt *, char *, char *);
@@ -119,4 +152,6 @@ void undo_xrm_do(struct song *, char *, struct songsx *, unsigned int);
 void undo_xdel_do(struct song *, char *, struct songsx *);
 struct songsx *undo_xnew_do(struct song *, char *, char *);
 
+extern unsigned undo_hotsize, undo_maxsize;
+
 #endif /* MIDISH_UNDO_H */
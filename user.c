@@ -33,6 +33,8 @@
 
 #include "mux.h"
 #include "mididev.h"
+#include "norm.h"
+#include "mixout.h"
 
 #include "track.h"
 #include "song.h"
@@ -40,6 +42,8 @@
 #include "builtin.h"
 #include "smf.h"
 #include "saveload.h"
+#include "setlist.h"
+#include "mdep_desp.h"
 
 struct song *usong;
 unsigned user_flag_batch = 0;
@@ -345,16 +349,24 @@ unsigned
 exec_lookupevspec(struct exec *o, char *name, struct evspec *e, int input)
 {
 	struct var *arg;
-	struct data *d;
-	struct songchan *i;
-	unsigned lo, hi, min, max;
 
 	arg = exec_varlookup(o, name);
 	if (!arg) {
 		log_puts("exec_lookupev: no such var\n");
 		panic();
 	}
-	d = arg->data;
+	return data_getevspec(arg->data, e, input);
+}
+
+/*
+ * same as exec_lookupevspec(), but take the list as argument
+ */
+unsigned
+data_getevspec(struct data *d, struct evspec *e, int input)
+{
+	struct songchan *i;
+	unsigned lo, hi, min, max;
+
 	if (d->type != DATA_LIST) {
 		cons_err("list expected in event range spec");
 		return 0;
@@ -925,14 +937,23 @@ struct el_ops user_el_ops = {
 unsigned
 user_mainloop(void)
 {
+	char *name;
+	unsigned i;
+
 	cons_init(&user_el_ops, NULL);
 	textio_init();
 	evctl_init();
+	norm_init();
 	seqev_pool_init(DEFAULT_MAXNSEQEVS);
+	seqev_scratch_init(DEFAULT_MAXNSCRATCHEVS);
 	state_pool_init(DEFAULT_MAXNSTATES);
 	chunk_pool_init(DEFAULT_MAXNCHUNKS);
 	sysex_pool_init(DEFAULT_MAXNSYSEXS);
 	seqptr_pool_init(DEFAULT_MAXNSEQPTRS);
+	data_pool_init(DEFAULT_MAXNDATAS);
+	node_pool_init(DEFAULT_MAXNNODES);
+	var_pool_init(DEFAULT_MAXNVARS);
+	mixout_pool_init(DEFAULT_MAXNMIXCHANS);
 
 	/*
 	 * create the project (ie the song) and
@@ -958,6 +979,23 @@ user_mainloop(void)
 			name_newarg("value", NULL)));
 	exec_newbuiltin(exec, "version", blt_version, NULL);
 	exec_newbuiltin(exec, "panic", blt_panic, NULL);
+	exec_newbuiltin(exec, "poolinfo", blt_poolinfo, NULL);
+	exec_newbuiltin(exec, "poolsize", blt_poolsize,
+			name_newarg("pool",
+			name_newarg("size", NULL)));
+	exec_newbuiltin(exec, "poolfix", blt_poolfix, NULL);
+	exec_newbuiltin(exec, "compact", blt_compact, NULL);
+	exec_newbuiltin(exec, "meminfo", blt_meminfo, NULL);
+	exec_newbuiltin(exec, "prof", blt_prof, NULL);
+	exec_newbuiltin(exec, "profclr", blt_profclr, NULL);
+	exec_newbuiltin(exec, "bench", blt_bench,
+			name_newarg("name",
+			name_newarg("count", NULL)));
+	exec_newbuiltin(exec, "jitter", blt_jitter,
+			name_newarg("period",
+			name_newarg("jitter",
+			name_newarg("seed",
+			name_newarg("input", NULL)))));
 	exec_newbuiltin(exec, "info", blt_info, NULL);
 
 	exec_newbuiltin(exec, "getunit", blt_getunit, NULL);
@@ -1003,13 +1041,30 @@ user_mainloop(void)
 	exec_newbuiltin(exec, "ls", blt_ls, NULL);
 	exec_newbuiltin(exec, "save", blt_save,
 			name_newarg("filename", NULL));
+	exec_newbuiltin(exec, "savelz", blt_savelz,
+			name_newarg("filename", NULL));
+	exec_newbuiltin(exec, "savebin", blt_savebin,
+			name_newarg("filename", NULL));
+	exec_newbuiltin(exec, "bgsave", blt_bgsave,
+			name_newarg("filename", NULL));
+	exec_newbuiltin(exec, "snapshot", blt_snapshot,
+			name_newarg("filename", NULL));
+	exec_newbuiltin(exec, "restore", blt_restore,
+			name_newarg("filename", NULL));
 	exec_newbuiltin(exec, "load", blt_load,
 			name_newarg("filename", NULL));
+	exec_newbuiltin(exec, "mapload", blt_mapload,
+			name_newarg("name", NULL));
+	exec_newbuiltin(exec, "slload", blt_slload,
+			name_newarg("filename", NULL));
+	exec_newbuiltin(exec, "slnext", blt_slnext, NULL);
 	exec_newbuiltin(exec, "reset", blt_reset, NULL);
 	exec_newbuiltin(exec, "export", blt_export,
 			name_newarg("filename", NULL));
 	exec_newbuiltin(exec, "import", blt_import,
 			name_newarg("filename", NULL));
+	exec_newbuiltin(exec, "smfplay", blt_smfplay,
+			name_newarg("filename", NULL));
 	exec_newbuiltin(exec, "i", blt_idle, NULL);
 	exec_newbuiltin(exec, "p", blt_play, NULL);
 	exec_newbuiltin(exec, "r", blt_rec, NULL);
@@ -1041,6 +1096,9 @@ user_mainloop(void)
 			name_newarg("name",
 			name_newarg("pattern", NULL)));
 	exec_newbuiltin(exec, "evinfo", blt_evinfo, NULL);
+	exec_newbuiltin(exec, "normrate", blt_normrate,
+			name_newarg("evname",
+			name_newarg("maxev", NULL)));
 	exec_newbuiltin(exec, "m", blt_metro,
 			name_newarg("onoff", NULL));
 	exec_newbuiltin(exec, "metrocf", blt_metrocf,
@@ -1052,6 +1110,11 @@ user_mainloop(void)
 			name_newarg("evspec", NULL));
 	exec_newbuiltin(exec, "u", blt_undo, NULL);
 	exec_newbuiltin(exec, "ul", blt_undolist, NULL);
+	exec_newbuiltin(exec, "undosize", blt_undosize,
+			name_newarg("hot",
+			name_newarg("max", NULL)));
+	exec_newbuiltin(exec, "workers", blt_workers,
+			name_newarg("count", NULL));
 	exec_newbuiltin(exec, "tlist", blt_tlist, NULL);
 	exec_newbuiltin(exec, "tnew", blt_tnew,
 			name_newarg("trackname", NULL));
@@ -1070,6 +1133,7 @@ user_mainloop(void)
 	exec_newbuiltin(exec, "tgetf", blt_tgetf, NULL);
 	exec_newbuiltin(exec, "tcheck", blt_tcheck, NULL);
 	exec_newbuiltin(exec, "trewrite", blt_trewrite, NULL);
+	exec_newbuiltin(exec, "tpack", blt_tpack, NULL);
 	exec_newbuiltin(exec, "tcut", blt_tcut, NULL);
 	exec_newbuiltin(exec, "tclr", blt_tclr, NULL);
 	exec_newbuiltin(exec, "tpaste", blt_tpaste, NULL);
@@ -1078,6 +1142,8 @@ user_mainloop(void)
 			name_newarg("amount", NULL));
 	exec_newbuiltin(exec, "tmerge", blt_tmerge,
 			name_newarg("source", NULL));
+	exec_newbuiltin(exec, "tflatten", blt_tflatten,
+			name_newarg("tracklist", NULL));
 	exec_newbuiltin(exec, "tquanta", blt_tquanta,
 			name_newarg("rate", NULL));
 	exec_newbuiltin(exec, "tquantf", blt_tquantf,
@@ -1089,6 +1155,8 @@ user_mainloop(void)
 	exec_newbuiltin(exec, "tevmap", blt_tevmap,
 			name_newarg("from",
 			name_newarg("to", NULL)));
+	exec_newbuiltin(exec, "tedit", blt_tedit,
+			name_newarg("list", NULL));
 	exec_newbuiltin(exec, "tclist", blt_tclist, NULL);
 	exec_newbuiltin(exec, "tinfo", blt_tinfo, NULL);
 	exec_newbuiltin(exec, "tdump", blt_tdump, NULL);
@@ -1188,6 +1256,9 @@ user_mainloop(void)
 			name_newarg("path", NULL)));
 	exec_newbuiltin(exec, "xexport", blt_xexport,
 			name_newarg("path", NULL));
+	exec_newbuiltin(exec, "xasync", blt_xasync, NULL);
+	exec_newbuiltin(exec, "noxasync", blt_noxasync, NULL);
+	exec_newbuiltin(exec, "xprogress", blt_xprogress, NULL);
 
 	exec_newbuiltin(exec, "shut", blt_shut, NULL);
 	exec_newbuiltin(exec, "proclist", blt_proclist, NULL);
@@ -1208,11 +1279,27 @@ user_mainloop(void)
 			name_newarg("devlist", NULL));
 	exec_newbuiltin(exec, "dclkrx", blt_dclkrx,
 			name_newarg("devnum", NULL));
+	exec_newbuiltin(exec, "dclkpll", blt_dclkpll,
+			name_newarg("onoff", NULL));
+	exec_newbuiltin(exec, "dclkinfo", blt_dclkinfo, NULL);
+	exec_newbuiltin(exec, "dxthru", blt_dxthru,
+			name_newarg("devnum",
+			name_newarg("thrudev", NULL)));
+	exec_newbuiltin(exec, "dbaud", blt_dbaud,
+			name_newarg("devnum",
+			name_newarg("baud", NULL)));
+	exec_newbuiltin(exec, "dlook", blt_dlook,
+			name_newarg("devnum",
+			name_newarg("msec", NULL)));
 	exec_newbuiltin(exec, "dclkrate", blt_dclkrate,
 			name_newarg("devnum",
 			name_newarg("tics_per_unit", NULL)));
 	exec_newbuiltin(exec, "dinfo", blt_dinfo,
 			name_newarg("devnum", NULL));
+	exec_newbuiltin(exec, "dlat", blt_dlat,
+			name_newarg("devnum", NULL));
+	exec_newbuiltin(exec, "dlatclr", blt_dlatclr,
+			name_newarg("devnum", NULL));
 	exec_newbuiltin(exec, "dixctl", blt_dixctl,
 			name_newarg("devnum",
 			name_newarg("ctlset", NULL)));
@@ -1226,8 +1313,17 @@ user_mainloop(void)
 			name_newarg("devnum",
 			name_newarg("flags", NULL)));
 
-  mididev_attach(0, "serial2", MIDIDEV_MODE_IN | MIDIDEV_MODE_OUT);
-  log_puts("SerialPort2 registered as Midi-Device 0.\n");
+	/*
+	 * attach registered serial ports as the first devices
+	 */
+	for (i = 0; (name = mdep_desp_name(i)) != NULL; i++) {
+		mididev_attach(i, name,
+		    MIDIDEV_MODE_IN | MIDIDEV_MODE_OUT);
+		log_puts(name);
+		log_puts(" registered as Midi-Device ");
+		log_putu(i);
+		log_puts(".\n");
+	}
 
 
 	/*
@@ -1250,18 +1346,24 @@ user_mainloop(void)
 
 	done = 0;
 	while (!done && mux_mdep_wait(1))
-		; /* nothing */
+		setlist_poll();
 
 	lex_done(&parse);
 	parse_done(&parse);
 	exec_delete(exec);
 	song_delete(usong);
 	usong = NULL;
+	setlist_done();
 	mididev_listdone();
+	mixout_pool_done();
+	var_pool_done();
+	node_pool_done();
+	data_pool_done();
 	seqptr_pool_done();
 	sysex_pool_done();
 	chunk_pool_done();
 	state_pool_done();
+	seqev_scratch_done();
 	seqev_pool_done();
 	evctl_done();
 	textio_done();
@@ -51,6 +51,7 @@ void user_oncompl_path(char *, int *, int *);
 /* useful conversion functions */
 
 unsigned exec_runfile(struct exec *, char *);
+int exec_runrc(struct exec *, char *);
 unsigned exec_runrcfile(struct exec *);
 
 unsigned exec_lookuptrack(struct exec *, char *, struct songtrk **);
@@ -69,6 +70,7 @@ unsigned exec_lookupval(struct exec *, char *, unsigned, unsigned *);
 void data_print(struct data *);
 unsigned data_num2chan(struct data *, unsigned *, unsigned *);
 unsigned data_getchan(struct data *, unsigned *, unsigned *, int);
+unsigned data_getevspec(struct data *, struct evspec *, int);
 unsigned data_getrange(struct data *, unsigned, unsigned, unsigned *, unsigned *);
 unsigned data_matchsysex(struct data *, struct sysex *, unsigned *);
 unsigned data_list2ctl(struct data *, unsigned *);
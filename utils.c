@@ -18,6 +18,12 @@
  * This allows traces to be collected during time sensitive operations without
  * disturbing them. The buffer can be flushed on standard error later, when
  * slow syscalls are no longer disruptive, e.g. at the end of the poll() loop.
+ *
+ * While log_rt is set (realtime context: clock, MIDI input, ...)  the
+ * buffer is never flushed, since writing to the console may block. If
+ * it's full, characters are dropped and counted; the count is
+ * reported on the next flush. There are two buffers, so log_take() can
+ * hand one to the console writer while traces go to the other.
  */
 #include <errno.h>
 #include <signal.h>
@@ -25,8 +31,12 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#ifdef ESP_PLATFORM
+#include "esp_heap_caps.h"
+#endif
 #include "utils.h"
 #include "tty.h"
+#include "work.h"
 
 /*
  * log buffer size
@@ -39,11 +49,48 @@
 #define LOG_PUTC(c) do {			\
 	if (log_used < LOG_BUFSZ)		\
 		log_buf[log_used++] = (c);	\
+	else					\
+		log_ndrop++;			\
 } while (0)
 
-char log_buf[LOG_BUFSZ];	/* buffer where traces are stored */
+char log_bufs[2][LOG_BUFSZ];	/* buffers where traces are stored */
+char *log_buf = log_bufs[0];	/* buffer in use */
 unsigned int log_used = 0;	/* bytes used in the buffer */
 unsigned int log_sync = 1;	/* if true, flush after each '\n' */
+unsigned int log_rt = 0;	/* if true, never flush */
+unsigned long log_ndrop = 0;	/* bytes dropped because buffer was full */
+
+/*
+ * return the buffer with the traces stored so far and its length, and
+ * start storing traces in the other buffer. The returned buffer remains
+ * valid until the next call
+ */
+size_t
+log_take(char **buf)
+{
+	unsigned long ndrop;
+	size_t used;
+	char *p;
+
+	*buf = log_buf;
+	used = log_used;
+	log_buf = (log_buf == log_bufs[0]) ? log_bufs[1] : log_bufs[0];
+	log_used = 0;
+
+	/*
+	 * the dropped bytes count goes first in the new buffer
+	 */
+	if (log_ndrop > 0) {
+		ndrop = log_ndrop;
+		log_ndrop = 0;
+		for (p = "log: "; *p != '\0'; p++)
+			LOG_PUTC(*p);
+		log_putu(ndrop);
+		for (p = " bytes dropped\n"; *p != '\0'; p++)
+			LOG_PUTC(*p);
+	}
+	return used;
+}
 
 /*
  * write the log buffer on stderr
@@ -51,10 +98,13 @@ unsigned int log_sync = 1;	/* if true, flush after each '\n' */
 void
 log_flush(void)
 {
-	if (log_used == 0)
+	char *buf;
+	size_t used;
+
+	if (log_rt || (log_used == 0 && log_ndrop == 0))
 		return;
-	tty_write(log_buf, log_used);
-	log_used = 0;
+	used = log_take(&buf);
+	tty_write(buf, used);
 }
 
 /*
@@ -68,7 +118,7 @@ log_putc(char *data, size_t count)
 	while (count > 0) {
 		c = *data++;
 		LOG_PUTC(c);
-		if (log_sync && c == '\n')
+		if (log_sync && !log_rt && c == '\n')
 			log_flush();
 		count--;
 	}
@@ -85,7 +135,7 @@ log_puts(char *msg)
 
 	while ((c = *p++) != '\0') {
 		LOG_PUTC(c);
-		if (log_sync && c == '\n')
+		if (log_sync && !log_rt && c == '\n')
 			log_flush();
 	}
 }
@@ -166,11 +216,78 @@ log_perror(char *str)
 void
 panic(void)
 {
+	log_rt = 0;
 	log_flush();
 	(void)kill(getpid(), SIGABRT);
 	_exit(1);
 }
 
+/*
+ * each block allocated with xmalloc() is preceded by a header with
+ * its size and the slot of its tag in mem_tags[], so the memory in
+ * use can be reported by tag. Tags are compared by address first,
+ * since they are string literals; once the table is full, new tags
+ * are accounted in the last slot
+ */
+union memhdr {
+	struct {
+		size_t size;
+		unsigned tag;
+	} h;
+	double align;
+};
+
+struct memtag mem_tags[MEM_NTAGS];
+unsigned mem_ntags = 0;
+unsigned long mem_used = 0, mem_maxused = 0;
+
+/*
+ * return the slot of the given tag, creating it if needed
+ */
+unsigned
+mem_tag(char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < mem_ntags; i++) {
+		if (mem_tags[i].name == name || strcmp(mem_tags[i].name, name) == 0)
+			return i;
+	}
+	if (mem_ntags == MEM_NTAGS) {
+		mem_tags[MEM_NTAGS - 1].name = "other";
+		return MEM_NTAGS - 1;
+	}
+	mem_tags[i].name = name;
+	mem_tags[i].nblks = 0;
+	mem_tags[i].used = 0;
+	mem_tags[i].maxused = 0;
+	mem_ntags++;
+	return i;
+}
+
+/*
+ * initialize the header of a block and account it
+ */
+void *
+mem_account(union memhdr *hdr, size_t size, char *tag)
+{
+	struct memtag *t;
+
+	work_lock();
+	hdr->h.size = size;
+	hdr->h.tag = mem_tag(tag);
+	t = &mem_tags[hdr->h.tag];
+	t->nblks++;
+	t->used += size;
+	if (t->maxused < t->used)
+		t->maxused = t->used;
+	mem_used += size;
+	if (mem_maxused < mem_used)
+		mem_maxused = mem_used;
+	work_unlock();
+	return hdr + 1;
+}
+
 /*
  * allocate 'size' bytes of memory (with size > 0). This functions never
  * fails (and never returns NULL), if there isn't enough memory then
@@ -179,16 +296,38 @@ panic(void)
 void *
 xmalloc(size_t size, char *tag)
 {
-	void *p;
+	union memhdr *hdr;
 
-	p = malloc(size);
-	if (p == NULL && size>0) {
+	hdr = malloc(sizeof(union memhdr) + size);
+	if (hdr == NULL) {
 		log_puts("failed to allocate ");
 		log_putx(size);
 		log_puts(" bytes\n");
 		panic();
 	}
-	return p;
+	return mem_account(hdr, size, tag);
+}
+
+/*
+ * same as xmalloc() but allocate memory of the given class. On boards
+ * with external RAM (PSRAM), MEM_BULK allocations are made there,
+ * and fall back to internal memory once it's full. Memory is freed
+ * with xfree().
+ */
+void *
+xmalloc_class(size_t size, char *tag, unsigned cls)
+{
+#if defined(ESP_PLATFORM) && (defined(BOARD_HAS_PSRAM) || defined(CONFIG_SPIRAM))
+	union memhdr *hdr;
+
+	if (cls == MEM_BULK && size > 0) {
+		hdr = heap_caps_malloc(sizeof(union memhdr) + size,
+		    MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+		if (hdr != NULL)
+			return mem_account(hdr, size, tag);
+	}
+#endif
+	return xmalloc(size, tag);
 }
 
 /*
@@ -197,13 +336,39 @@ xmalloc(size_t size, char *tag)
 void
 xfree(void *p)
 {
+	union memhdr *hdr;
+	struct memtag *t;
+
 #ifdef DEBUG
 	if (p == NULL) {
 		log_puts("xfree with NULL arg\n");
 		panic();
 	}
 #endif
-	free(p);
+	hdr = (union memhdr *)p - 1;
+	work_lock();
+	t = &mem_tags[hdr->h.tag];
+	t->nblks--;
+	t->used -= hdr->h.size;
+	mem_used -= hdr->h.size;
+	work_unlock();
+	free(hdr);
+}
+
+/*
+ * store the free heap size and the size of the largest free block,
+ * which shows how fragmented the heap is. They are 0 if unknown
+ */
+void
+mem_heapinfo(unsigned long *nfree, unsigned long *largest)
+{
+#ifdef ESP_PLATFORM
+	*nfree = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+	*largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+#else
+	*nfree = 0;
+	*largest = 0;
+#endif
 }
 
 /*
@@ -220,3 +385,50 @@ xstrdup(char *s, char *tag)
 	memcpy(p, s, size);
 	return p;
 }
+
+/*
+ * reset the given profiling counters
+ */
+void
+prof_reset(struct prof *p, char *name)
+{
+	p->name = name;
+	p->n = 0;
+	p->sum = 0;
+	p->min = ~0U;
+	p->max = 0;
+}
+
+/*
+ * account the given value
+ */
+void
+prof_val(struct prof *p, unsigned val)
+{
+	p->n++;
+	p->sum += val;
+	if (p->min > val)
+		p->min = val;
+	if (p->max < val)
+		p->max = val;
+}
+
+/*
+ * log the given profiling counters
+ */
+void
+prof_log(struct prof *p)
+{
+	log_puts(p->name);
+	log_puts(": n=");
+	log_putu(p->n);
+	if (p->n > 0) {
+		log_puts(" min=");
+		log_putu(p->min);
+		log_puts(" avg=");
+		log_putu(p->sum / p->n);
+		log_puts(" max=");
+		log_putu(p->max);
+	}
+	log_puts("\n");
+}
@@ -23,6 +23,16 @@
 extern "C" {
 #endif
 
+/*
+ * statistics about a series of values, used for profiling
+ */
+struct prof {
+	char *name;
+	unsigned n;		/* number of values */
+	unsigned long sum;	/* sum of values */
+	unsigned min, max;	/* smallest and largest value */
+};
+
 void log_putc(char *, size_t);
 void log_puts(char *);
 void log_putx(unsigned long);
@@ -32,15 +42,45 @@ void log_perror(char *);
 void log_putp(void *);
 void panic(void);
 void log_flush(void);
+size_t log_take(char **);
+
+/*
+ * memory classes: real-time structures go in fast (internal) memory,
+ * large data accessed sequentially (track events, sysex data, undo
+ * data) may go in external memory if available
+ */
+#define MEM_FAST	0
+#define MEM_BULK	1
+
+/*
+ * memory allocated with a given tag, see xmalloc()
+ */
+#define MEM_NTAGS	64
+struct memtag {
+	char *name;
+	unsigned long nblks;	/* blocks allocated */
+	unsigned long used;	/* bytes allocated */
+	unsigned long maxused;	/* max bytes ever allocated */
+};
 
 void *xmalloc(size_t, char *);
+void *xmalloc_class(size_t, char *, unsigned);
 char *xstrdup(char *, char *);
 void xfree(void *);
+void mem_heapinfo(unsigned long *, unsigned long *);
+
+void prof_reset(struct prof *, char *);
+void prof_val(struct prof *, unsigned);
+void prof_log(struct prof *);
 
 #ifdef __cplusplus
 }
 #endif
 
-extern unsigned log_sync;
+extern unsigned log_sync, log_rt;
+extern unsigned long log_ndrop;
+extern struct memtag mem_tags[];
+extern unsigned mem_ntags;
+extern unsigned long mem_used, mem_maxused;
 
 #endif /* UTILS_H */
@@ -0,0 +1,1126 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * this module compiles user procs into bytecode, once, when they are
+ * defined, and runs them on a stack machine. It behaves as the tree
+ * interpreter (see node.c), but:
+ *
+ *	- each variable name of the proc is given a slot in the frame,
+ *	  so there's no name lookup, except for globals, which are
+ *	  looked up once and then cached
+ *
+ *	- integers and nil are stored unboxed, so arithmetic doesn't
+ *	  allocate data structures
+ *
+ *	- called procs are looked up only once
+ *
+ * A slot stays unset until the proc assigns the variable, so, as
+ * with the tree interpreter, reading or assigning a variable that's
+ * not a local yet uses the global of the same name, if any.
+ *
+ * Builtins and procs that couldn't be compiled are called the usual
+ * way, with their arguments as local variables.
+ */
+
+#include "utils.h"
+#include "str.h"
+#include "cons.h"
+#include "data.h"
+#include "node.h"
+#include "exec.h"
+#include "vm.h"
+
+enum VM_OP {
+	VM_OP_NIL, VM_OP_LONG, VM_OP_CST, VM_OP_LOAD, VM_OP_STORE,
+	VM_OP_CALL, VM_OP_CALLR, VM_OP_CLRR, VM_OP_RET, VM_OP_EXIT,
+	VM_OP_END, VM_OP_JMP, VM_OP_JZ, VM_OP_LIST, VM_OP_RANGE,
+	VM_OP_FOR, VM_OP_NEXT, VM_OP_NEG, VM_OP_NOT, VM_OP_BITNOT,
+	VM_OP_ADD, VM_OP_SUB, VM_OP_MUL, VM_OP_DIV, VM_OP_MOD,
+	VM_OP_LSHIFT, VM_OP_RSHIFT, VM_OP_BITAND, VM_OP_BITOR, VM_OP_BITXOR,
+	VM_OP_EQ, VM_OP_NEQ, VM_OP_LT, VM_OP_LE, VM_OP_GT, VM_OP_GE,
+	VM_OP_AND, VM_OP_OR, VM_NOP
+};
+
+/*
+ * name and number of operands of each instruction
+ */
+struct vm_opinfo {
+	char *name;
+	unsigned nargs;
+};
+
+const struct vm_opinfo vm_opinfo[VM_NOP] = {
+	{"nil", 0}, {"long", 1}, {"cst", 1}, {"load", 1}, {"store", 1},
+	{"call", 2}, {"callr", 2}, {"clrr", 0}, {"ret", 0}, {"exit", 0},
+	{"end", 0}, {"jmp", 1}, {"jz", 1}, {"list", 1}, {"range", 0},
+	{"for", 0}, {"next", 2}, {"neg", 0}, {"not", 0}, {"bitnot", 0},
+	{"add", 0}, {"sub", 0}, {"mul", 0}, {"div", 0}, {"mod", 0},
+	{"lshift", 0}, {"rshift", 0}, {"bitand", 0}, {"bitor", 0},
+	{"bitxor", 0}, {"eq", 0}, {"neq", 0}, {"lt", 0}, {"le", 0},
+	{"gt", 0}, {"ge", 0}, {"and", 0}, {"or", 0}
+};
+
+/*
+ * tree nodes of operators, the instructions they're compiled to,
+ * and the routines used for operands that are not integers
+ */
+struct vm_opmap {
+	struct node_vmt *vmt;
+	unsigned op;
+	unsigned (*binary)(struct data *, struct data *);
+	unsigned (*unary)(struct data *);
+};
+
+const struct vm_opmap vm_opmap[] = {
+	{&node_vmt_neg, VM_OP_NEG, NULL, data_neg},
+	{&node_vmt_not, VM_OP_NOT, NULL, data_not},
+	{&node_vmt_bitnot, VM_OP_BITNOT, NULL, data_bitnot},
+	{&node_vmt_add, VM_OP_ADD, data_add, NULL},
+	{&node_vmt_sub, VM_OP_SUB, data_sub, NULL},
+	{&node_vmt_mul, VM_OP_MUL, data_mul, NULL},
+	{&node_vmt_div, VM_OP_DIV, data_div, NULL},
+	{&node_vmt_mod, VM_OP_MOD, data_mod, NULL},
+	{&node_vmt_lshift, VM_OP_LSHIFT, data_lshift, NULL},
+	{&node_vmt_rshift, VM_OP_RSHIFT, data_rshift, NULL},
+	{&node_vmt_bitand, VM_OP_BITAND, data_bitand, NULL},
+	{&node_vmt_bitor, VM_OP_BITOR, data_bitor, NULL},
+	{&node_vmt_bitxor, VM_OP_BITXOR, data_bitxor, NULL},
+	{&node_vmt_eq, VM_OP_EQ, data_eq, NULL},
+	{&node_vmt_neq, VM_OP_NEQ, data_neq, NULL},
+	{&node_vmt_lt, VM_OP_LT, data_lt, NULL},
+	{&node_vmt_le, VM_OP_LE, data_le, NULL},
+	{&node_vmt_gt, VM_OP_GT, data_gt, NULL},
+	{&node_vmt_ge, VM_OP_GE, data_ge, NULL},
+	{&node_vmt_and, VM_OP_AND, data_and, NULL},
+	{&node_vmt_or, VM_OP_OR, data_or, NULL},
+	{NULL, 0, NULL, NULL}
+};
+
+/*
+ * compiler state. The proc is compiled twice: the first pass only
+ * counts instructions, constants and slots, the second pass stores
+ * them in the allocated arrays
+ */
+struct vm_comp {
+	struct vm_code *c;		/* NULL during the first pass */
+	struct name *slots;		/* variable names */
+	unsigned nslot, ninsn, ncst;
+	unsigned depth, maxdepth;	/* values on the stack */
+	unsigned clrr;			/* last instruction is ``clrr'' */
+};
+
+unsigned vm_compexpr(struct vm_comp *, struct node *);
+
+unsigned vm_debug = 0;
+
+/*
+ * stack shared by all frames, vm_sp is the first free entry
+ */
+struct vm_val vm_stack[VM_STACKSIZE];
+unsigned vm_sp;
+
+/* ------------------------------------------------------ compiler --- */
+
+void
+vm_emit(struct vm_comp *k, long word)
+{
+	if (k->c)
+		k->c->insn[k->ninsn] = word;
+	k->ninsn++;
+}
+
+/*
+ * emit an instruction, skip ``clrr'' if the result register is
+ * already cleared
+ */
+void
+vm_op(struct vm_comp *k, unsigned op)
+{
+	if (op == VM_OP_CLRR && k->clrr)
+		return;
+	k->clrr = (op == VM_OP_CLRR);
+	vm_emit(k, op);
+}
+
+/*
+ * set the operand at the given offset to the current position,
+ * which becomes a jump target
+ */
+void
+vm_patch(struct vm_comp *k, unsigned offs)
+{
+	if (k->c)
+		k->c->insn[offs] = k->ninsn;
+	k->clrr = 0;
+}
+
+void
+vm_cpush(struct vm_comp *k, unsigned n)
+{
+	k->depth += n;
+	if (k->maxdepth < k->depth)
+		k->maxdepth = k->depth;
+}
+
+void
+vm_cpop(struct vm_comp *k, unsigned n)
+{
+	k->depth -= n;
+}
+
+/*
+ * return the slot number of the given variable, allocate one if
+ * it's not used yet
+ */
+unsigned
+vm_slotnum(struct vm_comp *k, char *name)
+{
+	struct name *i;
+	unsigned n;
+
+	for (i = k->slots, n = 0; i != NULL; i = i->next, n++) {
+		if (str_eq(i->str, name))
+			return n;
+	}
+	name_add(&k->slots, name_new(name));
+	return k->nslot++;
+}
+
+/*
+ * store a copy of the given constant and return its number
+ */
+unsigned
+vm_cstnum(struct vm_comp *k, struct data *d)
+{
+	struct data *n;
+
+	if (k->c) {
+		n = data_newnil();
+		data_assign(n, d);
+		k->c->cst[k->ncst] = n;
+		k->c->proc[k->ncst] = NULL;
+	}
+	return k->ncst++;
+}
+
+/*
+ * return the entry of the given operator node, or NULL if it's not
+ * an operator
+ */
+const struct vm_opmap *
+vm_opfind(struct node_vmt *vmt)
+{
+	const struct vm_opmap *m;
+
+	for (m = vm_opmap; m->vmt != NULL; m++) {
+		if (m->vmt == vmt)
+			return m;
+	}
+	return NULL;
+}
+
+unsigned
+vm_compcall(struct vm_comp *k, struct node *o, unsigned op)
+{
+	struct node *arg;
+	unsigned n;
+
+	n = 0;
+	for (arg = o->list; arg != NULL; arg = arg->next) {
+		if (!vm_compexpr(k, arg))
+			return 0;
+		n++;
+	}
+	vm_emit(k, op);
+	vm_emit(k, vm_cstnum(k, o->data));
+	vm_emit(k, n);
+	vm_cpop(k, n);
+	return 1;
+}
+
+/*
+ * compile an expression, which leaves its value on the stack.
+ * Return 0 if it contains nodes we don't handle
+ */
+unsigned
+vm_compexpr(struct vm_comp *k, struct node *o)
+{
+	const struct vm_opmap *m;
+	struct node *i;
+	unsigned n;
+
+	if (o->vmt == &node_vmt_cst) {
+		if (o->data->type == DATA_LONG) {
+			vm_op(k, VM_OP_LONG);
+			vm_emit(k, o->data->val.num);
+		} else if (o->data->type == DATA_NIL) {
+			vm_op(k, VM_OP_NIL);
+		} else {
+			vm_op(k, VM_OP_CST);
+			vm_emit(k, vm_cstnum(k, o->data));
+		}
+		vm_cpush(k, 1);
+	} else if (o->vmt == &node_vmt_var) {
+		vm_op(k, VM_OP_LOAD);
+		vm_emit(k, vm_slotnum(k, o->data->val.ref));
+		vm_cpush(k, 1);
+	} else if (o->vmt == &node_vmt_call) {
+		if (!vm_compcall(k, o, VM_OP_CALL))
+			return 0;
+		vm_cpush(k, 1);
+	} else if (o->vmt == &node_vmt_list) {
+		n = 0;
+		for (i = o->list; i != NULL; i = i->next) {
+			if (!vm_compexpr(k, i))
+				return 0;
+			n++;
+		}
+		vm_op(k, VM_OP_LIST);
+		vm_emit(k, n);
+		vm_cpop(k, n);
+		vm_cpush(k, 1);
+	} else if (o->vmt == &node_vmt_range) {
+		if (!vm_compexpr(k, o->list) ||
+		    !vm_compexpr(k, o->list->next))
+			return 0;
+		vm_op(k, VM_OP_RANGE);
+		vm_cpop(k, 1);
+	} else if ((m = vm_opfind(o->vmt)) != NULL) {
+		if (!vm_compexpr(k, o->list))
+			return 0;
+		if (m->binary) {
+			if (!vm_compexpr(k, o->list->next))
+				return 0;
+			vm_cpop(k, 1);
+		}
+		vm_emit(k, m->op);
+	} else
+		return 0;
+	return 1;
+}
+
+/*
+ * compile a statement. Each statement clears the result register,
+ * calls store their result in it, so as in the tree interpreter,
+ * a proc without ``return'' returns the result of the last call.
+ * Return 0 if it contains nodes we don't handle
+ */
+unsigned
+vm_compstmt(struct vm_comp *k, struct node *o)
+{
+	struct node *i;
+	unsigned jz, jmp, loop;
+
+	if (o->vmt == &node_vmt_slist) {
+		vm_op(k, VM_OP_CLRR);
+		for (i = o->list; i != NULL; i = i->next) {
+			if (!vm_compstmt(k, i))
+				return 0;
+		}
+	} else if (o->vmt == &node_vmt_call) {
+		if (!vm_compcall(k, o, VM_OP_CALLR))
+			return 0;
+	} else if (o->vmt == &node_vmt_nop) {
+		vm_op(k, VM_OP_CLRR);
+	} else if (o->vmt == &node_vmt_exit) {
+		vm_op(k, VM_OP_EXIT);
+	} else if (o->vmt == &node_vmt_return) {
+		if (!vm_compexpr(k, o->list))
+			return 0;
+		vm_op(k, VM_OP_RET);
+		vm_cpop(k, 1);
+	} else if (o->vmt == &node_vmt_assign) {
+		vm_op(k, VM_OP_CLRR);
+		if (!vm_compexpr(k, o->list))
+			return 0;
+		vm_op(k, VM_OP_STORE);
+		vm_emit(k, vm_slotnum(k, o->data->val.ref));
+		vm_cpop(k, 1);
+	} else if (o->vmt == &node_vmt_if) {
+		vm_op(k, VM_OP_CLRR);
+		if (!vm_compexpr(k, o->list))
+			return 0;
+		vm_op(k, VM_OP_JZ);
+		jz = k->ninsn;
+		vm_emit(k, 0);
+		vm_cpop(k, 1);
+		if (!vm_compstmt(k, o->list->next))
+			return 0;
+		if (o->list->next->next) {
+			vm_op(k, VM_OP_JMP);
+			jmp = k->ninsn;
+			vm_emit(k, 0);
+			vm_patch(k, jz);
+			if (!vm_compstmt(k, o->list->next->next))
+				return 0;
+			vm_patch(k, jmp);
+		} else
+			vm_patch(k, jz);
+	} else if (o->vmt == &node_vmt_for) {
+		vm_op(k, VM_OP_CLRR);
+		if (!vm_compexpr(k, o->list))
+			return 0;
+		vm_op(k, VM_OP_FOR);
+		loop = k->ninsn;
+		vm_op(k, VM_OP_NEXT);
+		vm_emit(k, vm_slotnum(k, o->data->val.ref));
+		jz = k->ninsn;
+		vm_emit(k, 0);
+		vm_cpush(k, 1);
+		vm_cpop(k, 1);
+		if (!vm_compstmt(k, o->list->next))
+			return 0;
+		vm_op(k, VM_OP_JMP);
+		vm_emit(k, loop);
+		vm_patch(k, jz);
+		vm_cpop(k, 1);
+	} else
+		return 0;
+	return 1;
+}
+
+unsigned
+vm_compproc(struct vm_comp *k, struct proc *p)
+{
+	struct name *a;
+
+	k->nslot = k->ninsn = k->ncst = 0;
+	k->depth = k->maxdepth = 0;
+	k->clrr = 0;
+	for (a = p->args; a != NULL; a = a->next)
+		vm_slotnum(k, a->str);
+	if (!vm_compstmt(k, p->code))
+		return 0;
+	vm_op(k, VM_OP_END);
+	return 1;
+}
+
+/*
+ * compile the given proc, return NULL if it uses constructs the VM
+ * doesn't handle, in which case the tree is interpreted
+ */
+struct vm_code *
+vm_compile(struct proc *p)
+{
+	struct vm_comp k;
+	struct vm_code *c;
+	struct name *a;
+	unsigned i;
+
+	k.c = NULL;
+	k.slots = NULL;
+	if (!vm_compproc(&k, p)) {
+		name_empty(&k.slots);
+		return NULL;
+	}
+	c = xmalloc(sizeof(struct vm_code), "vm_code");
+	c->insn = xmalloc(k.ninsn * sizeof(long), "vm_insn");
+	c->ninsn = k.ninsn;
+	c->ncst = k.ncst;
+	if (k.ncst > 0) {
+		c->cst = xmalloc(k.ncst * sizeof(struct data *), "vm_cst");
+		c->proc = xmalloc(k.ncst * sizeof(struct proc *), "vm_proc");
+	} else {
+		c->cst = NULL;
+		c->proc = NULL;
+	}
+	c->nslot = k.nslot;
+	c->slot = xmalloc(k.nslot * sizeof(char *) + 1, "vm_slot");
+	c->gvar = xmalloc(k.nslot * sizeof(struct var *) + 1, "vm_gvar");
+	for (a = k.slots, i = 0; a != NULL; a = a->next, i++) {
+		c->slot[i] = str_new(a->str);
+		c->gvar[i] = NULL;
+	}
+	c->nargs = 0;
+	c->vararg = 0;
+	for (a = p->args; a != NULL; a = a->next) {
+		if (str_eq(a->str, "..."))
+			c->vararg = 1;
+		else
+			c->nargs++;
+	}
+	c->maxstack = k.maxdepth;
+
+	/*
+	 * second pass, slots are already allocated, so they keep
+	 * their numbers
+	 */
+	k.c = c;
+	(void)vm_compproc(&k, p);
+	name_empty(&k.slots);
+	if (vm_debug)
+		vm_log(c);
+	return c;
+}
+
+void
+vm_free(struct vm_code *c)
+{
+	unsigned i;
+
+	if (c == NULL)
+		return;
+	for (i = 0; i < c->ncst; i++)
+		data_delete(c->cst[i]);
+	for (i = 0; i < c->nslot; i++)
+		str_delete(c->slot[i]);
+	if (c->cst) {
+		xfree(c->cst);
+		xfree(c->proc);
+	}
+	xfree(c->slot);
+	xfree(c->gvar);
+	xfree(c->insn);
+	xfree(c);
+}
+
+/*
+ * dump the bytecode on stderr
+ */
+void
+vm_log(struct vm_code *c)
+{
+	unsigned pc, op, i;
+
+	log_puts("slots:");
+	for (i = 0; i < c->nslot; i++) {
+		log_puts(" ");
+		log_puts(c->slot[i]);
+	}
+	log_puts(", stack: ");
+	log_putu(c->maxstack);
+	log_puts("\n");
+	for (pc = 0; pc < c->ninsn; pc += 1 + vm_opinfo[op].nargs) {
+		op = c->insn[pc];
+		log_putu(pc);
+		log_puts("\t");
+		log_puts(vm_opinfo[op].name);
+		for (i = 0; i < vm_opinfo[op].nargs; i++) {
+			log_puts(" ");
+			log_puti(c->insn[pc + 1 + i]);
+		}
+		if (op == VM_OP_CST || op == VM_OP_CALL || op == VM_OP_CALLR) {
+			log_puts("\t# ");
+			data_log(c->cst[c->insn[pc + 1]]);
+		} else if (op == VM_OP_LOAD || op == VM_OP_STORE ||
+		    op == VM_OP_NEXT) {
+			log_puts("\t# ");
+			log_puts(c->slot[c->insn[pc + 1]]);
+		}
+		log_puts("\n");
+	}
+}
+
+/* ------------------------------------------------------- values --- */
+
+/*
+ * free the given value
+ */
+void
+vm_drop(struct vm_val *v)
+{
+	if (v->type == VM_DATA || v->type == VM_ITER)
+		data_delete(v->data);
+	v->type = VM_UNSET;
+}
+
+/*
+ * move the given value into a new data structure
+ */
+struct data *
+vm_box(struct vm_val *v)
+{
+	struct data *d;
+
+	switch (v->type) {
+	case VM_LONG:
+		d = data_newlong(v->num);
+		break;
+	case VM_DATA:
+		d = v->data;
+		break;
+	case VM_NIL:
+		d = data_newnil();
+		break;
+	default:
+		log_puts("vm_box: bad type\n");
+		panic();
+		d = NULL;
+	}
+	v->type = VM_UNSET;
+	return d;
+}
+
+/*
+ * move the given data structure into the given value, unboxing it
+ * if possible
+ */
+void
+vm_unbox(struct vm_val *v, struct data *d)
+{
+	if (d->type == DATA_LONG) {
+		v->type = VM_LONG;
+		v->num = d->val.num;
+		data_delete(d);
+	} else if (d->type == DATA_NIL) {
+		v->type = VM_NIL;
+		data_delete(d);
+	} else {
+		v->type = VM_DATA;
+		v->data = d;
+	}
+}
+
+/*
+ * store a copy of the given data structure in the given value
+ */
+void
+vm_copy(struct vm_val *v, struct data *d)
+{
+	if (d->type == DATA_LONG) {
+		v->type = VM_LONG;
+		v->num = d->val.num;
+	} else if (d->type == DATA_NIL) {
+		v->type = VM_NIL;
+	} else {
+		v->type = VM_DATA;
+		v->data = data_newnil();
+		data_assign(v->data, d);
+	}
+}
+
+unsigned
+vm_eval(struct vm_val *v)
+{
+	switch (v->type) {
+	case VM_LONG:
+		return v->num != 0;
+	case VM_NIL:
+		return 0;
+	default:
+		return data_eval(v->data);
+	}
+}
+
+/*
+ * apply the given binary operator to the given values, store the
+ * result in the first one and free the second one. Return 0 on
+ * error
+ */
+unsigned
+vm_binop(unsigned op, struct vm_val *a, struct vm_val *b)
+{
+	const struct vm_opmap *m;
+	struct data *d1, *d2;
+	unsigned res;
+	long x, y;
+
+	if (op == VM_OP_AND || op == VM_OP_OR) {
+		x = vm_eval(a);
+		y = vm_eval(b);
+		vm_drop(a);
+		vm_drop(b);
+		a->type = VM_LONG;
+		a->num = (op == VM_OP_AND) ? (x && y) : (x || y);
+		return 1;
+	}
+	if (a->type == VM_LONG && b->type == VM_LONG) {
+		x = a->num;
+		y = b->num;
+		b->type = VM_UNSET;
+		switch (op) {
+		case VM_OP_ADD:
+			a->num = x + y;
+			return 1;
+		case VM_OP_SUB:
+			a->num = x - y;
+			return 1;
+		case VM_OP_MUL:
+			a->num = x * y;
+			return 1;
+		case VM_OP_DIV:
+		case VM_OP_MOD:
+			if (y == 0) {
+				cons_err("division by zero");
+				return 0;
+			}
+			a->num = (op == VM_OP_DIV) ? x / y : x % y;
+			return 1;
+		case VM_OP_LSHIFT:
+			a->num = x << y;
+			return 1;
+		case VM_OP_RSHIFT:
+			a->num = x >> y;
+			return 1;
+		case VM_OP_BITAND:
+			a->num = x & y;
+			return 1;
+		case VM_OP_BITOR:
+			a->num = x | y;
+			return 1;
+		case VM_OP_BITXOR:
+			a->num = x ^ y;
+			return 1;
+		case VM_OP_EQ:
+			a->num = x == y;
+			return 1;
+		case VM_OP_NEQ:
+			a->num = x != y;
+			return 1;
+		case VM_OP_LT:
+			a->num = x < y;
+			return 1;
+		case VM_OP_LE:
+			a->num = x <= y;
+			return 1;
+		case VM_OP_GT:
+			a->num = x > y;
+			return 1;
+		case VM_OP_GE:
+			a->num = x >= y;
+			return 1;
+		}
+		b->type = VM_LONG;
+		b->num = y;
+	}
+
+	/*
+	 * not integers, use data_xxx() routines
+	 */
+	for (m = vm_opmap; m->op != op; m++)
+		; /* nothing */
+	d1 = vm_box(a);
+	d2 = vm_box(b);
+	res = m->binary(d1, d2);
+	data_delete(d2);
+	if (!res) {
+		data_delete(d1);
+		return 0;
+	}
+	vm_unbox(a, d1);
+	return 1;
+}
+
+/*
+ * apply the given unary operator to the given value. Return 0 on
+ * error
+ */
+unsigned
+vm_unop(unsigned op, struct vm_val *a)
+{
+	const struct vm_opmap *m;
+	struct data *d;
+	unsigned res;
+
+	if (op == VM_OP_NOT) {
+		res = vm_eval(a);
+		vm_drop(a);
+		a->type = VM_LONG;
+		a->num = !res;
+		return 1;
+	}
+	if (a->type == VM_LONG) {
+		a->num = (op == VM_OP_NEG) ? -a->num : ~a->num;
+		return 1;
+	}
+	for (m = vm_opmap; m->op != op; m++)
+		; /* nothing */
+	d = vm_box(a);
+	res = m->unary(d);
+	if (!res) {
+		data_delete(d);
+		return 0;
+	}
+	vm_unbox(a, d);
+	return 1;
+}
+
+/* ------------------------------------------------------ machine --- */
+
+/*
+ * return the global variable used by the given unset slot, or NULL
+ */
+struct var *
+vm_global(struct exec *x, struct vm_code *c, unsigned n)
+{
+	if (c->gvar[n] == NULL) {
+		c->gvar[n] = (struct var *)name_lookup(&x->globals,
+		    c->slot[n]);
+	}
+	return c->gvar[n];
+}
+
+/*
+ * move the given value into the given variable: if it's not a
+ * local yet and there's a global with the same name, assign the
+ * global, else create the local
+ */
+void
+vm_store(struct exec *x, struct vm_code *c, struct vm_val *fp,
+    unsigned n, struct vm_val *v)
+{
+	struct var *var;
+
+	if (fp[n].type == VM_UNSET && (var = vm_global(x, c, n)) != NULL) {
+		data_delete(var->data);
+		var->data = vm_box(v);
+	} else {
+		vm_drop(&fp[n]);
+		fp[n] = *v;
+		v->type = VM_UNSET;
+	}
+}
+
+/*
+ * run the given code in the frame starting at 'fp'. Return the
+ * result as node_exec() would for the proc body
+ */
+unsigned
+vm_run(struct exec *x, struct vm_code *c, struct vm_val *fp, struct data **r)
+{
+	struct vm_val *sp, *v;
+	struct var *var;
+	struct proc *p;
+	struct data *d;
+	long *pc;
+	unsigned op, n, k, res;
+
+	sp = fp + c->nslot;
+	pc = c->insn;
+	for (;;) {
+		op = *pc++;
+		switch (op) {
+		case VM_OP_NIL:
+			sp->type = VM_NIL;
+			sp++;
+			break;
+		case VM_OP_LONG:
+			sp->type = VM_LONG;
+			sp->num = *pc++;
+			sp++;
+			break;
+		case VM_OP_CST:
+			vm_copy(sp, c->cst[*pc++]);
+			sp++;
+			break;
+		case VM_OP_LOAD:
+			n = *pc++;
+			v = fp + n;
+			if (v->type == VM_LONG || v->type == VM_NIL) {
+				*sp = *v;
+			} else if (v->type == VM_DATA) {
+				vm_copy(sp, v->data);
+			} else {
+				var = vm_global(x, c, n);
+				if (var == NULL) {
+					cons_errss(x->procname, c->slot[n],
+					    "no such variable");
+					goto err;
+				}
+				vm_copy(sp, var->data);
+			}
+			sp++;
+			break;
+		case VM_OP_STORE:
+			sp--;
+			vm_store(x, c, fp, *pc++, sp);
+			break;
+		case VM_OP_CALL:
+		case VM_OP_CALLR:
+			k = *pc++;
+			n = *pc++;
+			p = c->proc[k];
+			if (p == NULL) {
+				p = exec_proclookup(x, c->cst[k]->val.ref);
+				if (p == NULL) {
+					cons_errs(c->cst[k]->val.ref,
+					    "no such proc");
+					goto err;
+				}
+				c->proc[k] = p;
+			}
+			vm_sp = sp - vm_stack;
+			res = vm_call(x, p, n, &d);
+			sp -= n;
+			if (res == RESULT_ERR)
+				goto err;
+			if (op == VM_OP_CALL) {
+				vm_unbox(sp, d);
+				sp++;
+				break;
+			}
+			if (*r)
+				data_delete(*r);
+			*r = d;
+			if (res == RESULT_EXIT)
+				goto done;
+			break;
+		case VM_OP_CLRR:
+			if (*r) {
+				data_delete(*r);
+				*r = NULL;
+			}
+			break;
+		case VM_OP_RET:
+			sp--;
+			if (*r)
+				data_delete(*r);
+			*r = vm_box(sp);
+			res = RESULT_RETURN;
+			goto done;
+		case VM_OP_EXIT:
+			if (*r) {
+				data_delete(*r);
+				*r = NULL;
+			}
+			res = RESULT_EXIT;
+			goto done;
+		case VM_OP_END:
+			res = RESULT_OK;
+			goto done;
+		case VM_OP_JMP:
+			pc = c->insn + *pc;
+			break;
+		case VM_OP_JZ:
+			sp--;
+			n = vm_eval(sp);
+			vm_drop(sp);
+			if (n)
+				pc++;
+			else
+				pc = c->insn + *pc;
+			break;
+		case VM_OP_LIST:
+			n = *pc++;
+			d = data_newlist(NULL);
+			for (v = sp - n; v < sp; v++)
+				data_listadd(d, vm_box(v));
+			sp -= n;
+			sp->type = VM_DATA;
+			sp->data = d;
+			sp++;
+			break;
+		case VM_OP_RANGE:
+			sp--;
+			v = sp - 1;
+			if (v->type != VM_LONG || sp->type != VM_LONG) {
+				cons_err("cannot create a range with non integers");
+				vm_drop(sp);
+				goto err;
+			}
+			if (v->num > sp->num) {
+				cons_err("max > min, cant create a valid range");
+				goto err;
+			}
+			v->type = VM_DATA;
+			v->data = data_newrange(v->num, sp->num);
+			break;
+		case VM_OP_FOR:
+			v = sp - 1;
+			if (v->type != VM_DATA ||
+			    (v->data->type != DATA_LIST &&
+			     v->data->type != DATA_RANGE)) {
+				cons_errs(x->procname,
+				    "argument to 'for' must be a list or range");
+				goto err;
+			}
+			v->type = VM_ITER;
+			if (v->data->type == DATA_LIST) {
+				v->cur = v->data->val.list;
+			} else {
+				v->num = v->data->val.range.min;
+				v->cur = (v->num <= v->data->val.range.max) ?
+				    v->data : NULL;
+			}
+			break;
+		case VM_OP_NEXT:
+			n = *pc++;
+			v = sp - 1;
+			if (v->cur == NULL) {
+				sp--;
+				vm_drop(sp);
+				pc = c->insn + *pc;
+				break;
+			}
+			pc++;
+			if (v->data->type == DATA_LIST) {
+				vm_copy(sp, v->cur);
+				v->cur = v->cur->next;
+			} else {
+				sp->type = VM_LONG;
+				sp->num = v->num;
+				if (v->num == v->data->val.range.max)
+					v->cur = NULL;
+				else
+					v->num++;
+			}
+			vm_store(x, c, fp, n, sp);
+			break;
+		case VM_OP_NEG:
+		case VM_OP_NOT:
+		case VM_OP_BITNOT:
+			if (!vm_unop(op, sp - 1))
+				goto err;
+			break;
+		default:
+			if (op < VM_OP_ADD || op > VM_OP_OR) {
+				log_puts("vm_run: bad opcode\n");
+				panic();
+			}
+			sp--;
+			if (!vm_binop(op, sp - 1, sp))
+				goto err;
+			break;
+		}
+	}
+err:
+	if (*r) {
+		data_delete(*r);
+		*r = NULL;
+	}
+	res = RESULT_ERR;
+done:
+	for (v = fp + c->nslot; v < sp; v++)
+		vm_drop(v);
+	return res;
+}
+
+/*
+ * push the given value on the stack, used by the tree interpreter
+ * to pass arguments to vm_call(). Return 0 if the stack is full, in
+ * which case the value is freed
+ */
+unsigned
+vm_pushdata(struct data *d)
+{
+	if (vm_sp == VM_STACKSIZE) {
+		cons_err("too many nested operations");
+		data_delete(d);
+		return 0;
+	}
+	vm_unbox(&vm_stack[vm_sp++], d);
+	return 1;
+}
+
+/*
+ * free the given number of values on top of the stack
+ */
+void
+vm_pop(unsigned n)
+{
+	while (n-- > 0)
+		vm_drop(&vm_stack[--vm_sp]);
+}
+
+/*
+ * call the given proc with the given number of arguments, taken from
+ * the top of the stack. As node_exec_call(), always return a value
+ * unless there's an error
+ */
+unsigned
+vm_call(struct exec *x, struct proc *p, unsigned nargs, struct data **r)
+{
+	struct vm_code *c = p->vm;
+	struct vm_val *argv;
+	struct name **oldlocals, *newlocals, *argn;
+	struct var *valist;
+	struct data *d;
+	char *procname_save;
+	unsigned i, result;
+
+	*r = NULL;
+	argv = vm_stack + vm_sp - nargs;
+	newlocals = NULL;
+	result = RESULT_ERR;
+	procname_save = x->procname;
+	if (c == NULL) {
+		/*
+		 * builtin or not compiled, pass arguments as locals
+		 */
+		valist = NULL;
+		i = 0;
+		for (argn = p->args; argn != NULL; argn = argn->next) {
+			if (str_eq(argn->str, "...")) {
+				valist = var_new(&newlocals, "...",
+				    data_newlist(NULL));
+				break;
+			}
+			if (i == nargs) {
+				cons_errs(p->name.str, "to few arguments");
+				goto finish;
+			}
+			var_new(&newlocals, argn->str, vm_box(&argv[i++]));
+		}
+		if (valist == NULL && i < nargs) {
+			cons_errs(p->name.str, "to many arguments");
+			goto finish;
+		}
+		while (i < nargs)
+			data_listadd(valist->data, vm_box(&argv[i++]));
+		oldlocals = x->locals;
+		x->locals = &newlocals;
+		x->procname = p->name.str;
+		result = node_exec(p->code, x, r);
+		x->locals = oldlocals;
+	} else {
+		if (nargs < c->nargs) {
+			cons_errs(p->name.str, "to few arguments");
+			goto finish;
+		}
+		if (!c->vararg && nargs > c->nargs) {
+			cons_errs(p->name.str, "to many arguments");
+			goto finish;
+		}
+		if (x->depth == EXEC_MAXDEPTH ||
+		    argv + nargs + c->nslot + c->maxstack >
+		    vm_stack + VM_STACKSIZE) {
+			cons_err("too many nested operations");
+			goto finish;
+		}
+		i = c->nargs;
+		if (c->vararg) {
+			d = data_newlist(NULL);
+			for (; i < nargs; i++)
+				data_listadd(d, vm_box(&argv[i]));
+			i = c->nargs;
+			argv[i].type = VM_DATA;
+			argv[i].data = d;
+			i++;
+		}
+		for (; i < c->nslot; i++)
+			argv[i].type = VM_UNSET;
+		x->depth++;
+		x->procname = p->name.str;
+		result = vm_run(x, c, argv, r);
+		x->depth--;
+		for (i = 0; i < c->nslot; i++)
+			vm_drop(&argv[i]);
+	}
+	if (result != RESULT_ERR) {
+		if (*r == NULL)
+			*r = data_newnil();
+		if (result != RESULT_EXIT)
+			result = RESULT_OK;
+	}
+finish:
+	x->procname = procname_save;
+	var_empty(&newlocals);
+	for (i = 0; i < nargs; i++)
+		vm_drop(&argv[i]);
+	vm_sp = argv - vm_stack;
+	return result;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MIDISH_VM_H
+#define MIDISH_VM_H
+
+struct data;
+struct var;
+struct proc;
+struct exec;
+
+/*
+ * max number of values on the stack, for all nested calls
+ */
+#define VM_STACKSIZE	256
+
+/*
+ * a value on the stack or in a variable slot: nil and integers are
+ * stored unboxed, other values in a data structure owned by the slot
+ */
+struct vm_val {
+#define VM_UNSET	0		/* local not created yet */
+#define VM_NIL		1
+#define VM_LONG		2
+#define VM_DATA		3
+#define VM_ITER		4		/* state of a ``for'' loop */
+	unsigned type;
+	long num;			/* if integer, or next of range */
+	struct data *data;		/* if data, or list or range */
+	struct data *cur;		/* next list item, NULL if done */
+};
+
+/*
+ * a compiled proc
+ */
+struct vm_code {
+	long *insn;			/* instructions and operands */
+	unsigned ninsn;
+	struct data **cst;		/* constants and called proc names */
+	struct proc **proc;		/* called procs, resolved once */
+	unsigned ncst;
+	char **slot;			/* variable names, arguments first */
+	struct var **gvar;		/* global used while slot is unset */
+	unsigned nslot;
+	unsigned nargs;			/* fixed arguments */
+	unsigned vararg;		/* last argument is ``...'' */
+	unsigned maxstack;		/* max values pushed on the stack */
+};
+
+struct vm_code *vm_compile(struct proc *);
+void vm_free(struct vm_code *);
+void vm_log(struct vm_code *);
+unsigned vm_pushdata(struct data *);
+void vm_pop(unsigned);
+unsigned vm_call(struct exec *, struct proc *, unsigned, struct data **);
+
+extern unsigned vm_debug;
+
+#endif /* MIDISH_VM_H */
@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * run independent operations, typically one per track, on several
+ * threads. This is used only on host builds with USE_THREADS
+ * defined, elsewhere operations run one after another.
+ *
+ * Operations must only use their own track: events and states are
+ * the only shared resources, their pools are used through a cache
+ * per thread, refilled and emptied by batches with the lock held.
+ * Other global data (memory accounting, logs) must be accessed with
+ * the lock held. Undo records are created before and finished after
+ * the operations, by the caller, so they don't depend on scheduling
+ *
+ * Without threads, long operations may instead run on the interpreter
+ * without the realtime lock of dual-core boards, see work_detach(),
+ * so they don't stop the realtime task. The same resources are then
+ * used with the realtime lock held
+ */
+
+#ifdef USE_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#include "utils.h"
+#include "pool.h"
+#include "mux.h"
+#include "work.h"
+
+/*
+ * number of threads, 0 means one per processor
+ */
+unsigned work_nthreads = 0;
+
+/*
+ * true while operations are running on threads, or on the
+ * interpreter without the realtime lock
+ */
+unsigned work_active = 0;
+
+#ifdef USE_THREADS
+
+/*
+ * max number of pools cached by each thread, others are used
+ * directly with the lock held
+ */
+#define WORK_NCACHE	8
+
+/*
+ * number of entries moved at once between pools and caches
+ */
+#define WORK_BATCH	64
+
+struct workcache {
+	struct pool *pool;
+	struct poolent *first;		/* free entries */
+	unsigned n;			/* number of free entries */
+};
+
+struct worker {
+	pthread_t thread;
+	struct workcache cache[WORK_NCACHE];
+	unsigned ncache;
+};
+
+pthread_mutex_t work_mutex;
+pthread_key_t work_key;
+unsigned work_initdone = 0;
+
+void (*work_fn)(void *, unsigned);	/* operation to run */
+void *work_arg;				/* its argument */
+unsigned work_next, work_n;		/* next item, number of items */
+
+/*
+ * initialize the lock, it's recursive because pools call xmalloc()
+ */
+void
+work_init(void)
+{
+	pthread_mutexattr_t attr;
+
+	if (work_initdone)
+		return;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	if (pthread_mutex_init(&work_mutex, &attr) != 0 ||
+	    pthread_key_create(&work_key, NULL) != 0) {
+		log_puts("work_init: failed\n");
+		panic();
+	}
+	pthread_mutexattr_destroy(&attr);
+	work_initdone = 1;
+}
+
+/*
+ * return the cache of the current thread for the given pool, or NULL
+ * if there's none
+ */
+struct workcache *
+work_cache(struct pool *o)
+{
+	struct worker *w;
+	struct workcache *c;
+	unsigned i;
+
+	w = pthread_getspecific(work_key);
+	if (w == NULL)
+		return NULL;
+	for (i = 0; i < w->ncache; i++) {
+		c = &w->cache[i];
+		if (c->pool == o)
+			return c;
+	}
+	if (w->ncache == WORK_NCACHE)
+		return NULL;
+	c = &w->cache[w->ncache++];
+	c->pool = o;
+	c->first = NULL;
+	c->n = 0;
+	return c;
+}
+
+/*
+ * give back 'n' entries of the given cache to its pool, the lock
+ * must be held
+ */
+void
+work_cacheput(struct workcache *c, unsigned n)
+{
+	struct poolent *e;
+
+	while (n > 0) {
+		e = c->first;
+		c->first = e->next;
+		c->n--;
+		pool_put(c->pool, e);
+		n--;
+	}
+}
+
+/*
+ * pool_new() used while operations run on threads
+ */
+void *
+work_poolnew(struct pool *o)
+{
+	struct workcache *c;
+	struct poolent *e;
+	unsigned i;
+
+	c = work_cache(o);
+	if (c == NULL) {
+		work_lock();
+		e = pool_get(o);
+		work_unlock();
+		return e;
+	}
+	if (c->first == NULL) {
+		work_lock();
+		for (i = 0; i < WORK_BATCH; i++) {
+			e = pool_get(o);
+			e->next = c->first;
+			c->first = e;
+		}
+		c->n += WORK_BATCH;
+		work_unlock();
+	}
+	e = c->first;
+	c->first = e->next;
+	c->n--;
+	return e;
+}
+
+/*
+ * pool_del() used while operations run on threads
+ */
+void
+work_pooldel(struct pool *o, void *p)
+{
+	struct workcache *c;
+	struct poolent *e = p;
+
+	c = work_cache(o);
+	if (c == NULL) {
+		work_lock();
+		pool_put(o, p);
+		work_unlock();
+		return;
+	}
+	e->next = c->first;
+	c->first = e;
+	c->n++;
+	if (c->n >= 2 * WORK_BATCH) {
+		work_lock();
+		work_cacheput(c, WORK_BATCH);
+		work_unlock();
+	}
+}
+
+/*
+ * thread routine: run operations until there are no more
+ */
+void *
+work_main(void *arg)
+{
+	struct worker *w = arg;
+	unsigned i;
+
+	pthread_setspecific(work_key, w);
+	for (;;) {
+		work_lock();
+		i = work_next;
+		if (work_next < work_n)
+			work_next++;
+		work_unlock();
+		if (i == work_n)
+			break;
+		work_fn(work_arg, i);
+	}
+	return NULL;
+}
+
+/*
+ * return the number of threads to use for 'n' operations
+ */
+unsigned
+work_count(unsigned n)
+{
+	long ncpu;
+	unsigned count;
+
+	count = work_nthreads;
+	if (count == 0) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		count = ncpu > 0 ? ncpu : 1;
+	}
+	if (count > WORK_MAXTHREADS)
+		count = WORK_MAXTHREADS;
+	if (count > n)
+		count = n;
+	return count;
+}
+
+void
+work_lock(void)
+{
+	if (work_active)
+		pthread_mutex_lock(&work_mutex);
+}
+
+void
+work_unlock(void)
+{
+	if (work_active)
+		pthread_mutex_unlock(&work_mutex);
+}
+
+#else
+
+void
+work_lock(void)
+{
+	if (work_active)
+		mux_mdep_take();
+}
+
+void
+work_unlock(void)
+{
+	if (work_active)
+		mux_mdep_give();
+}
+
+/*
+ * pool_new() used while the interpreter runs without the lock
+ */
+void *
+work_poolnew(struct pool *o)
+{
+	void *p;
+
+	work_lock();
+	p = pool_get(o);
+	work_unlock();
+	return p;
+}
+
+/*
+ * pool_del() used while the interpreter runs without the lock
+ */
+void
+work_pooldel(struct pool *o, void *p)
+{
+	work_lock();
+	pool_put(o, p);
+	work_unlock();
+}
+
+#endif
+
+/*
+ * release the realtime lock while the interpreter runs a long
+ * operation (eg. quantizing a big track), so the realtime task
+ * keeps processing input. The operation must change only structures
+ * the realtime task doesn't use, typically a track that's not being
+ * played, and shared resources are used with work_lock(). Must be
+ * paired with work_attach(). Threads are used only on host builds,
+ * which have no realtime task
+ */
+void
+work_detach(void)
+{
+#ifndef USE_THREADS
+	work_active = 1;
+	mux_mdep_give();
+#endif
+}
+
+/*
+ * take back the realtime lock released by work_detach()
+ */
+void
+work_attach(void)
+{
+#ifndef USE_THREADS
+	mux_mdep_take();
+	work_active = 0;
+#endif
+}
+
+/*
+ * call fn(arg, i) for i from 0 to n - 1, on several threads if
+ * available, and return once all calls are done. Calls may run
+ * in any order
+ */
+void
+work_run(void (*fn)(void *, unsigned), void *arg, unsigned n)
+{
+	unsigned i;
+#ifdef USE_THREADS
+	struct worker workers[WORK_MAXTHREADS];
+	struct worker *w;
+	unsigned count, nstarted;
+
+	count = work_count(n);
+	if (count > 1) {
+		work_init();
+		work_fn = fn;
+		work_arg = arg;
+		work_next = 0;
+		work_n = n;
+		work_active = 1;
+		for (nstarted = 0; nstarted < count; nstarted++) {
+			w = &workers[nstarted];
+			w->ncache = 0;
+			if (pthread_create(&w->thread, NULL, work_main, w) != 0)
+				break;
+		}
+		for (i = 0; i < nstarted; i++)
+			pthread_join(workers[i].thread, NULL);
+		work_active = 0;
+		for (i = 0; i < nstarted; i++) {
+			w = &workers[i];
+			while (w->ncache > 0) {
+				w->ncache--;
+				work_cacheput(&w->cache[w->ncache],
+				    w->cache[w->ncache].n);
+			}
+		}
+		if (nstarted > 0)
+			return;
+	}
+#endif
+	for (i = 0; i < n; i++)
+		fn(arg, i);
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MIDISH_WORK_H
+#define MIDISH_WORK_H
+
+struct pool;
+
+/*
+ * max number of threads running track operations
+ */
+#define WORK_MAXTHREADS	16
+
+extern unsigned work_nthreads;
+extern unsigned work_active;
+
+void work_run(void (*)(void *, unsigned), void *, unsigned);
+void work_lock(void);
+void work_unlock(void);
+void work_detach(void);
+void work_attach(void);
+void *work_poolnew(struct pool *);
+void work_pooldel(struct pool *, void *);
+
+#endif /* MIDISH_WORK_H */